@@ -0,0 +1,131 @@
+#include <iostream>
+#include <vector>
+#include <omp.h>
+#include "../knn/knn.h"
+#include "../knn/asyncKnn.h"
+#include "../kdTree/kdTree.h"
+#include "bench.h"
+
+using namespace std;
+
+// Built once against kdTree.cpp and once against kdTree-parallel.cpp
+#ifdef BENCH_PARALLEL_BUILD
+#define BENCH_VARIANT "parallel"
+#else
+#define BENCH_VARIANT "sequential"
+#endif
+
+int main(int argc, char *argv[]) {
+  BenchConfig config;
+  if (!parseBenchArgs(argc, argv, "build, pool-build, knn, batch, async", config)) {
+    return 0;
+  }
+
+  // The sequential build ignores the thread count
+#ifdef BENCH_PARALLEL_BUILD
+  vector<size_t> buildThreads = config.threads;
+#else
+  vector<size_t> buildThreads = {1};
+#endif
+
+  vector<BenchResult> results;
+  printResultHeader();
+
+  for (const string& distribution : config.distributions) {
+    for (size_t n : config.sizes) {
+      for (size_t d : config.dimensions) {
+        PointSet data = makeBenchPoints(distribution, n, d, config.seed);
+        vector<vector<double>> queries = makeBenchQueries(distribution, config.numQueries, n, d, config.seed);
+
+        // Static tree construction
+        if (config.runs("build")) {
+          for (size_t threads : buildThreads) {
+            omp_set_num_threads(threads);
+            KDTree tree;
+            PointSet copy;
+            BenchResult result = {"build", BENCH_VARIANT, distribution, n, d, 0, threads, 1, n, {}};
+            result.samples = measure(config,
+                                     [&]() { tree = KDTree(); copy = data; },
+                                     [&]() { tree.buildKDTree(move(copy), 0, d); });
+            printResult(result);
+            results.push_back(result);
+          }
+        }
+
+        // The same tree built on a thread pool instead of OpenMP
+        if (config.runs("pool-build")) {
+          for (size_t threads : config.threads) {
+            ThreadPool pool(threads);
+            KDTree tree;
+            PointSet copy;
+            BenchResult result = {"pool-build", "pool", distribution, n, d, 0, threads, 1, n, {}};
+            result.samples = measure(config,
+                                     [&]() { tree = KDTree(); copy = data; },
+                                     [&]() { tree.buildKDTree(pool, move(copy), 0, d); });
+            printResult(result);
+            results.push_back(result);
+          }
+        }
+
+        if (!config.runs("knn") && !config.runs("batch") && !config.runs("async")) {
+          continue;
+        }
+
+        KDTree tree;
+        tree.buildKDTree(data, 0, d);
+        MetricSpec metric;
+
+        for (size_t k : config.ks) {
+          // One query after the other on one thread: latency
+          if (config.runs("knn")) {
+            BenchResult result = {"knn", BENCH_VARIANT, distribution, n, d, k, 1, 1, queries.size(), {}};
+            result.samples = measure(config, []() {}, [&]() {
+              for (const vector<double>& query : queries) {
+                vector<DistanceNode> neighbors;
+                kNNSearchIterative(tree.root.get(), query, k, neighbors, metric);
+              }
+            });
+            printResult(result);
+            results.push_back(result);
+          }
+
+          // Queries spread over the threads: throughput
+          if (config.runs("batch")) {
+            for (size_t threads : config.threads) {
+              omp_set_num_threads(threads);
+              BenchResult result = {"batch", BENCH_VARIANT, distribution, n, d, k, threads, 1, queries.size(), {}};
+              result.samples = measure(config, []() {}, [&]() {
+                #pragma omp parallel for schedule(dynamic, 16)
+                for (size_t q = 0; q < queries.size(); q++) {
+                  vector<DistanceNode> neighbors;
+                  kNNSearchIterative(tree.root.get(), queries[q], k, neighbors, metric);
+                }
+              });
+              printResult(result);
+              results.push_back(result);
+            }
+          }
+
+          // Same queries as futures on a thread pool (see asyncKnn.h)
+          if (config.runs("async")) {
+            for (size_t threads : config.threads) {
+              ThreadPool pool(threads);
+              AsyncKNN search(tree, pool, metric);
+              BenchResult result = {"async", "pool", distribution, n, d, k, threads, 1, queries.size(), {}};
+              result.samples = measure(config, []() {}, [&]() {
+                vector<future<vector<DistanceNode>>> answers = search.submitBatch(queries, k);
+                for (future<vector<DistanceNode>>& answer : answers) {
+                  pool.get(answer);
+                }
+              });
+              printResult(result);
+              results.push_back(result);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return finishBench(config, results);
+}
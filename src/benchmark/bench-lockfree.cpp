@@ -0,0 +1,110 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <omp.h>
+#include "../lockFree/kdTree.h"
+#include "bench.h"
+
+using namespace std;
+
+// Built once against lockFree/kdTree.cpp and once against lockFree/kdTree-parallel.cpp
+#ifdef BENCH_PARALLEL_BUILD
+#define BENCH_VARIANT "parallel"
+#else
+#define BENCH_VARIANT "sequential"
+#endif
+
+// Insert points [begin, end) of data, one call per point
+void insertRange(KDTree& tree, const PointSet& data, size_t begin, size_t end, int k) {
+  for (size_t i = begin; i < end; i++) {
+    tree.insertLockFree(data[i], 0, k);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  BenchConfig config;
+  if (!parseBenchArgs(argc, argv, "build, insert, pool-insert", config)) {
+    return 0;
+  }
+
+#ifdef BENCH_PARALLEL_BUILD
+  vector<size_t> buildThreads = config.threads;
+#else
+  vector<size_t> buildThreads = {1};
+#endif
+
+  vector<BenchResult> results;
+  printResultHeader();
+
+  for (const string& distribution : config.distributions) {
+    for (size_t n : config.sizes) {
+      for (size_t d : config.dimensions) {
+        PointSet data = makeBenchPoints(distribution, n, d, config.seed);
+
+        if (config.runs("build")) {
+          for (size_t threads : buildThreads) {
+            omp_set_num_threads(threads);
+            KDTree tree;
+            BenchResult result = {"lf-build", BENCH_VARIANT, distribution, n, d, 0, threads, 1, n, {}};
+            result.samples = measure(config,
+                                     [&]() { tree.clear(); },
+                                     [&]() { tree.buildKDTree(data, 0, d); });
+            printResult(result);
+            results.push_back(result);
+          }
+        }
+
+        // Build over the first half, then threads insert the second half concurrently
+        if (config.runs("insert")) {
+          size_t half = n / 2;
+          PointSet initial = data.project(d);
+          initial.resize(half);
+
+          for (size_t threads : config.threads) {
+            KDTree tree;
+            BenchResult result = {"lf-insert", BENCH_VARIANT, distribution, n, d, 0, threads, 1, n - half, {}};
+            result.samples = measure(config,
+                                     [&]() { tree.buildKDTree(initial, 0, d); },
+                                     [&]() {
+              vector<thread> workers;
+              for (size_t t = 0; t < threads; t++) {
+                size_t begin = half + (n - half) * t / threads;
+                size_t end = half + (n - half) * (t + 1) / threads;
+                workers.push_back(thread(insertRange, ref(tree), cref(data), begin, end, (int)d));
+              }
+              for (thread& worker : workers) {
+                worker.join();
+              }
+            });
+            printResult(result);
+            results.push_back(result);
+          }
+        }
+
+        // Same inserts spread over a thread pool by insertAll
+        if (config.runs("pool-insert")) {
+          size_t half = n / 2;
+          PointSet initial = data.project(d);
+          initial.resize(half);
+          PointSet later(d);
+          for (size_t i = half; i < n; i++) {
+            later.push_back(data.features(i), data.label(i));
+          }
+
+          for (size_t threads : config.threads) {
+            ThreadPool pool(threads);
+            KDTree tree;
+            BenchResult result = {"lf-pool-insert", "pool", distribution, n, d, 0, threads, 1, n - half, {}};
+            result.samples = measure(config,
+                                     [&]() { tree.buildKDTree(initial, 0, d); },
+                                     [&]() { tree.insertAll(pool, later, d); });
+            printResult(result);
+            results.push_back(result);
+          }
+        }
+      }
+    }
+  }
+
+  return finishBench(config, results);
+}
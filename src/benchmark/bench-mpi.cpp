@@ -0,0 +1,107 @@
+#include <iostream>
+#include <vector>
+#include <omp.h>
+#include "mpi.h"
+#include "../knn/knn.h"
+#include "../knn/mpiSearch.h"
+#include "../kdTree/kdTree.h"
+#include "bench.h"
+
+using namespace std;
+
+// Distributed kNN search as done by knn-mpi.out: every rank builds a tree
+// over its slice and rank 0 merges the neighbors. The number of ranks comes
+// from mpirun, so sweep it by running this binary once per rank count.
+int main(int argc, char *argv[]) {
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  int rank, nproc;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+  if (provided < MPI_THREAD_FUNNELED) {
+    if (rank == 0) {
+      cout << "The MPI library does not support OpenMP threads next to MPI calls (MPI_THREAD_FUNNELED)" << endl;
+    }
+    MPI_Finalize();
+    return 0;
+  }
+
+  // Only rank 0 prints and writes files
+  BenchConfig config;
+  bool proceed = parseBenchArgs(argc, argv, "build, search", config);
+  if (!proceed) {
+    MPI_Finalize();
+    return 0;
+  }
+  if (rank != 0) {
+    config.output = "";
+    config.baseline = "";
+  }
+
+  vector<BenchResult> results;
+  if (rank == 0) {
+    printResultHeader();
+  }
+
+  // Every rank's samples end with a barrier, rank 0 records the slowest rank
+  auto recordResult = [&](BenchResult& result) {
+    vector<double> slowest(result.samples.size());
+    MPI_Reduce(result.samples.data(), slowest.data(), result.samples.size(), MPI_DOUBLE,
+               MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+      result.samples = slowest;
+      printResult(result);
+      results.push_back(result);
+    }
+  };
+
+  for (const string& distribution : config.distributions) {
+    for (size_t n : config.sizes) {
+      for (size_t d : config.dimensions) {
+        // Same seed everywhere: each rank generates its own slice of the same points
+        long long begin, end;
+        sliceRange(rank, nproc, n, begin, end);
+        PointSet localData = makeBenchSlice(distribution, begin, end - begin, d, config.seed);
+        vector<vector<double>> queries = makeBenchQueries(distribution, config.numQueries, n, d, config.seed);
+
+        if (config.runs("build")) {
+          for (size_t threads : config.threads) {
+            omp_set_num_threads(threads);
+            KDTree tree;
+            PointSet copy;
+            BenchResult result = {"mpi-build", "parallel", distribution, n, d, 0, threads, (size_t)nproc, n, {}};
+            result.samples = measure(config,
+                                     [&]() { tree = KDTree(); copy = localData; MPI_Barrier(MPI_COMM_WORLD); },
+                                     [&]() { tree.buildKDTree(move(copy), 0, d); });
+            recordResult(result);
+          }
+        }
+
+        if (!config.runs("search")) {
+          continue;
+        }
+
+        KDTree tree;
+        tree.buildKDTree(localData, 0, d);
+        MetricSpec metric;
+
+        for (size_t k : config.ks) {
+          for (size_t threads : config.threads) {
+            omp_set_num_threads(threads);
+            BenchResult result = {"mpi-search", "parallel", distribution, n, d, k, threads, (size_t)nproc,
+                                  queries.size(), {}};
+            result.samples = measure(config, []() { MPI_Barrier(MPI_COMM_WORLD); }, [&]() {
+              vector<vector<DistanceNode2>> localResults = localBatchSearch(tree, queries, k, metric);
+              gatherBatchResults(localResults, k, rank, nproc);
+            });
+            recordResult(result);
+          }
+        }
+      }
+    }
+  }
+
+  int exitCode = finishBench(config, results);
+  MPI_Finalize();
+  return exitCode;
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <vector>
+#include <omp.h>
+#include "../knn/knn.h"
+#include "../kdTree/kdTree.h"
+#include "../kdTree/numaTree.h"
+#include "bench.h"
+
+using namespace std;
+
+// Batch kNN throughput of one tree built by kdTree-parallel.cpp, searched in
+// place (default), as an interleaved copy and as one replica per NUMA node.
+// Query threads are pinned to their node in all three, so only the placement
+// of the tree differs.
+
+int main(int argc, char *argv[]) {
+  BenchConfig config;
+  if (!parseBenchArgs(argc, argv, "default, interleave, replicate", config)) {
+    return 0;
+  }
+
+  const NumaTopology& topology = numaTopology();
+  printf("NUMA nodes: %zu\n", topology.size());
+  for (size_t node = 0; node < topology.size(); node++) {
+    printf("  node %d: %zu cpus\n", topology.nodes[node], topology.cpus[node].size());
+  }
+
+  vector<NumaPlacement> placements;
+  for (NumaPlacement placement : {NUMA_DEFAULT, NUMA_INTERLEAVE, NUMA_REPLICATE}) {
+    if (config.runs(numaPlacementName(placement))) {
+      placements.push_back(placement);
+    }
+  }
+  size_t maxThreads = *max_element(config.threads.begin(), config.threads.end());
+
+  vector<BenchResult> results;
+  printResultHeader();
+
+  for (const string& distribution : config.distributions) {
+    for (size_t n : config.sizes) {
+      for (size_t d : config.dimensions) {
+        vector<vector<double>> queries = makeBenchQueries(distribution, config.numQueries, n, d, config.seed);
+
+        // Built by the whole team, as the tools do
+        omp_set_num_threads(maxThreads);
+        KDTree tree;
+        tree.buildKDTree(makeBenchPoints(distribution, n, d, config.seed), 0, d);
+        MetricSpec metric;
+
+        for (NumaPlacement placement : placements) {
+          NumaTree index(tree, placement);
+          if (!index.isPlaced()) {
+            printf("(%s: pinning or memory policy refused, placement left to the kernel)\n",
+                   numaPlacementName(placement));
+          }
+
+          for (size_t k : config.ks) {
+            for (size_t threads : config.threads) {
+              BenchResult result = {"numa-batch", numaPlacementName(placement), distribution, n, d, k,
+                                    threads, 1, queries.size(), {}};
+              result.samples = measure(config, []() {}, [&]() {
+                #pragma omp parallel num_threads(threads)
+                {
+                  size_t node = queryThreadNode(omp_get_thread_num(), omp_get_num_threads());
+                  ScopedNodePinning pin(node);
+                  const KDTree& local = index.treeForNode(node);
+
+                  #pragma omp for schedule(dynamic, 16)
+                  for (size_t q = 0; q < queries.size(); q++) {
+                    vector<DistanceNode> neighbors;
+                    kNNSearchIterative(local.root.get(), queries[q], k, neighbors, metric);
+                  }
+                }
+              });
+              printResult(result);
+              results.push_back(result);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return finishBench(config, results);
+}
@@ -0,0 +1,410 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include "../pointSet.h"
+#include "../timing.h"
+#include "../utils.h"
+#include "../datasets/generators.h"
+
+using namespace std;
+
+// Shared harness of the benchmark binaries: command line sweep, synthetic
+// data, timed samples with warmup, JSON/CSV output and baseline comparison.
+
+// Parameters swept by every benchmark binary
+struct BenchConfig {
+  vector<size_t> sizes;
+  vector<size_t> dimensions;
+  vector<size_t> ks;
+  vector<size_t> threads;
+  vector<string> distributions;
+  vector<string> benchmarks;   // Benchmarks to run, empty runs all of them
+  size_t numQueries;
+  int warmup;
+  int repetitions;
+  unsigned seed;
+  string output;               // .json or .csv, by extension
+  string baseline;             // CSV written by an earlier run
+  double tolerance;            // Allowed slowdown of the median before flagging a regression
+
+  BenchConfig()
+      : sizes({100000}), dimensions({3, 8}), ks({10}), threads({1}),
+        distributions({"uniform", "gaussian"}), numQueries(1000),
+        warmup(1), repetitions(5), seed(42), tolerance(0.10) {}
+
+  bool runs(const string& benchmark) const {
+    return benchmarks.empty() || find(benchmarks.begin(), benchmarks.end(), benchmark) != benchmarks.end();
+  }
+};
+
+// One measured configuration
+struct BenchResult {
+  string benchmark;
+  string variant;
+  string distribution;
+  size_t n;
+  size_t d;
+  size_t k;
+  size_t threads;
+  size_t ranks;
+  size_t operations;           // Work done per sample: points built or inserted, queries answered
+  vector<double> samples;      // Seconds per sample
+
+  double percentile(double p) const {
+    vector<double> sorted = samples;
+    sort(sorted.begin(), sorted.end());
+    if (sorted.empty()) {
+      return 0.0;
+    }
+    // Linear interpolation between the closest ranks
+    double position = p * (sorted.size() - 1);
+    size_t below = (size_t)floor(position);
+    size_t above = min(below + 1, sorted.size() - 1);
+    return sorted[below] + (position - below) * (sorted[above] - sorted[below]);
+  }
+
+  double median() const { return percentile(0.5); }
+  double minimum() const { return percentile(0.0); }
+
+  double mean() const {
+    double sum = 0.0;
+    for (double sample : samples) {
+      sum += sample;
+    }
+    return samples.empty() ? 0.0 : sum / samples.size();
+  }
+
+  double stddev() const {
+    double average = mean();
+    double sum = 0.0;
+    for (double sample : samples) {
+      sum += (sample - average) * (sample - average);
+    }
+    return samples.size() > 1 ? sqrt(sum / (samples.size() - 1)) : 0.0;
+  }
+
+  // Operations per second at the median
+  double throughput() const {
+    double time = median();
+    return time > 0.0 ? operations / time : 0.0;
+  }
+
+  // Identifies the same measurement across runs
+  string key() const {
+    ostringstream out;
+    out << benchmark << "/" << variant << "/" << distribution << "/n=" << n << "/d=" << d
+        << "/k=" << k << "/threads=" << threads << "/ranks=" << ranks;
+    return out.str();
+  }
+};
+
+inline vector<size_t> parseSizeList(const string& value) {
+  vector<size_t> sizes;
+  for (double number : parseDoubleList(value)) {
+    if (number > 0) {
+      sizes.push_back((size_t)number);
+    }
+  }
+  return sizes;
+}
+
+inline vector<string> parseNameList(const string& value) {
+  vector<string> names;
+  istringstream in(value);
+  string name;
+  while (getline(in, name, ',')) {
+    if (!name.empty()) {
+      names.push_back(name);
+    }
+  }
+  return names;
+}
+
+inline void printBenchUsage(const char* program, const string& benchmarks) {
+  cout << "Usage: " << program << " [options], lists are comma separated" << endl;
+  cout << "Options:" << endl;
+  cout << "  -b list        Benchmarks to run: " << benchmarks << " (default all)" << endl;
+  cout << "  -n list        Numbers of points (default 100000)" << endl;
+  cout << "  -d list        Dimensions (default 3,8)" << endl;
+  cout << "  -k list        Numbers of neighbors (default 10)" << endl;
+  cout << "  -p list        Thread counts (default 1)" << endl;
+  cout << "  -g list        Distributions: uniform, gaussian, powerlaw, lowrank, duplicates" << endl;
+  cout << "                 (default uniform,gaussian)" << endl;
+  cout << "  -q value       Queries per sample (default 1000)" << endl;
+  cout << "  -w value       Warmup runs per configuration (default 1)" << endl;
+  cout << "  -r value       Measured runs per configuration (default 5)" << endl;
+  cout << "  -s value       Random seed (default 42)" << endl;
+  cout << "  -o value       Write the results to this .json or .csv file" << endl;
+  cout << "  -c value       Compare medians against a CSV written by an earlier run" << endl;
+  cout << "  -t value       Allowed slowdown before reporting a regression (default 0.1)" << endl;
+}
+
+// Parse the command line shared by all benchmark binaries, false to exit
+inline bool parseBenchArgs(int argc, char* argv[], const string& benchmarks, BenchConfig& config) {
+  int opt;
+  while ((opt = getopt(argc, argv, "hb:n:d:k:p:g:q:w:r:s:o:c:t:")) != -1) {
+    switch (opt) {
+      case 'h':
+        printBenchUsage(argv[0], benchmarks);
+        return false;
+      case 'b':
+        config.benchmarks = parseNameList(optarg);
+        break;
+      case 'n':
+        config.sizes = parseSizeList(optarg);
+        break;
+      case 'd':
+        config.dimensions = parseSizeList(optarg);
+        break;
+      case 'k':
+        config.ks = parseSizeList(optarg);
+        break;
+      case 'p':
+        config.threads = parseSizeList(optarg);
+        break;
+      case 'g':
+        config.distributions = parseNameList(optarg);
+        break;
+      case 'q':
+      case 'w':
+      case 'r':
+      case 's':
+        if (!isPositiveInteger(optarg)) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return false;
+        }
+        if (opt == 'q') config.numQueries = stoul(optarg);
+        if (opt == 'w') config.warmup = stoi(optarg);
+        if (opt == 'r') config.repetitions = max(1, stoi(optarg));
+        if (opt == 's') config.seed = stoul(optarg);
+        break;
+      case 'o':
+        config.output = optarg;
+        break;
+      case 'c':
+        config.baseline = optarg;
+        break;
+      case 't':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for t, t = " << optarg << endl;
+          return false;
+        }
+        config.tolerance = stod(optarg);
+        break;
+      default:
+        printBenchUsage(argv[0], benchmarks);
+        return false;
+    }
+  }
+
+  for (const string& distribution : config.distributions) {
+    Distribution parsed;
+    if (!parseDistribution(distribution, parsed)) {
+      cout << "Invalid value for g, g = " << distribution << endl;
+      return false;
+    }
+  }
+
+  if (config.sizes.empty() || config.dimensions.empty() || config.ks.empty() ||
+      config.threads.empty() || config.distributions.empty()) {
+    cout << "Empty sweep, check the -n, -d, -k, -p and -g lists" << endl;
+    return false;
+  }
+  return true;
+}
+
+// Points [first, first + count) of a synthetic dataset in [0, 100)^d from the
+// dataset generator (datasets/generators.h). The same seed gives the same
+// points on every rank, so each rank can generate just its own slice.
+inline PointSet makeBenchSlice(const string& distribution, size_t first, size_t count, size_t d, unsigned seed) {
+  GeneratorSpec spec;
+  parseDistribution(distribution, spec.distribution);
+  spec.dimensions = d;
+  spec.seed = seed;
+  return DatasetGenerator(spec).generate(first, count);
+}
+
+inline PointSet makeBenchPoints(const string& distribution, size_t n, size_t d, unsigned seed) {
+  return makeBenchSlice(distribution, 0, n, d, seed);
+}
+
+// Queries from the same distribution: the points that follow the n data points
+inline vector<vector<double>> makeBenchQueries(const string& distribution, size_t numQueries, size_t n,
+                                               size_t d, unsigned seed) {
+  PointSet points = makeBenchSlice(distribution, n, numQueries, d, seed);
+
+  vector<vector<double>> queries;
+  queries.reserve(numQueries);
+  for (size_t i = 0; i < points.size(); i++) {
+    queries.push_back(points[i].toVector());
+  }
+  return queries;
+}
+
+// Run setup() then a timed run(), warmup times unrecorded and repetitions times recorded
+template<typename Setup, typename Run>
+vector<double> measure(const BenchConfig& config, Setup setup, Run run) {
+  vector<double> samples;
+  for (int i = 0; i < config.warmup + config.repetitions; i++) {
+    setup();
+    Timer timer;
+    run();
+    double elapsed = timer.elapsed();
+    if (i >= config.warmup) {
+      samples.push_back(elapsed);
+    }
+  }
+  return samples;
+}
+
+inline void printResultHeader() {
+  printf("%-14s %-11s %-10s %9s %4s %6s %7s %5s %12s %12s %10s %14s\n", "benchmark", "variant",
+         "data", "n", "d", "k", "threads", "ranks", "median (s)", "min (s)", "stddev %", "ops/s");
+}
+
+inline void printResult(const BenchResult& result) {
+  double median = result.median();
+  printf("%-14s %-11s %-10s %9zu %4zu %6zu %7zu %5zu %12.6f %12.6f %10.2f %14.1f\n",
+         result.benchmark.c_str(), result.variant.c_str(), result.distribution.c_str(),
+         result.n, result.d, result.k, result.threads, result.ranks, median, result.minimum(),
+         median > 0.0 ? 100.0 * result.stddev() / median : 0.0, result.throughput());
+  fflush(stdout);
+}
+
+inline bool endsWith(const string& value, const string& suffix) {
+  return value.size() >= suffix.size() &&
+         value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+inline void writeResultsJSON(ostream& out, const vector<BenchResult>& results) {
+  out << "{\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& result = results[i];
+    out << "    {\"benchmark\": \"" << result.benchmark << "\", \"variant\": \"" << result.variant
+        << "\", \"distribution\": \"" << result.distribution << "\", \"n\": " << result.n
+        << ", \"d\": " << result.d << ", \"k\": " << result.k << ", \"threads\": " << result.threads
+        << ", \"ranks\": " << result.ranks << ", \"operations\": " << result.operations
+        << ", \"median\": " << result.median() << ", \"min\": " << result.minimum()
+        << ", \"mean\": " << result.mean() << ", \"p90\": " << result.percentile(0.9)
+        << ", \"stddev\": " << result.stddev() << ", \"throughput\": " << result.throughput()
+        << ", \"samples\": [";
+    for (size_t s = 0; s < result.samples.size(); s++) {
+      out << (s > 0 ? ", " : "") << result.samples[s];
+    }
+    out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+#define BENCH_CSV_HEADER "benchmark,variant,distribution,n,d,k,threads,ranks,operations,samples,median,min,mean,p90,stddev,throughput"
+
+inline void writeResultsCSV(ostream& out, const vector<BenchResult>& results) {
+  out << BENCH_CSV_HEADER << "\n";
+  for (const BenchResult& result : results) {
+    out << result.benchmark << "," << result.variant << "," << result.distribution << ","
+        << result.n << "," << result.d << "," << result.k << "," << result.threads << ","
+        << result.ranks << "," << result.operations << "," << result.samples.size() << ","
+        << result.median() << "," << result.minimum() << "," << result.mean() << ","
+        << result.percentile(0.9) << "," << result.stddev() << "," << result.throughput() << "\n";
+  }
+}
+
+// Write JSON for a .json file name, CSV otherwise
+inline bool writeResults(const string& filename, const vector<BenchResult>& results) {
+  ofstream out(filename);
+  if (!out.is_open()) {
+    cout << "Unable to open file " << filename << endl;
+    return false;
+  }
+  out.precision(9);
+  if (endsWith(filename, ".json")) {
+    writeResultsJSON(out, results);
+  } else {
+    writeResultsCSV(out, results);
+  }
+  return true;
+}
+
+// Medians of an earlier CSV run, by BenchResult::key
+inline map<string, double> readBaseline(const string& filename) {
+  map<string, double> medians;
+  ifstream in(filename);
+  if (!in.is_open()) {
+    cout << "Unable to open file " << filename << endl;
+    return medians;
+  }
+
+  string line;
+  getline(in, line);
+  if (line != BENCH_CSV_HEADER) {
+    cout << filename << " is not a benchmark CSV file" << endl;
+    return medians;
+  }
+
+  while (getline(in, line)) {
+    vector<string> fields;
+    istringstream fieldStream(line);
+    string field;
+    while (getline(fieldStream, field, ',')) {
+      fields.push_back(field);
+    }
+    if (fields.size() < 11) {
+      continue;
+    }
+
+    BenchResult result;
+    result.benchmark = fields[0];
+    result.variant = fields[1];
+    result.distribution = fields[2];
+    result.n = stoul(fields[3]);
+    result.d = stoul(fields[4]);
+    result.k = stoul(fields[5]);
+    result.threads = stoul(fields[6]);
+    result.ranks = stoul(fields[7]);
+    medians[result.key()] = stod(fields[10]);
+  }
+  return medians;
+}
+
+// Print the change of every median against the baseline, returns the number
+// of configurations slower by more than the tolerance
+inline size_t compareWithBaseline(const vector<BenchResult>& results, const string& filename, double tolerance) {
+  map<string, double> baseline = readBaseline(filename);
+  size_t regressions = 0;
+  printf("\nChange against %s (tolerance %.0f%%)\n", filename.c_str(), tolerance * 100.0);
+  for (const BenchResult& result : results) {
+    auto entry = baseline.find(result.key());
+    if (entry == baseline.end() || entry->second <= 0.0) {
+      continue;
+    }
+    double change = result.median() / entry->second - 1.0;
+    bool regression = change > tolerance;
+    regressions += regression;
+    printf("  %-70s %+8.2f%%%s\n", result.key().c_str(), change * 100.0, regression ? "  REGRESSION" : "");
+  }
+  printf("Regressions: %zu\n", regressions);
+  return regressions;
+}
+
+// Write the output file and compare against the baseline, returns the exit code
+inline int finishBench(const BenchConfig& config, const vector<BenchResult>& results) {
+  if (config.output != "" && writeResults(config.output, results)) {
+    printf("\nResults written to %s\n", config.output.c_str());
+  }
+  if (config.baseline != "" && compareWithBaseline(results, config.baseline, config.tolerance) > 0) {
+    return 1;
+  }
+  return 0;
+}
+
+#endif
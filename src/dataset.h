@@ -0,0 +1,195 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include "pointSet.h"
+
+using namespace std;
+
+// Binary dataset layout:
+//   BinaryHeader, followed by numPoints fixed-size records.
+//   Each record holds `dimensions` doubles followed by the label stored as
+//   an int64, so every record stays 8-byte aligned and can be addressed
+//   directly by index (which is what lets MPI ranks read their own slice).
+static const char BINARY_MAGIC[8] = {'K', 'D', 'T', 'B', 'I', 'N', '1', '\0'};
+
+struct BinaryHeader {
+  char magic[8];
+  uint64_t numPoints;
+  uint32_t dimensions;
+  uint32_t reserved;
+};
+
+// Size in bytes of a single record for the given dimensionality
+inline size_t binaryRecordSize(size_t dimensions) {
+  return (dimensions + 1) * sizeof(double);
+}
+
+// Check the header magic of a dataset file
+inline bool isBinaryDataset(const string& filename) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char magic[8];
+  bool isBinary = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                  memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return isBinary;
+}
+
+inline BinaryHeader makeBinaryHeader(uint64_t numPoints, uint32_t dimensions) {
+  BinaryHeader header;
+  memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+  header.numPoints = numPoints;
+  header.dimensions = dimensions;
+  header.reserved = 0;
+  return header;
+}
+
+// Decode one binary record into features and label
+inline void decodeBinaryRecord(const char* record, size_t dimensions,
+                               double* features, int& label) {
+  memcpy(features, record, dimensions * sizeof(double));
+  int64_t storedLabel;
+  memcpy(&storedLabel, record + dimensions * sizeof(double), sizeof(storedLabel));
+  label = (int)storedLabel;
+}
+
+// Encode features and label into one binary record
+inline void encodeBinaryRecord(char* record, size_t dimensions,
+                               const double* features, int label) {
+  memcpy(record, features, dimensions * sizeof(double));
+  int64_t storedLabel = label;
+  memcpy(record + dimensions * sizeof(double), &storedLabel, sizeof(storedLabel));
+}
+
+// Parse one CSV line "f1,f2,...,fn,label" held in [begin, end).
+// The last value on the line is the label, as in KDTree::parseInput.
+// Returns false for blank lines.
+inline bool parseCSVRecord(const char* begin, const char* end,
+                           vector<double>& features, int& label) {
+  features.clear();
+
+  // strtod needs a terminated string: copy the whole line, however long,
+  // into a buffer each thread reuses
+  thread_local string line;
+  line.assign(begin, end);
+
+  char* cursor = &line[0];
+  char* next;
+  double value;
+  bool haveValue = false;
+
+  while (true) {
+    double parsed = strtod(cursor, &next);
+    if (next == cursor) {
+      break;
+    }
+    if (haveValue) {
+      features.push_back(value);
+    }
+    value = parsed;
+    haveValue = true;
+
+    cursor = next;
+    while (*cursor == ',' || *cursor == ' ' || *cursor == '\t') {
+      cursor++;
+    }
+  }
+
+  if (!haveValue) {
+    return false;
+  }
+
+  label = (int)value;
+  return true;
+}
+
+// Read a CSV dataset into a PointSet.
+// The first line fixes the number of features, lines with a different count are skipped.
+inline PointSet readCSVDataset(const string& filename) {
+  PointSet points;
+  ifstream file(filename);
+  if (!file.is_open()) {
+    cout << "Unable to open file " << filename << endl;
+    return points;
+  }
+
+  string line;
+  vector<double> features;
+  int label;
+  size_t skipped = 0;
+  while (getline(file, line)) {
+    if (!parseCSVRecord(line.data(), line.data() + line.size(), features, label)) {
+      continue;
+    }
+    if (points.empty() && points.dimensions() == 0) {
+      points = PointSet(features.size());
+    }
+    if (features.size() != points.dimensions()) {
+      skipped++;
+      continue;
+    }
+    points.push_back(features.data(), label);
+  }
+
+  if (skipped > 0) {
+    cout << "Skipped " << skipped << " lines without " << points.dimensions() << " features" << endl;
+  }
+  points.shrinkToFit();
+  return points;
+}
+
+// Read a binary dataset (layout above) into a PointSet
+inline PointSet readBinaryDataset(const string& filename) {
+  ifstream file(filename, ios::binary);
+  BinaryHeader header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    cout << "Unable to read header of " << filename << endl;
+    return PointSet();
+  }
+
+  PointSet points(header.dimensions);
+  points.resize(header.numPoints);
+
+  // Decode in blocks of records straight into the feature buffer
+  size_t recordSize = binaryRecordSize(header.dimensions);
+  size_t recordsPerRead = max<size_t>(1, (1 << 20) / recordSize);
+  vector<char> buffer(recordsPerRead * recordSize);
+  uint64_t numRead = 0;
+  while (numRead < header.numPoints) {
+    size_t count = min<uint64_t>(recordsPerRead, header.numPoints - numRead);
+    file.read(buffer.data(), count * recordSize);
+    count = file.gcount() / recordSize;
+    for (size_t r = 0; r < count; r++) {
+      decodeBinaryRecord(buffer.data() + r * recordSize, header.dimensions,
+                         points.features(numRead + r), points.label(numRead + r));
+    }
+    numRead += count;
+    if (count == 0) {
+      break;
+    }
+  }
+  points.resize(numRead);
+  return points;
+}
+
+// Read a CSV or binary dataset, whichever the file holds
+inline PointSet readDataset(const string& filename) {
+  PointSet points = isBinaryDataset(filename) ? readBinaryDataset(filename) : readCSVDataset(filename);
+  cout << "Parsed " << points.size() << " data points from " << filename << " ("
+       << points.memoryBytes() / 1e6 << " MB)" << endl;
+  return points;
+}
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef DATASET_STREAM_H
+#define DATASET_STREAM_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include "dataset.h"
+#include "mpmcQueue.h"
+#include "timing.h"
+
+using namespace std;
+
+// A CSV or binary dataset (see dataset.h) handed out in chunks of points
+// while it is still being read, so building can overlap the I/O and the
+// whole file is never held in memory next to the index:
+//
+//   DatasetStream stream(filename, 2);
+//   PointSet chunk;
+//   while (stream.next(chunk)) { ... consume chunk ... }
+//
+// Every parser thread reads its own byte range of the file (whole lines for
+// CSV, whole records for binary) and pushes chunks into a bounded lock-free
+// queue, waiting while it is full. Chunks come out in no particular order.
+// next() may be called from several threads.
+
+#define STREAM_CHUNK_POINTS 4096
+#define STREAM_QUEUE_CHUNKS 64
+#define STREAM_READ_BYTES (1 << 20)
+
+// Where the points of a dataset file are
+struct DatasetLayout {
+  bool binary;
+  size_t dimensions;
+  size_t dataBegin;   // Byte range of the points
+  size_t dataEnd;
+};
+
+// Find the format, the dimensions and the byte range of the points without
+// reading them, false if the file cannot be opened or holds no point
+inline bool findDatasetLayout(const string& filename, DatasetLayout& layout) {
+  layout = {false, 0, 0, 0};
+  ifstream file(filename, ios::binary | ios::ate);
+  if (!file.is_open()) {
+    cout << "Unable to open file " << filename << endl;
+    return false;
+  }
+  layout.dataEnd = file.tellg();
+  file.seekg(0);
+
+  layout.binary = isBinaryDataset(filename);
+  if (layout.binary) {
+    BinaryHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+      cout << "Unable to read header of " << filename << endl;
+      return false;
+    }
+    layout.dimensions = header.dimensions;
+    layout.dataBegin = sizeof(header);
+    layout.dataEnd = min<uint64_t>(layout.dataEnd,
+                                   layout.dataBegin + header.numPoints * binaryRecordSize(header.dimensions));
+    if (layout.dimensions == 0) {
+      cout << "No features in " << filename << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // As readCSVDataset, the first parsable line fixes the number of features
+  string line;
+  vector<double> features;
+  int label;
+  while (getline(file, line)) {
+    if (parseCSVRecord(line.data(), line.data() + line.size(), features, label)) {
+      layout.dimensions = features.size();
+      if (layout.dimensions == 0) {
+        cout << "No features in " << filename << endl;
+        return false;
+      }
+      return true;
+    }
+  }
+  cout << "No data points in " << filename << endl;
+  return false;
+}
+
+class DatasetStream {
+public:
+  DatasetStream(const string& filename, size_t numParsers, size_t chunkPoints = STREAM_CHUNK_POINTS,
+                size_t queueChunks = STREAM_QUEUE_CHUNKS)
+      : filename(filename), chunkPoints(max<size_t>(chunkPoints, 1)), queue(max<size_t>(queueChunks, 2)),
+        running(0), numPoints(0), numSkipped(0), fullWaits(0), parseSeconds(0.0) {
+    if (!findDatasetLayout(filename, layout)) {
+      return;
+    }
+    numParsers = max<size_t>(numParsers, 1);
+    running = numParsers;
+    for (size_t p = 0; p < numParsers; p++) {
+      parsers.emplace_back([this, p, numParsers]() { parseRange(p, numParsers); });
+    }
+  }
+
+  ~DatasetStream() {
+    // Drain so that parsers blocked on a full queue can finish
+    PointSet chunk;
+    while (next(chunk)) {}
+    for (thread& parser : parsers) {
+      parser.join();
+    }
+  }
+
+  DatasetStream(const DatasetStream&) = delete;
+  DatasetStream& operator=(const DatasetStream&) = delete;
+
+  // False if the file could not be opened or holds no point
+  bool isOpen() const { return layout.dimensions > 0; }
+  size_t dimensions() const { return layout.dimensions; }
+
+  // Wait for the next chunk, false once the whole file has been handed out
+  bool next(PointSet& chunk) {
+    while (true) {
+      if (queue.tryPop(chunk)) {
+        return true;
+      }
+      // Parsers push before they finish, so an empty queue after the last one is final
+      if (running.load(memory_order_acquire) == 0) {
+        return queue.tryPop(chunk);
+      }
+      this_thread::yield();
+    }
+  }
+
+  // Totals, complete once next() returned false
+  size_t pointsRead() const { return numPoints.load(); }
+  size_t linesSkipped() const { return numSkipped.load(); }
+  size_t queueFullWaits() const { return fullWaits.load(); }
+  double parseTime() const { return parseSeconds.load(); }   // Until the last parser finished
+
+private:
+  void parseRange(size_t parser, size_t numParsers) {
+    Timer parseTimer;
+    size_t dataBegin = layout.dataBegin;
+    size_t bytes = layout.dataEnd - dataBegin;
+    if (layout.binary) {
+      // Split on record boundaries
+      size_t recordSize = binaryRecordSize(layout.dimensions);
+      size_t numRecords = bytes / recordSize;
+      parseBinary(dataBegin + numRecords * parser / numParsers * recordSize,
+                  dataBegin + numRecords * (parser + 1) / numParsers * recordSize);
+    } else {
+      parseCSV(dataBegin + bytes * parser / numParsers, dataBegin + bytes * (parser + 1) / numParsers);
+    }
+
+    // The last one out records when parsing ended
+    double elapsed = parseTimer.elapsed();
+    double longest = parseSeconds.load();
+    while (elapsed > longest && !parseSeconds.compare_exchange_weak(longest, elapsed)) {}
+    running.fetch_sub(1, memory_order_release);
+  }
+
+  // Lines starting in [begin, end): a line belongs to the range holding its first byte
+  void parseCSV(size_t begin, size_t end) {
+    ifstream file(filename, ios::binary);
+    vector<char> buffer(STREAM_READ_BYTES);
+    string carry;
+    vector<double> features;
+    int label;
+    size_t skipped = 0;
+    PointSet chunk(layout.dimensions);
+    chunk.reserve(chunkPoints);
+
+    // Start one byte early: unless that byte ends a line, the range starts
+    // inside a line that belongs to the previous range
+    bool skipPartial = begin > 0;
+    size_t lineStart = skipPartial ? begin - 1 : begin;   // File offset of carry[0]
+    file.seekg(lineStart);
+
+    auto parseLine = [&](const char* first, const char* last) {
+      if (!parseCSVRecord(first, last, features, label)) {
+        return;
+      }
+      if (features.size() != layout.dimensions) {
+        skipped++;
+        return;
+      }
+      chunk.push_back(features.data(), label);
+      if (chunk.size() == chunkPoints) {
+        emit(chunk);
+      }
+    };
+
+    while (lineStart < end && file) {
+      file.read(buffer.data(), buffer.size());
+      size_t got = file.gcount();
+      if (got == 0) {
+        break;
+      }
+      const char* cursor = buffer.data();
+      const char* bufferEnd = buffer.data() + got;
+      while (cursor < bufferEnd) {
+        const char* newline = static_cast<const char*>(memchr(cursor, '\n', bufferEnd - cursor));
+        if (newline == nullptr) {
+          carry.append(cursor, bufferEnd);
+          break;
+        }
+        carry.append(cursor, newline);
+        if (lineStart >= end) {
+          break;
+        }
+        if (!skipPartial) {
+          parseLine(carry.data(), carry.data() + carry.size());
+        }
+        skipPartial = false;
+        lineStart += carry.size() + 1;
+        carry.clear();
+        cursor = newline + 1;
+      }
+    }
+    // Last line without a newline
+    if (!carry.empty() && !skipPartial && lineStart < end) {
+      parseLine(carry.data(), carry.data() + carry.size());
+    }
+
+    if (!chunk.empty()) {
+      emit(chunk);
+    }
+    numSkipped += skipped;
+  }
+
+  // Records in the byte range [begin, end)
+  void parseBinary(size_t begin, size_t end) {
+    ifstream file(filename, ios::binary);
+    file.seekg(begin);
+    size_t recordSize = binaryRecordSize(layout.dimensions);
+    vector<char> buffer(chunkPoints * recordSize);
+    size_t remaining = (end - begin) / recordSize;
+    while (remaining > 0) {
+      size_t count = min(remaining, chunkPoints);
+      file.read(buffer.data(), count * recordSize);
+      count = file.gcount() / recordSize;
+      if (count == 0) {
+        break;
+      }
+      PointSet chunk(layout.dimensions);
+      chunk.resizeUninitialized(count);
+      for (size_t r = 0; r < count; r++) {
+        decodeBinaryRecord(buffer.data() + r * recordSize, layout.dimensions, chunk.features(r), chunk.label(r));
+      }
+      emit(chunk);
+      remaining -= count;
+    }
+  }
+
+  // Hand a full chunk to the consumers and start a new one
+  void emit(PointSet& chunk) {
+    numPoints += chunk.size();
+    fullWaits += queue.push(chunk);
+    chunk = PointSet(layout.dimensions);
+    chunk.reserve(chunkPoints);
+  }
+
+  string filename;
+  size_t chunkPoints;
+  MPMCQueue<PointSet> queue;
+  DatasetLayout layout;
+  vector<thread> parsers;
+  atomic<size_t> running;
+  atomic<size_t> numPoints;
+  atomic<size_t> numSkipped;
+  atomic<size_t> fullWaits;
+  atomic<double> parseSeconds;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <omp.h>
+#include "generators.h"
+#include "../dataset.h"
+#include "../utils.h"
+#include "../timing.h"
+
+using namespace std;
+
+// Blocks generated, formatted and written per round, per thread
+#define BLOCKS_PER_THREAD 8
+
+// Write value with `precision` decimals into buffer, return the length.
+// Rounds to fixed point and prints the digits, snprintf only for huge values.
+int formatFixed(double value, int precision, char* buffer, size_t size) {
+  static const uint64_t powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+                                    100000000, 1000000000};
+  if (precision > 9 || !(fabs(value) < 1e9)) {
+    return snprintf(buffer, size, "%.*f", precision, value);
+  }
+
+  char* cursor = buffer;
+  uint64_t scaled = (uint64_t)llround(fabs(value) * powers[precision]);
+  if (value < 0.0 && scaled > 0) {
+    *cursor++ = '-';
+  }
+
+  // Digits come out backwards
+  char digits[32];
+  int numDigits = 0;
+  for (int i = 0; i < precision; i++) {
+    digits[numDigits++] = '0' + scaled % 10;
+    scaled /= 10;
+  }
+  do {
+    digits[numDigits++] = '0' + scaled % 10;
+    scaled /= 10;
+  } while (scaled > 0);
+
+  for (int i = numDigits - 1; i >= 0; i--) {
+    *cursor++ = digits[i];
+    if (i == precision && precision > 0) {
+      *cursor++ = '.';
+    }
+  }
+  return cursor - buffer;
+}
+
+// Append one CSV line "f1,...,fd,label" per point
+void formatCSV(const PointSet& points, size_t begin, size_t end, int precision, string& out) {
+  char number[64];
+  for (size_t i = begin; i < end; i++) {
+    const double* features = points.features(i);
+    for (size_t axis = 0; axis < points.dimensions(); axis++) {
+      int length = formatFixed(features[axis], precision, number, sizeof(number));
+      number[length++] = ',';
+      out.append(number, length);
+    }
+    int length = snprintf(number, sizeof(number), "%d\n", points.label(i));
+    out.append(number, length);
+  }
+}
+
+// Append one binary record per point (see dataset.h)
+void formatBinary(const PointSet& points, size_t begin, size_t end, string& out) {
+  size_t recordSize = binaryRecordSize(points.dimensions());
+  size_t offset = out.size();
+  out.resize(offset + (end - begin) * recordSize);
+  for (size_t i = begin; i < end; i++) {
+    encodeBinaryRecord(&out[offset + (i - begin) * recordSize], points.dimensions(),
+                       points.features(i), points.label(i));
+  }
+}
+
+void printUsage(const char* program) {
+  cout << "Usage: " << program << " -n <points> -d <dimensions> -o <file> [options]" << endl;
+  cout << "Options:" << endl;
+  cout << "  -n value       Number of points" << endl;
+  cout << "  -d value       Number of features" << endl;
+  cout << "  -o value       Output file" << endl;
+  cout << "  -f value       Output format: csv or bin (default bin for .bin files, csv otherwise)" << endl;
+  cout << "  -t value       Distribution: uniform, gaussian, powerlaw, lowrank or duplicates (default uniform)" << endl;
+  cout << "  -s value       Random seed (default 42), the same seed gives the same file" << endl;
+  cout << "  -b value       Bounds of the coordinates 'low,high' (default 0,100)" << endl;
+  cout << "  -l value       Number of labels (default 2)" << endl;
+  cout << "  -c value       gaussian, powerlaw: number of clusters (default 16)" << endl;
+  cout << "  -w value       gaussian, powerlaw: cluster spread as a fraction of the bounds (default 0.02)" << endl;
+  cout << "  -a value       powerlaw, duplicates: Zipf exponent of the popularity (default 1.2)" << endl;
+  cout << "  -r value       lowrank: intrinsic dimension (default 2)" << endl;
+  cout << "  -e value       lowrank: noise as a fraction of the bounds (default 0.005)" << endl;
+  cout << "  -u value       duplicates: number of distinct points (default 1000)" << endl;
+  cout << "  -g             Round coordinates to integers" << endl;
+  cout << "  -p value       CSV digits after the decimal point (default 4)" << endl;
+  cout << "  -j value       Threads (default: all)" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  GeneratorSpec spec;
+  size_t numPoints = 0;
+  string filename = "";
+  string format = "";
+  int precision = 4;
+  bool haveDimensions = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hn:d:o:f:t:s:b:l:c:w:a:r:e:u:gp:j:")) != -1) {
+    switch (opt) {
+      case 'h':
+        printUsage(argv[0]);
+        return 0;
+      case 'n':
+      case 'd':
+      case 's':
+      case 'l':
+      case 'c':
+      case 'r':
+      case 'u':
+      case 'p':
+      case 'j':
+        if (!isPositiveInteger(optarg) || string(optarg).empty()) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'n') numPoints = stoull(optarg);
+        if (opt == 'd') { spec.dimensions = stoul(optarg); haveDimensions = spec.dimensions > 0; }
+        if (opt == 's') spec.seed = stoull(optarg);
+        if (opt == 'l') spec.numLabels = max(1, stoi(optarg));
+        if (opt == 'c') spec.clusters = stoul(optarg);
+        if (opt == 'r') spec.latentDimensions = stoul(optarg);
+        if (opt == 'u') spec.distinctPoints = stoul(optarg);
+        if (opt == 'p') precision = min(17, stoi(optarg));
+        if (opt == 'j') omp_set_num_threads(max(1, stoi(optarg)));
+        break;
+      case 'w':
+      case 'a':
+      case 'e':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'w') spec.spread = stod(optarg);
+        if (opt == 'a') spec.alpha = stod(optarg);
+        if (opt == 'e') spec.noise = stod(optarg);
+        break;
+      case 'b': {
+        vector<double> bounds = parseDoubleList(optarg);
+        if (bounds.size() != 2 || bounds[0] >= bounds[1]) {
+          cout << "Invalid value for b, b = " << optarg << endl;
+          return 0;
+        }
+        spec.low = bounds[0];
+        spec.high = bounds[1];
+        break;
+      }
+      case 't':
+        if (!parseDistribution(optarg, spec.distribution)) {
+          cout << "Invalid value for t, t = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'o':
+        filename = optarg;
+        break;
+      case 'f':
+        format = optarg;
+        if (format != "csv" && format != "bin") {
+          cout << "Invalid value for f, f = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'g':
+        spec.integers = true;
+        break;
+      default:
+        printUsage(argv[0]);
+        return 0;
+    }
+  }
+
+  if (numPoints == 0 || !haveDimensions || filename == "") {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+  if (format == "") {
+    format = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0 ? "bin" : "csv";
+  }
+  if (spec.integers) {
+    precision = 0;
+  }
+
+  FILE* file = fopen(filename.c_str(), format == "bin" ? "wb" : "w");
+  if (file == nullptr) {
+    cout << "Unable to open file " << filename << endl;
+    return 0;
+  }
+
+  Timer generateTimer;
+  DatasetGenerator generator(spec);
+
+  if (format == "bin") {
+    BinaryHeader header = makeBinaryHeader(numPoints, spec.dimensions);
+    fwrite(&header, sizeof(header), 1, file);
+  }
+
+  // Generate and format a round of blocks in parallel, then write it in order
+  int numThreads = omp_get_max_threads();
+  size_t pointsPerRound = (size_t)numThreads * BLOCKS_PER_THREAD * GENERATOR_BLOCK;
+  size_t blocksPerRound = (size_t)numThreads * BLOCKS_PER_THREAD;
+  vector<string> chunks(blocksPerRound);
+  size_t bytesWritten = 0;
+
+  for (size_t first = 0; first < numPoints; first += pointsPerRound) {
+    size_t count = min(pointsPerRound, numPoints - first);
+    PointSet points = generator.generate(first, count);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t chunk = 0; chunk < blocksPerRound; chunk++) {
+      chunks[chunk].clear();
+      size_t begin = min(count, chunk * GENERATOR_BLOCK);
+      size_t end = min(count, begin + GENERATOR_BLOCK);
+      if (format == "bin") {
+        formatBinary(points, begin, end, chunks[chunk]);
+      } else {
+        formatCSV(points, begin, end, precision, chunks[chunk]);
+      }
+    }
+
+    for (const string& chunk : chunks) {
+      if (fwrite(chunk.data(), 1, chunk.size(), file) != chunk.size()) {
+        cout << "Unable to write to " << filename << endl;
+        fclose(file);
+        return 0;
+      }
+      bytesWritten += chunk.size();
+    }
+  }
+
+  fclose(file);
+  double generateTime = generateTimer.elapsed();
+
+  printf("Generated %zu points with %zu features (seed %llu) into %s\n", numPoints, spec.dimensions,
+         (unsigned long long)spec.seed, filename.c_str());
+  printf("%.1f MB in %.3fs with %d threads (%.1f MB/s)\n", bytesWritten / 1e6, generateTime,
+         numThreads, bytesWritten / 1e6 / generateTime);
+  return 0;
+}
@@ -0,0 +1,262 @@
+#ifndef GENERATORS_H
+#define GENERATORS_H
+
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "../pointSet.h"
+
+using namespace std;
+
+// Synthetic datasets. Points are produced in blocks of GENERATOR_BLOCK, each
+// block with its own random stream seeded by (seed, block index), so point i
+// is the same whatever the number of threads and whichever slice is asked for.
+#define GENERATOR_BLOCK 4096
+
+// Upper bound on the intrinsic dimension of lowrank data
+#define GENERATOR_MAX_LATENT 64
+
+enum Distribution {
+  DIST_UNIFORM,       // Independent uniform coordinates
+  DIST_GAUSSIAN,      // Gaussian clusters of equal size
+  DIST_POWER_LAW,     // Cluster popularity follows Zipf, distances to the center are Pareto
+  DIST_LOW_RANK,      // A few latent dimensions embedded linearly, plus noise
+  DIST_DUPLICATES     // Copies of a small pool of distinct points, popularity follows Zipf
+};
+
+// Parse "uniform", "gaussian" (or "clustered"), "powerlaw", "lowrank" or "duplicates"
+inline bool parseDistribution(const string& value, Distribution& distribution) {
+  if (value == "uniform") {
+    distribution = DIST_UNIFORM;
+  } else if (value == "gaussian" || value == "clustered") {
+    distribution = DIST_GAUSSIAN;
+  } else if (value == "powerlaw") {
+    distribution = DIST_POWER_LAW;
+  } else if (value == "lowrank") {
+    distribution = DIST_LOW_RANK;
+  } else if (value == "duplicates") {
+    distribution = DIST_DUPLICATES;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct GeneratorSpec {
+  Distribution distribution;
+  size_t dimensions;
+  uint64_t seed;
+  double low;                  // Coordinates mostly fall in [low, high)
+  double high;
+  int numLabels;
+  size_t clusters;             // Gaussian and power-law clusters
+  double spread;               // Cluster sigma as a fraction of high - low
+  double alpha;                // Zipf exponent of cluster / pool popularity
+  size_t latentDimensions;     // Intrinsic dimension of lowrank
+  double noise;                // Lowrank noise sigma as a fraction of high - low
+  size_t distinctPoints;       // Pool size of duplicates
+  bool integers;               // Round coordinates to integers
+
+  GeneratorSpec()
+      : distribution(DIST_UNIFORM), dimensions(10), seed(42), low(0.0), high(100.0),
+        numLabels(2), clusters(16), spread(0.02), alpha(1.2), latentDimensions(2),
+        noise(0.005), distinctPoints(1000), integers(false) {}
+};
+
+class DatasetGenerator {
+public:
+  explicit DatasetGenerator(const GeneratorSpec& generatorSpec) : spec(generatorSpec) {
+    spec.latentDimensions = min<size_t>(max<size_t>(1, spec.latentDimensions), GENERATOR_MAX_LATENT);
+    mt19937_64 generator = stream(~0ULL);
+    uniform_real_distribution<double> uniform(spec.low, spec.high);
+    size_t d = spec.dimensions;
+
+    // Cluster centers, also the pool of distinct points for duplicates
+    size_t numCenters = spec.distribution == DIST_DUPLICATES ? max<size_t>(1, spec.distinctPoints)
+                                                             : max<size_t>(1, spec.clusters);
+    centers.resize(numCenters * d);
+    for (double& coordinate : centers) {
+      coordinate = uniform(generator);
+    }
+    if (spec.integers) {
+      for (double& coordinate : centers) {
+        coordinate = round(coordinate);
+      }
+    }
+    centerLabels.resize(numCenters);
+    uniform_int_distribution<int> pickLabel(0, max(1, spec.numLabels) - 1);
+    for (int& label : centerLabels) {
+      label = pickLabel(generator);
+    }
+
+    // Zipf popularity as a cumulative table
+    popularity.resize(numCenters);
+    double total = 0.0;
+    for (size_t c = 0; c < numCenters; c++) {
+      double weight = spec.distribution == DIST_GAUSSIAN ? 1.0 : 1.0 / pow(c + 1.0, spec.alpha);
+      total += weight;
+      popularity[c] = total;
+    }
+    for (double& cumulative : popularity) {
+      cumulative /= total;
+    }
+
+    // Random linear embedding of the latent space, columns of unit length
+    size_t r = spec.latentDimensions;
+    normal_distribution<double> gaussian(0.0, 1.0);
+    basis.resize(d * r);
+    for (size_t column = 0; column < r; column++) {
+      double norm = 0.0;
+      for (size_t axis = 0; axis < d; axis++) {
+        basis[axis * r + column] = gaussian(generator);
+        norm += basis[axis * r + column] * basis[axis * r + column];
+      }
+      norm = sqrt(norm);
+      for (size_t axis = 0; axis < d; axis++) {
+        basis[axis * r + column] /= norm > 0.0 ? norm : 1.0;
+      }
+    }
+  }
+
+  size_t dimensions() const { return spec.dimensions; }
+
+  // Fill points [first, first + count) into features (row-major) and labels
+  void generate(size_t first, size_t count, double* features, int* labels) const {
+    vector<double> skipped(spec.dimensions);
+    size_t next = first;
+    while (next < first + count) {
+      size_t block = next / GENERATOR_BLOCK;
+      size_t blockEnd = min((block + 1) * GENERATOR_BLOCK, first + count);
+      mt19937_64 generator = stream(block);
+
+      // Points of this block before `next` are generated and dropped, so
+      // results do not depend on where a request starts
+      for (size_t i = block * GENERATOR_BLOCK; i < blockEnd; i++) {
+        if (i < next) {
+          generatePoint(generator, skipped.data());
+        } else {
+          labels[i - first] = generatePoint(generator, features + (i - first) * spec.dimensions);
+        }
+      }
+      next = blockEnd;
+    }
+  }
+
+  // Points [first, first + count) as a PointSet, blocks spread over the OpenMP threads
+  PointSet generate(size_t first, size_t count) const {
+    PointSet points(spec.dimensions);
+    points.resize(count);
+    size_t firstBlock = first / GENERATOR_BLOCK;
+    size_t lastBlock = count > 0 ? (first + count - 1) / GENERATOR_BLOCK : firstBlock;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t block = firstBlock; block <= lastBlock; block++) {
+      size_t begin = max(first, block * GENERATOR_BLOCK);
+      size_t end = min(first + count, (block + 1) * GENERATOR_BLOCK);
+      if (begin < end) {
+        generate(begin, end - begin, points.features(begin - first), points.labelData() + (begin - first));
+      }
+    }
+    return points;
+  }
+
+private:
+  GeneratorSpec spec;
+  vector<double> centers;
+  vector<int> centerLabels;
+  vector<double> popularity;
+  vector<double> basis;
+
+  mt19937_64 stream(uint64_t index) const {
+    seed_seq sequence = {(uint32_t)spec.seed, (uint32_t)(spec.seed >> 32),
+                         (uint32_t)index, (uint32_t)(index >> 32)};
+    return mt19937_64(sequence);
+  }
+
+  size_t pickCenter(mt19937_64& generator) const {
+    double u = uniform_real_distribution<double>(0.0, 1.0)(generator);
+    size_t center = lower_bound(popularity.begin(), popularity.end(), u) - popularity.begin();
+    return min(center, popularity.size() - 1);
+  }
+
+  // Write one point, return its label
+  int generatePoint(mt19937_64& generator, double* point) const {
+    size_t d = spec.dimensions;
+    double extent = spec.high - spec.low;
+    normal_distribution<double> gaussian(0.0, 1.0);
+    int label = 0;
+
+    switch (spec.distribution) {
+      case DIST_UNIFORM: {
+        uniform_real_distribution<double> uniform(spec.low, spec.high);
+        for (size_t axis = 0; axis < d; axis++) {
+          point[axis] = uniform(generator);
+        }
+        label = uniform_int_distribution<int>(0, max(1, spec.numLabels) - 1)(generator);
+        break;
+      }
+      case DIST_GAUSSIAN: {
+        size_t center = pickCenter(generator);
+        for (size_t axis = 0; axis < d; axis++) {
+          point[axis] = centers[center * d + axis] + spec.spread * extent * gaussian(generator);
+        }
+        label = centerLabels[center];
+        break;
+      }
+      case DIST_POWER_LAW: {
+        // Random direction, Pareto(1.5) radius: dense cores with long tails
+        size_t center = pickCenter(generator);
+        double norm = 0.0;
+        for (size_t axis = 0; axis < d; axis++) {
+          point[axis] = gaussian(generator);
+          norm += point[axis] * point[axis];
+        }
+        double u = uniform_real_distribution<double>(0.0, 1.0)(generator);
+        double radius = spec.spread * extent * (pow(1.0 - u, -1.0 / 1.5) - 1.0);
+        norm = norm > 0.0 ? sqrt(norm) : 1.0;
+        for (size_t axis = 0; axis < d; axis++) {
+          point[axis] = centers[center * d + axis] + radius * point[axis] / norm;
+        }
+        label = centerLabels[center];
+        break;
+      }
+      case DIST_LOW_RANK: {
+        size_t r = spec.latentDimensions;
+        double latent[GENERATOR_MAX_LATENT];
+        uniform_real_distribution<double> uniform(-0.5, 0.5);
+        for (size_t column = 0; column < r; column++) {
+          latent[column] = uniform(generator) * extent;
+        }
+        for (size_t axis = 0; axis < d; axis++) {
+          double value = 0.5 * (spec.low + spec.high);
+          for (size_t column = 0; column < r; column++) {
+            value += basis[axis * r + column] * latent[column];
+          }
+          point[axis] = value + spec.noise * extent * gaussian(generator);
+        }
+        label = (latent[0] > 0.0) % max(1, spec.numLabels);
+        break;
+      }
+      case DIST_DUPLICATES: {
+        size_t original = pickCenter(generator);
+        for (size_t axis = 0; axis < d; axis++) {
+          point[axis] = centers[original * d + axis];
+        }
+        label = centerLabels[original];
+        break;
+      }
+    }
+
+    if (spec.integers) {
+      for (size_t axis = 0; axis < d; axis++) {
+        point[axis] = round(point[axis]);
+      }
+    }
+    return label;
+  }
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstdint>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include "kdTree.h"
+
+using namespace std;
+
+// Points that share all their coordinates collapsed into one row with a
+// count and a histogram of their labels. Row i stands for counts[i] input
+// points whose labels are histogramLabels[j] (histogramCounts[j] times) for
+// j in [histogramOffsets[i], histogramOffsets[i + 1]), in ascending label
+// order. The row's label is its most frequent one.
+struct DuplicateGroups {
+  PointSet points;
+  vector<uint32_t> counts;
+  vector<size_t> histogramOffsets;
+  vector<int> histogramLabels;
+  vector<uint32_t> histogramCounts;
+
+  size_t size() const { return points.size(); }
+
+  size_t memoryBytes() const {
+    return points.memoryBytes() + counts.capacity() * sizeof(uint32_t) +
+           histogramOffsets.capacity() * sizeof(size_t) + histogramLabels.capacity() * sizeof(int) +
+           histogramCounts.capacity() * sizeof(uint32_t);
+  }
+};
+
+// Collapse the points equal in their first d features (the ones the tree
+// splits and searches on), keeping only those features
+inline DuplicateGroups collapseDuplicates(const PointSet& data, size_t d) {
+  d = min(d, data.dimensions());
+  auto lessRow = [&data, d](size_t a, size_t b) {
+    const double* x = data.features(a);
+    const double* y = data.features(b);
+    for (size_t i = 0; i < d; i++) {
+      if (x[i] != y[i]) {
+        return x[i] < y[i];
+      }
+    }
+    return data.label(a) < data.label(b);
+  };
+  // Equal the way the sort sees it, so -0.0 and 0.0 are one point, as they
+  // are to every distance
+  auto sameRow = [d](const double* x, const double* y) {
+    for (size_t i = 0; i < d; i++) {
+      if (x[i] != y[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Sorted by coordinates then label, equal rows and their labels are runs
+  vector<size_t> order(data.size());
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(), lessRow);
+
+  DuplicateGroups groups;
+  groups.points = PointSet(d);
+  for (size_t run = 0; run < order.size();) {
+    const double* features = data.features(order[run]);
+    size_t end = run + 1;
+    while (end < order.size() && sameRow(data.features(order[end]), features)) {
+      end++;
+    }
+
+    groups.histogramOffsets.push_back(groups.histogramLabels.size());
+    int majority = data.label(order[run]);
+    uint32_t majorityCount = 0;
+    for (size_t i = run; i < end;) {
+      int label = data.label(order[i]);
+      size_t labelEnd = i + 1;
+      while (labelEnd < end && data.label(order[labelEnd]) == label) {
+        labelEnd++;
+      }
+      groups.histogramLabels.push_back(label);
+      groups.histogramCounts.push_back(labelEnd - i);
+      if (labelEnd - i > majorityCount) {
+        majorityCount = labelEnd - i;
+        majority = label;
+      }
+      i = labelEnd;
+    }
+
+    groups.points.push_back(features, majority);
+    groups.counts.push_back(end - run);
+    run = end;
+  }
+  groups.histogramOffsets.push_back(groups.histogramLabels.size());
+  groups.points.shrinkToFit();
+  return groups;
+}
+
+// A tree over the distinct points only, every node standing for all copies
+// of its point. Search it with kNNSearchMultiplicity (knn.h) and
+// multiplicityOf so the copies count toward k. The rows must stay in build
+// order, so the tree must not be relaid out.
+class DedupKDTree {
+public:
+  KDTree tree;
+  DuplicateGroups groups;
+  size_t numPoints;   // Input points, copies included
+
+  DedupKDTree() : numPoints(0) {}
+
+  void build(const PointSet& data, int depth, int d) {
+    numPoints = data.size();
+    groups = collapseDuplicates(data, d);
+
+    // The tree takes the rows over, the groups keep the counts and histograms
+    PointSet rows;
+    rows.swap(groups.points);
+    tree.buildKDTree(move(rows), depth, d);
+  }
+
+  size_t size() const { return tree.points.size(); }
+
+  size_t rowOf(const KDNode* node) const {
+    return (node->features - tree.points.data()) / tree.points.dimensions();
+  }
+
+  uint32_t multiplicityOf(const KDNode* node) const { return groups.counts[rowOf(node)]; }
+
+  // Add `take` of the node's points to votes[label], in ascending label order
+  template<typename Votes>
+  void addLabels(const KDNode* node, size_t take, Votes& votes) const {
+    size_t row = rowOf(node);
+    for (size_t j = groups.histogramOffsets[row]; j < groups.histogramOffsets[row + 1] && take > 0; j++) {
+      size_t copies = min<size_t>(take, groups.histogramCounts[j]);
+      votes[groups.histogramLabels[j]] += copies;
+      take -= copies;
+    }
+  }
+
+  size_t memoryBytes() const {
+    return tree.points.memoryBytes() + size() * sizeof(KDNode) + groups.memoryBytes();
+  }
+};
+
+#endif
@@ -2,69 +2,66 @@
 #include <vector>
 #include <algorithm>
 #include "kdTree.h"
+#include "../timing.h"
 #include <omp.h>
 
-#define MAX_PARALLEL_DEPTH 4
+// Spawn tasks for the top levels only, 2^MAX_PARALLEL_DEPTH subtrees in total
+#define MAX_PARALLEL_DEPTH 6
 using namespace std;
 
-// Function to build a KD-tree using OpenMP
-unique_ptr<KDNode> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
-
-  if (data.empty()) {
-    return nullptr;
-  }
-
-  // Choose axis based on depth for balanced tree construction
-  int axis = depth % k;
-
-  // Sort and choose median as pivot element along axis
-  int median = data.size() / 2;
-  nth_element(data.begin(), data.begin() + median, data.end(),
-              [axis](const DataPoint& a, const DataPoint& b) {
-                  return a.features[axis] < b.features[axis];
-              });
+// Subtrees of the top levels as OpenMP tasks (see buildMedianSubtree in kdTree.h)
+struct TaskBuild {
+  template<typename Left, typename Right>
+  void children(unique_ptr<KDNode>& left, Left buildLeft, unique_ptr<KDNode>& right, Right buildRight, int depth,
+                size_t) {
+    if (depth >= MAX_PARALLEL_DEPTH) {
+      // Non-parallel execution for deeper levels
+      left = buildLeft();
+      right = buildRight();
+      return;
+    }
 
-  // Create the root node
-  unique_ptr<KDNode> node = make_unique<KDNode>();
-  node->features = data[median].features;
-  node->label = data[median].label;
+    // Tasks may run on another thread, their phases still nest under this level
+    string parent = phasePath();
 
- if (depth < MAX_PARALLEL_DEPTH) {
-    #pragma omp parallel
+    // Subtrees own disjoint index ranges, let idle threads of the enclosing team pick them up
+    #pragma omp task shared(left, buildLeft, parent)
     {
-      #pragma omp single
-      {
-        #pragma omp task
-        {
-          // Build left subtree
-          vector<DataPoint> leftData(data.begin(), data.begin() + median);
-          node->left = buildKDTreeImpl(leftData, depth + 1, k);
-        }
+      PhaseContext context(parent);
+      left = buildLeft();
+    }
 
-        #pragma omp task
-        {
-          // Build right subtree
-          vector<DataPoint> rightData(data.begin() + median + 1, data.end());
-          node->right = buildKDTreeImpl(rightData, depth + 1, k);
-        }
-      }
+    #pragma omp task shared(right, buildRight, parent)
+    {
+      PhaseContext context(parent);
+      right = buildRight();
     }
-    #pragma omp taskwait // Wait for tasks to complete
-  } else {
-    // Non-parallel execution for deeper levels
-    vector<DataPoint> leftData(data.begin(), data.begin() + median);
-    node->left = buildKDTreeImpl(leftData, depth + 1, k);
 
-    vector<DataPoint> rightData(data.begin() + median + 1, data.end());
-    node->right = buildKDTreeImpl(rightData, depth + 1, k);
+    #pragma omp taskwait // Wait for tasks to complete
   }
- 
- // #pragma omp taskwait // Wait for tasks to complete
-  return node;
-}
+};
 
 // Function to build a KD-tree
-void KDTree::buildKDTree(vector<DataPoint>& data, int depth, int k) {
-  root = buildKDTreeImpl(data, depth, k);
+void KDTree::buildKDTree(PointSet data, int depth, int k) {
+  ScopedPhase phase("build");
+  points = move(data);
   dimensions = k;
+
+  // Subtrees partition an index array, the points themselves never move
+  vector<size_t> order(points.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+
+  // One team for the whole build, subtrees are spawned as tasks
+  string parent = phasePath();
+  #pragma omp parallel
+  {
+    #pragma omp single
+    {
+      PhaseContext context(parent);
+      TaskBuild spawner;
+      root = buildMedianSubtree(points, order.data(), order.data() + order.size(), depth, k, spawner);
+    }
+  }
 }
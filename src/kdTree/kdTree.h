@@ -5,86 +5,335 @@
 #include <fstream>
 #include <sstream>
 #include <cstddef>
+#include <cstring>
 #include <vector>
 #include <cmath>
 #include <iostream>
 #include <memory>
 #include <atomic>
+#include <algorithm>
 #include <utility>
+#include "../dataset.h"
+#include "../pointSet.h"
+#include "../rangeQuery.h"
+#include "../treeInspector.h"
+#include "../spaceFillingCurve.h"
+#include "../threadPool.h"
+#include "../timing.h"
 
 using namespace std;
 
-// Define a struct to represent a data point
-struct DataPoint {
-  vector<double> features;
-  int label;
-  int threadId;
+// Order of the point rows in memory once the tree is built
+enum TreeLayout {
+  LAYOUT_INPUT,   // Rows stay where they were given to buildKDTree
+  LAYOUT_DFS,     // Pre-order: a node is followed by its left subtree
+  LAYOUT_VEB      // van Emde Boas: recursively split the tree at half its height
 };
 
+// Parse "input", "dfs" or "veb"
+inline bool parseTreeLayout(const string& value, TreeLayout& layout) {
+  if (value == "input") {
+    layout = LAYOUT_INPUT;
+  } else if (value == "dfs") {
+    layout = LAYOUT_DFS;
+  } else if (value == "veb") {
+    layout = LAYOUT_VEB;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 class KDNode
 {
 public:
-  vector<double> features;
+  const double* features;   // Row of the tree's PointSet
   int label;
   unique_ptr<KDNode> left;
   unique_ptr<KDNode> right;
   
   // Constructor to initialize KDNode with features
-  KDNode() : label(0), left(nullptr), right(nullptr) {}
+  KDNode() : features(nullptr), label(0), left(nullptr), right(nullptr) {}
+
+};
+
+// Build the subtree over the points order[begin, end) of `points`: the
+// median along axis depth % k becomes the node, the two halves its subtrees.
+// Every build of the static tree runs this; the spawner only decides where
+// the subtrees are built, through
+//   spawner.children(left, buildLeft, right, buildRight, depth, count)
+// which must have set left = buildLeft() and right = buildRight() on return.
+template<typename Spawner>
+unique_ptr<KDNode> buildMedianSubtree(const PointSet& points, size_t* begin, size_t* end, int depth, int k,
+                                      Spawner& spawner) {
+  if (begin == end) {
+    return nullptr;
+  }
+  ScopedPhase phase(levelPhaseName(depth));
+
+  // Choose axis based on depth for balanced tree construction
+  int axis = depth % k;
+
+  // Sort and choose median as pivot element along axis
+  size_t* median = begin + (end - begin) / 2;
+  nth_element(begin, median, end,
+              [&points, axis](size_t a, size_t b) {
+                  return points.features(a)[axis] < points.features(b)[axis];
+              });
+
+  unique_ptr<KDNode> node = make_unique<KDNode>();
+  node->features = points.features(*median);
+  node->label = points.label(*median);
 
+  // Construct subtrees
+  spawner.children(node->left, [&]() { return buildMedianSubtree(points, begin, median, depth + 1, k, spawner); },
+                   node->right, [&]() { return buildMedianSubtree(points, median + 1, end, depth + 1, k, spawner); },
+                   depth, (size_t)(end - begin));
+  return node;
+}
+
+// Both subtrees on the calling thread
+struct SerialBuild {
+  template<typename Left, typename Right>
+  void children(unique_ptr<KDNode>& left, Left buildLeft, unique_ptr<KDNode>& right, Right buildRight, int,
+                size_t) {
+    left = buildLeft();
+    right = buildRight();
+  }
+};
+
+// Subtrees larger than `grain` points are split into two pool tasks: the left
+// one on the pool while this thread builds the right one
+struct PoolBuild {
+  ThreadPool& pool;
+  size_t grain;
+
+  template<typename Left, typename Right>
+  void children(unique_ptr<KDNode>& left, Left buildLeft, unique_ptr<KDNode>& right, Right buildRight, int,
+                size_t count) {
+    if (count <= grain) {
+      left = buildLeft();
+      right = buildRight();
+      return;
+    }
+    // The task may run on another thread, its phases still nest under this level
+    string parent = phasePath();
+    future<unique_ptr<KDNode>> pending = pool.submit([&buildLeft, parent]() {
+      PhaseContext context(parent);
+      return buildLeft();
+    });
+    right = buildRight();
+    left = pool.get(pending);
+  }
 };
 
 class KDTree {
 public:
   unique_ptr<KDNode> root;
   size_t dimensions; // To store the dimensionality of the data
+  PointSet points;   // Points of the tree, nodes point into this buffer
 
   // Constructor
   KDTree() : root(nullptr), dimensions(0) {}
 
-  void buildKDTree(vector<DataPoint>& data, int depth, int k);
-
-  // Function to parse input file into a vector of strings separated by newlines
-  vector<DataPoint> parseInput(const string& filename, size_t &dimension) {
-    vector<DataPoint> dataPoints;
-    string line;
-    ifstream file(filename);
-    
-    if (file.is_open()) {
-      while (getline(file, line)) {
-        istringstream iss(line);
-        DataPoint dataPoint;
-        double content;
-        char comma;  // To read and discard the comma separator
-        
-        // Read features and label into the vector
-        while (iss >> content) {
-          // Check for the end of the line
-          if (isspace(iss.peek()) || iss.peek() == '\n' || 
-                iss.peek() == '\r' || iss.peek() == EOF) {
-            // Read the label
-            dataPoint.label = (int)content;
-            break;
-          }
-
-          dataPoint.features.push_back(content);
-          iss >> comma;
-        }
-
-        dimension = fminf(dimension, dataPoint.features.size());
-
-        // Add data point
-        dataPoints.push_back(dataPoint);
-      }
-      file.close();
-    } else {
-      cout << "Unable to open file " << filename << endl;
+  // Build the tree over data, which the tree takes over (std::move it in
+  // when the caller does not need it any more)
+  void buildKDTree(PointSet data, int depth, int k);
+
+  // Same on a thread pool instead of OpenMP, e.g. next to searches running
+  // on that pool. Same tree as buildKDTree.
+  void buildKDTree(ThreadPool& pool, PointSet data, int depth, int k) {
+    points = move(data);
+    dimensions = k;
+
+    vector<size_t> order(points.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = i;
     }
+    PoolBuild spawner = {pool, POOL_BUILD_GRAIN};
+    root = buildMedianSubtree(points, order.data(), order.data() + order.size(), depth, k, spawner);
+  }
 
-    cout << "Parsed " << dataPoints.size() << " data points from " << filename << endl;
+  // Function to parse a CSV or binary dataset (see dataset.h) into a point set
+  PointSet parseInput(const string& filename, size_t &dimension) {
+    PointSet dataPoints = readDataset(filename);
+    // No rows read: nothing to narrow the dimensions down to
+    if (!dataPoints.empty()) {
+      dimension = min(dimension, dataPoints.dimensions());
+    }
     return dataPoints;
   }
 
+  // Move the point rows into the order of `layout`, so the rows a search
+  // reads one after the other share cache lines and pages
+  void relayout(TreeLayout layout) {
+    if (layout == LAYOUT_INPUT || root == nullptr) {
+      return;
+    }
+
+    vector<KDNode*> nodes;
+    nodes.reserve(points.size());
+    if (layout == LAYOUT_DFS) {
+      preOrder(root.get(), nodes);
+    } else {
+      vanEmdeBoasOrder(root.get(), height(root.get()), nodes);
+    }
+
+    // Every point is exactly one node
+    PointSet laidOut(points.dimensions());
+    laidOut.reserve(nodes.size());
+    for (KDNode* node : nodes) {
+      laidOut.push_back(node->features, node->label);
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+      nodes[i]->features = laidOut.features(i);
+    }
+    points.swap(laidOut);
+  }
+
+  // Deep copy with its own nodes and point buffer. The point rows are written
+  // by numThreads OpenMP threads in static chunks and the nodes by the calling
+  // thread, so under the first-touch policy the copy's pages land on the NUMA
+  // nodes of those threads (see numaTree.h).
+  KDTree clone(int numThreads = 1) const {
+    KDTree copy;
+    copy.dimensions = dimensions;
+    copy.points = PointSet(points.dimensions());
+    copy.points.resizeUninitialized(points.size());
+
+    size_t rowBytes = points.dimensions() * sizeof(double);
+    #pragma omp parallel for num_threads(numThreads) schedule(static)
+    for (size_t i = 0; i < points.size(); i++) {
+      memcpy(copy.points.features(i), points.features(i), rowBytes);
+      copy.points.label(i) = points.label(i);
+    }
+
+    copy.root = cloneSubtree(root.get(), points.data(), copy.points.data());
+    return copy;
+  }
+
+  // Depth, balance, memory and kd ordering (see treeInspector.h)
+  TreeReport inspect(const InspectOptions& options = InspectOptions()) const {
+    TreeReport report = inspectTree(root.get(), dimensions, options);
+    report.memoryBytes += points.memoryBytes();
+    return report;
+  }
+
+  // Range queries (see rangeQuery.h), subtrees are searched in parallel
+
+  // Count points within radius of center without materializing them
+  size_t radiusCount(const vector<double>& center, double radius) const {
+    RangeCounter counter;
+    rangeSearch(root.get(), BallRegion{center, radius}, splitDimensions(center), counter);
+    return counter.count;
+  }
+
+  // Call callback(const KDNode&) for every point within radius of center.
+  // The callback may run on several threads at once.
+  template<typename Callback>
+  void radiusQuery(const vector<double>& center, double radius, Callback callback) const {
+    RangeStreamer<Callback> streamer = {&callback};
+    rangeSearch(root.get(), BallRegion{center, radius}, splitDimensions(center), streamer);
+  }
+
+  // Collect the nodes of all points within radius of center
+  vector<const KDNode*> radiusCollect(const vector<double>& center, double radius) const {
+    RangeCollector<KDNode> collector;
+    rangeSearch(root.get(), BallRegion{center, radius}, splitDimensions(center), collector);
+    return collector.nodes;
+  }
+
+  // Count points inside the box [low, high] without materializing them
+  size_t boxCount(const vector<double>& low, const vector<double>& high) const {
+    RangeCounter counter;
+    rangeSearch(root.get(), BoxRegion{low, high}, splitDimensions(low), counter);
+    return counter.count;
+  }
+
+  // Call callback(const KDNode&) for every point inside the box [low, high].
+  // The callback may run on several threads at once.
+  template<typename Callback>
+  void boxQuery(const vector<double>& low, const vector<double>& high, Callback callback) const {
+    RangeStreamer<Callback> streamer = {&callback};
+    rangeSearch(root.get(), BoxRegion{low, high}, splitDimensions(low), streamer);
+  }
+
+  // Collect the nodes of all points inside the box [low, high]
+  vector<const KDNode*> boxCollect(const vector<double>& low, const vector<double>& high) const {
+    RangeCollector<KDNode> collector;
+    rangeSearch(root.get(), BoxRegion{low, high}, splitDimensions(low), collector);
+    return collector.nodes;
+  }
+
+  // Number of axes the tree cycles through when splitting, the query's
+  // length for a tree not built yet (then it cannot hold a point either)
+  size_t splitDimensions(const vector<double>& query) const {
+    return dimensions > 0 ? dimensions : query.size();
+  }
+
+  static int height(const KDNode* node) {
+    return node == nullptr ? 0 : 1 + max(height(node->left.get()), height(node->right.get()));
+  }
+
+  static void preOrder(KDNode* node, vector<KDNode*>& nodes) {
+    if (node == nullptr) {
+      return;
+    }
+    nodes.push_back(node);
+    preOrder(node->left.get(), nodes);
+    preOrder(node->right.get(), nodes);
+  }
+
+  // Nodes exactly `depth` levels below node
+  static void nodesAtDepth(KDNode* node, int depth, vector<KDNode*>& nodes) {
+    if (node == nullptr) {
+      return;
+    }
+    if (depth == 0) {
+      nodes.push_back(node);
+      return;
+    }
+    nodesAtDepth(node->left.get(), depth - 1, nodes);
+    nodesAtDepth(node->right.get(), depth - 1, nodes);
+  }
+
+  // The top `levels` levels below node: the upper half first, then every
+  // subtree hanging below it, each laid out the same way
+  static void vanEmdeBoasOrder(KDNode* node, int levels, vector<KDNode*>& nodes) {
+    if (node == nullptr || levels <= 0) {
+      return;
+    }
+    if (levels == 1) {
+      nodes.push_back(node);
+      return;
+    }
+
+    int topLevels = levels / 2;
+    vanEmdeBoasOrder(node, topLevels, nodes);
+
+    vector<KDNode*> bottomRoots;
+    nodesAtDepth(node, topLevels, bottomRoots);
+    for (KDNode* bottomRoot : bottomRoots) {
+      vanEmdeBoasOrder(bottomRoot, levels - topLevels, nodes);
+    }
+  }
+
+  // Copy of the subtree whose rows move from the buffer at `from` to the one at `to`
+  static unique_ptr<KDNode> cloneSubtree(const KDNode* node, const double* from, const double* to) {
+    if (node == nullptr) {
+      return nullptr;
+    }
+    unique_ptr<KDNode> copy = make_unique<KDNode>();
+    copy->features = to + (node->features - from);
+    copy->label = node->label;
+    copy->left = cloneSubtree(node->left.get(), from, to);
+    copy->right = cloneSubtree(node->right.get(), from, to);
+    return copy;
+  }
+
+  // Subtrees larger than this are split into two pool tasks
+  static const size_t POOL_BUILD_GRAIN = 4096;
+
   // Print KD-tree in-order
   void printKDTree(unique_ptr<KDNode>& root) {
     if (root == nullptr) {
@@ -96,8 +345,8 @@ public:
 
     // Print information for the current node
     cout << "Features: ";
-    for (double feature : root->features) {
-      cout << feature << " ";
+    for (size_t i = 0; i < points.dimensions(); i++) {
+      cout << root->features[i] << " ";
     }
     cout << "| Label: " << root->label << endl;
 
@@ -16,14 +16,22 @@ int main(int argc, char *argv[]) {
   size_t k;
   string filename = "";
   int opt;
+  vector<double> center, low, high;
+  double radius = -1.0;
+  bool inspect = false;
 
-  while ((opt = getopt(argc, argv, "hk:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "hk:i:c:r:l:u:I")) != -1) {
     switch (opt) {
       case 'h':
         cout << "Usage: " << argv[0] << " [-k value] [-i value]" << endl;
         cout << "Options:" << endl;
         cout << "  -k value       Number of dimension" << endl;
         cout << "  -i value       Input dataset" << endl;
+        cout << "  -c value       Center of a radius query, ex: -c '1 2 3'" << endl;
+        cout << "  -r value       Radius of a radius query" << endl;
+        cout << "  -l value       Low corner of a box query" << endl;
+        cout << "  -u value       High corner of a box query" << endl;
+        cout << "  -I             Report the depth, balance and memory of the tree, check its ordering" << endl;
         return 0;
       case 'k':
         if (isPositiveInteger(optarg)) {
@@ -36,6 +44,25 @@ int main(int argc, char *argv[]) {
       case 'i':
         filename = optarg;
         break;
+      case 'c':
+        center = parseDoubleList(optarg);
+        break;
+      case 'r':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for r, r = " << optarg << endl;
+          return 0;
+        }
+        radius = stod(optarg);
+        break;
+      case 'l':
+        low = parseDoubleList(optarg);
+        break;
+      case 'u':
+        high = parseDoubleList(optarg);
+        break;
+      case 'I':
+        inspect = true;
+        break;
       default:
         cout << "Usage: ./kdTree -k <number of dimensions>" << endl;
         return 0;
@@ -44,8 +71,15 @@ int main(int argc, char *argv[]) {
 
   KDTree myKDTree;
 
-  // Open the file and parse input into a vector of strings separated by newlines
-  vector<DataPoint> input = myKDTree.parseInput(filename, dimension);
+  // Open the file and parse input into a contiguous point set
+  ScopedPhase parsePhase("parse");
+  PointSet input = myKDTree.parseInput(filename, dimension);
+  parsePhase.end();
+
+  if (dimension == 0) {
+    cout << "No features to split on in " << filename << endl;
+    return 0;
+  }
     
   if (k > dimension) {
       cout << "Value given for k is greater than the number of features in the data set" << endl;
@@ -53,13 +87,47 @@ int main(int argc, char *argv[]) {
       cout << "Dimensions are " << dimension << endl;
       k = dimension;
   }
+
+  // Range queries need one coordinate per axis the tree splits on
+  if ((!center.empty() && center.size() != (size_t)k) || (!low.empty() && low.size() != (size_t)k) ||
+      (!high.empty() && high.size() != (size_t)k)) {
+    cout << "Range query coordinates must have " << k << " values, one per dimension" << endl;
+    return 0;
+  }
+  if (low.empty() != high.empty()) {
+    cout << "Box query needs both corners (-l and -u)" << endl;
+    return 0;
+  }
+  if (!center.empty() && radius < 0.0) {
+    cout << "Radius query needs a radius (-r)" << endl;
+    return 0;
+  }
   
   // Use the input vector to build the kd-tree
   Timer totalSimulationTimer;
-  myKDTree.buildKDTree(input, 0, k);
+  myKDTree.buildKDTree(move(input), 0, k);
   double totalSimulationTime = totalSimulationTimer.elapsed();
 
   printf("Total simulation time: %.6fs\n", totalSimulationTime);
 
+  // Range queries on the built tree
+  if (!center.empty() && radius >= 0.0) {
+    Timer rangeTimer;
+    size_t count = myKDTree.radiusCount(center, radius);
+    double rangeTime = rangeTimer.elapsed();
+    printf("Points within radius %.4f: %zu (%.6fs)\n", radius, count, rangeTime);
+  }
+
+  if (!low.empty()) {
+    Timer rangeTimer;
+    size_t count = myKDTree.boxCount(low, high);
+    double rangeTime = rangeTimer.elapsed();
+    printf("Points inside box: %zu (%.6fs)\n", count, rangeTime);
+  }
+
+  if (inspect) {
+    printTreeReport(myKDTree.inspect());
+  }
+
   return 0;
 }
@@ -0,0 +1,90 @@
+#ifndef NUMA_TREE_H
+#define NUMA_TREE_H
+
+#include <vector>
+#include <thread>
+#include <omp.h>
+#include "kdTree.h"
+#include "../numa.h"
+
+using namespace std;
+
+// A read-only tree placed on the NUMA nodes of the machine for searching:
+//
+//   NumaTree index(tree, NUMA_REPLICATE);
+//   #pragma omp parallel
+//   {
+//     size_t node = queryThreadNode(omp_get_thread_num(), omp_get_num_threads());
+//     ScopedNodePinning pin(node);
+//     const KDTree& local = index.treeForNode(node);
+//     ... search local ...
+//   }
+//
+// NUMA_DEFAULT searches the given tree where it is, NUMA_INTERLEAVE a copy
+// whose pages are spread over all nodes, NUMA_REPLICATE one copy per node,
+// written by a thread pinned to that node so first touch keeps it local.
+// The given tree must outlive a NUMA_DEFAULT index, the copies do not
+// depend on it.
+class NumaTree {
+public:
+  NumaTree(const KDTree& tree, NumaPlacement placement)
+      : source(&tree), placement(placement), placed(placement == NUMA_DEFAULT) {
+    if (placement == NUMA_INTERLEAVE) {
+      // The policy is per thread, so the copy is written by this one. Without
+      // it, spreading the first touch over the whole team comes closest.
+      ScopedMemoryPolicy policy(NUMA_MPOL_INTERLEAVE, allNumaNodes());
+      replicas.push_back(tree.clone(policy.ok() ? 1 : omp_get_max_threads()));
+      placed = policy.ok();
+    } else if (placement == NUMA_REPLICATE) {
+      size_t numNodes = numaTopology().size();
+      replicas.resize(numNodes);
+      vector<char> pinned(numNodes, 0);
+      vector<thread> builders;
+      for (size_t node = 0; node < numNodes; node++) {
+        builders.emplace_back([this, &tree, &pinned, node]() {
+          ScopedNodePinning pin(node);
+          pinned[node] = pin.ok();
+          replicas[node] = tree.clone(1);
+        });
+      }
+      for (thread& builder : builders) {
+        builder.join();
+      }
+      placed = find(pinned.begin(), pinned.end(), 0) == pinned.end();
+    }
+  }
+
+  // Tree the threads of topology node index `node` should search
+  const KDTree& treeForNode(size_t node) const {
+    if (replicas.empty()) {
+      return *source;
+    }
+    return replicas[node < replicas.size() ? node : 0];
+  }
+
+  // Tree for the node the calling thread runs on right now
+  const KDTree& localTree() const {
+    return treeForNode(currentNumaNode());
+  }
+
+  NumaPlacement placementKind() const { return placement; }
+
+  // False if the system refused to pin or set a memory policy, the trees
+  // then sit wherever the kernel put them
+  bool isPlaced() const { return placed; }
+
+private:
+  const KDTree* source;
+  vector<KDTree> replicas;
+  NumaPlacement placement;
+  bool placed;
+};
+
+// Node query thread `thread` of `numThreads` should be pinned to: threads are
+// dealt out to the nodes in contiguous blocks, as evenly as possible
+inline size_t queryThreadNode(size_t thread, size_t numThreads) {
+  size_t numNodes = numaTopology().size();
+  return numThreads == 0 ? 0 : min(numNodes - 1, thread * numNodes / numThreads);
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef ALLKNN_H
+#define ALLKNN_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+#include "../kdTree/kdTree.h"
+
+using namespace std;
+
+// Query subtrees with more points than this are handed to separate OpenMP tasks
+#define ALLKNN_TASK_POINTS 2048
+
+// kNN graph file layout (CSR):
+//   KNNGraphHeader
+//   uint64 offsets[numVertices + 1]   neighbors of vertex v are [offsets[v], offsets[v + 1])
+//   uint32 neighbors[numEdges]        vertex ids are row numbers of the input file
+//   float  distances[numEdges]        Euclidean distances, ascending per vertex
+static const char KNN_GRAPH_MAGIC[8] = {'K', 'N', 'N', 'G', 'R', 'P', 'H', '1'};
+
+struct KNNGraphHeader {
+  char magic[8];
+  uint64_t numVertices;
+  uint64_t numEdges;
+  uint32_t k;
+  uint32_t reserved;
+};
+
+// Node of the bounding-box tree used by the dual-tree traversal
+struct BoxNode {
+  int begin;    // Points order[begin, end) belong to this node
+  int end;
+  int left;     // Child node indices, -1 for a leaf
+  int right;
+};
+
+// Computes the k nearest neighbors of every point (excluding itself) by
+// traversing a bounding-box kd-tree against itself. A query node keeps a
+// bound on the k-th neighbor distance of all its points, and whole reference
+// nodes farther away than that bound are skipped for all those points at once.
+class AllKNN {
+public:
+  size_t numPoints;
+  size_t dimensions;
+  size_t k;
+
+  AllKNN(size_t k, int leafSize = 32) : numPoints(0), dimensions(0), k(k), leafSize(leafSize) {}
+
+  void build(const PointSet& data, size_t d) {
+    points = data.project(d);
+    numPoints = points.size();
+    dimensions = points.dimensions();
+
+    order.resize(numPoints);
+    for (size_t i = 0; i < numPoints; i++) {
+      order[i] = i;
+    }
+
+    nodes.clear();
+    lowCorners.clear();
+    highCorners.clear();
+    if (numPoints > 0) {
+      buildNode(0, numPoints);
+    }
+  }
+
+  // Fill the neighbor lists of every point
+  void run() {
+    candidateDistances.assign(numPoints * k, numeric_limits<double>::infinity());
+    candidateIndices.assign(numPoints * k, -1);
+    nodeMaxKth.assign(nodes.size(), numeric_limits<double>::infinity());
+    nodeMinKth.assign(nodes.size(), numeric_limits<double>::infinity());
+    if (numPoints == 0 || k == 0) {
+      return;
+    }
+
+    #pragma omp parallel
+    {
+      #pragma omp single
+      dualTraverse(0, 0);
+    }
+  }
+
+  // Neighbors found for a point, nearest first (index -1 = none)
+  const int* neighborsOf(size_t point) const { return &candidateIndices[point * k]; }
+
+  // Euclidean distance of the i-th neighbor of a point
+  double distanceOf(size_t point, size_t i) const { return sqrt(candidateDistances[point * k + i]); }
+
+  // Write the graph in the CSR layout described above
+  bool writeCSR(const string& filename) const {
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+      cout << "Unable to open file " << filename << endl;
+      return false;
+    }
+
+    vector<uint64_t> offsets(numPoints + 1, 0);
+    for (size_t p = 0; p < numPoints; p++) {
+      size_t count = 0;
+      while (count < k && candidateIndices[p * k + count] >= 0) {
+        count++;
+      }
+      offsets[p + 1] = offsets[p] + count;
+    }
+
+    vector<uint32_t> neighbors(offsets[numPoints]);
+    vector<float> distances(offsets[numPoints]);
+    #pragma omp parallel for schedule(static)
+    for (size_t p = 0; p < numPoints; p++) {
+      for (uint64_t e = offsets[p]; e < offsets[p + 1]; e++) {
+        neighbors[e] = candidateIndices[p * k + (e - offsets[p])];
+        distances[e] = sqrt(candidateDistances[p * k + (e - offsets[p])]);
+      }
+    }
+
+    KNNGraphHeader header;
+    memcpy(header.magic, KNN_GRAPH_MAGIC, sizeof(header.magic));
+    header.numVertices = numPoints;
+    header.numEdges = offsets[numPoints];
+    header.k = k;
+    header.reserved = 0;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char*>(neighbors.data()), neighbors.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(distances.data()), distances.size() * sizeof(float));
+    return file.good();
+  }
+
+private:
+  int leafSize;
+  PointSet points;
+  vector<int> order;              // Point indices, every node owns a contiguous range
+  vector<BoxNode> nodes;
+  vector<double> lowCorners;      // Bounding box of node i at [i * dimensions, (i + 1) * dimensions)
+  vector<double> highCorners;
+  vector<double> nodeDiameter;    // Length of each node's bounding box diagonal
+
+  // Per point: k best squared distances (ascending) and their point indices
+  vector<double> candidateDistances;
+  vector<int> candidateIndices;
+
+  // Per node: largest and smallest squared k-th candidate distance of its points
+  vector<double> nodeMaxKth;
+  vector<double> nodeMinKth;
+
+  const double* pointAt(int index) const { return points.features(index); }
+
+  int buildNode(int begin, int end) {
+    int nodeIndex = nodes.size();
+    nodes.push_back({begin, end, -1, -1});
+    lowCorners.resize(nodes.size() * dimensions);
+    highCorners.resize(nodes.size() * dimensions);
+    nodeDiameter.resize(nodes.size());
+
+    // Bounding box of the node's points
+    double* low = &lowCorners[nodeIndex * dimensions];
+    double* high = &highCorners[nodeIndex * dimensions];
+    for (size_t a = 0; a < dimensions; a++) {
+      low[a] = numeric_limits<double>::infinity();
+      high[a] = -numeric_limits<double>::infinity();
+    }
+    for (int i = begin; i < end; i++) {
+      const double* point = pointAt(order[i]);
+      for (size_t a = 0; a < dimensions; a++) {
+        low[a] = min(low[a], point[a]);
+        high[a] = max(high[a], point[a]);
+      }
+    }
+
+    // Split the widest side at the median
+    size_t axis = 0;
+    double diameter = 0.0;
+    for (size_t a = 0; a < dimensions; a++) {
+      double width = high[a] - low[a];
+      diameter += width * width;
+      if (width > high[axis] - low[axis]) {
+        axis = a;
+      }
+    }
+    nodeDiameter[nodeIndex] = sqrt(diameter);
+
+    if (end - begin <= leafSize || high[axis] == low[axis]) {
+      return nodeIndex;
+    }
+
+    int median = begin + (end - begin) / 2;
+    nth_element(order.begin() + begin, order.begin() + median, order.begin() + end,
+                [this, axis](int a, int b) { return pointAt(a)[axis] < pointAt(b)[axis]; });
+
+    int left = buildNode(begin, median);
+    int right = buildNode(median, end);
+    nodes[nodeIndex].left = left;
+    nodes[nodeIndex].right = right;
+    return nodeIndex;
+  }
+
+  bool isLeaf(int node) const { return nodes[node].left < 0; }
+  int sizeOf(int node) const { return nodes[node].end - nodes[node].begin; }
+
+  // Squared distance between the bounding boxes of two nodes
+  double boxDistance(int a, int b) const {
+    const double* lowA = &lowCorners[a * dimensions];
+    const double* highA = &highCorners[a * dimensions];
+    const double* lowB = &lowCorners[b * dimensions];
+    const double* highB = &highCorners[b * dimensions];
+
+    double distance = 0.0;
+    for (size_t i = 0; i < dimensions; i++) {
+      double gap = max(0.0, max(lowA[i] - highB[i], lowB[i] - highA[i]));
+      distance += gap * gap;
+    }
+    return distance;
+  }
+
+  // Largest squared distance a point of the query node may still need to look at.
+  // Besides the worst k-th distance of its points, a point q can always use the
+  // candidates of the node's best point p: they are within kth(p) + |q - p|.
+  double queryBound(int query) const {
+    double viaBestPoint = sqrt(nodeMinKth[query]) + nodeDiameter[query];
+    return min(nodeMaxKth[query], viaBestPoint * viaBestPoint);
+  }
+
+  // Insert a candidate into a point's sorted list of k best
+  void insertCandidate(int point, int candidate, double distance) {
+    double* distances = &candidateDistances[(size_t)point * k];
+    int* indices = &candidateIndices[(size_t)point * k];
+
+    size_t position = k - 1;
+    while (position > 0 && distances[position - 1] > distance) {
+      distances[position] = distances[position - 1];
+      indices[position] = indices[position - 1];
+      position--;
+    }
+    distances[position] = distance;
+    indices[position] = candidate;
+  }
+
+  // Brute force between two leaves, then refresh the query leaf's bounds
+  void baseCase(int query, int reference) {
+    const BoxNode& queryNode = nodes[query];
+    const BoxNode& referenceNode = nodes[reference];
+
+    double maxKth = 0.0;
+    double minKth = numeric_limits<double>::infinity();
+    for (int i = queryNode.begin; i < queryNode.end; i++) {
+      int q = order[i];
+      const double* queryPoint = pointAt(q);
+      double kth = candidateDistances[(size_t)q * k + k - 1];
+
+      for (int j = referenceNode.begin; j < referenceNode.end; j++) {
+        int r = order[j];
+        if (r == q) {
+          continue;
+        }
+        const double* referencePoint = pointAt(r);
+        double distance = 0.0;
+        for (size_t a = 0; a < dimensions; a++) {
+          double diff = queryPoint[a] - referencePoint[a];
+          distance += diff * diff;
+        }
+        if (distance < kth) {
+          insertCandidate(q, r, distance);
+          kth = candidateDistances[(size_t)q * k + k - 1];
+        }
+      }
+
+      maxKth = max(maxKth, kth);
+      minKth = min(minKth, kth);
+    }
+
+    nodeMaxKth[query] = maxKth;
+    nodeMinKth[query] = minKth;
+  }
+
+  // Squared distance between the centers of two bounding boxes
+  double centerDistance(int a, int b) const {
+    const double* lowA = &lowCorners[a * dimensions];
+    const double* highA = &highCorners[a * dimensions];
+    const double* lowB = &lowCorners[b * dimensions];
+    const double* highB = &highCorners[b * dimensions];
+
+    double distance = 0.0;
+    for (size_t i = 0; i < dimensions; i++) {
+      double diff = (lowA[i] + highA[i]) - (lowB[i] + highB[i]);
+      distance += diff * diff;
+    }
+    return 0.25 * distance;
+  }
+
+  // Visit both children of the reference node, nearest first so the query bound
+  // shrinks before the far child is tried
+  void traverseReferenceChildren(int query, int reference) {
+    int nearChild = nodes[reference].left;
+    int farChild = nodes[reference].right;
+    double nearDistance = boxDistance(query, nearChild);
+    double farDistance = boxDistance(query, farChild);
+    if (farDistance < nearDistance ||
+        (farDistance == nearDistance && centerDistance(query, farChild) < centerDistance(query, nearChild))) {
+      swap(nearChild, farChild);
+    }
+    dualTraverse(query, nearChild);
+    dualTraverse(query, farChild);
+  }
+
+  void dualTraverse(int query, int reference) {
+    if (boxDistance(query, reference) > queryBound(query)) {
+      return;
+    }
+
+    if (isLeaf(query) && isLeaf(reference)) {
+      baseCase(query, reference);
+      return;
+    }
+
+    if (isLeaf(query)) {
+      traverseReferenceChildren(query, reference);
+      return;
+    }
+
+    // Split the query node (and the reference node along with it): children own
+    // disjoint points, so they can run as separate tasks
+    int leftChild = nodes[query].left;
+    int rightChild = nodes[query].right;
+    bool splitReference = !isLeaf(reference);
+    if (sizeOf(query) > ALLKNN_TASK_POINTS) {
+      #pragma omp task
+      {
+        if (splitReference) traverseReferenceChildren(leftChild, reference);
+        else dualTraverse(leftChild, reference);
+      }
+      #pragma omp task
+      {
+        if (splitReference) traverseReferenceChildren(rightChild, reference);
+        else dualTraverse(rightChild, reference);
+      }
+      #pragma omp taskwait
+    } else if (splitReference) {
+      traverseReferenceChildren(leftChild, reference);
+      traverseReferenceChildren(rightChild, reference);
+    } else {
+      dualTraverse(leftChild, reference);
+      dualTraverse(rightChild, reference);
+    }
+
+    nodeMaxKth[query] = max(nodeMaxKth[leftChild], nodeMaxKth[rightChild]);
+    nodeMinKth[query] = min(nodeMinKth[leftChild], nodeMinKth[rightChild]);
+  }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef ASYNC_KNN_H
+#define ASYNC_KNN_H
+
+#include <vector>
+#include <future>
+#include <memory>
+#include "knn.h"
+#include "../threadPool.h"
+
+using namespace std;
+
+// Asynchronous kNN searches of one tree on a thread pool, instead of an
+// OpenMP team per call:
+//
+//   AsyncKNN search(tree);
+//   future<vector<DistanceNode>> answer = search.submit(query, 10, deadlineIn(chrono::milliseconds(5)));
+//   vector<DistanceNode> neighbors = answer.get();   // closest first
+//
+// A query whose deadline passes, or whose token is cancelled, before it
+// starts fails its future with DeadlineExceeded or TaskCancelled. Both are
+// only checked then: a search already running is not interrupted and its
+// future gets the full answer, however late. Size the deadline to drop the
+// backlog of a burst, not to bound one search. The neighbors point into the tree, which must outlive the searches and their
+// results and must not be rebuilt meanwhile (build a new tree and swap).
+class AsyncKNN {
+public:
+  explicit AsyncKNN(const KDTree& tree, ThreadPool& pool = sharedThreadPool(),
+                    const MetricSpec& metric = MetricSpec(), SearchOrder order = SEARCH_DEPTH_FIRST)
+      : tree(&tree), pool(&pool), metric(metric), order(order) {}
+
+  future<vector<DistanceNode>> submit(const vector<double>& query, size_t k,
+                                      Deadline deadline = noDeadline(),
+                                      const CancellationToken& token = CancellationToken()) const {
+    const KDTree* searched = tree;
+    MetricSpec spec = metric;
+    SearchOrder traversal = order;
+    return pool->submit([searched, spec, traversal, query, k]() {
+      return search(*searched, spec, traversal, query, k);
+    }, token, deadline);
+  }
+
+  // One future per query, `grain` queries per task. Every query checks the
+  // deadline and token when its turn comes, so only the queries not started
+  // by then fail, the ones before them in the task still complete.
+  vector<future<vector<DistanceNode>>> submitBatch(const vector<vector<double>>& queries, size_t k,
+                                                   Deadline deadline = noDeadline(),
+                                                   const CancellationToken& token = CancellationToken(),
+                                                   size_t grain = 16) const {
+    auto batch = make_shared<vector<vector<double>>>(queries);
+    auto results = make_shared<vector<promise<vector<DistanceNode>>>>(queries.size());
+    vector<future<vector<DistanceNode>>> answers;
+    for (promise<vector<DistanceNode>>& result : *results) {
+      answers.push_back(result.get_future());
+    }
+
+    const KDTree* searched = tree;
+    MetricSpec spec = metric;
+    SearchOrder traversal = order;
+    grain = max<size_t>(grain, 1);
+    for (size_t first = 0; first < queries.size(); first += grain) {
+      size_t last = min(queries.size(), first + grain);
+      pool->post([searched, spec, traversal, batch, results, first, last, k, deadline, token]() {
+        for (size_t q = first; q < last; q++) {
+          promise<vector<DistanceNode>>& result = (*results)[q];
+          if (abandonTask(result, token, deadline)) {
+            continue;
+          }
+          auto run = [&]() { return search(*searched, spec, traversal, (*batch)[q], k); };
+          fulfil(result, run);
+        }
+      });
+    }
+    return answers;
+  }
+
+  ThreadPool& threadPool() const { return *pool; }
+
+private:
+  static vector<DistanceNode> search(const KDTree& tree, const MetricSpec& metric, SearchOrder order,
+                                     vector<double> query, size_t k) {
+    if (metric.type == METRIC_COSINE) {
+      normalizeVector(query);
+    }
+    vector<DistanceNode> neighbors;
+    kNNSearchIterative(tree.root.get(), query, k, neighbors, metric, 0.0, 0, order);
+    return neighbors;
+  }
+
+  const KDTree* tree;
+  ThreadPool* pool;
+  MetricSpec metric;
+  SearchOrder order;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <omp.h>
+#include "knn.h"
+
+using namespace std;
+
+// kNN classification of whole query sets. Votes are taken straight from the
+// neighbor lists of the search (node labels, no neighbor features copied)
+// into a dense per-thread array indexed by label, instead of a map per query.
+
+enum VoteWeighting {
+  VOTE_UNIFORM,    // One vote per neighbor
+  VOTE_DISTANCE    // Votes weighted by 1 / distance, neighbors at distance 0 outvote all others
+};
+
+// Parse "uniform" or "distance"
+bool parseVoteWeighting(const string& value, VoteWeighting& weighting) {
+  if (value == "uniform") {
+    weighting = VOTE_UNIFORM;
+  } else if (value == "distance") {
+    weighting = VOTE_DISTANCE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Dense indices 0 .. size() - 1 for a set of labels, in ascending label order
+class LabelIndex {
+public:
+  LabelIndex() {}
+
+  explicit LabelIndex(vector<int> labels) {
+    sort(labels.begin(), labels.end());
+    labels.erase(unique(labels.begin(), labels.end()), labels.end());
+    values = labels;
+  }
+
+  static LabelIndex of(const PointSet& points) {
+    return LabelIndex(vector<int>(points.labelData(), points.labelData() + points.size()));
+  }
+
+  size_t size() const { return values.size(); }
+  int label(size_t index) const { return values[index]; }
+
+  // Index of label, size() if it is not in the set
+  size_t indexOf(int label) const {
+    auto it = lower_bound(values.begin(), values.end(), label);
+    return it != values.end() && *it == label ? it - values.begin() : values.size();
+  }
+
+  // Union of both label sets
+  LabelIndex merged(const LabelIndex& other) const {
+    vector<int> labels = values;
+    labels.insert(labels.end(), other.values.begin(), other.values.end());
+    return LabelIndex(labels);
+  }
+
+private:
+  vector<int> values;
+};
+
+// Label voted for by the neighbors (closest first, as the searches return
+// them). votes is scratch space of labels.size() entries. Ties go to the
+// smallest label, as with majorityLabel.
+int voteLabel(const vector<DistanceNode>& neighbors, const LabelIndex& labels, VoteWeighting weighting,
+              vector<double>& votes) {
+  if (neighbors.empty() || labels.size() == 0) {
+    return 0;
+  }
+  fill(votes.begin(), votes.end(), 0.0);
+
+  // Points on top of the query decide alone
+  bool exact = weighting == VOTE_DISTANCE && neighbors.front().distance == 0.0;
+  for (const DistanceNode& neighbor : neighbors) {
+    if (exact && neighbor.distance > 0.0) {
+      break;
+    }
+    double weight = weighting == VOTE_UNIFORM || exact ? 1.0 : 1.0 / neighbor.distance;
+    votes[labels.indexOf(neighbor.node->label)] += weight;
+  }
+
+  size_t best = max_element(votes.begin(), votes.end()) - votes.begin();
+  return labels.label(best);
+}
+
+class KNNClassifier {
+public:
+  // The tree holds the training points and must outlive the classifier
+  KNNClassifier(const KDTree& tree, size_t k, VoteWeighting weighting = VOTE_UNIFORM,
+                const MetricSpec& metric = MetricSpec(), SearchOrder order = SEARCH_DEPTH_FIRST)
+      : tree(&tree), labels(LabelIndex::of(tree.points)), k(k), weighting(weighting), metric(metric),
+        order(order) {}
+
+  const LabelIndex& trainingLabels() const { return labels; }
+
+  int classify(const vector<double>& query) const {
+    vector<DistanceNode> neighbors;
+    vector<double> votes(labels.size());
+    return classify(query, neighbors, votes);
+  }
+
+  // Predicted label of every query, spread over the OpenMP threads
+  vector<int> classifyBatch(const vector<vector<double>>& queries) const {
+    vector<int> predicted(queries.size());
+    #pragma omp parallel
+    {
+      vector<DistanceNode> neighbors;
+      vector<double> votes(labels.size());
+      #pragma omp for schedule(dynamic, 16)
+      for (size_t q = 0; q < queries.size(); q++) {
+        predicted[q] = classify(queries[q], neighbors, votes);
+      }
+    }
+    return predicted;
+  }
+
+private:
+  // Scratch buffers are reused across queries of one thread
+  int classify(const vector<double>& query, vector<DistanceNode>& neighbors, vector<double>& votes) const {
+    neighbors.clear();
+    kNNSearchIterative(tree->root.get(), query, k, neighbors, metric, 0.0, 0, order);
+    return voteLabel(neighbors, labels, weighting, votes);
+  }
+
+  const KDTree* tree;
+  LabelIndex labels;
+  size_t k;
+  VoteWeighting weighting;
+  MetricSpec metric;
+  SearchOrder order;
+};
+
+// counts[actual][predicted] over the dense indices of labels
+class ConfusionMatrix {
+public:
+  explicit ConfusionMatrix(const LabelIndex& labels)
+      : labels(labels), counts(labels.size() * labels.size(), 0) {}
+
+  void add(int actual, int predicted) {
+    counts[labels.indexOf(actual) * labels.size() + labels.indexOf(predicted)]++;
+  }
+
+  void add(const vector<int>& actual, const vector<int>& predicted) {
+    for (size_t i = 0; i < actual.size(); i++) {
+      add(actual[i], predicted[i]);
+    }
+  }
+
+  size_t count(size_t actual, size_t predicted) const { return counts[actual * labels.size() + predicted]; }
+
+  size_t total() const { return accumulate(counts.begin(), counts.end(), (size_t)0); }
+
+  size_t correct() const {
+    size_t sum = 0;
+    for (size_t i = 0; i < labels.size(); i++) {
+      sum += count(i, i);
+    }
+    return sum;
+  }
+
+  double accuracy() const { return total() > 0 ? (double)correct() / total() : 0.0; }
+
+  // Matrix with per-class recall (row) and precision (column)
+  void print() const {
+    size_t numLabels = labels.size();
+    printf("\nConfusion matrix (rows: actual, columns: predicted)\n%10s", "");
+    for (size_t p = 0; p < numLabels; p++) {
+      printf(" %8d", labels.label(p));
+    }
+    printf(" %8s\n", "recall");
+    for (size_t a = 0; a < numLabels; a++) {
+      size_t rowTotal = 0;
+      printf("%10d", labels.label(a));
+      for (size_t p = 0; p < numLabels; p++) {
+        printf(" %8zu", count(a, p));
+        rowTotal += count(a, p);
+      }
+      printf(" %8.4f\n", rowTotal > 0 ? (double)count(a, a) / rowTotal : 0.0);
+    }
+    printf("%10s", "precision");
+    for (size_t p = 0; p < numLabels; p++) {
+      size_t columnTotal = 0;
+      for (size_t a = 0; a < numLabels; a++) {
+        columnTotal += count(a, p);
+      }
+      printf(" %8.4f", columnTotal > 0 ? (double)count(p, p) / columnTotal : 0.0);
+    }
+    printf("\n");
+  }
+
+private:
+  LabelIndex labels;
+  vector<size_t> counts;
+};
+
+// Features of every point, the first d of them
+vector<vector<double>> pointFeatures(const PointSet& points, size_t d) {
+  vector<vector<double>> features(points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    features[i].assign(points.features(i), points.features(i) + min(d, points.dimensions()));
+  }
+  return features;
+}
+
+// k-fold cross-validation over data: the points are shuffled with seed and
+// dealt into folds, every fold is classified by a tree over the others.
+// Returns the accuracy of each fold, confusion gets all predictions.
+vector<double> crossValidate(const PointSet& data, size_t d, size_t folds, size_t k, VoteWeighting weighting,
+                             const MetricSpec& metric, SearchOrder order, unsigned seed,
+                             ConfusionMatrix& confusion) {
+  vector<size_t> shuffled(data.size());
+  iota(shuffled.begin(), shuffled.end(), 0);
+  shuffle(shuffled.begin(), shuffled.end(), mt19937(seed));
+
+  vector<double> accuracies;
+  for (size_t fold = 0; fold < folds; fold++) {
+    size_t first = data.size() * fold / folds;
+    size_t last = data.size() * (fold + 1) / folds;
+    vector<size_t> trainOrder(shuffled.begin(), shuffled.begin() + first);
+    trainOrder.insert(trainOrder.end(), shuffled.begin() + last, shuffled.end());
+    vector<size_t> testOrder(shuffled.begin() + first, shuffled.begin() + last);
+    if (trainOrder.empty() || testOrder.empty()) {
+      continue;
+    }
+
+    PointSet test = data.permuted(testOrder);
+    KDTree tree;
+    tree.buildKDTree(data.permuted(trainOrder), 0, d);
+    KNNClassifier classifier(tree, k, weighting, metric, order);
+
+    vector<int> predicted = classifier.classifyBatch(pointFeatures(test, d));
+    vector<int> actual(test.labelData(), test.labelData() + test.size());
+    ConfusionMatrix foldConfusion(LabelIndex::of(data));
+    foldConfusion.add(actual, predicted);
+    confusion.add(actual, predicted);
+    accuracies.push_back(foldConfusion.accuracy());
+  }
+  return accuracies;
+}
+
+#endif
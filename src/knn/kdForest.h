@@ -0,0 +1,348 @@
+#ifndef KDFOREST_H
+#define KDFOREST_H
+
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+#include "../kdTree/kdTree.h"
+#include "knn.h"
+
+using namespace std;
+
+// How each tree of the forest chooses its splitting hyperplanes
+enum ForestSplit {
+  SPLIT_HIGH_VARIANCE,  // Random axis among the highest-variance ones
+  SPLIT_ROTATION        // Median split after a random rotation of the data
+};
+
+// Number of highest-variance axes a split axis is drawn from
+#define FOREST_TOP_AXES 5
+
+// Number of points used to estimate per-axis variance at each node
+#define FOREST_VARIANCE_SAMPLE 128
+
+// Node of a randomized tree, stored in a flat array
+struct ForestNode {
+  int axis;       // Splitting axis, -1 for a leaf
+  double split;   // Splitting value (in rotated space for SPLIT_ROTATION)
+  int left;       // Child node indices, or [left, right) into the tree's point order for a leaf
+  int right;
+};
+
+// Branch waiting in the shared priority queue of a forest search
+struct ForestBranch {
+  double bound;   // Lower bound on the squared distance to the target
+  int tree;
+  int node;
+
+  bool operator>(const ForestBranch& other) const {
+    return bound > other.bound;
+  }
+};
+
+class KDForest {
+public:
+  PointSet points;        // Features and labels of all points, shared by every tree
+  size_t numPoints;
+  size_t dimensions;
+
+  KDForest(int numTrees = 4, int leafSize = 16, ForestSplit splitPolicy = SPLIT_HIGH_VARIANCE,
+           unsigned seed = 42)
+      : numPoints(0), dimensions(0), numTrees(numTrees), leafSize(leafSize),
+        splitPolicy(splitPolicy), seed(seed) {}
+
+  // Build all trees of the forest in parallel
+  void build(const PointSet& data, size_t d) {
+    points = data.project(d);
+    numPoints = points.size();
+    dimensions = points.dimensions();
+
+    trees.assign(numTrees, Tree());
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < numTrees; t++) {
+      buildTree(trees[t], seed + t);
+    }
+  }
+
+  // Find (approximately) the k nearest neighbors of target.
+  // All trees share one priority queue of unexplored branches and one budget of
+  // maxChecks distance computations (0 = no budget, exact search).
+  void kNNSearch(const vector<double>& target, size_t k, size_t maxChecks,
+                 vector<DistanceNode2>& nearestNeighbors) const {
+    nearestNeighbors.clear();
+    if (numPoints == 0 || k == 0) {
+      return;
+    }
+
+    // Max-heap of the best candidates so far, keyed by squared distance
+    priority_queue<pair<double, int>> best;
+    priority_queue<ForestBranch, vector<ForestBranch>, greater<ForestBranch>> branches;
+    uint32_t* checked = visitStamps();
+    uint32_t stamp = visitEpoch();
+    size_t checks = 0;
+
+    // The target seen by every tree (rotated for SPLIT_ROTATION)
+    vector<vector<double>> treeTargets(trees.size());
+    for (size_t t = 0; t < trees.size(); t++) {
+      treeTargets[t] = toTreeSpace(trees[t], target.data());
+      branches.push({0.0, (int)t, 0});
+    }
+
+    while (!branches.empty()) {
+      ForestBranch branch = branches.top();
+      branches.pop();
+
+      if (best.size() == k && branch.bound > best.top().first) {
+        break;
+      }
+      if (maxChecks > 0 && checks >= maxChecks) {
+        break;
+      }
+
+      const Tree& tree = trees[branch.tree];
+      const vector<double>& treeTarget = treeTargets[branch.tree];
+      int nodeIndex = branch.node;
+
+      // Descend to a leaf, queueing the far side of every split on the way
+      while (tree.nodes[nodeIndex].axis >= 0) {
+        const ForestNode& node = tree.nodes[nodeIndex];
+        double diff = treeTarget[node.axis] - node.split;
+        int nearChild = diff < 0 ? node.left : node.right;
+        int farChild = diff < 0 ? node.right : node.left;
+        branches.push({max(branch.bound, diff * diff), branch.tree, farChild});
+        nodeIndex = nearChild;
+      }
+
+      const ForestNode& leaf = tree.nodes[nodeIndex];
+      for (int i = leaf.left; i < leaf.right; i++) {
+        int index = tree.order[i];
+        if (checked[index] == stamp) {
+          continue;
+        }
+        checked[index] = stamp;
+        checks++;
+
+        double distance = squaredDistance(target.data(), points.features(index));
+        if (best.size() < k) {
+          best.push({distance, index});
+        } else if (distance < best.top().first) {
+          best.pop();
+          best.push({distance, index});
+        }
+      }
+    }
+
+    nearestNeighbors.resize(best.size());
+    for (size_t i = best.size(); i > 0; i--) {
+      nearestNeighbors[i - 1] = {sqrt(best.top().first), points.label(best.top().second)};
+      best.pop();
+    }
+  }
+
+private:
+  struct Tree {
+    vector<ForestNode> nodes;
+    vector<int> order;        // Point indices, leaves own contiguous ranges
+    vector<double> rotation;  // Row-major d x d orthonormal matrix (SPLIT_ROTATION only)
+  };
+
+  int numTrees;
+  int leafSize;
+  ForestSplit splitPolicy;
+  unsigned seed;
+  vector<Tree> trees;
+
+  // Points checked by a search are stamped with its epoch, so a search
+  // starts without clearing anything. The stamps belong to the calling thread
+  // and serve every forest it searches.
+  static vector<uint32_t>& threadStamps() {
+    static thread_local vector<uint32_t> stamps;
+    return stamps;
+  }
+
+  static uint32_t& threadEpoch() {
+    static thread_local uint32_t epoch = 0;
+    return epoch;
+  }
+
+  uint32_t* visitStamps() const {
+    vector<uint32_t>& stamps = threadStamps();
+    if (stamps.size() < numPoints) {
+      stamps.resize(numPoints, 0);
+    }
+    return stamps.data();
+  }
+
+  // A new epoch for the next search, clearing the stamps once the counter wraps
+  uint32_t visitEpoch() const {
+    uint32_t& epoch = threadEpoch();
+    if (++epoch == 0) {
+      vector<uint32_t>& stamps = threadStamps();
+      fill(stamps.begin(), stamps.end(), 0);
+      epoch = 1;
+    }
+    return epoch;
+  }
+
+  double squaredDistance(const double* a, const double* b) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < dimensions; i++) {
+      double diff = a[i] - b[i];
+      distance += diff * diff;
+    }
+    return distance;
+  }
+
+  // Coordinates of a point in the space the tree splits in
+  vector<double> toTreeSpace(const Tree& tree, const double* point) const {
+    if (tree.rotation.empty()) {
+      return vector<double>(point, point + dimensions);
+    }
+
+    vector<double> rotated(dimensions, 0.0);
+    for (size_t r = 0; r < dimensions; r++) {
+      const double* row = &tree.rotation[r * dimensions];
+      for (size_t c = 0; c < dimensions; c++) {
+        rotated[r] += row[c] * point[c];
+      }
+    }
+    return rotated;
+  }
+
+  // Random orthonormal matrix: Gram-Schmidt on Gaussian rows
+  vector<double> randomRotation(mt19937& rng) const {
+    normal_distribution<double> gaussian(0.0, 1.0);
+    vector<double> matrix(dimensions * dimensions);
+
+    for (size_t r = 0; r < dimensions; r++) {
+      double* row = &matrix[r * dimensions];
+      double norm = 0.0;
+      while (norm < 1e-9) {
+        for (size_t c = 0; c < dimensions; c++) {
+          row[c] = gaussian(rng);
+        }
+        for (size_t p = 0; p < r; p++) {
+          const double* previous = &matrix[p * dimensions];
+          double dot = 0.0;
+          for (size_t c = 0; c < dimensions; c++) {
+            dot += row[c] * previous[c];
+          }
+          for (size_t c = 0; c < dimensions; c++) {
+            row[c] -= dot * previous[c];
+          }
+        }
+        norm = 0.0;
+        for (size_t c = 0; c < dimensions; c++) {
+          norm += row[c] * row[c];
+        }
+        norm = sqrt(norm);
+      }
+      for (size_t c = 0; c < dimensions; c++) {
+        row[c] /= norm;
+      }
+    }
+
+    return matrix;
+  }
+
+  void buildTree(Tree& tree, unsigned treeSeed) {
+    mt19937 rng(treeSeed);
+
+    tree.order.resize(numPoints);
+    for (size_t i = 0; i < numPoints; i++) {
+      tree.order[i] = i;
+    }
+
+    // Rotated coordinates are only needed while choosing splits
+    vector<double> treePoints;
+    if (splitPolicy == SPLIT_ROTATION) {
+      tree.rotation = randomRotation(rng);
+      treePoints.resize(numPoints * dimensions);
+      for (size_t i = 0; i < numPoints; i++) {
+        vector<double> rotated = toTreeSpace(tree, points.features(i));
+        copy(rotated.begin(), rotated.end(), treePoints.begin() + i * dimensions);
+      }
+    }
+    const double* coordinates = splitPolicy == SPLIT_ROTATION ? treePoints.data() : points.data();
+
+    tree.nodes.clear();
+    tree.nodes.push_back(ForestNode());
+    buildNode(tree, coordinates, 0, 0, numPoints, 0, rng);
+  }
+
+  // Pick the splitting axis of the points in order[begin, end)
+  int chooseAxis(const Tree& tree, const double* coordinates, int begin, int end,
+                 int depth, mt19937& rng) const {
+    // Rotated trees already have random directions, cycle through them
+    if (splitPolicy == SPLIT_ROTATION) {
+      return depth % dimensions;
+    }
+
+    int count = end - begin;
+    int sampleSize = min(count, FOREST_VARIANCE_SAMPLE);
+    vector<double> mean(dimensions, 0.0);
+    vector<double> variance(dimensions, 0.0);
+
+    for (int s = 0; s < sampleSize; s++) {
+      const double* point = &coordinates[tree.order[begin + (long long)s * count / sampleSize] * dimensions];
+      for (size_t a = 0; a < dimensions; a++) {
+        mean[a] += point[a];
+      }
+    }
+    for (size_t a = 0; a < dimensions; a++) {
+      mean[a] /= sampleSize;
+    }
+    for (int s = 0; s < sampleSize; s++) {
+      const double* point = &coordinates[tree.order[begin + (long long)s * count / sampleSize] * dimensions];
+      for (size_t a = 0; a < dimensions; a++) {
+        double diff = point[a] - mean[a];
+        variance[a] += diff * diff;
+      }
+    }
+
+    vector<int> axes(dimensions);
+    for (size_t a = 0; a < dimensions; a++) {
+      axes[a] = a;
+    }
+    int topAxes = min<int>(FOREST_TOP_AXES, dimensions);
+    partial_sort(axes.begin(), axes.begin() + topAxes, axes.end(),
+                 [&variance](int a, int b) { return variance[a] > variance[b]; });
+
+    return axes[uniform_int_distribution<int>(0, topAxes - 1)(rng)];
+  }
+
+  void buildNode(Tree& tree, const double* coordinates, int nodeIndex,
+                 int begin, int end, int depth, mt19937& rng) {
+    if (end - begin <= leafSize) {
+      tree.nodes[nodeIndex] = {-1, 0.0, begin, end};
+      return;
+    }
+
+    int axis = chooseAxis(tree, coordinates, begin, end, depth, rng);
+
+    // Median split keeps every tree balanced
+    int median = begin + (end - begin) / 2;
+    nth_element(tree.order.begin() + begin, tree.order.begin() + median, tree.order.begin() + end,
+                [coordinates, axis, this](int a, int b) {
+                  return coordinates[a * dimensions + axis] < coordinates[b * dimensions + axis];
+                });
+    double split = coordinates[tree.order[median] * dimensions + axis];
+
+    int left = tree.nodes.size();
+    tree.nodes.push_back(ForestNode());
+    int right = tree.nodes.size();
+    tree.nodes.push_back(ForestNode());
+    tree.nodes[nodeIndex] = {axis, split, left, right};
+
+    buildNode(tree, coordinates, left, begin, median, depth + 1, rng);
+    buildNode(tree, coordinates, right, median, end, depth + 1, rng);
+  }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <cmath>
+#include <omp.h>
+#include "classifier.h"
+#include "../kdTree/kdTree.h"
+#include "../utils.h"
+#include "../timing.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  int k = -1, d = -1;
+  string filename = "";
+  string testFilename = "";
+  VoteWeighting weighting = VOTE_UNIFORM;
+  size_t folds = 0;
+  unsigned seed = 42;
+  MetricSpec metric;
+  SearchOrder order = SEARCH_DEPTH_FIRST;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hk:i:d:t:w:f:s:m:o:")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " -k <k> -i <training set> -d <dimensions> [-t <test set>] [-f <folds>]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -k value       Number of neighbors that vote" << endl;
+        cout << "  -i value       Labeled training dataset" << endl;
+        cout << "  -d value       Number of features to consider" << endl;
+        cout << "  -t value       Labeled test dataset, classified in parallel" << endl;
+        cout << "  -w value       Votes: uniform or distance (1 / distance), default uniform" << endl;
+        cout << "  -f value       k-fold cross-validation over the training dataset" << endl;
+        cout << "  -s value       Random seed of the cross-validation folds (default 42)" << endl;
+        cout << "  -m value       Distance metric, as for knn.out (default euclidean)" << endl;
+        cout << "  -o value       Traversal order: dfs or bbf (default dfs)" << endl;
+        return 0;
+      case 'k':
+      case 'd':
+      case 'f':
+      case 's':
+        if (!isPositiveInteger(optarg) || string(optarg).empty()) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'k') k = stoi(optarg);
+        if (opt == 'd') d = stoi(optarg);
+        if (opt == 'f') folds = stoul(optarg);
+        if (opt == 's') seed = stoul(optarg);
+        break;
+      case 'i':
+        filename = optarg;
+        break;
+      case 't':
+        testFilename = optarg;
+        break;
+      case 'w':
+        if (!parseVoteWeighting(optarg, weighting)) {
+          cout << "Invalid value for w, w = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'm':
+        if (!parseMetric(optarg, metric)) {
+          cout << "Invalid value for m, m = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'o':
+        if (!parseSearchOrder(optarg, order)) {
+          cout << "Invalid value for o, o = " << optarg << endl;
+          return 0;
+        }
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " -k <k> -i <training set> -d <dimensions> [-t <test set>] [-f <folds>]" << endl;
+        return 0;
+    }
+  }
+
+  if (k <= 0 || d <= 0 || filename == "" || (testFilename == "" && folds == 0)) {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+  if (folds == 1) {
+    cout << "Invalid value for f, f = 1" << endl;
+    return 0;
+  }
+
+  if (!checkMetric(metric, d)) {
+    return 0;
+  }
+
+  KDTree kdTree;
+  PointSet data = kdTree.parseInput(filename, kdTree.dimensions);
+  if (data.empty()) {
+    return 0;
+  }
+  if ((size_t)d > data.dimensions()) {
+    cout << "d = " << d << " is larger than the " << data.dimensions() << " features in the dataset" << endl;
+    return 0;
+  }
+  vector<vector<double>> noTargets;
+  normalizeForMetric(metric, data, noTargets);
+
+  printf("Points: %zu, k: %d, votes: %s, threads: %d\n", data.size(), k,
+         weighting == VOTE_UNIFORM ? "uniform" : "distance", omp_get_max_threads());
+
+  if (testFilename != "") {
+    PointSet test = readDataset(testFilename);
+    if (test.dimensions() < (size_t)d) {
+      cout << "The test dataset has fewer than " << d << " features" << endl;
+      return 0;
+    }
+    vector<vector<double>> queries = pointFeatures(test, d);
+    PointSet noData;
+    normalizeForMetric(metric, noData, queries);
+
+    Timer buildTimer;
+    kdTree.buildKDTree(data, 0, d);
+    double buildTime = buildTimer.elapsed();
+
+    KNNClassifier classifier(kdTree, k, weighting, metric, order);
+    Timer classifyTimer;
+    vector<int> predicted = classifier.classifyBatch(queries);
+    double classifyTime = classifyTimer.elapsed();
+
+    vector<int> actual(test.labelData(), test.labelData() + test.size());
+    ConfusionMatrix confusion(classifier.trainingLabels().merged(LabelIndex::of(test)));
+    confusion.add(actual, predicted);
+
+    printf("\nBuild time: %.6fs\n", buildTime);
+    printf("Classified %zu test points in %.6fs (%.1f points/s)\n", queries.size(), classifyTime,
+           queries.size() / classifyTime);
+    printf("Accuracy: %.4f (%zu of %zu)\n", confusion.accuracy(), confusion.correct(), confusion.total());
+    confusion.print();
+  }
+
+  if (folds > 0) {
+    if (folds > data.size()) {
+      cout << "Invalid value for f, f = " << folds << " is larger than the " << data.size() << " points" << endl;
+      return 0;
+    }
+
+    ConfusionMatrix confusion(LabelIndex::of(data));
+    Timer validationTimer;
+    vector<double> accuracies = crossValidate(data, d, folds, k, weighting, metric, order, seed, confusion);
+    double validationTime = validationTimer.elapsed();
+
+    double mean = 0.0;
+    for (double accuracy : accuracies) {
+      mean += accuracy;
+    }
+    mean /= accuracies.size();
+    double variance = 0.0;
+    for (double accuracy : accuracies) {
+      variance += (accuracy - mean) * (accuracy - mean);
+    }
+    double stddev = accuracies.size() > 1 ? sqrt(variance / (accuracies.size() - 1)) : 0.0;
+
+    printf("\n%zu-fold cross-validation (%.6fs)\n", folds, validationTime);
+    for (size_t fold = 0; fold < accuracies.size(); fold++) {
+      printf("  fold %zu: accuracy %.4f\n", fold + 1, accuracies[fold]);
+    }
+    printf("Accuracy: %.4f +- %.4f, pooled %.4f\n", mean, stddev, confusion.accuracy());
+    confusion.print();
+  }
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include "queryProtocol.h"
+#include "../utils.h"
+#include "../timing.h"
+
+using namespace std;
+
+// Load generator for knn-server.out: every connection keeps `depth` requests
+// in flight, cycling through the query file, and records the latency of each.
+
+// Latency percentile in seconds, latencies must be sorted
+double latencyPercentile(const vector<double>& latencies, double p) {
+  if (latencies.empty()) {
+    return 0.0;
+  }
+  size_t rank = min(latencies.size() - 1, (size_t)max(0.0, ceil(p * latencies.size()) - 1));
+  return latencies[rank];
+}
+
+// Parse a file of query points, one per line, keeping the first d features
+vector<vector<double>> readQueries(const string& filename, size_t d) {
+  vector<vector<double>> queries;
+  ifstream file(filename);
+  string line;
+  while (getline(file, line)) {
+    vector<double> query = parseDoubleList(line);
+    if (query.size() >= d) {
+      query.resize(d);
+      queries.push_back(query);
+    }
+  }
+  return queries;
+}
+
+struct ClientResult {
+  vector<double> latencies;
+  size_t errors;
+  bool failed;
+};
+
+// One connection: send up to depth requests ahead, then one more per response
+void runConnection(const string& socketPath, const vector<vector<double>>& queries, size_t firstQuery,
+                   size_t numRequests, uint32_t k, size_t depth, ClientResult& result) {
+  result = {vector<double>(), 0, false};
+  int fd = connectUnixSocket(socketPath);
+  if (fd < 0) {
+    result.failed = true;
+    return;
+  }
+
+  size_t dims = queries[0].size();
+  vector<chrono::steady_clock::time_point> sent(numRequests);
+  vector<char> request(sizeof(QueryRequestHeader) + dims * sizeof(double));
+  vector<QueryNeighbor> neighbors;
+  size_t numSent = 0;
+  size_t numReceived = 0;
+
+  auto sendNext = [&]() {
+    const vector<double>& query = queries[(firstQuery + numSent) % queries.size()];
+    QueryRequestHeader header = {QUERY_MAGIC, (uint32_t)numSent, k, (uint32_t)dims};
+    memcpy(request.data(), &header, sizeof(header));
+    memcpy(request.data() + sizeof(header), query.data(), dims * sizeof(double));
+    sent[numSent++] = chrono::steady_clock::now();
+    return writeFully(fd, request.data(), request.size());
+  };
+
+  while (numReceived < numRequests) {
+    while (numSent < numRequests && numSent - numReceived < depth) {
+      if (!sendNext()) {
+        result.failed = true;
+        close(fd);
+        return;
+      }
+    }
+
+    QueryResponseHeader header;
+    if (!readFully(fd, &header, sizeof(header)) || header.id >= numSent) {
+      result.failed = true;
+      close(fd);
+      return;
+    }
+    neighbors.resize(header.count);
+    if (!readFully(fd, neighbors.data(), header.count * sizeof(QueryNeighbor))) {
+      result.failed = true;
+      close(fd);
+      return;
+    }
+
+    chrono::duration<double> latency = chrono::steady_clock::now() - sent[header.id];
+    result.latencies.push_back(latency.count());
+    result.errors += header.status != QUERY_OK;
+    numReceived++;
+  }
+
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  string socketPath = "";
+  string queryFilename = "";
+  int d = -1;
+  int k = -1;
+  size_t numConnections = 1;
+  size_t depth = 1;
+  size_t numRequests = 10000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hs:q:d:k:c:p:r:")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " -s <socket> -q <queries> -d <dimensions> -k <k> [options]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -s value       Unix socket of knn-server.out" << endl;
+        cout << "  -q value       File of query points, one per line" << endl;
+        cout << "  -d value       Number of features per query" << endl;
+        cout << "  -k value       Number of neighbors to ask for" << endl;
+        cout << "  -c value       Concurrent connections (default 1)" << endl;
+        cout << "  -p value       Requests in flight per connection (default 1)" << endl;
+        cout << "  -r value       Total requests, split over the connections (default 10000)" << endl;
+        return 0;
+      case 's':
+        socketPath = optarg;
+        break;
+      case 'q':
+        queryFilename = optarg;
+        break;
+      case 'd':
+      case 'k':
+      case 'c':
+      case 'p':
+      case 'r':
+        if (!isPositiveInteger(optarg) || string(optarg).empty() || stoll(optarg) == 0) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'd') d = stoi(optarg);
+        if (opt == 'k') k = stoi(optarg);
+        if (opt == 'c') numConnections = stoul(optarg);
+        if (opt == 'p') depth = stoul(optarg);
+        if (opt == 'r') numRequests = stoul(optarg);
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " -s <socket> -q <queries> -d <dimensions> -k <k>" << endl;
+        return 0;
+    }
+  }
+
+  if (socketPath == "" || queryFilename == "" || d == -1 || k == -1) {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+
+  vector<vector<double>> queries = readQueries(queryFilename, d);
+  if (queries.empty()) {
+    cout << "No queries with " << d << " features in " << queryFilename << endl;
+    return 0;
+  }
+
+  // Requests split as evenly as possible, each connection starts at its own query
+  numConnections = min(numConnections, numRequests);
+  vector<ClientResult> results(numConnections);
+  vector<thread> connections;
+  Timer runTimer;
+  for (size_t c = 0; c < numConnections; c++) {
+    size_t requests = numRequests / numConnections + (c < numRequests % numConnections ? 1 : 0);
+    size_t firstQuery = c * queries.size() / numConnections;
+    connections.emplace_back(runConnection, socketPath, cref(queries), firstQuery, requests, (uint32_t)k,
+                             depth, ref(results[c]));
+  }
+  for (thread& connection : connections) {
+    connection.join();
+  }
+  double runTime = runTimer.elapsed();
+
+  vector<double> latencies;
+  size_t errors = 0;
+  size_t failedConnections = 0;
+  for (const ClientResult& result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    errors += result.errors;
+    failedConnections += result.failed;
+  }
+  sort(latencies.begin(), latencies.end());
+
+  printf("Connections: %zu, in flight per connection: %zu\n", numConnections, depth);
+  printf("Answered %zu of %zu requests in %.3fs (%.1f queries/s)", latencies.size(), numRequests, runTime,
+         latencies.size() / runTime);
+  if (errors > 0 || failedConnections > 0) {
+    printf(", %zu rejected, %zu connections failed", errors, failedConnections);
+  }
+  printf("\nLatency (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", latencyPercentile(latencies, 0.5) * 1e3,
+         latencyPercentile(latencies, 0.9) * 1e3, latencyPercentile(latencies, 0.99) * 1e3,
+         latencyPercentile(latencies, 1.0) * 1e3);
+  return 0;
+}
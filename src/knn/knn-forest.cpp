@@ -0,0 +1,185 @@
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <queue>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <stack>
+#include <omp.h>
+#include "knn.h"
+#include "kdForest.h"
+#include "../kdTree/kdTree.h"
+#include "../utils.h"
+#include "../timing.h"
+
+using namespace std;
+
+// Gaussian clusters with a per-cluster spread, loosely like embedding data
+PointSet generateClusteredData(size_t numPoints, size_t d, int numClusters, mt19937& rng) {
+  uniform_real_distribution<double> centerDistribution(-10.0, 10.0);
+  uniform_real_distribution<double> spreadDistribution(0.5, 2.0);
+  uniform_int_distribution<int> clusterDistribution(0, numClusters - 1);
+  normal_distribution<double> gaussian(0.0, 1.0);
+
+  vector<vector<double>> centers(numClusters, vector<double>(d));
+  vector<double> spreads(numClusters);
+  for (int c = 0; c < numClusters; c++) {
+    for (size_t a = 0; a < d; a++) {
+      centers[c][a] = centerDistribution(rng);
+    }
+    spreads[c] = spreadDistribution(rng);
+  }
+
+  PointSet data(d);
+  data.resize(numPoints);
+  for (size_t i = 0; i < numPoints; i++) {
+    int cluster = clusterDistribution(rng);
+    double* features = data.features(i);
+    for (size_t a = 0; a < d; a++) {
+      features[a] = centers[cluster][a] + spreads[cluster] * gaussian(rng);
+    }
+    data.label(i) = cluster;
+  }
+  return data;
+}
+
+// Exact k nearest distances by scanning every point
+vector<double> bruteForceDistances(const PointSet& data, const vector<double>& target, size_t k) {
+  vector<double> distances(data.size());
+  for (size_t i = 0; i < data.size(); i++) {
+    distances[i] = sqrt(EuclideanMetric().reducedDistance(target.data(), data.features(i), target.size()));
+  }
+  k = min(k, distances.size());
+  partial_sort(distances.begin(), distances.begin() + k, distances.end());
+  distances.resize(k);
+  return distances;
+}
+
+// Fraction of returned neighbors within the exact k-th distance
+double recallOf(const vector<double>& found, const vector<double>& exact) {
+  if (exact.empty()) {
+    return 1.0;
+  }
+  size_t hits = 0;
+  for (double distance : found) {
+    hits += distance <= exact.back() * (1.0 + 1e-12);
+  }
+  return (double)hits / exact.size();
+}
+
+int main(int argc, char *argv[]) {
+  size_t numPoints = 100000;
+  size_t numQueries = 200;
+  int k = 10;
+  int numTrees = 4;
+  size_t maxChecks = 2000;
+  bool rotate = false;
+  vector<size_t> dims = {8, 16, 32, 64, 128};
+  int opt;
+
+  // Parse command-line arguments
+  while ((opt = getopt(argc, argv, "hn:q:k:t:b:d:r")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " [-n value] [-q value] [-k value] [-t value] [-b value] [-d value] [-r]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -n value       Number of generated data points (default 100000)" << endl;
+        cout << "  -q value       Number of queries (default 200)" << endl;
+        cout << "  -k value       Number of neighbors to consider (default 10)" << endl;
+        cout << "  -t value       Number of trees in the forest (default 4)" << endl;
+        cout << "  -b value       Distance computations per forest query, 0 = exact (default 2000)" << endl;
+        cout << "  -d value       Run a single dimension instead of 8,16,32,64,128" << endl;
+        cout << "  -r             Split on randomly rotated axes instead of high-variance axes" << endl;
+        return 0;
+      case 'n':
+      case 'q':
+      case 'k':
+      case 't':
+      case 'b':
+      case 'd':
+        if (!isPositiveInteger(optarg)) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'n') numPoints = stoul(optarg);
+        if (opt == 'q') numQueries = stoul(optarg);
+        if (opt == 'k') k = stoi(optarg);
+        if (opt == 't') numTrees = stoi(optarg);
+        if (opt == 'b') maxChecks = stoul(optarg);
+        if (opt == 'd') dims = {stoul(optarg)};
+        break;
+      case 'r':
+        rotate = true;
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " [-n value] [-q value] [-k value] [-t value] [-b value] [-d value] [-r]" << endl;
+        return 0;
+    }
+  }
+
+  printf("%zu points, %zu queries, k = %d, %d trees (%s), budget %zu\n", numPoints, numQueries, k,
+         numTrees, rotate ? "rotated" : "high-variance axes", maxChecks);
+  printf("%6s %14s %14s %14s %14s %10s %10s\n", "dims", "brute (s/q)", "kdtree (s/q)",
+         "forest (s/q)", "forest build", "tree rec.", "forest rec.");
+
+  for (size_t d : dims) {
+    mt19937 rng(42 + d);
+    PointSet data = generateClusteredData(numPoints + numQueries, d, 32, rng);
+
+    // Queries come from the same distribution but are not in the index
+    vector<vector<double>> queries;
+    for (size_t q = 0; q < numQueries; q++) {
+      queries.push_back(data[numPoints + q].toVector());
+    }
+    data.resize(numPoints);
+
+    vector<vector<double>> exact(numQueries);
+    Timer bruteTimer;
+    for (size_t q = 0; q < numQueries; q++) {
+      exact[q] = bruteForceDistances(data, queries[q], k);
+    }
+    double bruteTime = bruteTimer.elapsed() / numQueries;
+
+    // Single kd-tree, exact search
+    KDTree kdTree;
+    kdTree.buildKDTree(data, 0, d);
+
+    double treeRecall = 0.0;
+    Timer treeTimer;
+    for (size_t q = 0; q < numQueries; q++) {
+      vector<DistanceNode> neighbors;
+      kNNSearchIterative(kdTree.root.get(), queries[q], k, neighbors);
+      vector<double> found;
+      for (const DistanceNode& neighbor : neighbors) {
+        found.push_back(neighbor.distance);
+      }
+      treeRecall += recallOf(found, exact[q]);
+    }
+    double treeTime = treeTimer.elapsed() / numQueries;
+
+    // Randomized forest with a shared budget
+    Timer buildTimer;
+    KDForest forest(numTrees, 16, rotate ? SPLIT_ROTATION : SPLIT_HIGH_VARIANCE);
+    forest.build(data, d);
+    double buildTime = buildTimer.elapsed();
+
+    double forestRecall = 0.0;
+    Timer forestTimer;
+    for (size_t q = 0; q < numQueries; q++) {
+      vector<DistanceNode2> neighbors;
+      forest.kNNSearch(queries[q], k, maxChecks, neighbors);
+      vector<double> found;
+      for (const DistanceNode2& neighbor : neighbors) {
+        found.push_back(neighbor.distance);
+      }
+      forestRecall += recallOf(found, exact[q]);
+    }
+    double forestTime = forestTimer.elapsed() / numQueries;
+
+    printf("%6zu %14.6f %14.6f %14.6f %14.6f %10.4f %10.4f\n", d, bruteTime, treeTime, forestTime,
+           buildTime, treeRecall / numQueries, forestRecall / numQueries);
+  }
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+#include "knn.h"
+#include "allKnn.h"
+#include "../kdTree/kdTree.h"
+#include "../utils.h"
+#include "../timing.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  int k = -1, d = -1;
+  int leafSize = 32;
+  string filename = "";
+  string outputFilename = "";
+  bool compare = false;
+  int opt;
+
+  // Parse command-line arguments
+  while ((opt = getopt(argc, argv, "hk:i:d:o:l:c")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " -k <k_value> -i <i_value> -d <d_value> [-o value] [-l value] [-c]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -k value       Number of neighbors of every point" << endl;
+        cout << "  -i value       Input dataset" << endl;
+        cout << "  -d value       Number of feature to consider in dataset" << endl;
+        cout << "  -o value       Write the kNN graph to this file (CSR layout, see allKnn.h)" << endl;
+        cout << "  -l value       Points per leaf of the dual tree (default 32)" << endl;
+        cout << "  -c             Also run one kd-tree search per point, compare time and results" << endl;
+        return 0;
+      case 'k':
+      case 'd':
+      case 'l':
+        if (!isPositiveInteger(optarg)) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'k') k = stoi(optarg);
+        if (opt == 'd') d = stoi(optarg);
+        if (opt == 'l') leafSize = stoi(optarg);
+        break;
+      case 'i':
+        filename = optarg;
+        break;
+      case 'o':
+        outputFilename = optarg;
+        break;
+      case 'c':
+        compare = true;
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " -k <k_value> -i <i_value> -d <d_value> [-o value] [-l value] [-c]" << endl;
+        return 0;
+    }
+  }
+
+  if (k == -1 || d == -1 || filename == "") {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+
+  KDTree kdTree;
+  PointSet data = kdTree.parseInput(filename, kdTree.dimensions);
+  if (data.empty()) {
+    return 0;
+  }
+  if ((size_t)d > data.dimensions()) {
+    cout << "d = " << d << " is larger than the " << data.dimensions() << " features in the dataset" << endl;
+    return 0;
+  }
+
+  Timer buildTimer;
+  AllKNN allKnn(k, leafSize);
+  allKnn.build(data, d);
+  double buildTime = buildTimer.elapsed();
+
+  Timer graphTimer;
+  allKnn.run();
+  double graphTime = graphTimer.elapsed();
+
+  printf("Points: %zu, k: %d, threads: %d\n", data.size(), k, omp_get_max_threads());
+  printf("Dual-tree build time: %.6fs\n", buildTime);
+  printf("All-kNN time: %.6fs\n", graphTime);
+
+  if (outputFilename != "") {
+    if (!allKnn.writeCSR(outputFilename)) {
+      return 0;
+    }
+    printf("kNN graph written to %s\n", outputFilename.c_str());
+  }
+
+  if (compare) {
+    // One independent search per point on the regular kd-tree, asking for one
+    // extra neighbor because every point finds itself at distance 0
+    kdTree.buildKDTree(data.project(d), 0, d);
+
+    size_t mismatches = 0;
+    Timer searchTimer;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:mismatches)
+    for (size_t p = 0; p < data.size(); p++) {
+      vector<double> target(data.features(p), data.features(p) + d);
+      vector<DistanceNode> neighbors;
+      kNNSearchIterative(kdTree.root.get(), target, k + 1, neighbors);
+
+      vector<double> expected;
+      for (const DistanceNode& neighbor : neighbors) {
+        expected.push_back(neighbor.distance);
+      }
+      sort(expected.begin(), expected.end());
+      if (!expected.empty()) {
+        expected.erase(expected.begin());
+      }
+
+      for (size_t i = 0; i < expected.size(); i++) {
+        if (fabs(allKnn.distanceOf(p, i) - expected[i]) > 1e-9 * max(1.0, expected[i])) {
+          mismatches++;
+          break;
+        }
+      }
+    }
+    double searchTime = searchTimer.elapsed();
+
+    printf("Per-point kd-tree search time: %.6fs\n", searchTime);
+    printf("Speedup: %.6f\n", searchTime / graphTime);
+    printf("Points with different neighbor distances: %zu\n", mismatches);
+  }
+
+  return 0;
+}
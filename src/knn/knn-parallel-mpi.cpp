@@ -6,168 +6,546 @@
 #include <cmath>
 #include <algorithm>
 #include <stack>
+#include <deque>
+#include <cstring>
 #include <omp.h>
 #include "mpi.h"
 #include "knn.h"
+#include "mpiSearch.h"
 #include "../kdTree/kdTree.h"
 #include "../utils.h"
 #include "../timing.h"
 
 using namespace std;
 
-void insertAndSortNeighbors2(vector<DistanceNode2>& nearestNeighbors, DistanceNode2& neighbor, size_t k) {
-  // Use lower_bound to find the position to insert the new element
-  auto it = std::lower_bound(nearestNeighbors.begin(),
-                            nearestNeighbors.end(),
-                            neighbor,
-                            [](const DistanceNode2& a, const DistanceNode2& b) {
-    return a.distance < b.distance;
-  });
+// Number of bytes (or whole records) read per collective call during ingest
+#define INGEST_CHUNK_BYTES (64 << 20)
 
-  nearestNeighbors.insert(it, neighbor);
+// Number of collective reads every rank must take part in to cover `length` bytes
+int collectiveReadCount(long long length, long long chunk) {
+  int localCount = (int)((length + chunk - 1) / chunk);
+  int count = 0;
+  MPI_Allreduce(&localCount, &count, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  return count;
+}
 
-  // Remove the last element if there are more than k neighbors
-  if (nearestNeighbors.size() > k) {
-    nearestNeighbors.pop_back();
+// Read this rank's share of a binary dataset (see dataset.h)
+PointSet parseBinarySliceMPI(MPI_File file, const BinaryHeader& header, int rank, int size) {
+  size_t dimensions = header.dimensions;
+  size_t recordSize = binaryRecordSize(dimensions);
+
+  long long begin, end;
+  sliceRange(rank, size, (long long)header.numPoints, begin, end);
+  PointSet localData(dimensions);
+  localData.resize(end - begin);
+
+  long long recordsPerRead = max<long long>(1, INGEST_CHUNK_BYTES / recordSize);
+  int numReads = collectiveReadCount(end - begin, recordsPerRead);
+  vector<char> buffer(min<long long>(recordsPerRead, max<long long>(end - begin, 1)) * recordSize);
+
+  long long next = begin;
+  for (int i = 0; i < numReads; i++) {
+    long long count = min(recordsPerRead, end - next);
+    MPI_Offset offset = sizeof(BinaryHeader) + (MPI_Offset)next * recordSize;
+    MPI_File_read_at_all(file, offset, buffer.data(), (int)(count * recordSize),
+                         MPI_BYTE, MPI_STATUS_IGNORE);
+
+    // Decode records straight into the local partition
+    for (long long r = 0; r < count; r++) {
+      decodeBinaryRecord(buffer.data() + r * recordSize, dimensions,
+                         localData.features(next - begin + r), localData.label(next - begin + r));
+    }
+    next += count;
   }
+
+  return localData;
 }
 
-// Function to distribute data among MPI processes
-std::vector<DataPoint> distributeData(int rank, int size, const std::vector<DataPoint>& allData) {
-  int dataSize = allData.size();
-  int localSize = dataSize / size;
+// Read this rank's share of a CSV dataset.
+// The file is split into equal byte ranges and a line belongs to the rank
+// whose range holds its first character, so every line is parsed exactly once.
+PointSet parseCSVSliceMPI(MPI_File file, int rank, int size) {
+  PointSet localData;
+
+  MPI_Offset fileSize;
+  MPI_File_get_size(file, &fileSize);
+
+  long long begin, end;
+  sliceRange(rank, size, (long long)fileSize, begin, end);
+
+  // Start one byte early: if that byte is a newline our first line starts at
+  // `begin`, otherwise the partial line belongs to the previous rank
+  long long position = begin > 0 ? begin - 1 : 0;
+  bool skipping = begin > 0;
+  bool done = false;
+
+  string pending;               // Bytes of a line split across two reads
+  long long lineStart = position;
+  vector<double> features;
+  int label;
+
+  // The first line fixes the number of features, as in readCSVDataset
+  auto emit = [&](const char* lineBegin, const char* lineEnd) {
+    if (parseCSVRecord(lineBegin, lineEnd, features, label)) {
+      if (localData.empty() && localData.dimensions() == 0) {
+        localData = PointSet(features.size());
+      }
+      if (features.size() == localData.dimensions()) {
+        localData.push_back(features.data(), label);
+      }
+    }
+  };
+
+  // Consume a block of bytes starting at absolute offset `blockOffset`
+  auto consume = [&](const char* data, size_t length, long long blockOffset) {
+    const char* cursor = data;
+    const char* stop = data + length;
+
+    while (cursor < stop && !done) {
+      const char* newline = (const char*)memchr(cursor, '\n', stop - cursor);
+      const char* lineEnd = newline == nullptr ? stop : newline;
+
+      if (!skipping) {
+        if (pending.empty()) {
+          lineStart = blockOffset + (cursor - data);
+        }
+        if (lineStart >= end) {
+          done = true;
+          break;
+        }
+        if (newline != nullptr && pending.empty()) {
+          emit(cursor, lineEnd);
+        } else {
+          pending.append(cursor, lineEnd);
+          if (newline != nullptr) {
+            emit(pending.data(), pending.data() + pending.size());
+            pending.clear();
+          }
+        }
+      }
 
-  // Calculate the starting index and local size for each process
-  int startIndex = rank * localSize;
-  int endIndex = startIndex + localSize;
-  if (rank == size - 1) {
-    endIndex = dataSize;
+      if (newline == nullptr) {
+        break;
+      }
+      skipping = false;
+      cursor = newline + 1;
+    }
+  };
+
+  // Collective pass over our own byte range
+  vector<char> buffer(INGEST_CHUNK_BYTES);
+  int numReads = collectiveReadCount(end - position, INGEST_CHUNK_BYTES);
+  for (int i = 0; i < numReads; i++) {
+    long long count = min<long long>(INGEST_CHUNK_BYTES, end - position);
+    MPI_File_read_at_all(file, position, buffer.data(), (int)max<long long>(count, 0),
+                         MPI_BYTE, MPI_STATUS_IGNORE);
+    if (count > 0) {
+      consume(buffer.data(), count, position);
+      position += count;
+    }
   }
 
-  // Allocate memory for the local data
-  std::vector<DataPoint> localData(allData.begin() + startIndex, allData.begin() + endIndex);
-  
+  // Finish the last line, which may run into the next rank's range
+  const long long tailChunk = 4096;
+  while (!done && !skipping && !pending.empty() && position < fileSize) {
+    long long count = min<long long>(tailChunk, fileSize - position);
+    MPI_File_read_at(file, position, buffer.data(), (int)count, MPI_BYTE, MPI_STATUS_IGNORE);
+    consume(buffer.data(), count, position);
+    position += count;
+  }
+
+  // Last line of the file without a trailing newline
+  if (!done && !skipping && !pending.empty() && lineStart < end) {
+    emit(pending.data(), pending.data() + pending.size());
+  }
+
+  localData.shrinkToFit();
   return localData;
 }
 
-void kNNSearchMPI(const KDNode* root, const vector<double>& target, size_t k,
-                                 vector<DistanceNode2>& neighbors) {
-  if (root == nullptr) {
-    return;
+// Function for each process to read only its own slice of the dataset
+PointSet parseInputMPI(const string& filename, int rank, int size) {
+  MPI_File file;
+  if (MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_RDONLY,
+                    MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+    if (rank == 0) {
+      cout << "Unable to open file " << filename << endl;
+    }
+    return PointSet();
   }
 
-  size_t targetSize = target.size();
+  MPI_Offset fileSize;
+  MPI_File_get_size(file, &fileSize);
 
-  stack<pair<const KDNode*, int>> nodeStack;
-  nodeStack.push({root, 0});
+  // Every rank reads the header so they agree on the format
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  int headerBytes = fileSize >= (MPI_Offset)sizeof(header) ? sizeof(header) : 0;
+  MPI_File_read_at_all(file, 0, &header, headerBytes, MPI_BYTE, MPI_STATUS_IGNORE);
 
-  while (!nodeStack.empty()) {
-    const KDNode* currentNode = nodeStack.top().first;
-    int depth = nodeStack.top().second;
-    nodeStack.pop();
+  PointSet localData;
+  if (headerBytes > 0 && memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0) {
+    localData = parseBinarySliceMPI(file, header, rank, size);
+  } else {
+    localData = parseCSVSliceMPI(file, rank, size);
+  }
 
-    if (currentNode == nullptr) {
-      continue;
+  MPI_File_close(&file);
+  return localData;
+}
+
+// Message tags of the dynamic (master-worker) batch search
+#define TAG_REQUEST 1
+#define TAG_WORK 2
+#define TAG_RESULT 3
+
+// A chunk may be handed to at most this many workers at once (re-issued stragglers)
+#define MAX_CHUNK_COPIES 2
+
+// Per-rank accounting of the dynamic batch search
+struct RankTimes {
+  double busy;
+  double idle;
+  int chunks;
+};
+
+// Size of a result message header, padded so the neighbors stay 8-byte aligned
+size_t chunkHeaderBytes(size_t numQueries) {
+  return ((1 + numQueries) * sizeof(int) + 7) & ~(size_t)7;
+}
+
+// Pack the results of one chunk: chunk id, neighbor count of each query, then the neighbors
+vector<char> packChunkResults(int chunkId, const vector<vector<DistanceNode2>>& results) {
+  size_t numNeighbors = 0;
+  for (const auto& neighbors : results) {
+    numNeighbors += neighbors.size();
+  }
+
+  size_t headerBytes = chunkHeaderBytes(results.size());
+  vector<char> buffer(headerBytes + numNeighbors * sizeof(DistanceNode2));
+  int* header = reinterpret_cast<int*>(buffer.data());
+  header[0] = chunkId;
+
+  char* cursor = buffer.data() + headerBytes;
+  for (size_t q = 0; q < results.size(); q++) {
+    header[1 + q] = results[q].size();
+    memcpy(cursor, results[q].data(), results[q].size() * sizeof(DistanceNode2));
+    cursor += results[q].size() * sizeof(DistanceNode2);
+  }
+
+  return buffer;
+}
+
+// Worker side: keep asking the master for chunks of queries until told to stop.
+// The next request is sent before searching the current chunk and results go
+// out with non-blocking sends, so the next chunk is usually waiting when we finish.
+RankTimes dynamicBatchWorker(const KDTree& tree, const vector<vector<double>>& queries,
+                             size_t k, int chunkSize, const MetricSpec& metric) {
+  RankTimes times = {0.0, 0.0, 0};
+  int request = 0;
+  MPI_Request requestHandle = MPI_REQUEST_NULL;
+  MPI_Request resultHandle = MPI_REQUEST_NULL;
+  vector<char> resultBuffer;
+
+  MPI_Isend(&request, 1, MPI_INT, 0, TAG_REQUEST, MPI_COMM_WORLD, &requestHandle);
+
+  while (true) {
+    Timer idleTimer;
+    ScopedPhase waitPhase("mpi wait");
+    int chunkId;
+    MPI_Recv(&chunkId, 1, MPI_INT, 0, TAG_WORK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    waitPhase.end();
+    times.idle += idleTimer.elapsed();
+
+    if (chunkId < 0) {
+      break;
     }
 
-    int axis = depth % targetSize;
+    // Ask for the next chunk right away
+    MPI_Wait(&requestHandle, MPI_STATUS_IGNORE);
+    MPI_Isend(&request, 1, MPI_INT, 0, TAG_REQUEST, MPI_COMM_WORLD, &requestHandle);
+
+    Timer busyTimer;
+    size_t begin = (size_t)chunkId * chunkSize;
+    size_t end = min(queries.size(), begin + chunkSize);
+    vector<vector<double>> chunk(queries.begin() + begin, queries.begin() + end);
+    ScopedPhase searchPhase("search");
+    vector<vector<DistanceNode2>> results = localBatchSearch(tree, chunk, k, metric);
+    searchPhase.end();
+    times.busy += busyTimer.elapsed();
+    times.chunks++;
+
+    // The previous result must be out before its buffer is reused
+    ScopedPhase sendPhase("mpi send");
+    MPI_Wait(&resultHandle, MPI_STATUS_IGNORE);
+    resultBuffer = packChunkResults(chunkId, results);
+    MPI_Isend(resultBuffer.data(), resultBuffer.size(), MPI_BYTE, 0, TAG_RESULT,
+              MPI_COMM_WORLD, &resultHandle);
+  }
 
-    double distance;
-    try {
-      distance = calculateDistance(target, currentNode->features);
-    } catch (const invalid_argument& error) {
-      cerr << "Exception caught: " << error.what() << endl;
+  MPI_Wait(&requestHandle, MPI_STATUS_IGNORE);
+  MPI_Wait(&resultHandle, MPI_STATUS_IGNORE);
+  return times;
+}
+
+// Master side: hand out chunks on request, re-issue chunks still running on
+// slow workers once the queue is empty and keep the first result of each chunk
+vector<vector<DistanceNode2>> dynamicBatchMaster(size_t numQueries, int chunkSize, int size) {
+  int numChunks = (numQueries + chunkSize - 1) / chunkSize;
+  vector<vector<DistanceNode2>> results(numQueries);
+
+  vector<bool> chunkDone(numChunks, false);
+  vector<vector<int>> chunkHolders(numChunks);   // Workers currently searching each chunk
+  vector<int> issuedPerWorker(size, 0);
+  vector<int> receivedPerWorker(size, 0);
+  deque<int> waitingWorkers;
+  int nextChunk = 0;
+  int chunksDone = 0;
+
+  auto sendChunk = [&](int worker, int chunkId) {
+    MPI_Send(&chunkId, 1, MPI_INT, worker, TAG_WORK, MPI_COMM_WORLD);
+    if (chunkId >= 0) {
+      chunkHolders[chunkId].push_back(worker);
+      issuedPerWorker[worker]++;
+    }
+  };
+
+  // Pick work for an idle worker, or -2 if it has to wait
+  auto pickChunk = [&](int worker) {
+    if (chunksDone == numChunks) {
+      return -1;
+    }
+    if (nextChunk < numChunks) {
+      return nextChunk++;
+    }
+    // Queue is empty: duplicate the oldest unfinished chunk this worker does not hold
+    for (int c = 0; c < numChunks; c++) {
+      const vector<int>& holders = chunkHolders[c];
+      if (!chunkDone[c] && holders.size() < MAX_CHUNK_COPIES &&
+          find(holders.begin(), holders.end(), worker) == holders.end()) {
+        return c;
+      }
+    }
+    return -2;
+  };
+
+  int stoppedWorkers = 0;
+  auto serveWorker = [&](int worker) {
+    int chunkId = pickChunk(worker);
+    if (chunkId == -2) {
+      waitingWorkers.push_back(worker);
+      return;
+    }
+    sendChunk(worker, chunkId);
+    stoppedWorkers += chunkId == -1;
+  };
+
+  // Run until every worker is stopped and every result it owes has arrived
+  auto outstandingResults = [&]() {
+    for (int w = 1; w < size; w++) {
+      if (receivedPerWorker[w] != issuedPerWorker[w]) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  vector<char> buffer;
+  while (stoppedWorkers < size - 1 || outstandingResults()) {
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+    int worker = status.MPI_SOURCE;
+
+    if (status.MPI_TAG == TAG_REQUEST) {
+      int request;
+      MPI_Recv(&request, 1, MPI_INT, worker, TAG_REQUEST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      serveWorker(worker);
       continue;
     }
 
-    DistanceNode2 neighbor = {distance, currentNode->label};
-    insertAndSortNeighbors2(neighbors, neighbor, k);
+    int bytes;
+    MPI_Get_count(&status, MPI_BYTE, &bytes);
+    buffer.resize(bytes);
+    MPI_Recv(buffer.data(), bytes, MPI_BYTE, worker, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    receivedPerWorker[worker]++;
+
+    const int* header = reinterpret_cast<const int*>(buffer.data());
+    int chunkId = header[0];
+    vector<int>& holders = chunkHolders[chunkId];
+    holders.erase(find(holders.begin(), holders.end(), worker));
+
+    // Later copies of a re-issued chunk are dropped
+    if (!chunkDone[chunkId]) {
+      chunkDone[chunkId] = true;
+      chunksDone++;
+
+      size_t begin = (size_t)chunkId * chunkSize;
+      size_t end = min(numQueries, begin + chunkSize);
+      const DistanceNode2* neighbors = reinterpret_cast<const DistanceNode2*>(
+          buffer.data() + chunkHeaderBytes(end - begin));
+      for (size_t q = begin; q < end; q++) {
+        int count = header[1 + q - begin];
+        results[q].assign(neighbors, neighbors + count);
+        neighbors += count;
+      }
+    }
 
-    if (target[axis] < currentNode->features[axis]) {
-      nodeStack.push({currentNode->right.get(), depth + 1});
-      nodeStack.push({currentNode->left.get(), depth + 1});
-    } else {
-      nodeStack.push({currentNode->left.get(), depth + 1});
-      nodeStack.push({currentNode->right.get(), depth + 1});
+    // A finished chunk may unblock waiting workers (new duplicate or stop)
+    size_t numWaiting = waitingWorkers.size();
+    for (size_t i = 0; i < numWaiting; i++) {
+      int waiting = waitingWorkers.front();
+      waitingWorkers.pop_front();
+      serveWorker(waiting);
     }
   }
+
+  return results;
 }
 
-// Find k nearest neighbors of target point (parallel implementation)
-void KNN::kNNSearchParallelMPI(const vector<DataPoint>& data, const vector<double>& target, int k, int rank, int size) {
-  // Distribute data among processes
-  vector<DataPoint> localData = distributeData(rank, size, data);
+// Search a batch of queries with dynamic load balancing.
+// Rank 0 only schedules, every other rank holds the full tree.
+vector<vector<DistanceNode2>> dynamicBatchSearch(const KDTree& tree, const vector<vector<double>>& queries,
+                                                 size_t k, int chunkSize, const MetricSpec& metric,
+                                                 int rank, int size, RankTimes& times) {
+  times = {0.0, 0.0, 0};
+  if (rank == 0) {
+    Timer masterTimer;
+    ScopedPhase phase("schedule");
+    vector<vector<DistanceNode2>> results = dynamicBatchMaster(queries.size(), chunkSize, size);
+    times.busy = masterTimer.elapsed();
+    return results;
+  }
+
+  times = dynamicBatchWorker(tree, queries, k, chunkSize, metric);
+  return vector<vector<DistanceNode2>>();
+}
+
+// Print how busy and idle every rank was during the search
+void reportRankTimes(const RankTimes& times, int rank, int size) {
+  vector<RankTimes> allTimes(rank == 0 ? size : 0);
+  MPI_Gather(&times, sizeof(RankTimes), MPI_BYTE, allTimes.data(), sizeof(RankTimes),
+             MPI_BYTE, 0, MPI_COMM_WORLD);
+
+  if (rank == 0) {
+    printf("\nPer-process search time:");
+    for (int r = 0; r < size; r++) {
+      printf("\n  Rank %d: busy %.6fs, idle %.6fs, chunks %d",
+             r, allTimes[r].busy, allTimes[r].idle, allTimes[r].chunks);
+    }
+    printf("\n");
+  }
+}
 
+// Find k nearest neighbors of target point (parallel implementation)
+// Each process only holds its own slice of the data (see parseInputMPI)
+void KNN::kNNSearchParallelMPI(PointSet& localData, const vector<double>& target, int k, int d, int rank, int size,
+                               const MetricSpec& metric) {
   // Build local KDTree
   KDTree localKDTree;
-  localKDTree.buildKDTree(localData, 0, data[0].features.size());
-  
-  vector<DistanceNode2> nearestNeighborsVector;
-  kNNSearchMPI(localKDTree.root.get(), target, static_cast<size_t>(k), nearestNeighborsVector);
-
-  MPI_Datatype MPI_DISTANCENODE;
-  MPI_Type_contiguous(sizeof(DistanceNode2), MPI_BYTE, &MPI_DISTANCENODE);
-  MPI_Type_commit(&MPI_DISTANCENODE);
-
-  int sizes[size] = {0};
-  int sizeToSend = nearestNeighborsVector.size();
-  MPI_Gather(&sizeToSend, 1, MPI_INT, &sizes, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-  // Compute displacements for all the particles (prefix sum)
-  int displacements[size];
-  int allNeighborsSum = 0;
-  for (int i = 0; i < size; i++) {
-    displacements[i] = allNeighborsSum;
-    allNeighborsSum += sizes[i];
-  }
-
-  // Gather nearest neighbors from all processes
-  vector<DistanceNode2> allNearestNeighbors(allNeighborsSum);
-  MPI_Gatherv(nearestNeighborsVector.data(), sizeToSend, MPI_DISTANCENODE,
-             allNearestNeighbors.data(), sizes, displacements,
-             MPI_DISTANCENODE, 0, MPI_COMM_WORLD);
-
-  // On process rank 0, combine the results
-  if (rank == 0) {
-    std::sort(allNearestNeighbors.begin(), allNearestNeighbors.end(),
-          [](const DistanceNode2& a, const DistanceNode2& b) {
-              return a.distance > b.distance;
-          });
+  localKDTree.buildKDTree(localData, 0, d);
 
-    vector<DataPoint> nearestNeighborsLocal;
-    while (!allNearestNeighbors.empty()) {
-      DistanceNode2 distanceNode = allNearestNeighbors.back();
-      vector<double> emptyVector;
-      DataPoint datapoint = {emptyVector, distanceNode.label};
-      nearestNeighbors.push_back(datapoint);
-      if (nearestNeighbors.size() >= static_cast<size_t>(k)) break;
-      allNearestNeighbors.pop_back();
+  vector<vector<double>> queries = {target};
+  vector<vector<DistanceNode2>> results =
+      gatherBatchResults(localBatchSearch(localKDTree, queries, static_cast<size_t>(k), metric),
+                         static_cast<size_t>(k), rank, size);
+
+  // Only labels travel back to rank 0, the neighbors have no features
+  if (rank == 0) {
+    nearestNeighbors = PointSet(0);
+    for (const DistanceNode2& distanceNode : results[0]) {
+      nearestNeighbors.push_back(nullptr, distanceNode.label);
     }
   }
 }
 
 int main(int argc, char *argv[]) {
-  int k, d = -1;
+  int k = -1, d = -1;
   string filename = "";
+  string queryFilename = "";
   int opt;
   vector<double> target;
-
-  MPI_Init(&argc, &argv);
+  bool runSequential = false;
+  int numThreads = 1;
+  int chunkSize = 0;
+  MetricSpec metric;
+  CurveType curve = CURVE_NONE;
+  TreeLayout layout = LAYOUT_INPUT;
+
+  // Only the main thread of each process makes MPI calls
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   int rank, nproc;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+  if (provided < MPI_THREAD_FUNNELED) {
+    if (rank == 0) {
+      cout << "The MPI library does not support OpenMP threads next to MPI calls (MPI_THREAD_FUNNELED)" << endl;
+    }
+    MPI_Finalize();
+    return 0;
+  }
+
+  // One profile per rank
+  if (nproc > 1 && phaseProfilePath() != "" && phaseProfilePath() != "-") {
+    setPhaseProfilePath(phaseProfilePath() + "." + to_string(rank));
+  }
+
+#ifdef KNN_STATS
+  // One stats file per rank
+  if (nproc > 1 && searchStatsPath() != "") {
+    setSearchStatsPath(searchStatsPath() + "." + to_string(rank));
+  }
+#endif
 
   // Parse command-line arguments
-  while ((opt = getopt(argc, argv, "hk:i:d:t:")) != -1) {
+  while ((opt = getopt(argc, argv, "hk:i:d:t:q:n:w:m:sz:l:")) != -1) {
     switch (opt) {
       case 'h':
         cout << "Usage: " << argv[0] << " [-k value] [-i value]" << endl;
         cout << "Options:" << endl;
         cout << "  -k value       Number of neighbors to consider" << endl;
-        cout << "  -i value       Input dataset" << endl;
+        cout << "  -i value       Input dataset (CSV or binary)" << endl;
         cout << "  -d value       Number of feature to consider in dataset" << endl;
         cout << "  -t value       Target point" << endl;
+        cout << "  -q value       File of target points, one per line (batch mode)" << endl;
+        cout << "  -n value       OpenMP threads per process (default 1)" << endl;
+        cout << "  -w value       Hand out batch queries dynamically in chunks of this size" << endl;
+        cout << "                 (rank 0 schedules, other ranks hold the whole dataset)" << endl;
+        cout << "  -m value       Distance metric: euclidean, manhattan, chebyshev, minkowski:<p>," << endl;
+        cout << "                 weighted:<w1,...,wd> or cosine (default euclidean)" << endl;
+        cout << "  -z value       Sort points and batch queries along a curve first: none, morton or hilbert" << endl;
+        cout << "  -l value       Memory layout of the local trees: input, dfs or veb (default input)" << endl;
+        cout << "  -s             Also run the sequential search on rank 0" << endl;
         return 0;
+      case 'm':
+        if (!parseMetric(optarg, metric)) {
+            cout << "Invalid value for m, m = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'w':
+        if (isPositiveInteger(optarg) && stoi(optarg) > 0) {
+            chunkSize = stoi(optarg);
+        } else {
+            cout << "Invalid value for w, w = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 's':
+        runSequential = true;
+        break;
+      case 'z':
+        if (!parseCurveType(optarg, curve)) {
+            cout << "Invalid value for z, z = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'l':
+        if (!parseTreeLayout(optarg, layout)) {
+            cout << "Invalid value for l, l = " << optarg << endl;
+            return 0;
+        }
+        break;
       case 'k':
         if (isPositiveInteger(optarg)) {
             k = stoi(optarg);
@@ -190,50 +568,223 @@ int main(int argc, char *argv[]) {
       case 't':
         target = parseInputVector(optarg);
         break;
+      case 'q':
+        queryFilename = optarg;
+        break;
+      case 'n':
+        if (isPositiveInteger(optarg) && stoi(optarg) > 0) {
+            numThreads = stoi(optarg);
+        } else {
+            cout << "Invalid value for n, n = " << optarg << endl;
+            return 0;
+        }
+        break;
       default:
         cout << "Usage: " << argv[0] << " -k <k_value> -i <i_value> -d <d_value>" << endl;
         return 0;
     }
   }
 
-  if (k == -1 || d == -1 || filename == "" || target.size() == 0) {
+  if (k == -1 || d == -1 || filename == "" || (target.size() == 0 && queryFilename == "")) {
     cout << "Not enough arguments provided." << endl;
     return 0;
   }
 
-  KDTree kdTree;
-  vector<DataPoint> data = kdTree.parseInput(filename, kdTree.dimensions);
+  if (!checkMetric(metric, d)) {
+    return 0;
+  }
+
+  omp_set_num_threads(numThreads);
+
+  // Dynamic scheduling needs every worker to answer any query on its own
+  bool dynamicMode = chunkSize > 0 && nproc > 1;
 
-  // Run sequential knn search
-  Timer sequentialTimer;
-  KNN seqKnn;
-  kdTree.buildKDTree(data, 0, d);
-  seqKnn.kNNSearch(kdTree, target, k);
-  double sequentialTime = sequentialTimer.elapsed();
+  // Each process reads and parses only its own slice of the input,
+  // or the whole file when queries are scheduled dynamically
+  Timer ingestTimer;
+  ScopedPhase parsePhase("parse");
+  PointSet localData = dynamicMode ? parseInputMPI(filename, 0, 1)
+                                   : parseInputMPI(filename, rank, nproc);
+  if (dynamicMode && rank == 0) {
+    localData.release();
+  }
+  parsePhase.end();
+  double localIngestTime = ingestTimer.elapsed();
+
+  ScopedPhase reducePhase("mpi reduce");
+  double ingestTime;
+  MPI_Reduce(&localIngestTime, &ingestTime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  long long localPoints = localData.size();
+  long long localBytes = localData.memoryBytes();
+  long long totalPoints, maxLocalPoints, maxLocalBytes;
+  MPI_Reduce(&localPoints, &totalPoints, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(&localPoints, &maxLocalPoints, 1, MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(&localBytes, &maxLocalBytes, 1, MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  reducePhase.end();
+
+  // A single target is a batch of one
+  vector<vector<double>> queries;
+  if (queryFilename != "") {
+    size_t skipped;
+    queries = parseQueryFile(queryFilename, d, &skipped);
+    if (rank == 0 && skipped > 0) {
+      cout << "Skipped " << skipped << " query lines with fewer than " << d << " features" << endl;
+    }
+    // Every rank read the same file, so they all stop here
+    if (queries.empty()) {
+      if (rank == 0) {
+        cout << "No queries with " << d << " features in " << queryFilename << endl;
+      }
+      MPI_Finalize();
+      return 0;
+    }
+  } else {
+    queries.push_back(target);
+  }
+  normalizeForMetric(metric, localData, queries);
 
-  // Run parallel knn search
+  // Every rank sees the same queries, so they all agree on this order
+  vector<size_t> queryOrder = queryCurveOrder(queries, curve, d);
+  applyOrder(queries, queryOrder);
+
+  // Run parallel knn search: task-parallel local build, query-parallel local search
   Timer parallelTimer;
-  KNN parallelKnn;
-  parallelKnn.kNNSearchParallelMPI(data, target, k, rank, nproc);
+  KDTree localKDTree;
+  if (!localData.empty()) {
+    {
+      ScopedPhase phase("curve sort");
+      sortAlongCurve(localData, curve, d);
+    }
+    localKDTree.buildKDTree(move(localData), 0, d);
+    {
+      ScopedPhase phase("relayout");
+      localKDTree.relayout(layout);
+    }
+  }
+  double localBuildTime = parallelTimer.elapsed();
+
+  RankTimes times;
+  vector<vector<DistanceNode2>> results;
+  if (dynamicMode) {
+    ScopedPhase phase("dynamic search");
+    results = dynamicBatchSearch(localKDTree, queries, static_cast<size_t>(k), chunkSize,
+                                 metric, rank, nproc, times);
+  } else {
+    Timer busyTimer;
+    ScopedPhase searchPhase("search");
+    vector<vector<DistanceNode2>> localResults =
+        localBatchSearch(localKDTree, queries, static_cast<size_t>(k), metric);
+    searchPhase.end();
+    times.busy = busyTimer.elapsed();
+    times.chunks = 1;
+
+    Timer idleTimer;
+    ScopedPhase barrierPhase("mpi barrier");
+    MPI_Barrier(MPI_COMM_WORLD);
+    barrierPhase.end();
+    times.idle = idleTimer.elapsed();
+    results = gatherBatchResults(localResults, static_cast<size_t>(k), rank, nproc);
+  }
   double parallelTime = parallelTimer.elapsed();
 
+  double buildTime;
+  MPI_Reduce(&localBuildTime, &buildTime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  reportRankTimes(times, rank, nproc);
+
+  // Back to the order of the query file
+  restoreOrder(queries, queryOrder);
   if (rank == 0) {
-    printf("\nSequential KNN");
-    seqKnn.findTargetLabel();
+    restoreOrder(results, queryOrder);
+  }
+
+  vector<int> parallelLabels(queries.size());
+  if (rank == 0) {
+    for (size_t q = 0; q < queries.size(); q++) {
+      vector<int> labels;
+      for (const DistanceNode2& neighbor : results[q]) {
+        labels.push_back(neighbor.label);
+      }
+      parallelLabels[q] = majorityLabel(labels);
+    }
+  }
 
-    printf("\nParallel KNN");
-    parallelKnn.findTargetLabel();
+  // Run sequential knn search on rank 0 (needs the whole dataset in memory)
+  vector<int> sequentialLabels(queries.size());
+  double sequentialTime = 0.0;
+  if (runSequential && rank == 0) {
+    ScopedPhase phase("sequential");
+    KDTree kdTree;
+    PointSet data = kdTree.parseInput(filename, kdTree.dimensions);
+    vector<vector<double>> noTargets;
+    normalizeForMetric(metric, data, noTargets);
+
+    Timer sequentialTimer;
+    kdTree.buildKDTree(move(data), 0, d);
+    for (size_t q = 0; q < queries.size(); q++) {
+      KNN seqKnn;
+      seqKnn.kNNSearch(kdTree, queries[q], k, metric);
+      vector<int> labels;
+      for (size_t n = 0; n < seqKnn.nearestNeighbors.size(); n++) {
+        labels.push_back(seqKnn.nearestNeighbors.label(n));
+      }
+      sequentialLabels[q] = majorityLabel(labels);
+    }
+    sequentialTime = sequentialTimer.elapsed();
+  }
 
-    printf("\nTotal simulation time for KNN sequential search: %.6fs", sequentialTime);
+  if (rank == 0) {
+    // Dynamic workers each hold the whole dataset, slices add up to it
+    printf("\nParsed %lld data points, at most %lld per process (%.1f MB)",
+           dynamicMode ? maxLocalPoints : totalPoints, maxLocalPoints, maxLocalBytes / 1e6);
+    printf("\nProcesses: %d, threads per process: %d%s", nproc, numThreads,
+           dynamicMode ? ", dynamic scheduling" : "");
+    printf("\nTotal ingest time: %.6fs\n", ingestTime);
+
+    if (queries.size() == 1) {
+      if (runSequential) {
+        printf("\nSequential KNN");
+        printf("\nPredicted label for the target point: %d\n", sequentialLabels[0]);
+      }
+      printf("\nParallel KNN");
+      printf("\nPredicted label for the target point: %d\n", parallelLabels[0]);
+    } else {
+      size_t mismatches = 0;
+      for (size_t q = 0; q < queries.size(); q++) {
+        mismatches += runSequential && sequentialLabels[q] != parallelLabels[q];
+      }
+      printf("\nAnswered %zu queries (%.1f queries/s)", queries.size(),
+             queries.size() / (parallelTime - buildTime));
+      if (runSequential) {
+        printf("\nLabels differing from the sequential search: %zu", mismatches);
+      }
+      printf("\n");
+    }
+
+    if (runSequential) {
+      printf("\nTotal simulation time for KNN sequential search: %.6fs", sequentialTime);
+    }
+    printf("\nParallel build time: %.6fs", buildTime);
     printf("\nTotal simulation time for KNN parallel search: %.6fs", parallelTime);
-    printf("\nSpeedup: %.6f\n", sequentialTime/parallelTime);
+    if (runSequential) {
+      printf("\nSpeedup: %.6f", sequentialTime/parallelTime);
+    }
+    printf("\n");
 
     std::ofstream results_file;
     results_file.open("knn_timings.txt", std::ios_base::app); // Appending to the file
 
-    results_file << "Sequential: " << " Time: " << sequentialTime << " seconds" << endl;
-    results_file << "Parallel: " << "Processes: " << nproc << ", Time: " << parallelTime << " seconds" << endl;
-    results_file << "Speedup: " << (sequentialTime/ parallelTime) << "\n" << endl;
+    if (runSequential) {
+      results_file << "Sequential: " << " Time: " << sequentialTime << " seconds" << endl;
+    }
+    results_file << "Parallel: " << "Processes: " << nproc << ", Threads: " << numThreads
+                 << ", Queries: " << queries.size() << ", Ingest: " << ingestTime
+                 << " seconds, Build: " << buildTime << " seconds, Time: " << parallelTime
+                 << " seconds" << endl;
+    if (runSequential) {
+      results_file << "Speedup: " << (sequentialTime/ parallelTime) << endl;
+    }
+    results_file << endl;
   }
 
   MPI_Finalize();
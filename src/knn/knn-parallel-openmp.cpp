@@ -13,8 +13,9 @@
 
 using namespace std;
 
+template<typename Metric>
 void kNNSearchIterativeParallel(const KDNode* root, const vector<double>& target, size_t k,
-                                 vector<DistanceNode>& nearestNeighbors) {
+                                 vector<DistanceNode>& nearestNeighbors, const Metric& metric) {
   if (root == nullptr) {
     return;
   }
@@ -40,13 +41,7 @@ void kNNSearchIterativeParallel(const KDNode* root, const vector<double>& target
 
       int axis = depth % targetSize;
 
-      double distance;
-      try {
-        distance = calculateDistance(target, currentNode->features);
-      } catch (const invalid_argument& error) {
-        cerr << "Exception caught: " << error.what() << endl;
-        continue;
-      }
+      double distance = metric.reducedDistance(target.data(), currentNode->features, targetSize);
 
       DistanceNode neighbor = {distance, currentNode};
       #pragma omp critical
@@ -68,30 +63,38 @@ void kNNSearchIterativeParallel(const KDNode* root, const vector<double>& target
       }
     }
   }
+
+  for (DistanceNode& neighbor : nearestNeighbors) {
+    neighbor.distance = metric.fromReduced(neighbor.distance);
+  }
 }
 
 // Find k nearest neighbors of target point (parallel implementation)
-void KNN::kNNSearchParallelOpenMP(const KDTree& kdTree, const vector<double>& target, int k) {
+void KNN::kNNSearchParallelOpenMP(const KDTree& kdTree, const vector<double>& target, int k,
+                                  const MetricSpec& metric) {
   vector<DistanceNode> nearestNeighborsVector;
+  if (!checkTarget(kdTree, target)) {
+    return;
+  }
 
-  kNNSearchIterativeParallel(kdTree.root.get(), target, static_cast<size_t>(k), nearestNeighborsVector);
+  withMetric(metric, [&](const auto& policy) {
+    kNNSearchIterativeParallel(kdTree.root.get(), target, static_cast<size_t>(k),
+                               nearestNeighborsVector, policy);
+  });
 
   // Collect the results from the priority queue
-  while (!nearestNeighborsVector.empty()) {
-    DistanceNode point = nearestNeighborsVector.back();
-    nearestNeighbors.push_back({point.node->features, point.node->label});
-    nearestNeighborsVector.pop_back();
-  }
+  collectNeighbors(kdTree, nearestNeighborsVector);
 }
 
 int main(int argc, char *argv[]) {
-  int k, d = -1;
+  int k = -1, d = -1;
   string filename = "";
   int opt;
   vector<double> target;
+  MetricSpec metric;
 
   // Parse command-line arguments
-  while ((opt = getopt(argc, argv, "hk:i:d:t:")) != -1) {
+  while ((opt = getopt(argc, argv, "hk:i:d:t:m:")) != -1) {
     switch (opt) {
       case 'h':
         cout << "Usage: " << argv[0] << " [-k value] [-i value]" << endl;
@@ -100,6 +103,8 @@ int main(int argc, char *argv[]) {
         cout << "  -i value       Input dataset" << endl;
         cout << "  -d value       Number of feature to consider in dataset" << endl;
         cout << "  -t value       Target point" << endl;
+        cout << "  -m value       Distance metric: euclidean, manhattan, chebyshev, minkowski:<p>," << endl;
+        cout << "                 weighted:<w1,...,wd> or cosine (default euclidean)" << endl;
         return 0;
       case 'k':
         if (isPositiveInteger(optarg)) {
@@ -123,6 +128,12 @@ int main(int argc, char *argv[]) {
       case 't':
         target = parseInputVector(optarg);
         break;
+      case 'm':
+        if (!parseMetric(optarg, metric)) {
+            cout << "Invalid value for m, m = " << optarg << endl;
+            return 0;
+        }
+        break;
       default:
         cout << "Usage: " << argv[0] << " -k <k_value> -i <i_value> -d <d_value>" << endl;
         return 0;
@@ -134,20 +145,27 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (!checkMetric(metric, d)) {
+    return 0;
+  }
+
   KDTree kdTree;
-  vector<DataPoint> data = kdTree.parseInput(filename, kdTree.dimensions);
-  kdTree.buildKDTree(data, 0, d);
+  PointSet data = kdTree.parseInput(filename, kdTree.dimensions);
+  vector<vector<double>> targets = {target};
+  normalizeForMetric(metric, data, targets);
+  target = targets[0];
+  kdTree.buildKDTree(move(data), 0, d);
 
   // Run sequential knn search
   Timer sequentialTimer;
   KNN seqKnn;
-  seqKnn.kNNSearch(kdTree, target, k);
+  seqKnn.kNNSearch(kdTree, target, k, metric);
   double sequentialTime = sequentialTimer.elapsed();
 
   // Run parallel knn search
   Timer parallelTimer;
   KNN parallelKnn;
-  parallelKnn.kNNSearchParallelOpenMP(kdTree, target, k);
+  parallelKnn.kNNSearchParallelOpenMP(kdTree, target, k, metric);
   double parallelTime = parallelTimer.elapsed();
 
   parallelKnn.printNearestNeighbors();
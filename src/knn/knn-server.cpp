@@ -0,0 +1,437 @@
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <csignal>
+#include <poll.h>
+#include "knn.h"
+#include "queryProtocol.h"
+#include "../kdTree/kdTree.h"
+#include "../utils.h"
+#include "../timing.h"
+#include "../threadPool.h"
+
+using namespace std;
+
+// Resident kNN server: the tree is built once, then queries arrive over a
+// Unix socket (-s) or stdin/stdout in the binary protocol of queryProtocol.h.
+// Queries arriving within the batch window are searched together as one task
+// of the thread pool, which also builds the tree. Messages go to stderr,
+// stdout may carry the protocol. With -c, repeated targets are answered
+// from a result cache (resultCache.h) instead of searched again.
+
+// One client. The fd closes once the reader and every pending query are done with it.
+struct Connection {
+  int readFd;
+  int writeFd;
+  mutex writeLock;
+
+  Connection(int readFd, int writeFd) : readFd(readFd), writeFd(writeFd) {}
+
+  ~Connection() {
+    if (readFd > STDERR_FILENO) {
+      close(readFd);
+    }
+    if (writeFd != readFd && writeFd > STDERR_FILENO) {
+      close(writeFd);
+    }
+  }
+};
+
+struct PendingQuery {
+  shared_ptr<Connection> connection;
+  uint32_t id;
+  uint32_t k;
+  vector<double> target;
+  chrono::steady_clock::time_point arrival;
+};
+
+// Queries waiting to be batched
+class BatchQueue {
+public:
+  BatchQueue() : closed(false) {}
+
+  void push(PendingQuery query) {
+    {
+      lock_guard<mutex> guard(lock);
+      queries.push_back(move(query));
+    }
+    ready.notify_one();
+  }
+
+  // Wait for a query, then until the window after its arrival has passed or
+  // maxBatch queries are waiting. False once closed and drained.
+  bool popBatch(vector<PendingQuery>& batch, chrono::microseconds window, size_t maxBatch) {
+    unique_lock<mutex> guard(lock);
+    ready.wait(guard, [this]() { return closed || !queries.empty(); });
+    if (queries.empty()) {
+      return false;
+    }
+
+    auto deadline = queries.front().arrival + window;
+    ready.wait_until(guard, deadline, [this, maxBatch]() { return closed || queries.size() >= maxBatch; });
+
+    batch.clear();
+    while (!queries.empty() && batch.size() < maxBatch) {
+      batch.push_back(move(queries.front()));
+      queries.pop_front();
+    }
+    return true;
+  }
+
+  void close() {
+    {
+      lock_guard<mutex> guard(lock);
+      closed = true;
+    }
+    ready.notify_all();
+  }
+
+private:
+  mutex lock;
+  condition_variable ready;
+  deque<PendingQuery> queries;
+  bool closed;
+};
+
+struct ServerConfig {
+  size_t dimensions;
+  size_t maxK;
+  MetricSpec metric;
+  SearchOrder order;
+  chrono::microseconds budget;   // Per-query latency budget, 0 for none
+  ResultCache<vector<QueryNeighbor>>* cache;   // nullptr for none
+  double quantum;                // Cache key grid, 0 for exact targets
+};
+
+// Search every query of a batch and answer it, one write per connection
+void runBatch(const KDTree& tree, const ServerConfig& config, vector<PendingQuery>& batch) {
+  map<Connection*, string> replies;
+  vector<DistanceNode> neighbors;
+
+  for (PendingQuery& query : batch) {
+    QueryResponseHeader header = {query.id, QUERY_OK, 0, 0};
+    vector<QueryNeighbor> found;
+
+    if (query.target.size() != config.dimensions) {
+      header.status = QUERY_BAD_DIMENSIONS;
+    } else if (query.k == 0 || query.k > config.maxK) {
+      header.status = QUERY_BAD_K;
+    } else if (config.budget.count() > 0 && chrono::steady_clock::now() > query.arrival + config.budget) {
+      // Too late to be of use, spend the time on queries that can still make it
+      header.status = QUERY_DEADLINE_EXCEEDED;
+    } else {
+      if (config.metric.type == METRIC_COSINE) {
+        normalizeVector(query.target);
+      }
+      auto search = [&]() {
+        neighbors.clear();
+        kNNSearchIterative(tree.root.get(), query.target, query.k, neighbors, config.metric, 0.0, 0, config.order);
+        vector<QueryNeighbor> answer;
+        for (const DistanceNode& neighbor : neighbors) {
+          answer.push_back({neighbor.distance, neighbor.node->label, 0});
+        }
+        return answer;
+      };
+      if (config.cache != nullptr) {
+        // The tree never changes while serving, every answer stays valid
+        CacheKey key = makeCacheKey(query.target, query.k, searchCacheTag(config.metric, config.order),
+                                    config.quantum);
+        found = config.cache->fetch(key, 0, search);
+      } else {
+        found = search();
+      }
+
+      vector<int> labels;
+      for (const QueryNeighbor& neighbor : found) {
+        labels.push_back(neighbor.label);
+      }
+      header.count = found.size();
+      header.label = majorityLabel(labels);
+    }
+
+    string& reply = replies[query.connection.get()];
+    reply.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    reply.append(reinterpret_cast<const char*>(found.data()), found.size() * sizeof(QueryNeighbor));
+  }
+
+  for (PendingQuery& query : batch) {
+    auto reply = replies.find(query.connection.get());
+    if (reply == replies.end()) {
+      continue;
+    }
+    // A client that went away just misses its answers
+    lock_guard<mutex> guard(query.connection->writeLock);
+    writeFully(query.connection->writeFd, reply->second.data(), reply->second.size());
+    replies.erase(reply);
+  }
+}
+
+// Read requests until the client closes the connection or breaks the protocol
+void readRequests(shared_ptr<Connection> connection, BatchQueue& queue) {
+  QueryRequestHeader header;
+  while (readFully(connection->readFd, &header, sizeof(header))) {
+    if (header.magic != QUERY_MAGIC || header.dimensions > QUERY_MAX_DIMENSIONS) {
+      cerr << "Malformed request, closing the connection" << endl;
+      break;
+    }
+    PendingQuery query = {connection, header.id, header.k, vector<double>(header.dimensions),
+                          chrono::steady_clock::time_point()};
+    if (!readFully(connection->readFd, query.target.data(), header.dimensions * sizeof(double))) {
+      break;
+    }
+    query.arrival = chrono::steady_clock::now();
+    queue.push(move(query));
+  }
+}
+
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+  stopRequested = 1;
+}
+
+int main(int argc, char *argv[]) {
+  int d = -1;
+  string filename = "";
+  string socketPath = "";
+  MetricSpec metric;
+  SearchOrder order = SEARCH_DEPTH_FIRST;
+  TreeLayout layout = LAYOUT_INPUT;
+  size_t numThreads = max(1u, thread::hardware_concurrency());
+  size_t maxK = 1024;
+  long windowMicros = 200;
+  size_t maxBatch = 64;
+  double budgetMillis = 0.0;
+  size_t cacheMegabytes = 0;
+  double quantum = 0.0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hi:d:s:m:o:l:n:k:w:b:t:c:q:")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " -i <dataset> -d <dimensions> [-s socket] [options]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -i value       Input dataset, CSV or binary" << endl;
+        cout << "  -d value       Number of features to consider in dataset" << endl;
+        cout << "  -s value       Unix socket to listen on (default: one client on stdin/stdout)" << endl;
+        cout << "  -m value       Distance metric, as for knn.out (default euclidean)" << endl;
+        cout << "  -o value       Traversal order: dfs or bbf (default dfs)" << endl;
+        cout << "  -l value       Memory layout of the built tree: input, dfs or veb (default input)" << endl;
+        cout << "  -n value       Worker threads (default: all cores)" << endl;
+        cout << "  -k value       Largest k a request may ask for (default 1024)" << endl;
+        cout << "  -w value       Batch window in microseconds (default 200)" << endl;
+        cout << "  -b value       Largest batch (default 64)" << endl;
+        cout << "  -t value       Latency budget in milliseconds: queries still waiting after it" << endl;
+        cout << "                 are rejected instead of searched (default: none)" << endl;
+        cout << "  -c value       Result cache budget in megabytes (default: no cache)" << endl;
+        cout << "  -q value       Cache targets on a grid of this spacing, so nearby targets share" << endl;
+        cout << "                 their answer (default 0: only identical targets)" << endl;
+        return 0;
+      case 'i':
+        filename = optarg;
+        break;
+      case 's':
+        socketPath = optarg;
+        break;
+      case 'd':
+      case 'n':
+      case 'k':
+      case 'w':
+      case 'b':
+      case 'c':
+        if (!isPositiveInteger(optarg) || string(optarg).empty()) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'd') d = stoi(optarg);
+        if (opt == 'n') numThreads = max(1, stoi(optarg));
+        if (opt == 'k') maxK = max(1, stoi(optarg));
+        if (opt == 'w') windowMicros = stol(optarg);
+        if (opt == 'b') maxBatch = max(1, stoi(optarg));
+        if (opt == 'c') cacheMegabytes = stoul(optarg);
+        break;
+      case 't':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for t, t = " << optarg << endl;
+          return 0;
+        }
+        budgetMillis = stod(optarg);
+        break;
+      case 'q':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for q, q = " << optarg << endl;
+          return 0;
+        }
+        quantum = stod(optarg);
+        break;
+      case 'm':
+        if (!parseMetric(optarg, metric)) {
+          cout << "Invalid value for m, m = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'o':
+        if (!parseSearchOrder(optarg, order)) {
+          cout << "Invalid value for o, o = " << optarg << endl;
+          return 0;
+        }
+        break;
+      case 'l':
+        if (!parseTreeLayout(optarg, layout)) {
+          cout << "Invalid value for l, l = " << optarg << endl;
+          return 0;
+        }
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " -i <dataset> -d <dimensions> [-s socket]" << endl;
+        return 0;
+    }
+  }
+
+  if (d == -1 || filename == "") {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+  if (!checkMetric(metric, d)) {
+    return 0;
+  }
+
+  // In stdin mode the protocol keeps the real stdout, anything printed goes to stderr
+  int replyFd = STDOUT_FILENO;
+  if (socketPath == "") {
+    fflush(stdout);
+    replyFd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  // One pool for the build and the searches
+  unique_ptr<ThreadPool> pool(new ThreadPool(numThreads));
+
+  // Built once, read-only while serving
+  Timer buildTimer;
+  KDTree tree;
+  PointSet data = tree.parseInput(filename, tree.dimensions);
+  if (data.empty()) {
+    cerr << "No points in " << filename << endl;
+    return 0;
+  }
+  vector<vector<double>> noTargets;
+  normalizeForMetric(metric, data, noTargets);
+  size_t numPoints = data.size();
+  tree.buildKDTree(*pool, move(data), 0, d);
+  tree.relayout(layout);
+  cerr << "Indexed " << numPoints << " points in " << buildTimer.elapsed() << "s" << endl;
+
+  unique_ptr<ResultCache<vector<QueryNeighbor>>> cache;
+  if (cacheMegabytes > 0) {
+    cache.reset(new ResultCache<vector<QueryNeighbor>>(cacheMegabytes << 20));
+  }
+  ServerConfig config = {(size_t)d, maxK, metric, order,
+                         chrono::microseconds((long long)(budgetMillis * 1000.0)), cache.get(), quantum};
+  BatchQueue queue;
+  atomic<size_t> numQueries(0);
+  atomic<size_t> numBatches(0);
+
+  // Pulls batches off the queue and hands them to the pool
+  thread dispatcher([&]() {
+    vector<PendingQuery> batch;
+    while (queue.popBatch(batch, chrono::microseconds(windowMicros), maxBatch)) {
+      numQueries += batch.size();
+      numBatches++;
+      auto shared = make_shared<vector<PendingQuery>>(move(batch));
+      pool->post([&tree, &config, shared]() { runBatch(tree, config, *shared); });
+      batch = vector<PendingQuery>();
+    }
+  });
+
+  Timer serveTimer;
+  if (socketPath == "") {
+    cerr << "Serving on stdin/stdout" << endl;
+    readRequests(make_shared<Connection>(STDIN_FILENO, replyFd), queue);
+  } else {
+    int listenFd = listenUnixSocket(socketPath);
+    if (listenFd < 0) {
+      cerr << "Unable to listen on " << socketPath << ": " << strerror(errno) << endl;
+      queue.close();
+      dispatcher.join();
+      return 0;
+    }
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+    cerr << "Serving on " << socketPath << " with " << numThreads << " threads" << endl;
+
+    // One reader thread per client, joined once the client is gone
+    struct Reader {
+      weak_ptr<Connection> connection;
+      shared_ptr<atomic<bool>> done;
+      thread worker;
+    };
+    list<Reader> readers;
+
+    // Poll so a signal is noticed within 100ms
+    while (!stopRequested) {
+      for (auto reader = readers.begin(); reader != readers.end();) {
+        if (*reader->done) {
+          reader->worker.join();
+          reader = readers.erase(reader);
+        } else {
+          ++reader;
+        }
+      }
+
+      pollfd listening = {listenFd, POLLIN, 0};
+      if (poll(&listening, 1, 100) <= 0) {
+        continue;
+      }
+      int clientFd = accept(listenFd, nullptr, nullptr);
+      if (clientFd < 0) {
+        continue;
+      }
+      auto connection = make_shared<Connection>(clientFd, clientFd);
+      auto done = make_shared<atomic<bool>>(false);
+      readers.push_back({connection, done, thread([connection, done, &queue]() {
+        readRequests(connection, queue);
+        *done = true;
+      })});
+    }
+
+    // Unblock the readers, answers to queries already read still go out
+    for (Reader& reader : readers) {
+      shared_ptr<Connection> connection = reader.connection.lock();
+      if (connection) {
+        shutdown(connection->readFd, SHUT_RD);
+      }
+    }
+    for (Reader& reader : readers) {
+      reader.worker.join();
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+  }
+
+  // Answers what is still queued
+  queue.close();
+  dispatcher.join();
+  pool.reset();
+
+  double serveTime = serveTimer.elapsed();
+  size_t batches = numBatches;
+  cerr << "Answered " << numQueries << " queries in " << batches << " batches (mean batch "
+       << (batches > 0 ? (double)numQueries / batches : 0.0) << ") over " << serveTime << "s" << endl;
+  if (cache) {
+    CacheStats stats = cache->stats();
+    recordCacheStats("server", stats);
+    printCacheStats(stats);
+  }
+  return 0;
+}
@@ -6,20 +6,33 @@
 #include <algorithm>
 #include <stack>
 #include "knn.h"
+#include "neighborIterator.h"
 #include "../kdTree/kdTree.h"
+#include "../kdTree/dedup.h"
 #include "../utils.h"
 #include "../timing.h"
 
 using namespace std;
 
 int main(int argc, char *argv[]) {
-  int k, d = -1;
+  int k = -1, d = -1;
   string filename = "";
   int opt;
   vector<double> target;
+  MetricSpec metric;
+  string queryFilename = "";
+  double epsilon = 0.0;
+  size_t maxChecks = 0;
+  SearchOrder order = SEARCH_DEPTH_FIRST;
+  bool compareOrders = false;
+  CurveType curve = CURVE_NONE;
+  TreeLayout layout = LAYOUT_INPUT;
+  bool collapse = false;
+  bool filterByLabel = false;
+  int filterLabel = 0;
 
   // Parse command-line arguments
-  while ((opt = getopt(argc, argv, "hk:i:d:t:")) != -1) {
+  while ((opt = getopt(argc, argv, "hk:i:d:t:m:q:e:b:o:cz:l:uL:")) != -1) {
     switch (opt) {
       case 'h':
         cout << "Usage: " << argv[0] << " [-k value] [-i value]" << endl;
@@ -28,7 +41,38 @@ int main(int argc, char *argv[]) {
         cout << "  -i value       Input dataset" << endl;
         cout << "  -d value       Number of feature to consider in dataset" << endl;
         cout << "  -t value       Target point" << endl;
+        cout << "  -m value       Distance metric: euclidean, manhattan, chebyshev, minkowski:<p>," << endl;
+        cout << "                 weighted:<w1,...,wd> or cosine (default euclidean)" << endl;
+        cout << "  -q value       File of target points, one per line" << endl;
+        cout << "  -e value       Approximate search: (1+e)-approximate pruning" << endl;
+        cout << "  -b value       Approximate search: check at most this many nodes per query" << endl;
+        cout << "  -o value       Traversal order: dfs (depth-first) or bbf (best-bin-first), default dfs" << endl;
+        cout << "  -c             Compare both traversal orders for k = 1, 10, 100, 1000 and k" << endl;
+        cout << "  -z value       Sort points and queries along a curve first: none, morton or hilbert" << endl;
+        cout << "  -l value       Memory layout of the built tree: input, dfs or veb (default input)" << endl;
+        cout << "  -u             Compare against a tree with duplicate points collapsed into counted nodes" << endl;
+        cout << "  -L value       k nearest points with this label: pulled one by one from a neighbor" << endl;
+        cout << "                 iterator, against searches rerun with k doubled until enough match" << endl;
         return 0;
+      case 'q':
+        queryFilename = optarg;
+        break;
+      case 'e':
+        if (isNonNegativeNumber(optarg)) {
+            epsilon = stod(optarg);
+        } else {
+            cout << "Invalid value for e, e = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'b':
+        if (isPositiveInteger(optarg)) {
+            maxChecks = stoul(optarg);
+        } else {
+            cout << "Invalid value for b, b = " << optarg << endl;
+            return 0;
+        }
+        break;
       case 'k':
         if (isPositiveInteger(optarg)) {
             k = stoi(optarg);
@@ -51,24 +95,320 @@ int main(int argc, char *argv[]) {
       case 't':
         target = parseInputVector(optarg);
         break;
+      case 'o':
+        if (!parseSearchOrder(optarg, order)) {
+            cout << "Invalid value for o, o = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'c':
+        compareOrders = true;
+        break;
+      case 'u':
+        collapse = true;
+        break;
+      case 'L':
+        if (isPositiveInteger(optarg) && string(optarg) != "") {
+            filterByLabel = true;
+            filterLabel = stoi(optarg);
+        } else {
+            cout << "Invalid value for L, L = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'z':
+        if (!parseCurveType(optarg, curve)) {
+            cout << "Invalid value for z, z = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'l':
+        if (!parseTreeLayout(optarg, layout)) {
+            cout << "Invalid value for l, l = " << optarg << endl;
+            return 0;
+        }
+        break;
+      case 'm':
+        if (!parseMetric(optarg, metric)) {
+            cout << "Invalid value for m, m = " << optarg << endl;
+            return 0;
+        }
+        break;
       default:
         cout << "Usage: " << argv[0] << " -k <k_value> -i <i_value> -d <d_value>" << endl;
         return 0;
     }
   }
 
-  if (k == -1 || d == -1 || filename == "" || target.size() == 0) {
+  if (k == -1 || d == -1 || filename == "" || (target.size() == 0 && queryFilename == "")) {
     cout << "Not enough arguments provided." << endl;
     return 0;
   }
 
+  if (!checkMetric(metric, d)) {
+    return 0;
+  }
+
   KDTree kdTree;
-  vector<DataPoint> data = kdTree.parseInput(filename, kdTree.dimensions);
-  kdTree.buildKDTree(data, 0, d);
+  ScopedPhase parsePhase("parse");
+  PointSet data = kdTree.parseInput(filename, kdTree.dimensions);
+  parsePhase.end();
+  vector<vector<double>> targets = {target};
+  normalizeForMetric(metric, data, targets);
+  target = targets[0];
+
+  // Locality preprocessing: neighbors in space become neighbors in memory
+  Timer layoutTimer;
+  {
+    ScopedPhase phase("curve sort");
+    sortAlongCurve(data, curve, d);
+  }
+  kdTree.buildKDTree(move(data), 0, d);
+  {
+    ScopedPhase phase("relayout");
+    kdTree.relayout(layout);
+  }
+  double layoutBuildTime = layoutTimer.elapsed();
+
+  bool approximate = epsilon > 0.0 || maxChecks > 0;
+
+  vector<vector<double>> queries;
+  if (queryFilename != "") {
+    size_t skipped;
+    queries = parseQueryFile(queryFilename, d, &skipped);
+    if (skipped > 0) {
+      cout << "Skipped " << skipped << " query lines with fewer than " << d << " features" << endl;
+    }
+    if (queries.empty()) {
+      cout << "No queries with " << d << " features in " << queryFilename << endl;
+      return 0;
+    }
+    PointSet noData;
+    normalizeForMetric(metric, noData, queries);
+
+    // Only the aggregates are reported, so the answers need not go back to file order
+    applyOrder(queries, queryCurveOrder(queries, curve, d));
+  } else {
+    queries.push_back(target);
+  }
+
+  if (compareOrders) {
+    // Same queries with both traversal orders, for small and large k
+    vector<size_t> kValues = {1, 10, 100, 1000, (size_t)k};
+    sort(kValues.begin(), kValues.end());
+    kValues.erase(unique(kValues.begin(), kValues.end()), kValues.end());
+
+    printf("\nQueries: %zu\n", queries.size());
+    printf("%8s %16s %16s %10s %12s\n", "k", "dfs (s/query)", "bbf (s/query)", "speedup", "mismatches");
+    for (size_t kValue : kValues) {
+      if (kValue > kdTree.points.size()) {
+        continue;
+      }
+
+      double depthFirstTime = 0.0;
+      double bestBinTime = 0.0;
+      size_t mismatches = 0;
+      for (const vector<double>& query : queries) {
+        vector<DistanceNode> depthFirst;
+        Timer depthFirstTimer;
+        kNNSearchIterative(kdTree.root.get(), query, kValue, depthFirst, metric, 0.0, 0, SEARCH_DEPTH_FIRST);
+        depthFirstTime += depthFirstTimer.elapsed();
+
+        vector<DistanceNode> bestBin;
+        Timer bestBinTimer;
+        kNNSearchIterative(kdTree.root.get(), query, kValue, bestBin, metric, 0.0, 0, SEARCH_BEST_BIN_FIRST);
+        bestBinTime += bestBinTimer.elapsed();
+
+        // Both are exact, the k-th distances must agree
+        if (depthFirst.size() != bestBin.size() ||
+            fabs(depthFirst.back().distance - bestBin.back().distance) > 1e-9 * max(1.0, depthFirst.back().distance)) {
+          mismatches++;
+        }
+      }
+
+      size_t numQueries = max<size_t>(queries.size(), 1);
+      printf("%8zu %16.8f %16.8f %10.4f %12zu\n", kValue, depthFirstTime / numQueries,
+             bestBinTime / numQueries, depthFirstTime / bestBinTime, mismatches);
+    }
+    return 0;
+  }
+
+  if (collapse) {
+    // Same queries on the full tree and on one node per distinct point
+    Timer collapseTimer;
+    DedupKDTree dedupTree;
+    dedupTree.build(kdTree.points, 0, d);
+    double collapseTime = collapseTimer.elapsed();
+
+    double fullTime = 0.0;
+    double collapsedTime = 0.0;
+    size_t mismatches = 0;
+    size_t labelMismatches = 0;
+    size_t tiedQueries = 0;
+    auto multiplicity = [&dedupTree](const KDNode* node) { return dedupTree.multiplicityOf(node); };
+    for (const vector<double>& query : queries) {
+      vector<DistanceNode> full;
+      Timer fullTimer;
+      kNNSearchIterative(kdTree.root.get(), query, k, full, metric);
+      fullTime += fullTimer.elapsed();
+
+      vector<CountedNeighbor> collapsed;
+      Timer collapsedTimer;
+      kNNSearchMultiplicity(dedupTree.tree.root.get(), query, k, collapsed, metric, multiplicity);
+      collapsedTime += collapsedTimer.elapsed();
+
+      // Expanded by their counts, the distances must be the same
+      vector<double> expanded;
+      for (const CountedNeighbor& neighbor : collapsed) {
+        expanded.insert(expanded.end(), neighbor.count, neighbor.distance);
+      }
+      bool same = expanded.size() == full.size();
+      for (size_t i = 0; same && i < full.size(); i++) {
+        same = fabs(expanded[i] - full[i].distance) <= 1e-9 * max(1.0, full[i].distance);
+      }
+      mismatches += !same;
+
+      // And the predicted label, voted from the label histograms of the collapsed nodes
+      KNN fullKnn;
+      fullKnn.collectNeighbors(kdTree, full);
+      map<int, size_t> votes;
+      for (const CountedNeighbor& neighbor : collapsed) {
+        dedupTree.addLabels(neighbor.node, neighbor.count, votes);
+      }
+      int fullLabel = fullKnn.predictLabel();
+      int collapsedLabel = majorityLabel(votes);
+
+      // With a point k + 1 at the k-th distance, which copies make the cut is
+      // arbitrary in either tree, and so may be the vote
+      vector<CountedNeighbor> further;
+      kNNSearchMultiplicity(dedupTree.tree.root.get(), query, k + 1, further, metric, multiplicity);
+      size_t furtherPoints = 0;
+      for (const CountedNeighbor& neighbor : further) {
+        furtherPoints += neighbor.count;
+      }
+      if (!collapsed.empty() && furtherPoints > (size_t)k && further.back().distance == collapsed.back().distance) {
+        tiedQueries++;
+      } else {
+        labelMismatches += fullLabel != collapsedLabel;
+      }
+    }
+
+    size_t numQueries = max<size_t>(queries.size(), 1);
+    size_t fullBytes = kdTree.points.memoryBytes() + kdTree.points.size() * sizeof(KDNode);
+    printf("\nDistinct points: %zu of %zu, collapsed and built in %.6fs\n", dedupTree.size(),
+           kdTree.points.size(), collapseTime);
+    printf("%10s %12s %14s %16s\n", "tree", "nodes", "memory (MB)", "search (s/query)");
+    printf("%10s %12zu %14.3f %16.8f\n", "full", kdTree.points.size(), fullBytes / 1e6, fullTime / numQueries);
+    printf("%10s %12zu %14.3f %16.8f\n", "collapsed", dedupTree.size(), dedupTree.memoryBytes() / 1e6,
+           collapsedTime / numQueries);
+    printf("Memory reduction: %.2fx, search speedup: %.2fx\n", (double)fullBytes / dedupTree.memoryBytes(),
+           fullTime / collapsedTime);
+    printf("Queries compared: %zu, with different distances: %zu\n", queries.size(), mismatches);
+    if (tiedQueries == queries.size()) {
+      printf("Predicted labels not compared: every query is tied at the k-th distance\n");
+    } else {
+      printf("Predicted labels compared: %zu, different: %zu (%zu tied at the k-th distance not compared)\n",
+             queries.size() - tiedQueries, labelMismatches, tiedQueries);
+    }
+    return 0;
+  }
+
+  if (filterByLabel) {
+    // Neighbors of one label, without knowing how far the search must go to find k of them
+    LabelIs accept(filterLabel);
+    double iteratorTime = 0.0;
+    double rerunTime = 0.0;
+    size_t searches = 0;
+    size_t pointsSearched = 0;
+    size_t found = 0;
+    size_t mismatches = 0;
+    for (const vector<double>& query : queries) {
+      vector<DistanceNode> pulled;
+      Timer iteratorTimer;
+      kNNSearchFiltered(kdTree.root.get(), query, k, pulled, metric, accept);
+      iteratorTime += iteratorTimer.elapsed();
+      found += pulled.size();
+
+      vector<DistanceNode> filtered;
+      Timer rerunTimer;
+      for (size_t kTry = k;; kTry *= 2) {
+        kTry = min(kTry, kdTree.points.size());
+        vector<DistanceNode> neighbors;
+        kNNSearchIterative(kdTree.root.get(), query, kTry, neighbors, metric, 0.0, 0, order);
+        searches++;
+        pointsSearched += kTry;
+        filtered.clear();
+        for (size_t i = 0; i < neighbors.size() && filtered.size() < (size_t)k; i++) {
+          if (accept(neighbors[i].node)) {
+            filtered.push_back(neighbors[i]);
+          }
+        }
+        if (filtered.size() == (size_t)k || kTry == kdTree.points.size()) {
+          break;
+        }
+      }
+      rerunTime += rerunTimer.elapsed();
+
+      bool same = filtered.size() == pulled.size();
+      for (size_t i = 0; same && i < pulled.size(); i++) {
+        same = fabs(filtered[i].distance - pulled[i].distance) <= 1e-9 * max(1.0, pulled[i].distance);
+      }
+      mismatches += !same;
+    }
+
+    size_t numQueries = max<size_t>(queries.size(), 1);
+    printf("\nQueries: %zu, neighbors with label %d: %.2f per query (k = %d)\n", queries.size(), filterLabel,
+           (double)found / numQueries, k);
+    printf("Iterator: %.8fs per query\n", iteratorTime / numQueries);
+    printf("Reruns with doubled k: %.8fs per query, %.2f searches and %.1f points searched per query\n",
+           rerunTime / numQueries, (double)searches / numQueries, (double)pointsSearched / numQueries);
+    printf("Speedup: %.4f, queries with different distances: %zu\n", rerunTime / iteratorTime, mismatches);
+    return 0;
+  }
+
+  if (queryFilename != "" || approximate) {
+    // Compare the approximate search against the exact one on every query
+
+    double exactTime = 0.0;
+    double approxTime = 0.0;
+    double totalRecall = 0.0;
+
+    for (const vector<double>& query : queries) {
+      Timer exactTimer;
+      KNN exactKnn;
+      ScopedPhase exactPhase("exact search");
+      exactKnn.kNNSearch(kdTree, query, k, metric, order);
+      exactPhase.end();
+      exactTime += exactTimer.elapsed();
+
+      Timer approxTimer;
+      KNN approxKnn;
+      ScopedPhase approxPhase("approximate search");
+      approxKnn.kNNSearchApprox(kdTree, query, k, epsilon, maxChecks, metric, order);
+      approxPhase.end();
+      approxTime += approxTimer.elapsed();
+
+      totalRecall += approxKnn.recall(exactKnn, query, metric);
+    }
+
+    size_t numQueries = max<size_t>(queries.size(), 1);
+    printf("\nQueries: %zu, epsilon: %.3f, node budget: %zu", queries.size(), epsilon, maxChecks);
+    printf("\nBuild time (with reordering): %.6fs", layoutBuildTime);
+    printf("\nMean recall: %.4f", totalRecall / numQueries);
+    printf("\nMean exact search time: %.6fs", exactTime / numQueries);
+    printf("\nMean approximate search time: %.6fs", approxTime / numQueries);
+    printf("\nSpeedup: %.6f\n", exactTime / approxTime);
+#ifdef KNN_STATS
+    printSearchStats(searchStatsSnapshot());
+#endif
+    return 0;
+  }
 
   Timer totalSimulationTimer;
   KNN knn;
-  knn.kNNSearch(kdTree, target, k);
+  ScopedPhase searchPhase("search");
+  knn.kNNSearch(kdTree, target, k, metric, order);
+  searchPhase.end();
   double totalSimulationTime = totalSimulationTimer.elapsed();
 
   knn.printNearestNeighbors();
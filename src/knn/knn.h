@@ -3,7 +3,12 @@
 
 #include <iostream>
 #include <map>
+#include <algorithm>
+#include <stack>
+#include <queue>
 #include "../kdTree/kdTree.h"
+#include "metrics.h"
+#include "searchStats.h"
 
 using namespace std;
 
@@ -19,7 +24,7 @@ struct DistanceNode2 {
 
 // Calculate Euclidean distance between two points
 // Generalizable to points with any number of features
-double calculateDistance(vector<double> point1, vector<double> point2) {
+double calculateDistance(const vector<double>& point1, const vector<double>& point2) {
   // Throw exception for invalid input
   if (point1.size() != point2.size()) {
     throw invalid_argument("Points must have the same number of features");
@@ -54,46 +59,343 @@ void insertAndSortNeighbors(vector<DistanceNode>& nearestNeighbors, DistanceNode
   }
 }
 
-// Search KDTree for nearest neighbors
+// Subtree waiting to be visited, with a lower bound on its distance to the target
+struct SearchEntry {
+  const KDNode* node;
+  int depth;
+  double bound;
+};
+
+// Order in which kNN searches visit the subtrees they could not prune
+enum SearchOrder {
+  SEARCH_DEPTH_FIRST,     // Stack, near side first (kNNSearchIterative)
+  SEARCH_BEST_BIN_FIRST   // Priority queue keyed by the subtree's lower bound (kNNSearchBestBinFirst)
+};
+
+// Subtree waiting in the priority queue of a best-bin-first search.
+// terms points to the per-axis axisBound terms of the subtree's cell in the
+// search's pool, their combination is bound.
+struct BranchEntry {
+  double bound;
+  const KDNode* node;
+  int depth;
+  size_t terms;
+
+  bool operator>(const BranchEntry& other) const {
+    return bound > other.bound;
+  }
+};
+
+// Search KDTree for nearest neighbors using the given distance metric
+// Subtrees that cannot hold a point closer than the current k-th neighbor are
+// skipped. With epsilon > 0 a subtree is also skipped when it can only improve
+// the k-th distance by a factor below 1 + epsilon, and maxChecks > 0 stops the
+// search after that many nodes. The defaults give an exact search.
+// Distances are compared in the metric's reduced form and converted at the end.
+template<typename Metric>
 void kNNSearchIterative(const KDNode* root, const vector<double>& target, size_t k,
-                        vector<DistanceNode>& nearestNeighbors) {
+                        vector<DistanceNode>& nearestNeighbors, const Metric& metric,
+                        double epsilon = 0.0, size_t maxChecks = 0) {
   if (root == nullptr) {
     return;
   }
 
-  stack<pair<const KDNode*, int>> nodeStack;
-  nodeStack.push({root, 0});
+  STATS_BEGIN();
+  size_t checks = 0;
+  double pruneScale = metric.reducedScale(1.0 + epsilon);
+  stack<SearchEntry> nodeStack;
+  nodeStack.push({root, 0, 0.0});
 
   while (!nodeStack.empty()) {
-    const KDNode* currentNode = nodeStack.top().first;
-    int depth = nodeStack.top().second;
+    SearchEntry entry = nodeStack.top();
+    const KDNode* currentNode = entry.node;
+    int depth = entry.depth;
     nodeStack.pop();
 
     if (currentNode == nullptr) {
       continue;
     }
 
-    int axis = depth % target.size();
-
-    double distance;
-    try {
-      distance = calculateDistance(target, currentNode->features);
-    } catch (const invalid_argument& error) {
-      cerr << "Exception caught: " << error.what() << endl;
+    // Prune subtrees that are too far away to matter
+    if (nearestNeighbors.size() == k &&
+        entry.bound * pruneScale > nearestNeighbors.back().distance) {
+      STATS_ADD(subtreesPruned, 1);
       continue;
     }
 
+    if (maxChecks > 0 && checks >= maxChecks) {
+      break;
+    }
+    checks++;
+    STATS_ADD(nodesVisited, 1);
+
+    int axis = depth % target.size();
+
+    double distance = metric.reducedDistance(target.data(), currentNode->features, target.size());
+    STATS_ADD(distanceEvaluations, 1);
+    STATS_ADD(candidateInserts, nearestNeighbors.size() < k ||
+                                (!nearestNeighbors.empty() && distance < nearestNeighbors.back().distance));
+
     DistanceNode neighbor = {distance, currentNode};
     insertAndSortNeighbors(nearestNeighbors, neighbor, k);
 
-    if (target[axis] < currentNode->features[axis]) {
-      nodeStack.push({currentNode->right.get(), depth + 1});
-      nodeStack.push({currentNode->left.get(), depth + 1});
+    // The far side of the splitting plane is at least this far from the target
+    double diff = target[axis] - currentNode->features[axis];
+    double farBound = max(entry.bound, metric.axisBound(diff, axis));
+
+    if (diff < 0) {
+      nodeStack.push({currentNode->right.get(), depth + 1, farBound});
+      nodeStack.push({currentNode->left.get(), depth + 1, entry.bound});
     } else {
-      nodeStack.push({currentNode->left.get(), depth + 1});
-      nodeStack.push({currentNode->right.get(), depth + 1});
+      nodeStack.push({currentNode->left.get(), depth + 1, farBound});
+      nodeStack.push({currentNode->right.get(), depth + 1, entry.bound});
     }
+    STATS_MAX(maxStackDepth, nodeStack.size());
+  }
+
+  for (DistanceNode& neighbor : nearestNeighbors) {
+    neighbor.distance = metric.fromReduced(neighbor.distance);
   }
+  STATS_END();
+}
+
+// Search KDTree for nearest neighbors, always continuing from the unexplored
+// subtree closest to the target. Good candidates are found early and the search
+// stops as soon as the closest remaining subtree cannot improve the result.
+// The lower bound of a subtree is the distance from the target to its cell,
+// updated in O(1) when a split moves one side of the cell (metric.replaceAxis).
+// epsilon and maxChecks work as in kNNSearchIterative.
+template<typename Metric>
+void kNNSearchBestBinFirst(const KDNode* root, const vector<double>& target, size_t k,
+                           vector<DistanceNode>& nearestNeighbors, const Metric& metric,
+                           double epsilon = 0.0, size_t maxChecks = 0) {
+  if (root == nullptr || k == 0) {
+    return;
+  }
+
+  STATS_BEGIN();
+  size_t dims = target.size();
+  size_t checks = 0;
+  double pruneScale = metric.reducedScale(1.0 + epsilon);
+
+  // Per-axis terms of every queued cell, dims values per entry
+  vector<double> termPool(dims, 0.0);
+  priority_queue<BranchEntry, vector<BranchEntry>, greater<BranchEntry>> branches;
+  branches.push({0.0, root, 0, 0});
+
+  while (!branches.empty()) {
+    BranchEntry branch = branches.top();
+    branches.pop();
+
+    // Every remaining subtree is at least this far away
+    if (nearestNeighbors.size() == k && branch.bound * pruneScale > nearestNeighbors.back().distance) {
+      STATS_ADD(subtreesPruned, branches.size() + 1);
+      break;
+    }
+
+    // Descend towards the target, queueing the far side of every split
+    const KDNode* currentNode = branch.node;
+    int depth = branch.depth;
+    while (currentNode != nullptr) {
+      if (maxChecks > 0 && checks >= maxChecks) {
+        break;
+      }
+      checks++;
+      STATS_ADD(nodesVisited, 1);
+
+      double distance = metric.reducedDistance(target.data(), currentNode->features, dims);
+      STATS_ADD(distanceEvaluations, 1);
+      if (nearestNeighbors.size() < k || distance < nearestNeighbors.back().distance) {
+        STATS_ADD(candidateInserts, 1);
+        DistanceNode neighbor = {distance, currentNode};
+        insertAndSortNeighbors(nearestNeighbors, neighbor, k);
+      }
+
+      int axis = depth % dims;
+      double diff = target[axis] - currentNode->features[axis];
+      const KDNode* nearChild = diff < 0 ? currentNode->left.get() : currentNode->right.get();
+      const KDNode* farChild = diff < 0 ? currentNode->right.get() : currentNode->left.get();
+
+      if (farChild != nullptr) {
+        double oldTerm = termPool[branch.terms + axis];
+        double newTerm = max(oldTerm, metric.axisBound(diff, axis));
+        double farBound = metric.replaceAxis(branch.bound, oldTerm, newTerm);
+
+        if (nearestNeighbors.size() < k || farBound * pruneScale <= nearestNeighbors.back().distance) {
+          // Grow first, then copy by index: inserting a range of the pool
+          // into itself is undefined
+          size_t farTerms = termPool.size();
+          termPool.resize(farTerms + dims);
+          copy_n(termPool.begin() + branch.terms, dims, termPool.begin() + farTerms);
+          termPool[farTerms + axis] = newTerm;
+          branches.push({farBound, farChild, depth + 1, farTerms});
+          STATS_MAX(maxStackDepth, branches.size());
+        } else {
+          STATS_ADD(subtreesPruned, 1);
+        }
+      }
+
+      // The near side keeps the cell distance of its parent
+      currentNode = nearChild;
+      depth++;
+    }
+
+    if (maxChecks > 0 && checks >= maxChecks) {
+      break;
+    }
+  }
+
+  for (DistanceNode& neighbor : nearestNeighbors) {
+    neighbor.distance = metric.fromReduced(neighbor.distance);
+  }
+  STATS_END();
+}
+
+// Neighbor standing for `count` points at the same place
+struct CountedNeighbor {
+  double distance;
+  const KDNode* node;
+  size_t count;
+};
+
+// Depth-first search of a tree whose nodes stand for several points each
+// (duplicates collapsed, see dedup.h): multiplicity(node) points count toward
+// k. The neighbors hold min(k, points in the tree) points in total, the
+// farthest one only as many of its copies as are needed. Same distances as
+// kNNSearchIterative on the tree with all copies.
+template<typename Metric, typename Multiplicity>
+void kNNSearchMultiplicity(const KDNode* root, const vector<double>& target, size_t k,
+                           vector<CountedNeighbor>& nearestNeighbors, const Metric& metric,
+                           Multiplicity multiplicity) {
+  if (root == nullptr || k == 0) {
+    return;
+  }
+
+  STATS_BEGIN();
+  size_t found = 0;   // Points held by nearestNeighbors
+  stack<SearchEntry> nodeStack;
+  nodeStack.push({root, 0, 0.0});
+
+  while (!nodeStack.empty()) {
+    SearchEntry entry = nodeStack.top();
+    const KDNode* currentNode = entry.node;
+    int depth = entry.depth;
+    nodeStack.pop();
+
+    if (currentNode == nullptr) {
+      continue;
+    }
+
+    if (found >= k && entry.bound > nearestNeighbors.back().distance) {
+      STATS_ADD(subtreesPruned, 1);
+      continue;
+    }
+    STATS_ADD(nodesVisited, 1);
+
+    double distance = metric.reducedDistance(target.data(), currentNode->features, target.size());
+    STATS_ADD(distanceEvaluations, 1);
+    if (found < k || distance < nearestNeighbors.back().distance) {
+      STATS_ADD(candidateInserts, 1);
+      CountedNeighbor neighbor = {distance, currentNode, multiplicity(currentNode)};
+      auto it = upper_bound(nearestNeighbors.begin(), nearestNeighbors.end(), neighbor,
+                            [](const CountedNeighbor& a, const CountedNeighbor& b) {
+                              return a.distance < b.distance;
+                            });
+      nearestNeighbors.insert(it, neighbor);
+      found += neighbor.count;
+
+      // Drop the farthest while the others still hold k points
+      while (found - nearestNeighbors.back().count >= k) {
+        found -= nearestNeighbors.back().count;
+        nearestNeighbors.pop_back();
+      }
+    }
+
+    int axis = depth % target.size();
+    double diff = target[axis] - currentNode->features[axis];
+    double farBound = max(entry.bound, metric.axisBound(diff, axis));
+
+    if (diff < 0) {
+      nodeStack.push({currentNode->right.get(), depth + 1, farBound});
+      nodeStack.push({currentNode->left.get(), depth + 1, entry.bound});
+    } else {
+      nodeStack.push({currentNode->left.get(), depth + 1, farBound});
+      nodeStack.push({currentNode->right.get(), depth + 1, entry.bound});
+    }
+    STATS_MAX(maxStackDepth, nodeStack.size());
+  }
+
+  // Only the copies needed to reach k
+  if (found > k) {
+    nearestNeighbors.back().count -= found - k;
+  }
+  for (CountedNeighbor& neighbor : nearestNeighbors) {
+    neighbor.distance = metric.fromReduced(neighbor.distance);
+  }
+  STATS_END();
+}
+
+// Same with the metric chosen at run time
+template<typename Multiplicity>
+void kNNSearchMultiplicity(const KDNode* root, const vector<double>& target, size_t k,
+                           vector<CountedNeighbor>& nearestNeighbors, const MetricSpec& spec,
+                           Multiplicity multiplicity) {
+  withMetric(spec, [&](const auto& metric) {
+    kNNSearchMultiplicity(root, target, k, nearestNeighbors, metric, multiplicity);
+  });
+}
+
+// Euclidean search, see above
+void kNNSearchIterative(const KDNode* root, const vector<double>& target, size_t k,
+                        vector<DistanceNode>& nearestNeighbors,
+                        double epsilon = 0.0, size_t maxChecks = 0) {
+  kNNSearchIterative(root, target, k, nearestNeighbors, EuclideanMetric(), epsilon, maxChecks);
+}
+
+// Search with the metric and traversal order chosen at run time
+void kNNSearchIterative(const KDNode* root, const vector<double>& target, size_t k,
+                        vector<DistanceNode>& nearestNeighbors, const MetricSpec& spec,
+                        double epsilon = 0.0, size_t maxChecks = 0,
+                        SearchOrder order = SEARCH_DEPTH_FIRST) {
+  withMetric(spec, [&](const auto& metric) {
+    if (order == SEARCH_BEST_BIN_FIRST) {
+      kNNSearchBestBinFirst(root, target, k, nearestNeighbors, metric, epsilon, maxChecks);
+    } else {
+      kNNSearchIterative(root, target, k, nearestNeighbors, metric, epsilon, maxChecks);
+    }
+  });
+}
+
+// Parse "dfs" or "bbf" (-o flag). Returns false on bad input.
+bool parseSearchOrder(const string& value, SearchOrder& order) {
+  if (value == "dfs") {
+    order = SEARCH_DEPTH_FIRST;
+  } else if (value == "bbf") {
+    order = SEARCH_BEST_BIN_FIRST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Result cache tag (resultCache.h) of searches with this metric and order:
+// answers cached under one tag are never served to the other
+uint64_t searchCacheTag(const MetricSpec& spec, SearchOrder order) {
+  uint64_t tag = hashWord(hashWord(14695981039346656037ull, spec.type), order);
+  return hashWords(spec.weights.data(), spec.weights.size(), hashWords(&spec.p, 1, tag));
+}
+
+// Distance between two points of n features under the metric chosen at run time
+double metricDistance(const MetricSpec& spec, const double* point1, const double* point2, size_t n) {
+  double distance = 0.0;
+  withMetric(spec, [&](const auto& metric) {
+    distance = metric.fromReduced(metric.reducedDistance(point1, point2, n));
+  });
+  return distance;
+}
+
+double metricDistance(const MetricSpec& spec, const vector<double>& point1, const vector<double>& point2) {
+  return metricDistance(spec, point1.data(), point2.data(), point1.size());
 }
 
 // Parse target point (vector of features)
@@ -107,61 +409,195 @@ vector<double> parseInputVector(const std::string& input) {
   return point;
 }
 
+// Check that a metric chosen on the command line fits d-dimensional data
+bool checkMetric(const MetricSpec& metric, size_t d) {
+  if (metric.type == METRIC_WEIGHTED && metric.weights.size() != d) {
+    cout << "Weighted metric needs " << d << " weights, got " << metric.weights.size() << endl;
+    return false;
+  }
+  return true;
+}
+
+// The cosine metric expects unit vectors, normalize data and targets up front
+void normalizeForMetric(const MetricSpec& metric, PointSet& data,
+                        vector<vector<double>>& targets) {
+  if (metric.type != METRIC_COSINE) {
+    return;
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    normalizeVector(data.features(i), data.dimensions());
+  }
+  for (vector<double>& target : targets) {
+    normalizeVector(target);
+  }
+}
+
+// Parse a file of query points, one per line, keeping the first d features.
+// Extra trailing values (e.g. a label column) are ignored.
+// Lines with fewer than d values are skipped, counted in *skipped if given
+// (blank lines are not counted)
+vector<vector<double>> parseQueryFile(const string& filename, size_t d, size_t* skipped = nullptr) {
+  vector<vector<double>> queries;
+  ifstream file(filename);
+  string line;
+
+  if (skipped != nullptr) {
+    *skipped = 0;
+  }
+  if (!file.is_open()) {
+    cout << "Unable to open query file " << filename << endl;
+    return queries;
+  }
+
+  while (getline(file, line)) {
+    replace(line.begin(), line.end(), ',', ' ');
+    vector<double> query = parseInputVector(line);
+    if (query.size() < d) {
+      if (skipped != nullptr && line.find_first_not_of(" \t\r") != string::npos) {
+        (*skipped)++;
+      }
+      continue;
+    }
+    query.resize(d);
+    queries.push_back(query);
+  }
+
+  return queries;
+}
+
+// Label with the most votes, the smallest of those tied
+int majorityLabel(const map<int, size_t>& labelCounts) {
+  size_t maxCount = 0;
+  int bestLabel = 0;
+  for (auto keyVal : labelCounts) {
+    if (keyVal.second > maxCount) {
+      maxCount = keyVal.second;
+      bestLabel = keyVal.first;
+    }
+  }
+  return bestLabel;
+}
+
+// Majority vote over the labels of a neighbor list
+int majorityLabel(const vector<int>& labels) {
+  map<int, size_t> labelCounts;
+  for (int label : labels) {
+    labelCounts[label]++;
+  }
+  return majorityLabel(labelCounts);
+}
+
 class KNN {
 public:
-  vector<DataPoint> nearestNeighbors;
+  PointSet nearestNeighbors;
   int targetLabel;
 
   // void kNNSearch(const KDTree& kdTree, const vector<double>& target, int k);
 
-  void kNNSearchParallelOpenMP(const KDTree& kdTree, const vector<double>& target, int k);
+  void kNNSearchParallelOpenMP(const KDTree& kdTree, const vector<double>& target, int k,
+                               const MetricSpec& metric = MetricSpec());
   
-  void kNNSearchParallelMPI(const vector<DataPoint>& data, const vector<double>& target, int k, int rank, int nproc);
+  void kNNSearchParallelMPI(PointSet& localData, const vector<double>& target, int k, int d, int rank, int nproc,
+                            const MetricSpec& metric = MetricSpec());
 
   // Find k nearest neighbors of target point
-  void kNNSearch(const KDTree& kdTree, const vector<double>& target, int k) {
+  void kNNSearch(const KDTree& kdTree, const vector<double>& target, int k,
+                 const MetricSpec& metric = MetricSpec(), SearchOrder order = SEARCH_DEPTH_FIRST) {
     vector<DistanceNode> nearestNeighborsVector;
+    if (!checkTarget(kdTree, target)) {
+      return;
+    }
 
     // Add k nearest neighbors to result using kdTree
-    kNNSearchIterative(kdTree.root.get(), target, (size_t)k, nearestNeighborsVector);
+    kNNSearchIterative(kdTree.root.get(), target, (size_t)k, nearestNeighborsVector, metric,
+                       0.0, 0, order);
 
-    // Collect the results from the priority queue
+    collectNeighbors(kdTree, nearestNeighborsVector);
+  }
+
+  // Find approximately nearest neighbors of target point
+  // (see kNNSearchIterative for epsilon and maxChecks)
+  void kNNSearchApprox(const KDTree& kdTree, const vector<double>& target, int k,
+                       double epsilon, size_t maxChecks, const MetricSpec& metric = MetricSpec(),
+                       SearchOrder order = SEARCH_DEPTH_FIRST) {
+    vector<DistanceNode> nearestNeighborsVector;
+    if (!checkTarget(kdTree, target)) {
+      return;
+    }
+
+    kNNSearchIterative(kdTree.root.get(), target, (size_t)k, nearestNeighborsVector,
+                       metric, epsilon, maxChecks, order);
+
+    collectNeighbors(kdTree, nearestNeighborsVector);
+  }
+
+  // Nodes only hold pointers into the tree's points, the target may not be longer
+  bool checkTarget(const KDTree& kdTree, const vector<double>& target) const {
+    if (target.size() > kdTree.points.dimensions()) {
+      cerr << "Exception caught: Points must have the same number of features" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Copy the neighbors found into nearestNeighbors, farthest first
+  void collectNeighbors(const KDTree& kdTree, vector<DistanceNode>& nearestNeighborsVector) {
+    nearestNeighbors = PointSet(kdTree.points.dimensions());
+    nearestNeighbors.reserve(nearestNeighborsVector.size());
     while (!nearestNeighborsVector.empty()) {
       DistanceNode point = nearestNeighborsVector.back();
-      nearestNeighbors.push_back({ point.node->features, point.node->label });
+      nearestNeighbors.push_back(point.node->features, point.node->label);
       nearestNeighborsVector.pop_back();
     }
   }
 
+  // Fraction of our neighbors that are true k nearest neighbors of target.
+  // Points tied with the exact k-th distance count as correct.
+  double recall(const KNN& exact, const vector<double>& target,
+                const MetricSpec& metric = MetricSpec()) const {
+    if (exact.nearestNeighbors.empty()) {
+      return 1.0;
+    }
+
+    double kthDistance = 0.0;
+    for (size_t i = 0; i < exact.nearestNeighbors.size(); i++) {
+      kthDistance = max(kthDistance, metricDistance(metric, target.data(),
+                                                    exact.nearestNeighbors.features(i), target.size()));
+    }
+
+    size_t hits = 0;
+    for (size_t i = 0; i < nearestNeighbors.size(); i++) {
+      hits += metricDistance(metric, target.data(), nearestNeighbors.features(i), target.size()) <=
+              kthDistance * (1.0 + 1e-12);
+    }
+
+    return (double)hits / exact.nearestNeighbors.size();
+  }
+
   void printNearestNeighbors() {
     cout << "\nList of " << nearestNeighbors.size() << " nearest neighbors:" << endl;
-    for (auto neighbor : nearestNeighbors) {
-      int numFeatures = neighbor.features.size();
-      for (int i = 0; i < numFeatures; i++) {
-        cout << neighbor.features[i] << " ";
+    for (size_t n = 0; n < nearestNeighbors.size(); n++) {
+      PointView neighbor = nearestNeighbors[n];
+      for (double feature : neighbor) {
+        cout << feature << " ";
       }
       cout << neighbor.label << endl;
     }
   }
 
-  // Determine the target point's label based on its nearest neighbors
-  void findTargetLabel() {
-    map<int,int> labelCounts;
-
-    // Count occurrences of each label among nearest neighbors
-    for (auto neighbor : nearestNeighbors) {
-      labelCounts[neighbor.label]++;
-    }
-
-    // Find the label with the highest count
-    int maxCount = 0;
-    for (auto keyVal : labelCounts) {
-      if (keyVal.second > maxCount) {
-        maxCount = keyVal.second;
-        targetLabel = keyVal.first;
-      }
+  // Majority label of the nearest neighbors, kept in targetLabel
+  int predictLabel() {
+    map<int, size_t> labelCounts;
+    for (size_t n = 0; n < nearestNeighbors.size(); n++) {
+      labelCounts[nearestNeighbors.label(n)]++;
     }
+    targetLabel = majorityLabel(labelCounts);
+    return targetLabel;
+  }
 
+  // Determine the target point's label based on its nearest neighbors
+  void findTargetLabel() {
+    predictLabel();
     cout << "\nPredicted label for the target point: " << targetLabel << endl;
   }
 };
@@ -0,0 +1,222 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+// Distance metrics as compile-time policies.
+// Searches are templated on the metric, so each one gets its own inner loop
+// with no virtual dispatch. Metrics work on a "reduced" distance that orders
+// points the same way but is cheaper to compute (e.g. squared Euclidean).
+//
+// Every metric provides:
+//   reducedDistance(a, b, n)  reduced distance between two points
+//   axisBound(diff, axis)     reduced lower bound on the distance to any point on
+//                             the far side of a splitting plane |diff| away on axis
+//   fromReduced(r)            actual distance of a reduced distance
+//   reducedScale(f)           factor by which the reduced distance grows when the
+//                             actual distance grows by f (used for epsilon pruning)
+//   replaceAxis(r, old, new)  reduced lower bound r after the axisBound term of one
+//                             axis grows from old to new (incremental cell distance)
+
+struct EuclideanMetric {
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      double diff = a[i] - b[i];
+      distance += diff * diff;
+    }
+    return distance;
+  }
+  double axisBound(double diff, size_t) const { return diff * diff; }
+  double fromReduced(double r) const { return sqrt(r); }
+  double reducedScale(double f) const { return f * f; }
+  double replaceAxis(double r, double oldTerm, double newTerm) const { return r - oldTerm + newTerm; }
+};
+
+// L1 distance
+struct ManhattanMetric {
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      distance += fabs(a[i] - b[i]);
+    }
+    return distance;
+  }
+  double axisBound(double diff, size_t) const { return fabs(diff); }
+  double fromReduced(double r) const { return r; }
+  double reducedScale(double f) const { return f; }
+  double replaceAxis(double r, double oldTerm, double newTerm) const { return r - oldTerm + newTerm; }
+};
+
+// L-infinity distance
+struct ChebyshevMetric {
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      distance = max(distance, fabs(a[i] - b[i]));
+    }
+    return distance;
+  }
+  double axisBound(double diff, size_t) const { return fabs(diff); }
+  double fromReduced(double r) const { return r; }
+  double reducedScale(double f) const { return f; }
+  double replaceAxis(double r, double, double newTerm) const { return max(r, newTerm); }
+};
+
+// General Lp distance, p >= 1
+struct MinkowskiMetric {
+  double p;
+
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      distance += pow(fabs(a[i] - b[i]), p);
+    }
+    return distance;
+  }
+  double axisBound(double diff, size_t) const { return pow(fabs(diff), p); }
+  double fromReduced(double r) const { return pow(r, 1.0 / p); }
+  double reducedScale(double f) const { return pow(f, p); }
+  double replaceAxis(double r, double oldTerm, double newTerm) const { return r - oldTerm + newTerm; }
+};
+
+// Euclidean distance with a non-negative weight per axis
+struct WeightedEuclideanMetric {
+  const double* weights;    // One weight per axis, owned by the MetricSpec
+
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      double diff = a[i] - b[i];
+      distance += weights[i] * diff * diff;
+    }
+    return distance;
+  }
+  double axisBound(double diff, size_t axis) const { return weights[axis] * diff * diff; }
+  double fromReduced(double r) const { return sqrt(r); }
+  double reducedScale(double f) const { return f * f; }
+  double replaceAxis(double r, double oldTerm, double newTerm) const { return r - oldTerm + newTerm; }
+};
+
+// Cosine distance 1 - a.b, for vectors normalized to unit length.
+// On unit vectors 1 - a.b = |a - b|^2 / 2, which gives the plane bound.
+struct CosineMetric {
+  double reducedDistance(const double* a, const double* b, size_t n) const {
+    double dot = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      dot += a[i] * b[i];
+    }
+    return max(0.0, 1.0 - dot);
+  }
+  double axisBound(double diff, size_t) const { return 0.5 * diff * diff; }
+  double fromReduced(double r) const { return r; }
+  double reducedScale(double f) const { return f; }
+  double replaceAxis(double r, double oldTerm, double newTerm) const { return r - oldTerm + newTerm; }
+};
+
+enum MetricType {
+  METRIC_EUCLIDEAN,
+  METRIC_MANHATTAN,
+  METRIC_CHEBYSHEV,
+  METRIC_MINKOWSKI,
+  METRIC_WEIGHTED,
+  METRIC_COSINE
+};
+
+// Metric chosen at run time (-m flag), turned into a policy by withMetric
+struct MetricSpec {
+  MetricType type = METRIC_EUCLIDEAN;
+  double p = 2.0;              // METRIC_MINKOWSKI
+  vector<double> weights;      // METRIC_WEIGHTED
+};
+
+// Parse "euclidean", "manhattan", "chebyshev", "minkowski:<p>",
+// "weighted:<w1,w2,...>" or "cosine". Returns false on bad input.
+bool parseMetric(const string& value, MetricSpec& spec) {
+  string name = value.substr(0, value.find(':'));
+  string argument = value.find(':') == string::npos ? "" : value.substr(value.find(':') + 1);
+
+  spec = MetricSpec();
+  if (name == "euclidean" || name == "l2") {
+    spec.type = METRIC_EUCLIDEAN;
+  } else if (name == "manhattan" || name == "l1") {
+    spec.type = METRIC_MANHATTAN;
+  } else if (name == "chebyshev" || name == "linf") {
+    spec.type = METRIC_CHEBYSHEV;
+  } else if (name == "minkowski") {
+    spec.type = METRIC_MINKOWSKI;
+    spec.p = atof(argument.c_str());
+    return spec.p >= 1.0;
+  } else if (name == "weighted") {
+    spec.type = METRIC_WEIGHTED;
+    replace(argument.begin(), argument.end(), ',', ' ');
+    istringstream iss(argument);
+    double weight;
+    while (iss >> weight) {
+      if (weight < 0.0) {
+        return false;
+      }
+      spec.weights.push_back(weight);
+    }
+    return !spec.weights.empty();
+  } else if (name == "cosine") {
+    spec.type = METRIC_COSINE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Call function(metric) with the policy object matching spec.
+// The switch runs once per call, the search inside is specialized per metric.
+template<typename Function>
+void withMetric(const MetricSpec& spec, Function function) {
+  switch (spec.type) {
+    case METRIC_EUCLIDEAN:
+      function(EuclideanMetric());
+      break;
+    case METRIC_MANHATTAN:
+      function(ManhattanMetric());
+      break;
+    case METRIC_CHEBYSHEV:
+      function(ChebyshevMetric());
+      break;
+    case METRIC_MINKOWSKI:
+      function(MinkowskiMetric{spec.p});
+      break;
+    case METRIC_WEIGHTED:
+      function(WeightedEuclideanMetric{spec.weights.data()});
+      break;
+    case METRIC_COSINE:
+      function(CosineMetric());
+      break;
+  }
+}
+
+// Scale a point of n features to unit length (input of the cosine metric)
+void normalizeVector(double* point, size_t n) {
+  double norm = 0.0;
+  for (size_t i = 0; i < n; i++) {
+    norm += point[i] * point[i];
+  }
+  norm = sqrt(norm);
+  if (norm > 0.0) {
+    for (size_t i = 0; i < n; i++) {
+      point[i] /= norm;
+    }
+  }
+}
+
+void normalizeVector(vector<double>& point) {
+  normalizeVector(point.data(), point.size());
+}
+
+#endif
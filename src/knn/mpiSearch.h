@@ -0,0 +1,126 @@
+#ifndef MPI_SEARCH_H
+#define MPI_SEARCH_H
+
+#include <vector>
+#include <algorithm>
+#include "mpi.h"
+#include "knn.h"
+#include "../kdTree/kdTree.h"
+#include "../timing.h"
+
+using namespace std;
+
+// Distributed batch search: every rank searches its local tree and rank 0
+// merges the neighbors. Shared by knn-mpi.out and the MPI benchmark.
+
+// Split `total` items evenly among processes and return this rank's [begin, end)
+void sliceRange(int rank, int size, long long total, long long& begin, long long& end) {
+  begin = total * rank / size;
+  end = total * (rank + 1) / size;
+}
+
+// Search the local tree, keeping only the distance and label of each neighbor
+void kNNSearchMPI(const KDNode* root, const vector<double>& target, size_t k,
+                  vector<DistanceNode2>& neighbors, const MetricSpec& metric) {
+  vector<DistanceNode> nearestNeighbors;
+  kNNSearchIterative(root, target, k, nearestNeighbors, metric);
+
+  neighbors.clear();
+  for (const DistanceNode& neighbor : nearestNeighbors) {
+    neighbors.push_back({neighbor.distance, neighbor.node->label});
+  }
+}
+
+// Search the local tree for every query, queries are spread over the OpenMP threads
+vector<vector<DistanceNode2>> localBatchSearch(const KDTree& localKDTree, const vector<vector<double>>& queries,
+                                               size_t k, const MetricSpec& metric) {
+  vector<vector<DistanceNode2>> results(queries.size());
+
+  string parent = phasePath();
+  #pragma omp parallel
+  {
+    PhaseContext context(parent);
+    ScopedPhase phase("search thread");
+
+    #pragma omp for schedule(dynamic, 16)
+    for (size_t q = 0; q < queries.size(); q++) {
+      kNNSearchMPI(localKDTree.root.get(), queries[q], k, results[q], metric);
+    }
+  }
+
+  return results;
+}
+
+// Gather every process' local neighbors on rank 0 and keep the k closest per query
+vector<vector<DistanceNode2>> gatherBatchResults(const vector<vector<DistanceNode2>>& localResults,
+                                                size_t k, int rank, int size) {
+  int numQueries = localResults.size();
+  ScopedPhase gatherPhase("mpi gather");
+
+  MPI_Datatype MPI_DISTANCENODE;
+  MPI_Type_contiguous(sizeof(DistanceNode2), MPI_BYTE, &MPI_DISTANCENODE);
+  MPI_Type_commit(&MPI_DISTANCENODE);
+
+  // Flatten local results, remembering how many neighbors each query has
+  vector<int> localCounts(numQueries);
+  vector<DistanceNode2> localNeighbors;
+  for (int q = 0; q < numQueries; q++) {
+    localCounts[q] = localResults[q].size();
+    localNeighbors.insert(localNeighbors.end(), localResults[q].begin(), localResults[q].end());
+  }
+
+  vector<int> allCounts(rank == 0 ? numQueries * size : 0);
+  MPI_Gather(localCounts.data(), numQueries, MPI_INT, allCounts.data(), numQueries, MPI_INT, 0, MPI_COMM_WORLD);
+
+  vector<int> sizes(size, 0);
+  int sizeToSend = localNeighbors.size();
+  MPI_Gather(&sizeToSend, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+  // Compute displacements for all the neighbors (prefix sum)
+  vector<int> displacements(size, 0);
+  int allNeighborsSum = 0;
+  for (int i = 0; i < size; i++) {
+    displacements[i] = allNeighborsSum;
+    allNeighborsSum += sizes[i];
+  }
+
+  // Gather nearest neighbors from all processes
+  vector<DistanceNode2> allNearestNeighbors(allNeighborsSum);
+  MPI_Gatherv(localNeighbors.data(), sizeToSend, MPI_DISTANCENODE,
+              allNearestNeighbors.data(), sizes.data(), displacements.data(),
+              MPI_DISTANCENODE, 0, MPI_COMM_WORLD);
+
+  MPI_Type_free(&MPI_DISTANCENODE);
+  gatherPhase.end();
+
+  // On process rank 0, combine the results
+  vector<vector<DistanceNode2>> merged;
+  if (rank == 0) {
+    ScopedPhase mergePhase("merge");
+    merged.resize(numQueries);
+    for (int r = 0; r < size; r++) {
+      int offset = displacements[r];
+      for (int q = 0; q < numQueries; q++) {
+        int count = allCounts[r * numQueries + q];
+        merged[q].insert(merged[q].end(), allNearestNeighbors.begin() + offset,
+                         allNearestNeighbors.begin() + offset + count);
+        offset += count;
+      }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int q = 0; q < numQueries; q++) {
+      std::sort(merged[q].begin(), merged[q].end(),
+                [](const DistanceNode2& a, const DistanceNode2& b) {
+                  return a.distance < b.distance;
+                });
+      if (merged[q].size() > k) {
+        merged[q].resize(k);
+      }
+    }
+  }
+
+  return merged;
+}
+
+#endif
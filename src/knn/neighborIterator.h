@@ -0,0 +1,165 @@
+#ifndef NEIGHBOR_ITERATOR_H
+#define NEIGHBOR_ITERATOR_H
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <type_traits>
+#include "knn.h"
+
+using namespace std;
+
+// Neighbors of a target one at a time, nearest first, for callers that do
+// not know k up front (keep pulling until enough neighbors pass a filter)
+// instead of rerunning kNNSearchIterative with ever larger k. Subtrees and
+// points wait in one priority queue keyed by their reduced distance (the
+// subtree's is the lower bound of best-bin-first search), so a point comes out
+// once nothing left in the queue can be closer, and each next() does only the
+// work needed to settle one more neighbor. Points the predicate rejects are
+// never queued. The tree must not change while iterating.
+//
+//   NeighborIterator<EuclideanMetric, LabelIs> neighbors(root, target, EuclideanMetric(), LabelIs(3));
+//   DistanceNode neighbor;
+//   while (neighbors.next(neighbor) && !enough(neighbor)) { ... }
+
+// Predicate taking every point
+struct AcceptAll {
+  bool operator()(const KDNode*) const { return true; }
+};
+
+// Predicate taking the points with one label
+struct LabelIs {
+  int label;
+
+  explicit LabelIs(int label) : label(label) {}
+  bool operator()(const KDNode* node) const { return node->label == label; }
+};
+
+template<typename Metric, typename Predicate = AcceptAll>
+class NeighborIterator {
+public:
+  NeighborIterator(const KDNode* root, const vector<double>& target, const Metric& metric,
+                   Predicate accept = Predicate())
+      : target(target), metric(metric), accept(accept), termPool(target.size(), 0.0), visited(0), returned(0) {
+    if (root != nullptr && !target.empty()) {
+      pending.push({0.0, root, 0, 0, false});
+    }
+  }
+
+  // The next nearest accepted point, false once there is none left
+  bool next(DistanceNode& neighbor) {
+    size_t dims = target.size();
+    while (!pending.empty()) {
+      Entry entry = pending.top();
+      pending.pop();
+
+      if (entry.point) {
+        neighbor = {metric.fromReduced(entry.key), entry.node};
+        returned++;
+        return true;
+      }
+
+      const KDNode* node = entry.node;
+      visited++;
+      if (accept(node)) {
+        pending.push({metric.reducedDistance(target.data(), node->features, dims), node, entry.depth, 0, true});
+      }
+
+      int axis = entry.depth % dims;
+      double diff = target[axis] - node->features[axis];
+      const KDNode* nearChild = diff < 0 ? node->left.get() : node->right.get();
+      const KDNode* farChild = diff < 0 ? node->right.get() : node->left.get();
+
+      // The near side keeps the cell of its parent
+      if (nearChild != nullptr) {
+        pending.push({entry.key, nearChild, entry.depth + 1, entry.terms, false});
+      }
+      if (farChild != nullptr) {
+        double oldTerm = termPool[entry.terms + axis];
+        double newTerm = max(oldTerm, metric.axisBound(diff, axis));
+        // Grow first, then copy by index: inserting a range of the pool into itself is undefined
+        size_t farTerms = termPool.size();
+        termPool.resize(farTerms + dims);
+        copy_n(termPool.begin() + entry.terms, dims, termPool.begin() + farTerms);
+        termPool[farTerms + axis] = newTerm;
+        pending.push({metric.replaceAxis(entry.key, oldTerm, newTerm), farChild, entry.depth + 1, farTerms, false});
+      }
+    }
+    return false;
+  }
+
+  // Up to count more neighbors, appended to neighbors. Returns how many were found.
+  size_t next(size_t count, vector<DistanceNode>& neighbors) {
+    DistanceNode neighbor;
+    size_t found = 0;
+    while (found < count && next(neighbor)) {
+      neighbors.push_back(neighbor);
+      found++;
+    }
+    return found;
+  }
+
+  size_t nodesVisited() const { return visited; }
+  size_t neighborsReturned() const { return returned; }
+  size_t queued() const { return pending.size(); }
+
+private:
+  // Subtree with the lower bound of its cell, or a point with its distance.
+  // terms points to the per-axis axisBound terms of a subtree's cell in termPool.
+  struct Entry {
+    double key;
+    const KDNode* node;
+    int depth;
+    size_t terms;
+    bool point;
+
+    // Points before subtrees at the same distance, so they come out without
+    // expanding the subtree first
+    bool operator>(const Entry& other) const {
+      return key > other.key || (key == other.key && !point && other.point);
+    }
+  };
+
+  vector<double> target;
+  Metric metric;
+  Predicate accept;
+  vector<double> termPool;
+  priority_queue<Entry, vector<Entry>, greater<Entry>> pending;
+  size_t visited;    // Subtrees expanded
+  size_t returned;
+};
+
+// Pass the accepted neighbors of target to visit, nearest first, with the
+// metric chosen at run time, until visit returns false or the tree runs out.
+// Returns how many neighbors were visited.
+template<typename Predicate, typename Visit>
+size_t forEachNeighbor(const KDNode* root, const vector<double>& target, const MetricSpec& spec,
+                       Predicate accept, Visit visit) {
+  size_t count = 0;
+  withMetric(spec, [&](const auto& metric) {
+    NeighborIterator<typename decay<decltype(metric)>::type, Predicate> neighbors(root, target, metric, accept);
+    DistanceNode neighbor;
+    while (neighbors.next(neighbor)) {
+      count++;
+      if (!visit(neighbor)) {
+        break;
+      }
+    }
+  });
+  return count;
+}
+
+// The k nearest points the predicate accepts, fewer if the tree has fewer
+template<typename Predicate>
+void kNNSearchFiltered(const KDNode* root, const vector<double>& target, size_t k,
+                       vector<DistanceNode>& nearestNeighbors, const MetricSpec& spec, Predicate accept) {
+  if (k == 0) {
+    return;
+  }
+  forEachNeighbor(root, target, spec, accept, [&](const DistanceNode& neighbor) {
+    nearestNeighbors.push_back(neighbor);
+    return nearestNeighbors.size() < k;
+  });
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef QUERY_PROTOCOL_H
+#define QUERY_PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Binary protocol of knn-server.out, in native byte order (local sockets only).
+// A connection carries any number of requests, responses may come back out of
+// order and carry the id of their request.
+//   Request:  QueryRequestHeader, then `dimensions` doubles
+//   Response: QueryResponseHeader, then `count` QueryNeighbor, closest first
+
+#define QUERY_MAGIC 0x514e4e4bu   // "KNNQ"
+#define QUERY_MAX_DIMENSIONS 65536
+
+enum QueryStatus : uint32_t {
+  QUERY_OK = 0,
+  QUERY_BAD_DIMENSIONS = 1,   // Not the dimensions of the server's tree
+  QUERY_BAD_K = 2,            // k is 0 or above the server's limit
+  QUERY_DEADLINE_EXCEEDED = 3 // Still waiting when the server's latency budget ran out
+};
+
+struct QueryRequestHeader {
+  uint32_t magic;
+  uint32_t id;
+  uint32_t k;
+  uint32_t dimensions;
+};
+
+struct QueryResponseHeader {
+  uint32_t id;
+  uint32_t status;
+  uint32_t count;
+  int32_t label;      // Majority label of the neighbors
+};
+
+struct QueryNeighbor {
+  double distance;
+  int32_t label;
+  int32_t padding;
+};
+
+// Read exactly `bytes`, false on end of stream or error
+bool readFully(int fd, void* buffer, size_t bytes) {
+  char* cursor = static_cast<char*>(buffer);
+  while (bytes > 0) {
+    ssize_t got = read(fd, cursor, bytes);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    cursor += got;
+    bytes -= got;
+  }
+  return true;
+}
+
+bool writeFully(int fd, const void* buffer, size_t bytes) {
+  const char* cursor = static_cast<const char*>(buffer);
+  while (bytes > 0) {
+    ssize_t put = write(fd, cursor, bytes);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return false;
+    }
+    cursor += put;
+    bytes -= put;
+  }
+  return true;
+}
+
+// Fill a Unix socket address, false if the path does not fit
+bool unixSocketAddress(const string& path, sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return true;
+}
+
+// Listening socket at path (replacing a stale one), -1 on error
+int listenUnixSocket(const string& path) {
+  sockaddr_un address;
+  if (!unixSocketAddress(path, address)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Connected socket, -1 on error
+int connectUnixSocket(const string& path) {
+  sockaddr_un address;
+  if (!unixSocketAddress(path, address)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#endif
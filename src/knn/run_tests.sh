@@ -1,9 +1,26 @@
 #!/bin/bash
 
+# Compare pure MPI (one thread per rank) against hybrid MPI + OpenMP layouts
+# using the same number of cores. knn-mpi.out appends one line per run to
+# knn_timings.txt, the summary at the end is built from those lines.
+
 cores=(2 4 8 16 32 64 128)
+threads=(1 2 4 8 16)
 for i in "${cores[@]}";
 do
-    echo "Running on $i cores"
-    export NUM_PROCS=$i
-    make run-mpi
+    for t in "${threads[@]}";
+    do
+        if (( t > i )); then
+            continue
+        fi
+        procs=$((i / t))
+        echo "Running on $i cores: $procs processes x $t threads"
+        export NUM_PROCS=$procs
+        export NUM_THREADS=$t
+        make run-mpi
+    done
 done
+
+echo
+echo "Scaling report (processes x threads: ingest, build, total)"
+grep "^Parallel:" knn_timings.txt | sed -E 's/.*Processes: ([0-9]+), Threads: ([0-9]+), Queries: ([0-9]+), Ingest: ([0-9.e-]+) seconds, Build: ([0-9.e-]+) seconds, Time: ([0-9.e-]+) seconds/\1 x \2: ingest \4s, build \5s, total \6s/'
@@ -0,0 +1,303 @@
+#ifndef SEARCH_STATS_H
+#define SEARCH_STATS_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include "../resultCache.h"
+
+using namespace std;
+
+// Per-query search counters. Compiled in only with -DKNN_STATS (make STATS=1),
+// otherwise the STATS_* macros expand to nothing and searches pay nothing.
+//
+// Each thread keeps its own totals and histograms, merged on demand:
+//   lastQueryStats()       counters of the calling thread's last query
+//   searchStatsSnapshot()  all threads merged
+//   resetSearchStats()     start over
+// With KNN_STATS_JSON=<file> in the environment every binary writes the
+// merged stats to <file> as JSON when it exits. Result caches in front of
+// the searches (resultCache.h) report through recordCacheStats(), which is
+// always compiled in.
+
+struct QueryStats {
+  size_t nodesVisited;         // Nodes taken off the stack / queue and examined
+  size_t distanceEvaluations;  // Full point-to-target distances computed
+  size_t subtreesPruned;       // Subtrees skipped because of their lower bound
+  size_t candidateInserts;     // Points that entered the current k nearest
+  size_t maxStackDepth;        // Largest number of pending subtrees
+};
+
+#define QUERY_STATS_FIELDS 5
+
+inline const char* queryStatsName(int field) {
+  static const char* names[QUERY_STATS_FIELDS] = {"nodesVisited", "distanceEvaluations", "subtreesPruned",
+                                                  "candidateInserts", "maxStackDepth"};
+  return names[field];
+}
+
+inline size_t queryStatsField(const QueryStats& stats, int field) {
+  const size_t values[QUERY_STATS_FIELDS] = {stats.nodesVisited, stats.distanceEvaluations, stats.subtreesPruned,
+                                             stats.candidateInserts, stats.maxStackDepth};
+  return values[field];
+}
+
+// Power-of-two histogram: bucket b counts values in [2^(b-1), 2^b), bucket 0 counts zeros
+class StatsHistogram {
+public:
+  static const int NUM_BUCKETS = 65;
+
+  StatsHistogram() : buckets(NUM_BUCKETS, 0), count(0), sum(0), maximum(0) {}
+
+  void add(size_t value) {
+    int bucket = 0;
+    while (bucket < 64 && (value >> bucket) != 0) {
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    sum += value;
+    maximum = max(maximum, value);
+  }
+
+  void merge(const StatsHistogram& other) {
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      buckets[b] += other.buckets[b];
+    }
+    count += other.count;
+    sum += other.sum;
+    maximum = max(maximum, other.maximum);
+  }
+
+  double mean() const { return count > 0 ? (double)sum / count : 0.0; }
+
+  // Upper end of the bucket holding the p-th value, capped at the maximum
+  size_t percentile(double p) const {
+    size_t rank = (size_t)(p * count);
+    size_t seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      seen += buckets[b];
+      if (seen > rank) {
+        return min(maximum, bucketHigh(b));
+      }
+    }
+    return maximum;
+  }
+
+  static size_t bucketLow(int b) { return b == 0 ? 0 : (size_t)1 << (b - 1); }
+  static size_t bucketHigh(int b) { return b == 0 ? 0 : b == 64 ? ~(size_t)0 : ((size_t)1 << b) - 1; }
+
+  vector<size_t> buckets;
+  size_t count;
+  size_t sum;
+  size_t maximum;
+};
+
+// Aggregate of many queries
+struct SearchStats {
+  size_t queries;
+  StatsHistogram histograms[QUERY_STATS_FIELDS];
+
+  SearchStats() : queries(0) {}
+
+  void add(const QueryStats& stats) {
+    queries++;
+    for (int field = 0; field < QUERY_STATS_FIELDS; field++) {
+      histograms[field].add(queryStatsField(stats, field));
+    }
+  }
+
+  void merge(const SearchStats& other) {
+    queries += other.queries;
+    for (int field = 0; field < QUERY_STATS_FIELDS; field++) {
+      histograms[field].merge(other.histograms[field]);
+    }
+  }
+};
+
+// Per-thread stats, owned by a registry so they outlive their threads
+struct ThreadSearchStats {
+  SearchStats total;
+  QueryStats last;
+};
+
+struct SearchStatsRegistry {
+  mutex lock;
+  vector<unique_ptr<ThreadSearchStats>> threads;
+  map<string, CacheStats> caches;
+  string outputPath;
+
+  SearchStatsRegistry() {
+    const char* path = getenv("KNN_STATS_JSON");
+    outputPath = path != nullptr ? path : "";
+  }
+
+  ~SearchStatsRegistry();
+};
+
+inline SearchStatsRegistry& searchStatsRegistry() {
+  static SearchStatsRegistry registry;
+  return registry;
+}
+
+inline ThreadSearchStats& threadSearchStats() {
+  thread_local ThreadSearchStats* stats = nullptr;
+  if (stats == nullptr) {
+    SearchStatsRegistry& registry = searchStatsRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    registry.threads.push_back(unique_ptr<ThreadSearchStats>(new ThreadSearchStats()));
+    stats = registry.threads.back().get();
+  }
+  return *stats;
+}
+
+inline void recordQueryStats(const QueryStats& stats) {
+  ThreadSearchStats& local = threadSearchStats();
+  local.last = stats;
+  local.total.add(stats);
+}
+
+inline QueryStats lastQueryStats() {
+  return threadSearchStats().last;
+}
+
+// Merge every thread's stats. Call while no search is running.
+inline SearchStats searchStatsSnapshot() {
+  SearchStatsRegistry& registry = searchStatsRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  SearchStats merged;
+  for (const auto& stats : registry.threads) {
+    merged.merge(stats->total);
+  }
+  return merged;
+}
+
+inline void resetSearchStats() {
+  SearchStatsRegistry& registry = searchStatsRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  for (auto& stats : registry.threads) {
+    *stats = ThreadSearchStats();
+  }
+}
+
+// Latest stats of the named result cache, written with the search stats
+inline void recordCacheStats(const string& name, const CacheStats& stats) {
+  SearchStatsRegistry& registry = searchStatsRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  registry.caches[name] = stats;
+}
+
+inline map<string, CacheStats> cacheStatsSnapshot() {
+  SearchStatsRegistry& registry = searchStatsRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  return registry.caches;
+}
+
+// Where the stats go at exit, e.g. one file per MPI rank
+inline void setSearchStatsPath(const string& path) {
+  searchStatsRegistry().outputPath = path;
+}
+
+inline string searchStatsPath() {
+  return searchStatsRegistry().outputPath;
+}
+
+inline void writeSearchStatsJSON(ostream& out, const SearchStats& stats, size_t numThreads,
+                                 const map<string, CacheStats>& caches = map<string, CacheStats>()) {
+  out << "{\n  \"queries\": " << stats.queries << ",\n  \"threads\": " << numThreads << ",\n  \"counters\": {\n";
+  for (int field = 0; field < QUERY_STATS_FIELDS; field++) {
+    const StatsHistogram& histogram = stats.histograms[field];
+    out << "    \"" << queryStatsName(field) << "\": {\"total\": " << histogram.sum
+        << ", \"mean\": " << histogram.mean() << ", \"p50\": " << histogram.percentile(0.5)
+        << ", \"p90\": " << histogram.percentile(0.9) << ", \"p99\": " << histogram.percentile(0.99)
+        << ", \"max\": " << histogram.maximum << ", \"histogram\": [";
+    bool first = true;
+    for (int b = 0; b < StatsHistogram::NUM_BUCKETS; b++) {
+      if (histogram.buckets[b] == 0) {
+        continue;
+      }
+      out << (first ? "" : ", ") << "[" << StatsHistogram::bucketLow(b) << ", "
+          << StatsHistogram::bucketHigh(b) << ", " << histogram.buckets[b] << "]";
+      first = false;
+    }
+    out << "]}" << (field + 1 < QUERY_STATS_FIELDS ? "," : "") << "\n";
+  }
+  out << "  }";
+  if (!caches.empty()) {
+    out << ",\n  \"caches\": {\n";
+    for (auto cache = caches.begin(); cache != caches.end(); ++cache) {
+      out << "    \"" << cache->first << "\": ";
+      writeCacheStatsJSON(out, cache->second);
+      out << (next(cache) != caches.end() ? "," : "") << "\n";
+    }
+    out << "  }";
+  }
+  out << "\n}\n";
+}
+
+inline bool writeSearchStatsJSON(const string& path) {
+  ofstream out(path);
+  if (!out.is_open()) {
+    cerr << "Unable to open file " << path << endl;
+    return false;
+  }
+  SearchStats stats = searchStatsSnapshot();
+  map<string, CacheStats> caches = cacheStatsSnapshot();
+  size_t numThreads;
+  {
+    SearchStatsRegistry& registry = searchStatsRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    numThreads = registry.threads.size();
+  }
+  writeSearchStatsJSON(out, stats, numThreads, caches);
+  return true;
+}
+
+// One line per counter: mean, median, p99 and max per query
+inline void printSearchStats(const SearchStats& stats) {
+  printf("\nSearch counters over %zu queries (mean / p50 / p99 / max):", stats.queries);
+  for (int field = 0; field < QUERY_STATS_FIELDS; field++) {
+    const StatsHistogram& histogram = stats.histograms[field];
+    printf("\n  %-20s %12.1f %10zu %10zu %10zu", queryStatsName(field), histogram.mean(),
+           histogram.percentile(0.5), histogram.percentile(0.99), histogram.maximum);
+  }
+  printf("\n");
+}
+
+inline SearchStatsRegistry::~SearchStatsRegistry() {
+  if (outputPath == "" || (threads.empty() && caches.empty())) {
+    return;
+  }
+  ofstream out(outputPath);
+  if (!out.is_open()) {
+    cerr << "Unable to open file " << outputPath << endl;
+    return;
+  }
+  SearchStats merged;
+  for (const auto& stats : threads) {
+    merged.merge(stats->total);
+  }
+  writeSearchStatsJSON(out, merged, threads.size(), caches);
+}
+
+#ifdef KNN_STATS
+#define STATS_BEGIN() QueryStats queryStats = {0, 0, 0, 0, 0}
+#define STATS_ADD(field, amount) (queryStats.field += (amount))
+#define STATS_MAX(field, value) (queryStats.field = max<size_t>(queryStats.field, (value)))
+#define STATS_END() recordQueryStats(queryStats)
+#else
+#define STATS_BEGIN() ((void)0)
+#define STATS_ADD(field, amount) ((void)0)
+#define STATS_MAX(field, value) ((void)0)
+#define STATS_END() ((void)0)
+#endif
+
+#endif
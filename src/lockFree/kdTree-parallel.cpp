@@ -7,8 +7,8 @@
 using namespace std;
 
 // Function to build a KD-tree using OpenMP
-atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
-  if (data.empty()) {
+KDNode* buildKDTreeImpl(const PointSet& data, size_t* begin, size_t* end, int depth, int k) {
+  if (begin == end) {
     return nullptr;
   }
 
@@ -16,16 +16,16 @@ atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
   int axis = depth % k;
 
   // Sort and choose median as pivot element along axis
-  int median = data.size() / 2;
-  nth_element(data.begin(), data.begin() + median, data.end(),
-              [axis](const DataPoint& a, const DataPoint& b) {
-                  return a.features[axis] < b.features[axis];
+  size_t* median = begin + (end - begin) / 2;
+  nth_element(begin, median, end,
+              [&data, axis](size_t a, size_t b) {
+                  return data.features(a)[axis] < data.features(b)[axis];
               });
 
   // Create the root node
   KDNode* node = new KDNode(); // Use raw pointer instead of unique_ptr
-  node->features = data[median].features;
-  node->label = data[median].label;
+  node->features = data[*median].toVector();
+  node->label = data.label(*median);
 
   // Construct subtrees in parallel
   #pragma omp parallel sections
@@ -33,15 +33,13 @@ atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
     #pragma omp section
     {
     // Build left subtree
-    vector<DataPoint> leftData(data.begin(), data.begin() + median);
-    node->left = buildKDTreeImpl(leftData, depth + 1, k).load();
+    node->left = buildKDTreeImpl(data, begin, median, depth + 1, k);
     }
 
     #pragma omp section
     {
     // Build right subtree
-    vector<DataPoint> rightData(data.begin() + median + 1, data.end());
-    node->right = buildKDTreeImpl(rightData, depth + 1, k).load();
+    node->right = buildKDTreeImpl(data, median + 1, end, depth + 1, k);
     }
   }
 
@@ -49,7 +47,15 @@ atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
 }
 
 // Function to build a KD-tree
-void KDTree::buildKDTree(vector<DataPoint>& data, int depth, int k) {
-  root.store(buildKDTreeImpl(data, depth, k));
+void KDTree::buildKDTree(const PointSet& data, int depth, int k) {
+  clear();
+
+  // Subtrees partition an index array, the points themselves never move
+  vector<size_t> order(data.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  root.store(buildKDTreeImpl(data, order.data(), order.data() + order.size(), depth, k));
   dimensions = k;
+  modified();
 }
@@ -5,8 +5,8 @@
 
 using namespace std;
 
-atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
-  if (data.empty()) {
+KDNode* buildKDTreeImpl(const PointSet& data, size_t* begin, size_t* end, int depth, int k) {
+  if (begin == end) {
     return nullptr;
   }
 
@@ -14,28 +14,34 @@ atomic<KDNode*> buildKDTreeImpl(vector<DataPoint>& data, int depth, int k) {
   int axis = depth % k;
 
   // Sort and choose median as pivot element along axis
-  int median = data.size() / 2;
-  nth_element(data.begin(), data.begin() + median, data.end(),
-              [axis](const DataPoint& a, const DataPoint& b) {
-                  return a.features[axis] < b.features[axis];
+  size_t* median = begin + (end - begin) / 2;
+  nth_element(begin, median, end,
+              [&data, axis](size_t a, size_t b) {
+                  return data.features(a)[axis] < data.features(b)[axis];
               });
 
   // unique_ptr<KDNode> node = make_unique<KDNode>();
   KDNode* node = new KDNode(); // Use raw pointer instead of unique_ptr
-  node->features = data[median].features;
-  node->label = data[median].label;
+  node->features = data[*median].toVector();
+  node->label = data.label(*median);
 
   // Construct subtrees
-  vector<DataPoint> leftData(data.begin(), data.begin() + median);
-  node->left = buildKDTreeImpl(leftData, depth + 1, k).load();
-  vector<DataPoint> rightData(data.begin() + median + 1, data.end());
-  node->right = buildKDTreeImpl(rightData, depth + 1, k).load();
+  node->left = buildKDTreeImpl(data, begin, median, depth + 1, k);
+  node->right = buildKDTreeImpl(data, median + 1, end, depth + 1, k);
 
   return node;
 }
 
 // Function to build a KD-tree
-void KDTree::buildKDTree(vector<DataPoint>& data, int depth, int k) {
-  root.store(buildKDTreeImpl(data, depth, k));
+void KDTree::buildKDTree(const PointSet& data, int depth, int k) {
+  clear();
+
+  // Subtrees partition an index array, the points themselves never move
+  vector<size_t> order(data.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  root.store(buildKDTreeImpl(data, order.data(), order.data() + order.size(), depth, k));
   dimensions = k;
+  modified();
 }
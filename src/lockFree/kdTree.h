@@ -10,17 +10,51 @@
 #include <iostream>
 #include <memory>
 #include <atomic>
-
+#include <queue>
+#include <algorithm>
+#include "../dataset.h"
+#include "../pointSet.h"
+#include "../rangeQuery.h"
+#include "../treeInspector.h"
+#include "../threadPool.h"
+#include "../datasetStream.h"
+#include "../timing.h"
+#include <thread>
+#include <mutex>
+#include <omp.h>
 
 using namespace std;
 
-// Define a struct to represent a data point
-struct DataPoint {
-  vector<double> features;
-  int label;
-  int threadId;
+// How ingest() turns the streamed chunks into the tree
+enum IngestMode {
+  INGEST_INSERT,   // Builders insert every point into the lock-free tree as its chunk arrives
+  INGEST_NODES     // Builders only turn chunks into nodes, one balanced tree over all of them at the end
+};
+
+// Parse "insert" or "nodes"
+inline bool parseIngestMode(const string& value, IngestMode& mode) {
+  if (value == "insert") {
+    mode = INGEST_INSERT;
+  } else if (value == "nodes") {
+    mode = INGEST_NODES;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct IngestStats {
+  size_t points;
+  size_t chunks;
+  size_t skipped;          // CSV lines with another number of features
+  size_t queueFullWaits;   // Times a parser found the chunk queue full, i.e. building was the bottleneck
+  double parseTime;        // From the start until the last chunk was parsed
+  double totalTime;        // From the start until the tree was ready
 };
 
+// Subtrees with more nodes than this are rebalanced as separate tasks
+#define REBALANCE_TASK_NODES 8192
+
 class KDNode
 {
 public:
@@ -33,62 +67,220 @@ public:
   KDNode() : label(0), left(nullptr), right(nullptr) {}
 };
 
+// One of the k nearest points found by KDTree::nearest
+struct LockFreeNeighbor {
+  double distance;
+  const KDNode* node;
+};
+
 class KDTree {
 public:
   atomic<KDNode*> root;
   size_t dimensions; // To store the dimensionality of the data
 
   // Constructor
-  KDTree() : root(nullptr), dimensions(0) {}
-
-  void buildKDTree(vector<DataPoint>& data, int depth, int k);
-
-  // Function to parse input file into a vector of strings separated by newlines
-  vector<DataPoint> parseInput(const string& filename, size_t &dimension) {
-    vector<DataPoint> dataPoints;
-    string line;
-    ifstream file(filename);
-    
-    if (file.is_open()) {
-      while (getline(file, line)) {
-        istringstream iss(line);
-        DataPoint dataPoint;
-        double content;
-        char comma;  // To read and discard the comma separator
-        
-        // Read features and label into the vector
-        while (iss >> content) {
-          // Check for the end of the line
-          if (isspace(iss.peek()) || iss.peek() == '\n' || 
-                iss.peek() == '\r' || iss.peek() == EOF) {
-            // Read the label
-            dataPoint.label = (int)content;
-            break;
-          }
+  KDTree() : root(nullptr), dimensions(0), modifications(0) {}
 
-          dataPoint.features.push_back(content);
-          iss >> comma;
-        }
+  ~KDTree() { clear(); }
 
-        dimension = fminf(dimension, dataPoint.features.size());
+  // Changes with every insert, rebuild and rebalance, so answers computed
+  // at one version (see resultCache.h) are known to be stale at another.
+  // Read it before searching: a point linked during the search changes it.
+  uint64_t version() const { return modifications.load(memory_order_acquire); }
 
-        // Add data point
-        dataPoints.push_back(dataPoint);
-      }
-      file.close();
-    } else {
-      cout << "Unable to open file " << filename << endl;
+  // Free every node. Not safe while other threads still insert.
+  void clear() {
+    vector<KDNode*> pending;
+    if (root.load() != nullptr) {
+      pending.push_back(root.exchange(nullptr));
     }
+    modified();
+    while (!pending.empty()) {
+      KDNode* node = pending.back();
+      pending.pop_back();
+      if (node->left.load() != nullptr) pending.push_back(node->left.load());
+      if (node->right.load() != nullptr) pending.push_back(node->right.load());
+      delete node;
+    }
+  }
 
-    cout << "Parsed " << dataPoints.size() << " data points from " << filename << endl;
+  // Nodes copy their features so that points inserted later need no backing set
+  void buildKDTree(const PointSet& data, int depth, int k);
+
+  // Function to parse a CSV or binary dataset (see dataset.h) into a point set
+  PointSet parseInput(const string& filename, size_t &dimension) {
+    PointSet dataPoints = readDataset(filename);
+    // No rows read: nothing to narrow the dimensions down to
+    if (!dataPoints.empty()) {
+      dimension = min(dimension, dataPoints.dimensions());
+    }
     return dataPoints;
   }
 
-  void insertLockFree(const DataPoint& dataPoint, int depth, int k) {
+  void insertLockFree(const PointView& point, int depth, int k) {
     KDNode* node = new KDNode();
-    node->features = dataPoint.features;
-    node->label = dataPoint.label;
+    node->features = point.toVector();
+    node->label = point.label;
     insertRecursiveLockFree(root, node, depth, k);
+    modified();
+  }
+
+  // Insert every point on the pool's threads, safe next to other inserts and searches
+  void insertAll(ThreadPool& pool, const PointSet& points, int k, size_t grain = 1024) {
+    pool.parallelFor(0, points.size(), grain, [this, &points, k](size_t i) {
+      insertLockFree(points[i], 0, k);
+    });
+  }
+
+  // Build from a dataset file while it is being read (see datasetStream.h):
+  // numParsers threads parse chunks of points, numBuilders threads take them
+  // off the queue, so building overlaps the I/O and the file is never held
+  // in memory as a whole. Points go next to those already in the tree.
+  // INGEST_NODES and `rebalance` end with one balanced tree over all nodes.
+  IngestStats ingest(const string& filename, int k, IngestMode mode, size_t numParsers, size_t numBuilders,
+                     bool rebalanceAfter = false) {
+    Timer ingestTimer;
+    IngestStats stats = {0, 0, 0, 0, 0.0, 0.0};
+    DatasetStream stream(filename, numParsers);
+    if (!stream.isOpen()) {
+      return stats;
+    }
+    dimensions = k;
+
+    mutex collected;
+    vector<KDNode*> nodes;
+    atomic<size_t> numChunks(0);
+    vector<thread> builders;
+    for (size_t b = 0; b < max<size_t>(numBuilders, 1); b++) {
+      builders.emplace_back([this, &stream, &collected, &nodes, &numChunks, mode, k]() {
+        PointSet chunk;
+        vector<KDNode*> chunkNodes;
+        while (stream.next(chunk)) {
+          numChunks++;
+          for (size_t i = 0; i < chunk.size(); i++) {
+            if (mode == INGEST_INSERT) {
+              insertLockFree(chunk[i], 0, k);
+            } else {
+              KDNode* node = new KDNode();
+              node->features = chunk[i].toVector();
+              node->label = chunk.label(i);
+              chunkNodes.push_back(node);
+            }
+          }
+        }
+        lock_guard<mutex> guard(collected);
+        nodes.insert(nodes.end(), chunkNodes.begin(), chunkNodes.end());
+      });
+    }
+    for (thread& builder : builders) {
+      builder.join();
+    }
+
+    if (mode == INGEST_NODES) {
+      collectNodes(nodes);
+      root.store(rebalanceNodes(nodes.data(), nodes.data() + nodes.size(), k));
+      modified();
+    } else if (rebalanceAfter) {
+      rebalance(k);
+    }
+
+    stats.points = stream.pointsRead();
+    stats.chunks = numChunks;
+    stats.skipped = stream.linesSkipped();
+    stats.queueFullWaits = stream.queueFullWaits();
+    stats.parseTime = stream.parseTime();
+    stats.totalTime = ingestTimer.elapsed();
+    cout << "Parsed " << stats.points << " data points from " << filename << endl;
+    if (stats.skipped > 0) {
+      cout << "Skipped " << stats.skipped << " lines without " << stream.dimensions() << " features" << endl;
+    }
+    return stats;
+  }
+
+  // Relink the nodes into a balanced tree, splitting at medians as
+  // buildKDTree does. Nodes stay where they are. Not safe while other
+  // threads insert or search.
+  void rebalance(int k) {
+    vector<KDNode*> nodes;
+    collectNodes(nodes);
+    root.store(rebalanceNodes(nodes.data(), nodes.data() + nodes.size(), k));
+    dimensions = k;
+    modified();
+  }
+
+  // The k points closest to target (Euclidean, over the split dimensions),
+  // closest first. Safe next to inserts, which it may or may not see.
+  vector<LockFreeNeighbor> nearest(const vector<double>& target, size_t k) const {
+    priority_queue<pair<double, const KDNode*>> best;   // Squared distances, farthest on top
+    if (target.size() != splitDimensions(target)) {
+      throw invalid_argument("Points must have the same number of features");
+    }
+    if (k > 0) {
+      nearestSearch(root.load(), target, 0, splitDimensions(target), k, best);
+    }
+    vector<LockFreeNeighbor> neighbors(best.size());
+    for (size_t i = neighbors.size(); i-- > 0; best.pop()) {
+      neighbors[i] = {sqrt(best.top().first), best.top().second};
+    }
+    return neighbors;
+  }
+
+  // Depth, balance, memory and kd ordering (see treeInspector.h). Cheap
+  // enough to run now and then next to inserts, to tell when to rebalance.
+  TreeReport inspect(const InspectOptions& options = InspectOptions()) const {
+    return inspectTree(root.load(), dimensions, options);
+  }
+
+  // Range queries (see rangeQuery.h), subtrees are searched in parallel
+
+  // Count points within radius of center without materializing them
+  size_t radiusCount(const vector<double>& center, double radius) const {
+    RangeCounter counter;
+    rangeSearch(root.load(), BallRegion{center, radius}, splitDimensions(center), counter);
+    return counter.count;
+  }
+
+  // Call callback(const KDNode&) for every point within radius of center.
+  // The callback may run on several threads at once.
+  template<typename Callback>
+  void radiusQuery(const vector<double>& center, double radius, Callback callback) const {
+    RangeStreamer<Callback> streamer = {&callback};
+    rangeSearch(root.load(), BallRegion{center, radius}, splitDimensions(center), streamer);
+  }
+
+  // Collect the nodes of all points within radius of center
+  vector<const KDNode*> radiusCollect(const vector<double>& center, double radius) const {
+    RangeCollector<KDNode> collector;
+    rangeSearch(root.load(), BallRegion{center, radius}, splitDimensions(center), collector);
+    return collector.nodes;
+  }
+
+  // Count points inside the box [low, high] without materializing them
+  size_t boxCount(const vector<double>& low, const vector<double>& high) const {
+    RangeCounter counter;
+    rangeSearch(root.load(), BoxRegion{low, high}, splitDimensions(low), counter);
+    return counter.count;
+  }
+
+  // Call callback(const KDNode&) for every point inside the box [low, high].
+  // The callback may run on several threads at once.
+  template<typename Callback>
+  void boxQuery(const vector<double>& low, const vector<double>& high, Callback callback) const {
+    RangeStreamer<Callback> streamer = {&callback};
+    rangeSearch(root.load(), BoxRegion{low, high}, splitDimensions(low), streamer);
+  }
+
+  // Collect the nodes of all points inside the box [low, high]
+  vector<const KDNode*> boxCollect(const vector<double>& low, const vector<double>& high) const {
+    RangeCollector<KDNode> collector;
+    rangeSearch(root.load(), BoxRegion{low, high}, splitDimensions(low), collector);
+    return collector.nodes;
+  }
+
+  // Number of axes the tree cycles through when splitting, the query's
+  // length for a tree not built yet (then it cannot hold a point either)
+  size_t splitDimensions(const vector<double>& query) const {
+    return dimensions > 0 ? dimensions : query.size();
   }
 
   void printKDTree(KDNode* node) {
@@ -111,18 +303,99 @@ public:
   }
   
 private:
+  atomic<uint64_t> modifications;
+
+  void modified() { modifications.fetch_add(1, memory_order_release); }
+
+  static void nearestSearch(const KDNode* node, const vector<double>& target, size_t depth, size_t dims,
+                            size_t k, priority_queue<pair<double, const KDNode*>>& best) {
+    if (node == nullptr) {
+      return;
+    }
+    double distance = 0.0;
+    for (size_t i = 0; i < dims; i++) {
+      double diff = node->features[i] - target[i];
+      distance += diff * diff;
+    }
+    if (best.size() < k) {
+      best.push({distance, node});
+    } else if (distance < best.top().first) {
+      best.pop();
+      best.push({distance, node});
+    }
+
+    // Equal values may sit on either side, so the far side is only skipped
+    // when the splitting plane is strictly farther than the k-th point
+    size_t axis = depth % dims;
+    double diff = target[axis] - node->features[axis];
+    const KDNode* nearSide = diff < 0 ? node->left.load() : node->right.load();
+    const KDNode* farSide = diff < 0 ? node->right.load() : node->left.load();
+    nearestSearch(nearSide, target, depth + 1, dims, k, best);
+    if (best.size() < k || diff * diff <= best.top().first) {
+      nearestSearch(farSide, target, depth + 1, dims, k, best);
+    }
+  }
+
+  // Append every node of the tree to nodes and detach it
+  void collectNodes(vector<KDNode*>& nodes) {
+    size_t first = nodes.size();
+    if (root.load() != nullptr) {
+      nodes.push_back(root.exchange(nullptr));
+    }
+    for (size_t i = first; i < nodes.size(); i++) {
+      KDNode* node = nodes[i];
+      if (node->left.load() != nullptr) nodes.push_back(node->left.exchange(nullptr));
+      if (node->right.load() != nullptr) nodes.push_back(node->right.exchange(nullptr));
+    }
+  }
+
+  // Balanced tree over the nodes [begin, end), built by an OpenMP team
+  static KDNode* rebalanceNodes(KDNode** begin, KDNode** end, int k) {
+    KDNode* result = nullptr;
+    #pragma omp parallel if(end - begin > REBALANCE_TASK_NODES)
+    #pragma omp single
+    result = rebalanceSubtree(begin, end, 0, k);
+    return result;
+  }
+
+  // Large halves as tasks
+  static KDNode* rebalanceSubtree(KDNode** begin, KDNode** end, int depth, int k) {
+    if (begin == end) {
+      return nullptr;
+    }
+
+    int axis = depth % k;
+    KDNode** median = begin + (end - begin) / 2;
+    nth_element(begin, median, end,
+                [axis](const KDNode* a, const KDNode* b) { return a->features[axis] < b->features[axis]; });
+
+    KDNode* node = *median;
+    if (end - begin > REBALANCE_TASK_NODES) {
+      #pragma omp task shared(node)
+      node->left.store(rebalanceSubtree(begin, median, depth + 1, k));
+      node->right.store(rebalanceSubtree(median + 1, end, depth + 1, k));
+      #pragma omp taskwait
+    } else {
+      node->left.store(rebalanceSubtree(begin, median, depth + 1, k));
+      node->right.store(rebalanceSubtree(median + 1, end, depth + 1, k));
+    }
+    return node;
+  }
+
   void insertRecursiveLockFree(atomic<KDNode*>& current, KDNode* node, int depth, int k) {
+    // A strong CAS only fails when the slot is taken, and then leaves the
+    // node that took it in expected: descend from there, never reload it
     KDNode* expected = nullptr;
-    if (!current.load() && current.compare_exchange_weak(expected, node)) {
+    if (current.compare_exchange_strong(expected, node)) {
       return;
     }
 
     // Determine dimension for comparison
     int dim = depth % k;
-    if (node->features[dim] < current.load()->features[dim]) {
-      insertRecursiveLockFree(current.load()->left, node, depth + 1, k);
+    if (node->features[dim] < expected->features[dim]) {
+      insertRecursiveLockFree(expected->left, node, depth + 1, k);
     } else {
-      insertRecursiveLockFree(current.load()->right, node, depth + 1, k);
+      insertRecursiveLockFree(expected->right, node, depth + 1, k);
     }
   }
 };
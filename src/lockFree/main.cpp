@@ -4,6 +4,7 @@
 #include "kdTree.h"
 #include "../timing.h"
 #include "../utils.h"
+#include "../resultCache.h"
 #include <atomic>
 #include <thread>
 
@@ -12,23 +13,50 @@ using namespace std;
 size_t dimension = numeric_limits<int>::max();
 
 // Define a function for threads to execute
-void threadInsertion(KDTree& tree, DataPoint dataPoint, int depth, int k) {
-  tree.insertLockFree(dataPoint, depth, k);
+void threadInsertion(KDTree& tree, PointView point, int depth, int k) {
+  tree.insertLockFree(point, depth, k);
 }
 
 int main(int argc, char *argv[]) {
   size_t k;
   string filename = "";
   int opt;
+  vector<double> center, low, high;
+  double radius = -1.0;
   const int numThreads = 5;  // Can adjust this number
+  bool streaming = false;
+  IngestMode ingestMode = INGEST_INSERT;
+  size_t numParsers = 2;
+  size_t numBuilders = max(1u, thread::hardware_concurrency());
+  bool rebalance = false;
+  string queryFilename = "";
+  size_t numNeighbors = 10;
+  size_t cacheMegabytes = 0;
+  double quantum = 0.0;
+  double maxCostRatio = 0.0;
 
-  while ((opt = getopt(argc, argv, "hk:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "hk:i:c:r:l:u:s:p:b:Rq:n:C:Q:I:")) != -1) {
     switch (opt) {
       case 'h':
         cout << "Usage: " << argv[0] << " [-k value] [-i value]" << endl;
         cout << "Options:" << endl;
         cout << "  -k value       Number of dimension" << endl;
         cout << "  -i value       Input dataset" << endl;
+        cout << "  -c value       Center of a radius query, ex: -c '1 2 3'" << endl;
+        cout << "  -r value       Radius of a radius query" << endl;
+        cout << "  -l value       Low corner of a box query" << endl;
+        cout << "  -u value       High corner of a box query" << endl;
+        cout << "  -s value       Build while parsing: insert (into the lock-free tree) or nodes" << endl;
+        cout << "                 (one balanced tree once all points are in)" << endl;
+        cout << "  -p value       Parser threads when streaming (default 2)" << endl;
+        cout << "  -b value       Builder threads when streaming (default one per core)" << endl;
+        cout << "  -R             Rebalance the tree once streaming insertion is done" << endl;
+        cout << "  -q value       Dataset of kNN query points, searched twice, then again after an insert" << endl;
+        cout << "  -n value       Neighbors per kNN query (default 10)" << endl;
+        cout << "  -C value       Result cache budget in megabytes for the kNN queries (default: none)" << endl;
+        cout << "  -Q value       Cache targets on a grid of this spacing (default 0: identical targets)" << endl;
+        cout << "  -I value       Report the shape of the tree once built, rebalance it if its predicted" << endl;
+        cout << "                 query cost is above value times a balanced tree's, ex: -I 1.5" << endl;
         return 0;
       case 'k':
         if (isPositiveInteger(optarg)) {
@@ -41,6 +69,67 @@ int main(int argc, char *argv[]) {
       case 'i':
         filename = optarg;
         break;
+      case 'c':
+        center = parseDoubleList(optarg);
+        break;
+      case 'r':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for r, r = " << optarg << endl;
+          return 0;
+        }
+        radius = stod(optarg);
+        break;
+      case 'l':
+        low = parseDoubleList(optarg);
+        break;
+      case 'u':
+        high = parseDoubleList(optarg);
+        break;
+      case 's':
+        if (!parseIngestMode(optarg, ingestMode)) {
+          cout << "Invalid value for s, s = " << optarg << endl;
+          return 0;
+        }
+        streaming = true;
+        break;
+      case 'p':
+      case 'b':
+        if (!isPositiveInteger(optarg) || string(optarg).empty() || stoul(optarg) == 0) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'p') numParsers = stoul(optarg);
+        if (opt == 'b') numBuilders = stoul(optarg);
+        break;
+      case 'R':
+        rebalance = true;
+        break;
+      case 'q':
+        queryFilename = optarg;
+        break;
+      case 'n':
+      case 'C':
+        if (!isPositiveInteger(optarg) || string(optarg).empty()) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'n') numNeighbors = stoul(optarg);
+        if (opt == 'C') cacheMegabytes = stoul(optarg);
+        break;
+      case 'Q':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for Q, Q = " << optarg << endl;
+          return 0;
+        }
+        quantum = stod(optarg);
+        break;
+      case 'I':
+        if (!isNonNegativeNumber(optarg)) {
+          cout << "Invalid value for I, I = " << optarg << endl;
+          return 0;
+        }
+        maxCostRatio = stod(optarg);
+        break;
       default:
         cout << "Usage: ./kdTree -k <number of dimensions>" << endl;
         return 0;
@@ -48,9 +137,24 @@ int main(int argc, char *argv[]) {
   }
 
   KDTree myKDTree;
+  PointSet input;
+
+  if (streaming) {
+    // Only the dimensions for now, the points are read while building
+    DatasetLayout layout;
+    if (!findDatasetLayout(filename, layout)) {
+      return 0;
+    }
+    dimension = min(dimension, layout.dimensions);
+  } else {
+    // Open the file and parse input into a contiguous point set
+    input = myKDTree.parseInput(filename, dimension);
+  }
 
-  // Open the file and parse input into a vector of strings separated by newlines
-  vector<DataPoint> input = myKDTree.parseInput(filename, dimension);
+  if (dimension == 0) {
+    cout << "No features to split on in " << filename << endl;
+    return 0;
+  }
     
   if (k > dimension) {
     cout << "Value given for k is greater than the number of features in the data set" << endl;
@@ -58,19 +162,41 @@ int main(int argc, char *argv[]) {
     cout << "Dimensions are " << dimension << endl;
     k = dimension;
   }
+
+  // Range queries need one coordinate per axis the tree splits on
+  if ((!center.empty() && center.size() != (size_t)k) || (!low.empty() && low.size() != (size_t)k) ||
+      (!high.empty() && high.size() != (size_t)k)) {
+    cout << "Range query coordinates must have " << k << " values, one per dimension" << endl;
+    return 0;
+  }
+  if (low.empty() != high.empty()) {
+    cout << "Box query needs both corners (-l and -u)" << endl;
+    return 0;
+  }
+  if (!center.empty() && radius < 0.0) {
+    cout << "Radius query needs a radius (-r)" << endl;
+    return 0;
+  }
   
   // Use the input vector to build the kd-tree
   Timer totalSimulationTimer;
-  myKDTree.buildKDTree(input, 0, k);
+  if (streaming) {
+    // From the file to a ready tree, parsing and building at once
+    IngestStats stats = myKDTree.ingest(filename, k, ingestMode, numParsers, numBuilders, rebalance);
+    printf("Streamed %zu points in %zu chunks: parsed after %.6fs, tree ready after %.6fs (queue full %zu times)\n",
+           stats.points, stats.chunks, stats.parseTime, stats.totalTime, stats.queueFullWaits);
+  } else {
+    myKDTree.buildKDTree(input, 0, k);
+  }
   double totalSimulationTime = totalSimulationTimer.elapsed();
 
   // Create and launch threads
+    PointSet inserted(k);
+    inserted.resize(numThreads);  // k zeros per point (just for example)
     std::thread threads[numThreads];
     for (int i = 0; i < numThreads; ++i) {
-      DataPoint dp;
-      dp.label = i % 2;  // Just for example
-      dp.features = std::vector<double>(k, 0); // Fill with k zeros (just for example)
-      threads[i] = std::thread(threadInsertion, std::ref(myKDTree), dp, 0, k);
+      inserted.label(i) = i % 2;  // Just for example
+      threads[i] = std::thread(threadInsertion, std::ref(myKDTree), inserted[i], 0, k);
     }
 
     // Wait for all threads to complete
@@ -80,6 +206,93 @@ int main(int argc, char *argv[]) {
 
   printf("Total simulation time: %.6fs\n", totalSimulationTime);
 
+  // Range queries on the built tree
+  if (!center.empty() && radius >= 0.0) {
+    Timer rangeTimer;
+    size_t count = myKDTree.radiusCount(center, radius);
+    double rangeTime = rangeTimer.elapsed();
+    printf("Points within radius %.4f: %zu (%.6fs)\n", radius, count, rangeTime);
+  }
+
+  if (!low.empty()) {
+    Timer rangeTimer;
+    size_t count = myKDTree.boxCount(low, high);
+    double rangeTime = rangeTimer.elapsed();
+    printf("Points inside box: %zu (%.6fs)\n", count, rangeTime);
+  }
+
+  // Health check of the tree as the inserts left it
+  if (maxCostRatio > 0.0) {
+    TreeReport report = myKDTree.inspect();
+    printTreeReport(report);
+    if (needsRebuild(report, maxCostRatio)) {
+      printf("\nPredicted cost %.3fx a balanced tree's, above %.3fx: rebalancing\n", report.costRatio,
+             maxCostRatio);
+      Timer rebalanceTimer;
+      myKDTree.rebalance(k);
+      printf("Rebalanced in %.6fs\n", rebalanceTimer.elapsed());
+      printTreeReport(myKDTree.inspect());
+    }
+  }
+
+  // kNN queries through the result cache: the second pass is answered from
+  // it, an insert makes every answer stale for the third
+  if (queryFilename != "") {
+    PointSet queries = readDataset(queryFilename);
+    if (queries.dimensions() < k) {
+      cout << "The query dataset has fewer than " << k << " features" << endl;
+      return 0;
+    }
+    if (queries.size() == 0) {
+      cout << "No queries in " << queryFilename << endl;
+      return 0;
+    }
+    unique_ptr<ResultCache<vector<LockFreeNeighbor>>> cache;
+    if (cacheMegabytes > 0) {
+      cache.reset(new ResultCache<vector<LockFreeNeighbor>>(cacheMegabytes << 20));
+    }
+
+    const char* passes[3] = {"cold", "repeated", "after insert"};
+    for (int pass = 0; pass < 3; pass++) {
+      if (pass == 2) {
+        myKDTree.insertLockFree(queries[0], 0, k);
+      }
+      vector<vector<LockFreeNeighbor>> answers(queries.size());
+      Timer queryTimer;
+      for (size_t q = 0; q < queries.size(); q++) {
+        vector<double> target(queries.features(q), queries.features(q) + k);
+        auto search = [&]() { return myKDTree.nearest(target, numNeighbors); };
+        if (cache) {
+          uint64_t version = myKDTree.version();
+          answers[q] = cache->fetch(makeCacheKey(target, numNeighbors, 0, quantum), version, search);
+        } else {
+          answers[q] = search();
+        }
+      }
+      double queryTime = queryTimer.elapsed();
+
+      // With exact keys a cached answer must be the answer
+      size_t mismatches = 0;
+      if (quantum == 0.0 && cache) {
+        for (size_t q = 0; q < queries.size(); q++) {
+          vector<LockFreeNeighbor> expected =
+              myKDTree.nearest(vector<double>(queries.features(q), queries.features(q) + k), numNeighbors);
+          for (size_t i = 0; i < expected.size(); i++) {
+            mismatches += i >= answers[q].size() || answers[q][i].distance != expected[i].distance;
+          }
+        }
+      }
+      printf("%zu kNN queries (%s): %.6fs", queries.size(), passes[pass], queryTime);
+      if (quantum == 0.0 && cache) {
+        printf(", %zu answers differ from an uncached search", mismatches);
+      }
+      printf("\n");
+    }
+    if (cache) {
+      printCacheStats(cache->stats());
+    }
+  }
+
   myKDTree.printKDTree(myKDTree.root.load());
 
   return 0;
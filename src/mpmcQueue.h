@@ -0,0 +1,116 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+// Bounded multi-producer multi-consumer queue without locks (Dmitry Vyukov's
+// array queue). Every cell carries a sequence number saying whose turn it is:
+// pos for the producer that claims position pos, pos + 1 for the consumer
+// once the value is in. Producers and consumers only contend on their own
+// counter, and a full queue makes producers wait instead of growing.
+
+// Cache line size used to keep the counters apart
+#define MPMC_CACHE_LINE 64
+
+template<typename T>
+class MPMCQueue {
+public:
+  // Capacity is rounded up to a power of two
+  explicit MPMCQueue(size_t capacity)
+      : cells(roundUpPowerOfTwo(capacity)), mask(cells.size() - 1), enqueuePos(0), dequeuePos(0) {
+    for (size_t i = 0; i < cells.size(); i++) {
+      cells[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // False if the queue is full, value is then left untouched
+  bool tryPush(T& value) {
+    size_t pos = enqueuePos.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+      if (difference == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(memory_order_relaxed);
+      }
+    }
+    cell->value = move(value);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // False if the queue is empty
+  bool tryPop(T& value) {
+    size_t pos = dequeuePos.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)(pos + 1);
+      if (difference == 0) {
+        if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        pos = dequeuePos.load(memory_order_relaxed);
+      }
+    }
+    value = move(cell->value);
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+  }
+
+  // Wait for room, returns the number of times the queue was found full
+  size_t push(T& value) {
+    size_t waits = 0;
+    while (!tryPush(value)) {
+      waits++;
+      this_thread::yield();
+    }
+    return waits;
+  }
+
+private:
+  static size_t roundUpPowerOfTwo(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    return size;
+  }
+
+  struct Cell {
+    atomic<size_t> sequence;
+    T value;
+
+    Cell() : sequence(0) {}
+  };
+
+  vector<Cell> cells;
+  size_t mask;
+  alignas(MPMC_CACHE_LINE) atomic<size_t> enqueuePos;
+  alignas(MPMC_CACHE_LINE) atomic<size_t> dequeuePos;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// NUMA topology, thread pinning and memory placement through the raw Linux
+// system calls, so nothing has to link libnuma. On other systems, or when a
+// call is refused (e.g. in a container), everything degrades to one node and
+// the functions return false.
+
+// Memory policies of set_mempolicy(2)
+#define NUMA_MPOL_DEFAULT 0
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+
+// Where a read-only index lives
+enum NumaPlacement {
+  NUMA_DEFAULT,      // Wherever the building thread first touched it
+  NUMA_INTERLEAVE,   // Pages spread round-robin over all nodes
+  NUMA_REPLICATE     // One copy per node, queried by the threads of that node
+};
+
+inline const char* numaPlacementName(NumaPlacement placement) {
+  static const char* names[] = {"default", "interleave", "replicate"};
+  return names[placement];
+}
+
+// Parse a kernel CPU list such as "0-3,8,10-11"
+inline vector<int> parseCpuList(const string& list) {
+  vector<int> cpus;
+  stringstream ranges(list);
+  string range;
+  while (getline(ranges, range, ',')) {
+    size_t dash = range.find('-');
+    try {
+      int first = stoi(range.substr(0, dash));
+      int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    } catch (...) {
+      // Empty or malformed entry
+    }
+  }
+  return cpus;
+}
+
+// CPUs of every memory node, read from sysfs
+struct NumaTopology {
+  vector<int> nodes;              // Node ids, usually 0 .. n-1
+  vector<vector<int>> cpus;       // CPUs of nodes[i]
+
+  size_t size() const { return nodes.size(); }
+
+  // Index of the node holding cpu, 0 if unknown
+  size_t nodeOfCpu(int cpu) const {
+    for (size_t i = 0; i < cpus.size(); i++) {
+      if (find(cpus[i].begin(), cpus[i].end(), cpu) != cpus[i].end()) {
+        return i;
+      }
+    }
+    return 0;
+  }
+};
+
+inline NumaTopology detectNumaTopology() {
+  NumaTopology topology;
+  ifstream online("/sys/devices/system/node/has_cpu");
+  string list;
+  if (online.is_open() && getline(online, list)) {
+    for (int node : parseCpuList(list)) {
+      ifstream cpuList("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+      string cpus;
+      if (cpuList.is_open() && getline(cpuList, cpus) && !parseCpuList(cpus).empty()) {
+        topology.nodes.push_back(node);
+        topology.cpus.push_back(parseCpuList(cpus));
+      }
+    }
+  }
+
+  // No sysfs: one node with every CPU
+  if (topology.nodes.empty()) {
+    topology.nodes.push_back(0);
+    topology.cpus.push_back(vector<int>());
+#ifdef __linux__
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < numCpus; cpu++) {
+      topology.cpus[0].push_back(cpu);
+    }
+#endif
+  }
+  return topology;
+}
+
+inline const NumaTopology& numaTopology() {
+  static NumaTopology topology = detectNumaTopology();
+  return topology;
+}
+
+// Restrict the calling thread to the given CPUs
+inline bool pinThreadToCpus(const vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+// Restrict the calling thread to the CPUs of topology node index `node`
+inline bool pinThreadToNode(size_t node) {
+  const NumaTopology& topology = numaTopology();
+  return node < topology.size() && pinThreadToCpus(topology.cpus[node]);
+}
+
+// CPUs the calling thread may run on
+inline vector<int> threadCpus() {
+  vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+// Pin the calling thread to a node for one scope, the previous CPUs after
+class ScopedNodePinning {
+public:
+  explicit ScopedNodePinning(size_t node) : previous(threadCpus()), pinned(pinThreadToNode(node)) {}
+
+  ~ScopedNodePinning() {
+    if (pinned) {
+      pinThreadToCpus(previous);
+    }
+  }
+
+  bool ok() const { return pinned; }
+
+private:
+  vector<int> previous;
+  bool pinned;
+};
+
+// Node index the calling thread runs on right now
+inline size_t currentNumaNode() {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return numaTopology().nodeOfCpu(cpu);
+  }
+#endif
+  return 0;
+}
+
+// Bit mask of the given topology node indices, for the memory policy calls
+inline vector<unsigned long> numaNodeMask(const vector<size_t>& nodes) {
+  const NumaTopology& topology = numaTopology();
+  const size_t bits = 8 * sizeof(unsigned long);
+  int maxNode = *max_element(topology.nodes.begin(), topology.nodes.end());
+  vector<unsigned long> mask(maxNode / bits + 1, 0);
+  for (size_t node : nodes) {
+    int id = topology.nodes[node];
+    mask[id / bits] |= 1UL << (id % bits);
+  }
+  return mask;
+}
+
+inline vector<size_t> allNumaNodes() {
+  vector<size_t> nodes(numaTopology().size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i] = i;
+  }
+  return nodes;
+}
+
+// Policy for the calling thread's future allocations
+inline bool setThreadMemoryPolicy(int mode, const vector<size_t>& nodes) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  if (mode == NUMA_MPOL_DEFAULT) {
+    return syscall(SYS_set_mempolicy, NUMA_MPOL_DEFAULT, nullptr, 0) == 0;
+  }
+  vector<unsigned long> mask = numaNodeMask(nodes);
+  return syscall(SYS_set_mempolicy, mode, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1) == 0;
+#else
+  return false;
+#endif
+}
+
+// Memory policy of the calling thread for one scope, back to default after
+class ScopedMemoryPolicy {
+public:
+  ScopedMemoryPolicy(int mode, const vector<size_t>& nodes) : applied(setThreadMemoryPolicy(mode, nodes)) {}
+
+  ~ScopedMemoryPolicy() {
+    if (applied) {
+      setThreadMemoryPolicy(NUMA_MPOL_DEFAULT, vector<size_t>());
+    }
+  }
+
+  bool ok() const { return applied; }
+
+private:
+  bool applied;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <future>
+#include <iostream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../threadPool.h"
+#include "../timing.h"
+
+using namespace std;
+
+// Fixed-size blocks of a file, read into page-aligned buffers (so the file
+// may be opened with O_DIRECT) and kept in an LRU cache of a fixed number of
+// blocks. prefetch() reads a block on the cache's I/O threads while the
+// caller works on others; get() waits for it if it is still on its way.
+// Blocks handed out stay valid after they are evicted.
+
+// Page-aligned, block-sized buffer
+class DiskBlock {
+public:
+  DiskBlock(size_t bytes, size_t alignment) : bytes(bytes), buffer(nullptr) {
+    if (posix_memalign(&buffer, alignment, bytes) != 0) {
+      buffer = nullptr;
+    }
+  }
+
+  ~DiskBlock() { free(buffer); }
+
+  DiskBlock(const DiskBlock&) = delete;
+  DiskBlock& operator=(const DiskBlock&) = delete;
+
+  char* data() { return static_cast<char*>(buffer); }
+  const char* data() const { return static_cast<const char*>(buffer); }
+  size_t size() const { return bytes; }
+
+private:
+  size_t bytes;
+  void* buffer;
+};
+
+struct BlockCacheStats {
+  size_t hits;           // get() found the block cached or on its way
+  size_t misses;         // get() had to read it
+  size_t prefetches;     // Reads started by prefetch()
+  size_t prefetchHits;   // Prefetched blocks that get() asked for before they were evicted
+  size_t evictions;
+  size_t reads;          // Blocks read from the file
+  size_t bytesRead;
+  double readSeconds;    // Summed over the reading threads
+};
+
+inline void printBlockCacheStats(const BlockCacheStats& stats, size_t capacity, size_t blockBytes) {
+  size_t lookups = stats.hits + stats.misses;
+  printf("Block cache (%zu blocks of %zu KB): %zu hits, %zu misses (hit rate %.2f%%), %zu evictions\n", capacity,
+         blockBytes >> 10, stats.hits, stats.misses, lookups > 0 ? 100.0 * stats.hits / lookups : 0.0,
+         stats.evictions);
+  printf("  %zu blocks read (%.2f MB, %.6fs), %zu read ahead of which %zu were used\n", stats.reads,
+         stats.bytesRead / 1048576.0, stats.readSeconds, stats.prefetches, stats.prefetchHits);
+}
+
+// Open for reading, with O_DIRECT if asked for and the file system allows it
+inline int openBlockFile(const string& path, bool directIO) {
+  int fd = -1;
+#ifdef O_DIRECT
+  if (directIO) {
+    fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+  }
+#endif
+  if (fd < 0) {
+    fd = open(path.c_str(), O_RDONLY);
+  }
+  return fd;
+}
+
+class BlockCache {
+public:
+  typedef shared_ptr<const DiskBlock> Block;
+
+  // Block i is the blockBytes at dataOffset + i * blockBytes of fd
+  BlockCache(int fd, uint64_t dataOffset, size_t blockBytes, size_t alignment, size_t capacity, size_t ioThreads)
+      : fd(fd), dataOffset(dataOffset), blockBytes(blockBytes), alignment(alignment),
+        capacityBlocks(max<size_t>(capacity, 1)), hits(0), misses(0), prefetches(0), prefetchHits(0),
+        evictions(0), reads(0), bytesRead(0), readNanos(0), io(max<size_t>(ioThreads, 1)) {}
+
+  BlockCache(const BlockCache&) = delete;
+  BlockCache& operator=(const BlockCache&) = delete;
+
+  size_t capacity() const { return capacityBlocks; }
+
+  // The block, read now unless it is cached or being prefetched
+  Block get(size_t block) {
+    shared_future<Block> pending;
+    shared_ptr<promise<Block>> reading;
+    {
+      lock_guard<mutex> guard(lock);
+      auto found = entries.find(block);
+      if (found != entries.end()) {
+        hits.fetch_add(1, memory_order_relaxed);
+        if (found->second.prefetched) {
+          prefetchHits.fetch_add(1, memory_order_relaxed);
+          found->second.prefetched = false;
+        }
+        lru.splice(lru.begin(), lru, found->second.position);
+        pending = found->second.block;
+      } else {
+        misses.fetch_add(1, memory_order_relaxed);
+        reading = make_shared<promise<Block>>();
+        pending = reading->get_future().share();
+        insertLocked(block, pending, false);
+      }
+    }
+    if (reading) {
+      reading->set_value(read(block));
+    }
+    return pending.get();
+  }
+
+  // Start reading the block on an I/O thread unless it is cached already
+  void prefetch(size_t block) {
+    auto reading = make_shared<promise<Block>>();
+    {
+      lock_guard<mutex> guard(lock);
+      if (entries.count(block) > 0) {
+        return;
+      }
+      insertLocked(block, reading->get_future().share(), true);
+    }
+    prefetches.fetch_add(1, memory_order_relaxed);
+    io.post([this, block, reading]() { reading->set_value(read(block)); });
+  }
+
+  BlockCacheStats stats() const {
+    return {hits.load(), misses.load(), prefetches.load(), prefetchHits.load(), evictions.load(), reads.load(),
+            bytesRead.load(), readNanos.load() / 1e9};
+  }
+
+  void resetStats() {
+    hits = 0;
+    misses = 0;
+    prefetches = 0;
+    prefetchHits = 0;
+    evictions = 0;
+    reads = 0;
+    bytesRead = 0;
+    readNanos = 0;
+  }
+
+private:
+  struct Entry {
+    shared_future<Block> block;
+    list<size_t>::iterator position;
+    bool prefetched;   // Not asked for by get() yet
+  };
+
+  void insertLocked(size_t block, shared_future<Block> pending, bool prefetched) {
+    lru.push_front(block);
+    entries[block] = {pending, lru.begin(), prefetched};
+    while (entries.size() > capacityBlocks) {
+      // Whoever still waits for or holds the evicted block keeps it alive
+      entries.erase(lru.back());
+      lru.pop_back();
+      evictions.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  // A block of zeros if the read fails, which reads as an empty leaf
+  Block read(size_t block) {
+    Timer readTimer;
+    shared_ptr<DiskBlock> result = make_shared<DiskBlock>(blockBytes, alignment);
+    if (result->data() == nullptr) {
+      cerr << "Unable to allocate a block of " << blockBytes << " bytes" << endl;
+      return make_shared<DiskBlock>(0, alignment);
+    }
+    size_t done = 0;
+    while (done < blockBytes) {
+      ssize_t got = pread(fd, result->data() + done, blockBytes - done, dataOffset + block * blockBytes + done);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        cerr << "Unable to read block " << block << ": " << (got < 0 ? strerror(errno) : "end of file") << endl;
+        memset(result->data(), 0, blockBytes);
+        break;
+      }
+      done += got;
+    }
+    reads.fetch_add(1, memory_order_relaxed);
+    bytesRead.fetch_add(done, memory_order_relaxed);
+    readNanos.fetch_add((uint64_t)(readTimer.elapsed() * 1e9), memory_order_relaxed);
+    return result;
+  }
+
+  int fd;
+  uint64_t dataOffset;
+  size_t blockBytes;
+  size_t alignment;
+  size_t capacityBlocks;
+
+  mutex lock;
+  unordered_map<size_t, Entry> entries;
+  list<size_t> lru;   // Most recently used first
+
+  atomic<size_t> hits;
+  atomic<size_t> misses;
+  atomic<size_t> prefetches;
+  atomic<size_t> prefetchHits;
+  atomic<size_t> evictions;
+  atomic<size_t> reads;
+  atomic<size_t> bytesRead;
+  atomic<uint64_t> readNanos;
+
+  // Last, so pending reads finish before anything they touch goes away
+  ThreadPool io;
+};
+
+#endif
@@ -0,0 +1,927 @@
+#ifndef DISK_TREE_H
+#define DISK_TREE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <memory>
+#include <numeric>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+#include "../dataset.h"
+#include "../datasetStream.h"
+#include "../pointSet.h"
+#include "../timing.h"
+#include "blockCache.h"
+
+using namespace std;
+
+// KD-tree for datasets larger than memory. Only the top of the tree lives
+// in memory: every node keeps the bounding box of its points, and the leaves
+// point at blocks of the index file that hold up to leafCapacity points each.
+//
+// Index file, every part page-aligned:
+//   page 0        DiskTreeHeader
+//   blocks        numLeaves leaf blocks of blockBytes: a uint64 count, 8 bytes
+//                 of padding, leafCapacity * d features, leafCapacity int32 labels
+//   nodesOffset   numNodes DiskNode, then numNodes boxes of d lows and d highs
+//
+// Building never holds more than the memory budget of points: runs of points
+// larger than that are split at a sampled median in one pass over the run
+// file, into two new run files, until a run fits and is built in memory.
+// Searches go through an LRU block cache whose size follows from the memory
+// budget once the top tree is loaded, and read ahead the blocks they will
+// probably need next.
+
+#define DISK_TREE_MAGIC "KDTDISK"
+#define DISK_PAGE_BYTES 4096
+#define DISK_BLOCK_BYTES (64 << 10)
+#define DISK_LEAF_HEADER_BYTES 16
+#define DISK_SAMPLE_POINTS 65536
+#define DISK_READ_AHEAD 4
+#define DISK_IO_BUFFER_BYTES (4 << 20)
+
+struct DiskTreeHeader {
+  char magic[8];
+  uint32_t dimensions;
+  uint32_t pageBytes;
+  uint64_t blockBytes;
+  uint64_t leafCapacity;
+  uint64_t numPoints;
+  uint64_t numLeaves;
+  uint64_t numNodes;
+  uint64_t nodesOffset;
+};
+
+struct DiskNode {
+  double split;     // Informational, searches only use the boxes
+  int32_t axis;     // -1 for a split by count (points identical in the run sample)
+  int32_t leaf;     // Block of the points, -1 for inner nodes
+  int32_t left;
+  int32_t right;
+  uint64_t count;   // Points below
+};
+
+struct DiskTreeOptions {
+  size_t blockBytes = DISK_BLOCK_BYTES;    // Rounded up to whole pages
+  size_t pageBytes = DISK_PAGE_BYTES;
+  size_t memoryBytes = (size_t)256 << 20;  // Points held at once while building
+  size_t numParsers = 2;                   // For CSV input
+};
+
+struct DiskBuildStats {
+  size_t points;
+  size_t leaves;
+  size_t nodes;
+  size_t partitionPasses;     // Runs split on disk
+  size_t bytesPartitioned;    // Read by those passes
+  size_t inMemorySubtrees;    // Runs small enough to build in memory
+  double seconds;
+};
+
+struct DiskNeighbor {
+  double distance;
+  int label;
+};
+
+inline size_t roundUpTo(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+// Points per leaf block of blockBytes
+inline size_t diskLeafCapacity(size_t blockBytes, size_t dimensions) {
+  return (blockBytes - DISK_LEAF_HEADER_BYTES) / (dimensions * sizeof(double) + sizeof(int32_t));
+}
+
+// Write all of buffer at offset, false on error
+inline bool writeAt(int fd, const void* buffer, size_t bytes, uint64_t offset) {
+  const char* cursor = static_cast<const char*>(buffer);
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, cursor, bytes, offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    cursor += written;
+    bytes -= written;
+    offset += written;
+  }
+  return true;
+}
+
+inline bool readAt(int fd, void* buffer, size_t bytes, uint64_t offset) {
+  char* cursor = static_cast<char*>(buffer);
+  while (bytes > 0) {
+    ssize_t got = pread(fd, cursor, bytes, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    cursor += got;
+    bytes -= got;
+    offset += got;
+  }
+  return true;
+}
+
+// Writes the index file of a dataset, see DiskKDTree::build
+class DiskTreeBuilder {
+public:
+  DiskTreeBuilder(const string& indexPath, size_t d, const DiskTreeOptions& options)
+      : indexPath(indexPath), d(d), options(options), fd(-1), numRuns(0), stats() {
+    this->options.pageBytes = max<size_t>(options.pageBytes, 512);
+    size_t minimumBlock = DISK_LEAF_HEADER_BYTES + d * sizeof(double) + sizeof(int32_t);
+    blockBytes = roundUpTo(max(options.blockBytes, minimumBlock), this->options.pageBytes);
+    leafCapacity = diskLeafCapacity(blockBytes, d);
+    pointBytes = d * sizeof(double) + sizeof(int) + sizeof(size_t);
+  }
+
+  bool build(const string& input, DiskBuildStats& result) {
+    Timer buildTimer;
+    fd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      cout << "Unable to create " << indexPath << ": " << strerror(errno) << endl;
+      return false;
+    }
+
+    Run all;
+    bool ok = firstRun(input, all) && all.count > 0;
+    if (ok) {
+      buildRun(all, 0);
+      ok = !failed && writeTopTree();
+    } else if (all.owned) {
+      unlink(all.path.c_str());
+    }
+    close(fd);
+    if (!ok) {
+      unlink(indexPath.c_str());
+      return false;
+    }
+
+    stats.points = all.count;
+    stats.leaves = numLeaves();
+    stats.nodes = nodes.size();
+    stats.seconds = buildTimer.elapsed();
+    result = stats;
+    return true;
+  }
+
+private:
+  // Points in a file of binary dataset records (dataset.h)
+  struct Run {
+    string path;
+    uint64_t offset;
+    uint64_t count;
+    size_t dimensions;   // Of the records, the first d are indexed
+    bool owned;          // A scratch file, removed once used
+  };
+
+  // Sequential record reader with a large buffer
+  class RunReader {
+  public:
+    explicit RunReader(const Run& run)
+        : file(fopen(run.path.c_str(), "rb")), remaining(run.count), dimensions(run.dimensions),
+          recordBytes(binaryRecordSize(run.dimensions)), features(run.dimensions) {
+      if (file != nullptr) {
+        setvbuf(file, nullptr, _IOFBF, DISK_IO_BUFFER_BYTES);
+        fseek(file, run.offset, SEEK_SET);
+      }
+      record.resize(recordBytes);
+    }
+
+    ~RunReader() {
+      if (file != nullptr) {
+        fclose(file);
+      }
+    }
+
+    // Features of the next point, false at the end or on error
+    bool next(const double*& point, int& label) {
+      if (file == nullptr || remaining == 0 || fread(record.data(), recordBytes, 1, file) != 1) {
+        return false;
+      }
+      decodeBinaryRecord(record.data(), dimensions, features.data(), label);
+      point = features.data();
+      remaining--;
+      return true;
+    }
+
+  private:
+    FILE* file;
+    uint64_t remaining;
+    size_t dimensions;
+    size_t recordBytes;
+    vector<char> record;
+    vector<double> features;
+  };
+
+  class RunWriter {
+  public:
+    RunWriter(const string& path, size_t d)
+        : file(fopen(path.c_str(), "wb")), d(d), count(0), record(binaryRecordSize(d)) {
+      if (file != nullptr) {
+        setvbuf(file, nullptr, _IOFBF, DISK_IO_BUFFER_BYTES);
+      }
+    }
+
+    ~RunWriter() { finish(); }
+
+    bool isOpen() const { return file != nullptr; }
+
+    void write(const double* point, int label) {
+      encodeBinaryRecord(record.data(), d, point, label);
+      fwrite(record.data(), record.size(), 1, file);
+      count++;
+    }
+
+    // False if anything failed to reach the file
+    bool finish() {
+      if (file == nullptr) {
+        return count == 0;
+      }
+      bool ok = !ferror(file);
+      ok = fclose(file) == 0 && ok;
+      file = nullptr;
+      return ok;
+    }
+
+    uint64_t written() const { return count; }
+
+  private:
+    FILE* file;
+    size_t d;
+    uint64_t count;
+    vector<char> record;
+  };
+
+  string scratchPath() { return indexPath + ".run" + to_string(numRuns++); }
+
+  void removeRun(const Run& run) {
+    if (run.owned) {
+      unlink(run.path.c_str());
+    }
+  }
+
+  // The whole input as a run: binary datasets are read in place, CSV is
+  // streamed into a scratch run first
+  bool firstRun(const string& input, Run& run) {
+    run = {input, 0, 0, 0, false};
+    DatasetLayout layout;
+    if (!findDatasetLayout(input, layout)) {
+      return false;
+    }
+    if (layout.dimensions < d) {
+      cout << "d = " << d << " is larger than the " << layout.dimensions << " features in the dataset" << endl;
+      return false;
+    }
+    if (layout.binary) {
+      run.offset = layout.dataBegin;
+      run.count = (layout.dataEnd - layout.dataBegin) / binaryRecordSize(layout.dimensions);
+      run.dimensions = layout.dimensions;
+      return true;
+    }
+
+    run = {scratchPath(), 0, 0, d, true};
+    RunWriter writer(run.path, d);
+    if (!writer.isOpen()) {
+      cout << "Unable to create " << run.path << endl;
+      return false;
+    }
+    DatasetStream stream(input, options.numParsers);
+    PointSet chunk;
+    while (stream.next(chunk)) {
+      for (size_t i = 0; i < chunk.size(); i++) {
+        writer.write(chunk.features(i), chunk.label(i));
+      }
+    }
+    run.count = writer.written();
+    if (!writer.finish()) {
+      cout << "Unable to write " << run.path << endl;
+      return false;
+    }
+    cout << "Parsed " << run.count << " data points from " << input << endl;
+    return true;
+  }
+
+  int32_t addNode() {
+    nodes.push_back({0.0, -1, -1, -1, -1, 0});
+    boxes.resize(boxes.size() + 2 * d);
+    return nodes.size() - 1;
+  }
+
+  double* low(int32_t node) { return &boxes[2 * d * node]; }
+  double* high(int32_t node) { return &boxes[2 * d * node + d]; }
+
+  // Inner node box: union of the children's
+  void mergeBoxes(int32_t node) {
+    int32_t left = nodes[node].left;
+    int32_t right = nodes[node].right;
+    for (size_t i = 0; i < d; i++) {
+      low(node)[i] = min(low(left)[i], low(right)[i]);
+      high(node)[i] = max(high(left)[i], high(right)[i]);
+    }
+    nodes[node].count = nodes[left].count + nodes[right].count;
+  }
+
+  size_t numLeaves() const { return leafCount; }
+
+  int32_t buildRun(const Run& run, int depth) {
+    if (run.count * pointBytes <= options.memoryBytes || run.count <= leafCapacity) {
+      PointSet points = loadRun(run);
+      removeRun(run);
+      vector<size_t> order(points.size());
+      iota(order.begin(), order.end(), 0);
+      stats.inMemorySubtrees++;
+      return buildInMemory(points, order.data(), order.data() + order.size(), depth);
+    }
+
+    stats.partitionPasses++;
+    stats.bytesPartitioned += run.count * binaryRecordSize(run.dimensions);
+
+    // Reservoir sample of the run, to pick the axis and the median
+    PointSet sample(d);
+    mt19937_64 random(depth * 7919 + numRuns);
+    {
+      RunReader reader(run);
+      const double* point;
+      int label;
+      for (uint64_t seen = 0; reader.next(point, label); seen++) {
+        if (sample.size() < DISK_SAMPLE_POINTS) {
+          sample.push_back(point, label);
+        } else {
+          uint64_t slot = random() % (seen + 1);
+          if (slot < DISK_SAMPLE_POINTS) {
+            memcpy(sample.features(slot), point, d * sizeof(double));
+          }
+        }
+      }
+    }
+
+    // The depth's axis unless the sample is flat along it
+    int axis = -1;
+    double split = 0.0;
+    bool inclusive = false;   // Points equal to split go left
+    for (size_t a = 0; a < d && axis < 0; a++) {
+      size_t candidate = (depth + a) % d;
+      vector<double> values(sample.size());
+      for (size_t i = 0; i < sample.size(); i++) {
+        values[i] = sample.features(i)[candidate];
+      }
+      auto median = values.begin() + values.size() / 2;
+      nth_element(values.begin(), median, values.end());
+      double lowest = *min_element(values.begin(), values.end());
+      double highest = *max_element(values.begin(), values.end());
+      if (lowest < highest) {
+        axis = candidate;
+        split = *median;
+        // Both sides hold sampled points, so neither comes out empty
+        inclusive = split == lowest;
+      }
+    }
+
+    Run left = {scratchPath(), 0, 0, d, true};
+    Run right = {scratchPath(), 0, 0, d, true};
+    {
+      RunWriter leftWriter(left.path, d);
+      RunWriter rightWriter(right.path, d);
+      if (!leftWriter.isOpen() || !rightWriter.isOpen()) {
+        cout << "Unable to create the runs of " << indexPath << endl;
+        failed = true;
+        removeRun(run);
+        return -1;
+      }
+      RunReader reader(run);
+      const double* point;
+      int label;
+      // Identical points are dealt out alternately
+      for (uint64_t i = 0; reader.next(point, label); i++) {
+        bool goesLeft = axis < 0 ? i % 2 == 0 : inclusive ? point[axis] <= split : point[axis] < split;
+        (goesLeft ? leftWriter : rightWriter).write(point, label);
+      }
+      left.count = leftWriter.written();
+      right.count = rightWriter.written();
+      if (!leftWriter.finish() || !rightWriter.finish()) {
+        cout << "Unable to write the runs of " << indexPath << endl;
+        failed = true;
+      }
+    }
+    removeRun(run);
+    if (failed || left.count == 0 || right.count == 0) {
+      // Only a file that changed under us gets here
+      failed = true;
+      removeRun(left);
+      removeRun(right);
+      return -1;
+    }
+
+    int32_t node = addNode();
+    nodes[node].axis = axis;
+    nodes[node].split = split;
+    int32_t leftNode = buildRun(left, depth + 1);
+    int32_t rightNode = buildRun(right, depth + 1);
+    if (failed) {
+      return -1;
+    }
+    nodes[node].left = leftNode;
+    nodes[node].right = rightNode;
+    mergeBoxes(node);
+    return node;
+  }
+
+  PointSet loadRun(const Run& run) {
+    PointSet points(d);
+    points.reserve(run.count);
+    RunReader reader(run);
+    const double* point;
+    int label;
+    while (reader.next(point, label)) {
+      points.push_back(point, label);
+    }
+    return points;
+  }
+
+  // Median splits down to leaves, as KDTree::buildKDTree
+  int32_t buildInMemory(PointSet& points, size_t* begin, size_t* end, int depth) {
+    if ((size_t)(end - begin) <= leafCapacity) {
+      return writeLeaf(points, begin, end);
+    }
+    int32_t node = addNode();
+    int axis = depth % d;
+    size_t* median = begin + (end - begin) / 2;
+    nth_element(begin, median, end, [&points, axis](size_t a, size_t b) {
+      return points.features(a)[axis] < points.features(b)[axis];
+    });
+    nodes[node].axis = axis;
+    nodes[node].split = points.features(*median)[axis];
+    int32_t leftNode = buildInMemory(points, begin, median, depth + 1);
+    int32_t rightNode = buildInMemory(points, median, end, depth + 1);
+    nodes[node].left = leftNode;
+    nodes[node].right = rightNode;
+    mergeBoxes(node);
+    return node;
+  }
+
+  // Leaves are numbered, and so written, in order
+  int32_t writeLeaf(const PointSet& points, const size_t* begin, const size_t* end) {
+    int32_t node = addNode();
+    uint64_t count = end - begin;
+    nodes[node].leaf = leafCount++;
+    nodes[node].count = count;
+
+    DiskBlock block(blockBytes, options.pageBytes);
+    memset(block.data(), 0, blockBytes);
+    memcpy(block.data(), &count, sizeof(count));
+    double* features = reinterpret_cast<double*>(block.data() + DISK_LEAF_HEADER_BYTES);
+    int32_t* labels = reinterpret_cast<int32_t*>(block.data() + DISK_LEAF_HEADER_BYTES +
+                                                 leafCapacity * d * sizeof(double));
+    fill(low(node), low(node) + d, numeric_limits<double>::infinity());
+    fill(high(node), high(node) + d, -numeric_limits<double>::infinity());
+    for (uint64_t i = 0; i < count; i++) {
+      const double* point = points.features(begin[i]);
+      memcpy(features + i * d, point, d * sizeof(double));
+      labels[i] = points.label(begin[i]);
+      for (size_t axis = 0; axis < d; axis++) {
+        low(node)[axis] = min(low(node)[axis], point[axis]);
+        high(node)[axis] = max(high(node)[axis], point[axis]);
+      }
+    }
+    if (!writeAt(fd, block.data(), blockBytes, options.pageBytes + nodes[node].leaf * blockBytes)) {
+      cout << "Unable to write " << indexPath << ": " << strerror(errno) << endl;
+      failed = true;
+    }
+    return node;
+  }
+
+  bool writeTopTree() {
+    DiskTreeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_TREE_MAGIC, sizeof(header.magic));
+    header.dimensions = d;
+    header.pageBytes = options.pageBytes;
+    header.blockBytes = blockBytes;
+    header.leafCapacity = leafCapacity;
+    header.numPoints = nodes.empty() ? 0 : nodes[0].count;
+    header.numLeaves = leafCount;
+    header.numNodes = nodes.size();
+    header.nodesOffset = roundUpTo(options.pageBytes + leafCount * blockBytes, options.pageBytes);
+
+    vector<char> page(options.pageBytes, 0);
+    memcpy(page.data(), &header, sizeof(header));
+    if (!writeAt(fd, page.data(), page.size(), 0) ||
+        !writeAt(fd, nodes.data(), nodes.size() * sizeof(DiskNode), header.nodesOffset) ||
+        !writeAt(fd, boxes.data(), boxes.size() * sizeof(double),
+                 header.nodesOffset + nodes.size() * sizeof(DiskNode))) {
+      cout << "Unable to write " << indexPath << ": " << strerror(errno) << endl;
+      return false;
+    }
+    return true;
+  }
+
+  string indexPath;
+  size_t d;
+  DiskTreeOptions options;
+  size_t blockBytes;
+  size_t leafCapacity;
+  size_t pointBytes;   // Memory per point of an in-memory build
+  int fd;
+  size_t numRuns;
+  size_t leafCount = 0;
+  bool failed = false;
+  vector<DiskNode> nodes;   // Root first
+  vector<double> boxes;
+  DiskBuildStats stats;
+};
+
+struct DiskBatchStats {
+  size_t queries;
+  size_t candidates;   // (query, leaf) pairs whose leaf may hold one of the query's neighbors
+  size_t leaves;       // Distinct leaves among them
+  size_t blocks;       // Leaves fetched, once each; the others were pruned for all their queries
+  size_t scans;        // Pairs scanned, the others were pruned by then
+  double planSeconds;
+  double scanSeconds;
+};
+
+class DiskKDTree {
+public:
+  DiskKDTree() : fd(-1) { memset(&header, 0, sizeof(header)); }
+
+  ~DiskKDTree() {
+    cache.reset();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  DiskKDTree(const DiskKDTree&) = delete;
+  DiskKDTree& operator=(const DiskKDTree&) = delete;
+
+  // Write the index of the first d features of a CSV or binary dataset
+  static bool build(const string& input, const string& indexPath, size_t d, const DiskTreeOptions& options,
+                    DiskBuildStats& stats) {
+    DiskTreeBuilder builder(indexPath, d, options);
+    return builder.build(input, stats);
+  }
+
+  // Load the top tree, and leave the rest of memoryBytes to the block cache
+  bool open(const string& path, size_t memoryBytes, size_t ioThreads = 2, bool directIO = false) {
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+      cout << "Unable to open file " << path << endl;
+      return false;
+    }
+    bool ok = readAt(file, &header, sizeof(header), 0) &&
+              memcmp(header.magic, DISK_TREE_MAGIC, sizeof(header.magic)) == 0 && header.dimensions > 0;
+    if (ok) {
+      nodes.resize(header.numNodes);
+      boxes.resize(header.numNodes * 2 * header.dimensions);
+      ok = readAt(file, nodes.data(), nodes.size() * sizeof(DiskNode), header.nodesOffset) &&
+           readAt(file, boxes.data(), boxes.size() * sizeof(double),
+                  header.nodesOffset + nodes.size() * sizeof(DiskNode));
+    }
+    close(file);
+    if (!ok) {
+      cout << path << " is not a disk KD-tree index" << endl;
+      return false;
+    }
+
+    leafNodes.assign(header.numLeaves, -1);
+    for (size_t node = 0; node < nodes.size(); node++) {
+      if (nodes[node].leaf >= 0) {
+        leafNodes[nodes[node].leaf] = node;
+      }
+    }
+
+    size_t blocks = memoryBytes > topTreeBytes() ? (memoryBytes - topTreeBytes()) / header.blockBytes : 0;
+    if (blocks < DISK_READ_AHEAD + 2) {
+      cout << "A memory budget of " << memoryBytes << " bytes leaves room for " << blocks
+           << " blocks next to the top tree, caching " << DISK_READ_AHEAD + 2 << " anyway" << endl;
+      blocks = DISK_READ_AHEAD + 2;
+    }
+    fd = openBlockFile(path, directIO);
+    cache.reset(new BlockCache(fd, header.pageBytes, header.blockBytes, header.pageBytes, blocks, ioThreads));
+    return true;
+  }
+
+  size_t dimensions() const { return header.dimensions; }
+  size_t size() const { return header.numPoints; }
+  size_t numLeaves() const { return header.numLeaves; }
+  size_t blockBytes() const { return header.blockBytes; }
+  size_t leafCapacity() const { return header.leafCapacity; }
+  size_t cacheBlocks() const { return cache->capacity(); }
+
+  size_t topTreeBytes() const {
+    return nodes.size() * sizeof(DiskNode) + boxes.size() * sizeof(double) + leafNodes.size() * sizeof(int32_t);
+  }
+
+  BlockCacheStats cacheStats() const { return cache->stats(); }
+  void resetCacheStats() { cache->resetStats(); }
+
+  // The k nearest points to the first d features of target (Euclidean),
+  // closest first. Leaves are visited by the distance of their boxes; the
+  // nearest few pending ones are read ahead while the current one is scanned.
+  vector<DiskNeighbor> search(const vector<double>& target, size_t k) {
+    Candidates best;
+    vector<pair<double, int32_t>> frontier;   // Min-heap of (box distance, node)
+    auto closer = greater<pair<double, int32_t>>();
+    if (k == 0 || nodes.empty()) {
+      return {};
+    }
+    frontier.push_back({boxDistance(0, target.data()), 0});
+    while (!frontier.empty()) {
+      pop_heap(frontier.begin(), frontier.end(), closer);
+      double bound = frontier.back().first;
+      int32_t node = frontier.back().second;
+      frontier.pop_back();
+      if (best.size() == k && bound > best.top().first) {
+        break;
+      }
+
+      if (nodes[node].leaf < 0) {
+        for (int32_t child : {nodes[node].left, nodes[node].right}) {
+          double distance = boxDistance(child, target.data());
+          if (best.size() < k || distance <= best.top().first) {
+            frontier.push_back({distance, child});
+            push_heap(frontier.begin(), frontier.end(), closer);
+          }
+        }
+        continue;
+      }
+      readAhead(frontier, best, k);
+      scanLeaf(*cache->get(nodes[node].leaf), target.data(), k, best);
+    }
+    return sortedNeighbors(best);
+  }
+
+  // Every target's k nearest points, reading each leaf block at most once
+  // for the whole batch. The top tree alone bounds each target's k-th
+  // distance (the farthest corners of leaves holding k points), which gives
+  // the leaves it may need. Every leaf is then fetched once for all the
+  // targets that need it: first the leaves nearest to some target, which
+  // tighten the bounds quickly, then the others, each group in file order.
+  // A leaf that all its targets have ruled out by its turn is not read.
+  vector<vector<DiskNeighbor>> searchBatch(const vector<vector<double>>& targets, size_t k,
+                                           DiskBatchStats* batchStats = nullptr) {
+    Timer planTimer;
+    vector<vector<int32_t>> leaves(targets.size());
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t q = 0; q < targets.size(); q++) {
+      candidateLeaves(targets[q].data(), k, leaves[q]);
+    }
+
+    // (leaf, query) pairs by leaf, and the leaves nearest to some target
+    vector<pair<int32_t, uint32_t>> pairs;
+    vector<char> nearest(numLeaves(), 0);
+    for (size_t q = 0; q < targets.size(); q++) {
+      if (!leaves[q].empty()) {
+        nearest[leaves[q].front()] = 1;
+      }
+      for (int32_t leaf : leaves[q]) {
+        pairs.push_back({leaf, (uint32_t)q});
+      }
+      vector<int32_t>().swap(leaves[q]);
+    }
+    sort(pairs.begin(), pairs.end());
+    vector<pair<size_t, size_t>> groups;   // Pair ranges of one leaf, in reading order
+    for (size_t first = 0; first < pairs.size();) {
+      size_t last = first + 1;
+      while (last < pairs.size() && pairs[last].first == pairs[first].first) {
+        last++;
+      }
+      groups.push_back({first, last});
+      first = last;
+    }
+    stable_partition(groups.begin(), groups.end(),
+                     [&](const pair<size_t, size_t>& group) { return nearest[pairs[group.first].first] != 0; });
+    double planSeconds = planTimer.elapsed();
+
+    Timer scanTimer;
+    vector<Candidates> best(targets.size());
+    vector<uint32_t> active;
+    size_t blocks = 0, scans = 0;
+    // Targets that may still find a neighbor in the leaf
+    auto needs = [&](int32_t leaf, uint32_t q) {
+      return best[q].size() < k || boxDistance(leafNodes[leaf], targets[q].data()) <= best[q].top().first;
+    };
+    auto needed = [&](const pair<size_t, size_t>& group) {
+      for (size_t i = group.first; i < group.second; i++) {
+        if (needs(pairs[i].first, pairs[i].second)) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    size_t prefetched = 0;   // Groups up to here were considered for read-ahead
+    for (size_t g = 0; g < groups.size(); g++) {
+      // Bounds only shrink, so a group not needed now never will be
+      for (prefetched = max(prefetched, g + 1); prefetched < min(groups.size(), g + 1 + DISK_READ_AHEAD);
+           prefetched++) {
+        if (needed(groups[prefetched])) {
+          cache->prefetch(pairs[groups[prefetched].first].first);
+        }
+      }
+
+      int32_t leaf = pairs[groups[g].first].first;
+      active.clear();
+      for (size_t i = groups[g].first; i < groups[g].second; i++) {
+        if (needs(leaf, pairs[i].second)) {
+          active.push_back(pairs[i].second);
+        }
+      }
+      if (active.empty()) {
+        continue;
+      }
+      BlockCache::Block block = cache->get(leaf);
+      blocks++;
+      scans += active.size();
+      #pragma omp parallel for if(active.size() >= 64)
+      for (size_t i = 0; i < active.size(); i++) {
+        scanLeaf(*block, targets[active[i]].data(), k, best[active[i]]);
+      }
+    }
+
+    vector<vector<DiskNeighbor>> results(targets.size());
+    for (size_t q = 0; q < targets.size(); q++) {
+      results[q] = sortedNeighbors(best[q]);
+    }
+    if (batchStats != nullptr) {
+      *batchStats = {targets.size(), pairs.size(), groups.size(), blocks, scans, planSeconds,
+                     scanTimer.elapsed()};
+    }
+    return results;
+  }
+
+  // Scan of every block, to check the searches
+  vector<DiskNeighbor> searchExhaustive(const vector<double>& target, size_t k) {
+    Candidates best;
+    for (size_t leaf = 0; leaf < numLeaves(); leaf++) {
+      if (leaf + DISK_READ_AHEAD < numLeaves()) {
+        cache->prefetch(leaf + DISK_READ_AHEAD);
+      }
+      scanLeaf(*cache->get(leaf), target.data(), k, best);
+    }
+    return sortedNeighbors(best);
+  }
+
+private:
+  // Squared distances, farthest on top
+  typedef priority_queue<pair<double, int>> Candidates;
+
+  const double* low(int32_t node) const { return &boxes[2 * header.dimensions * node]; }
+  const double* high(int32_t node) const { return &boxes[2 * header.dimensions * node + header.dimensions]; }
+
+  // Squared distance to the nearest point of the node's box
+  double boxDistance(int32_t node, const double* target) const {
+    const double* lowCorner = low(node);
+    const double* highCorner = high(node);
+    double distance = 0.0;
+    for (size_t i = 0; i < header.dimensions; i++) {
+      double outside = max(max(lowCorner[i] - target[i], target[i] - highCorner[i]), 0.0);
+      distance += outside * outside;
+    }
+    return distance;
+  }
+
+  // Squared distance to the farthest corner of the node's box
+  double farthestDistance(int32_t node, const double* target) const {
+    const double* lowCorner = low(node);
+    const double* highCorner = high(node);
+    double distance = 0.0;
+    for (size_t i = 0; i < header.dimensions; i++) {
+      double farthest = max(fabs(target[i] - lowCorner[i]), fabs(target[i] - highCorner[i]));
+      distance += farthest * farthest;
+    }
+    return distance;
+  }
+
+  void scanLeaf(const DiskBlock& block, const double* target, size_t k, Candidates& best) const {
+    if (block.size() < DISK_LEAF_HEADER_BYTES) {
+      return;
+    }
+    size_t d = header.dimensions;
+    uint64_t count;
+    memcpy(&count, block.data(), sizeof(count));
+    count = min<uint64_t>(count, header.leafCapacity);
+    const double* features = reinterpret_cast<const double*>(block.data() + DISK_LEAF_HEADER_BYTES);
+    const int32_t* labels = reinterpret_cast<const int32_t*>(block.data() + DISK_LEAF_HEADER_BYTES +
+                                                             header.leafCapacity * d * sizeof(double));
+    for (uint64_t i = 0; i < count; i++) {
+      const double* point = features + i * d;
+      double distance = 0.0;
+      for (size_t axis = 0; axis < d; axis++) {
+        double diff = point[axis] - target[axis];
+        distance += diff * diff;
+      }
+      if (best.size() < k) {
+        best.push({distance, labels[i]});
+      } else if (distance < best.top().first) {
+        best.pop();
+        best.push({distance, labels[i]});
+      }
+    }
+  }
+
+  // Start reading the closest pending leaves that may still matter
+  void readAhead(const vector<pair<double, int32_t>>& frontier, const Candidates& best, size_t k) {
+    pair<double, int32_t> nearest[DISK_READ_AHEAD];
+    size_t found = 0;
+    for (const pair<double, int32_t>& entry : frontier) {
+      if (nodes[entry.second].leaf < 0 || (best.size() == k && entry.first > best.top().first)) {
+        continue;
+      }
+      if (found < DISK_READ_AHEAD) {
+        nearest[found++] = entry;
+      } else {
+        pair<double, int32_t>* farthest = max_element(nearest, nearest + found);
+        if (entry < *farthest) {
+          *farthest = entry;
+        }
+      }
+    }
+    for (size_t i = 0; i < found; i++) {
+      cache->prefetch(nodes[nearest[i].second].leaf);
+    }
+  }
+
+  // Leaves that may hold one of the k nearest points to target, nearest box first
+  void candidateLeaves(const double* target, size_t k, vector<int32_t>& leaves) const {
+    leaves.clear();
+    if (k == 0 || nodes.empty()) {
+      return;
+    }
+    double bound = numeric_limits<double>::infinity();
+    priority_queue<pair<double, uint64_t>> covering;   // (farthest distance, count) of leaves holding k points
+    uint64_t covered = 0;
+    vector<pair<double, int32_t>> found;
+    vector<pair<double, int32_t>> frontier = {{boxDistance(0, target), 0}};
+    auto closer = greater<pair<double, int32_t>>();
+    while (!frontier.empty()) {
+      pop_heap(frontier.begin(), frontier.end(), closer);
+      pair<double, int32_t> entry = frontier.back();
+      frontier.pop_back();
+      if (entry.first > bound) {
+        break;
+      }
+      const DiskNode& node = nodes[entry.second];
+      if (node.leaf < 0) {
+        for (int32_t child : {node.left, node.right}) {
+          double distance = boxDistance(child, target);
+          if (distance <= bound) {
+            frontier.push_back({distance, child});
+            push_heap(frontier.begin(), frontier.end(), closer);
+          }
+        }
+        continue;
+      }
+
+      // The k-th nearest point is no farther than the farthest corner of
+      // the leaves that, nearest corners first, hold k points
+      found.push_back({entry.first, node.leaf});
+      covering.push({farthestDistance(entry.second, target), node.count});
+      covered += node.count;
+      while (covered - covering.top().second >= k) {
+        covered -= covering.top().second;
+        covering.pop();
+      }
+      if (covered >= k) {
+        bound = min(bound, covering.top().first);
+      }
+    }
+    for (const pair<double, int32_t>& leaf : found) {
+      if (leaf.first <= bound) {
+        leaves.push_back(leaf.second);
+      }
+    }
+  }
+
+  static vector<DiskNeighbor> sortedNeighbors(Candidates& best) {
+    vector<DiskNeighbor> neighbors(best.size());
+    for (size_t i = neighbors.size(); i-- > 0; best.pop()) {
+      neighbors[i] = {sqrt(best.top().first), best.top().second};
+    }
+    return neighbors;
+  }
+
+  DiskTreeHeader header;
+  vector<DiskNode> nodes;   // Root first
+  vector<double> boxes;
+  vector<int32_t> leafNodes;
+  int fd;
+  unique_ptr<BlockCache> cache;
+};
+
+#endif
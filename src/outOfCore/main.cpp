@@ -0,0 +1,201 @@
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <omp.h>
+#include "diskTree.h"
+#include "../dataset.h"
+#include "../timing.h"
+#include "../utils.h"
+
+using namespace std;
+
+// Build a disk-resident KD-tree index of a dataset (-i) and/or query one
+// (-x, or the one just built): every query alone through the block cache,
+// then in batches grouped by leaf block.
+
+int main(int argc, char *argv[]) {
+  string filename = "";
+  string indexPath = "";
+  string queryFilename = "";
+  size_t d = 0;
+  size_t k = 10;
+  size_t blockKilobytes = DISK_BLOCK_BYTES >> 10;
+  size_t memoryMegabytes = 256;
+  size_t batchSize = 0;
+  size_t ioThreads = 2;
+  bool directIO = false;
+  bool check = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hi:o:x:d:k:b:m:q:B:t:Dc")) != -1) {
+    switch (opt) {
+      case 'h':
+        cout << "Usage: " << argv[0] << " -i <dataset> [-o index] | -x <index> [-q queries] [options]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -i value       Dataset to index, CSV or binary" << endl;
+        cout << "  -o value       Index file to write (default: <dataset>.kdd)" << endl;
+        cout << "  -x value       Existing index file to query" << endl;
+        cout << "  -d value       Number of features to index (default: all)" << endl;
+        cout << "  -b value       Leaf block size in KB, whole pages (default 64)" << endl;
+        cout << "  -m value       Memory budget in MB: points held while building, top tree plus" << endl;
+        cout << "                 block cache while querying (default 256)" << endl;
+        cout << "  -q value       Query points, one per line" << endl;
+        cout << "  -k value       Neighbors per query (default 10)" << endl;
+        cout << "  -B value       Queries per batch (default: all)" << endl;
+        cout << "  -t value       Read-ahead I/O threads (default 2)" << endl;
+        cout << "  -D             Read blocks with O_DIRECT, bypassing the page cache" << endl;
+        cout << "  -c             Check the answers against a scan of every block" << endl;
+        return 0;
+      case 'i':
+        filename = optarg;
+        break;
+      case 'o':
+      case 'x':
+        indexPath = optarg;
+        break;
+      case 'q':
+        queryFilename = optarg;
+        break;
+      case 'd':
+      case 'k':
+      case 'b':
+      case 'm':
+      case 'B':
+      case 't':
+        if (!isPositiveInteger(optarg) || string(optarg).empty() || stoul(optarg) == 0) {
+          cout << "Invalid value for " << (char)opt << ", " << (char)opt << " = " << optarg << endl;
+          return 0;
+        }
+        if (opt == 'd') d = stoul(optarg);
+        if (opt == 'k') k = stoul(optarg);
+        if (opt == 'b') blockKilobytes = stoul(optarg);
+        if (opt == 'm') memoryMegabytes = stoul(optarg);
+        if (opt == 'B') batchSize = stoul(optarg);
+        if (opt == 't') ioThreads = stoul(optarg);
+        break;
+      case 'D':
+        directIO = true;
+        break;
+      case 'c':
+        check = true;
+        break;
+      default:
+        cout << "Usage: " << argv[0] << " -i <dataset> [-o index] | -x <index> [-q queries]" << endl;
+        return 0;
+    }
+  }
+
+  if (filename == "" && indexPath == "") {
+    cout << "Not enough arguments provided." << endl;
+    return 0;
+  }
+
+  if (filename != "") {
+    if (indexPath == "") {
+      indexPath = filename + ".kdd";
+    }
+    if (d == 0) {
+      DatasetLayout layout;
+      if (!findDatasetLayout(filename, layout)) {
+        return 0;
+      }
+      d = layout.dimensions;
+    }
+
+    DiskTreeOptions options;
+    options.blockBytes = blockKilobytes << 10;
+    options.memoryBytes = memoryMegabytes << 20;
+    DiskBuildStats stats;
+    if (!DiskKDTree::build(filename, indexPath, d, options, stats)) {
+      return 0;
+    }
+    printf("Indexed %zu points in %zu leaves (%zu nodes) in %.6fs\n", stats.points, stats.leaves, stats.nodes,
+           stats.seconds);
+    printf("  %zu partitioning passes over %.2f MB, %zu subtrees built in memory\n", stats.partitionPasses,
+           stats.bytesPartitioned / 1048576.0, stats.inMemorySubtrees);
+  }
+
+  if (queryFilename == "") {
+    return 0;
+  }
+
+  DiskKDTree tree;
+  if (!tree.open(indexPath, memoryMegabytes << 20, ioThreads, directIO)) {
+    return 0;
+  }
+  printf("Index %s: %zu points, %zu dimensions, %zu leaves of up to %zu points\n", indexPath.c_str(), tree.size(),
+         tree.dimensions(), tree.numLeaves(), tree.leafCapacity());
+  printf("Top tree %.2f MB, block cache %zu blocks (%.2f MB)\n", tree.topTreeBytes() / 1048576.0,
+         tree.cacheBlocks(), tree.cacheBlocks() * tree.blockBytes() / 1048576.0);
+
+  PointSet queryPoints = readDataset(queryFilename);
+  if (queryPoints.dimensions() < tree.dimensions()) {
+    cout << "The query points have fewer than " << tree.dimensions() << " features" << endl;
+    return 0;
+  }
+  vector<vector<double>> queries(queryPoints.size());
+  for (size_t q = 0; q < queries.size(); q++) {
+    queries[q].assign(queryPoints.features(q), queryPoints.features(q) + tree.dimensions());
+  }
+
+  // One query at a time, reading ahead along each search
+  vector<vector<DiskNeighbor>> single(queries.size());
+  Timer singleTimer;
+  for (size_t q = 0; q < queries.size(); q++) {
+    single[q] = tree.search(queries[q], k);
+  }
+  double singleTime = singleTimer.elapsed();
+  printf("\n%zu queries one at a time: %.6fs (%.1f queries/s)\n", queries.size(), singleTime,
+         queries.size() / singleTime);
+  printBlockCacheStats(tree.cacheStats(), tree.cacheBlocks(), tree.blockBytes());
+
+  // Batches grouped by leaf block, each block fetched once per batch
+  tree.resetCacheStats();
+  if (batchSize == 0) {
+    batchSize = queries.size();
+  }
+  vector<vector<DiskNeighbor>> batched;
+  size_t candidates = 0, leaves = 0, blocks = 0, scans = 0;
+  double planTime = 0.0, scanTime = 0.0;
+  Timer batchTimer;
+  for (size_t first = 0; first < queries.size(); first += batchSize) {
+    vector<vector<double>> batch(queries.begin() + first, queries.begin() + min(queries.size(), first + batchSize));
+    DiskBatchStats stats;
+    vector<vector<DiskNeighbor>> answers = tree.searchBatch(batch, k, &stats);
+    batched.insert(batched.end(), answers.begin(), answers.end());
+    candidates += stats.candidates;
+    leaves += stats.leaves;
+    blocks += stats.blocks;
+    scans += stats.scans;
+    planTime += stats.planSeconds;
+    scanTime += stats.scanSeconds;
+  }
+  double batchTime = batchTimer.elapsed();
+  printf("\n%zu queries in batches of %zu: %.6fs (%.1f queries/s, planning %.6fs, scanning %.6fs)\n",
+         queries.size(), batchSize, batchTime, queries.size() / batchTime, planTime, scanTime);
+  printf("  %zu candidate (query, leaf) pairs over %zu leaves: %zu leaves fetched, %zu pairs scanned\n", candidates,
+         leaves, blocks, scans);
+  printBlockCacheStats(tree.cacheStats(), tree.cacheBlocks(), tree.blockBytes());
+
+  size_t mismatches = 0;
+  for (size_t q = 0; q < queries.size(); q++) {
+    for (size_t i = 0; i < single[q].size(); i++) {
+      mismatches += i >= batched[q].size() || single[q][i].distance != batched[q][i].distance;
+    }
+  }
+  printf("\nBatched answers differing from single ones: %zu\n", mismatches);
+
+  if (check) {
+    size_t wrong = 0;
+    Timer checkTimer;
+    for (size_t q = 0; q < queries.size(); q++) {
+      vector<DiskNeighbor> expected = tree.searchExhaustive(queries[q], k);
+      for (size_t i = 0; i < expected.size(); i++) {
+        wrong += i >= single[q].size() || single[q][i].distance != expected[i].distance;
+      }
+    }
+    printf("Answers differing from a scan of every block: %zu (%.6fs)\n", wrong, checkTimer.elapsed());
+  }
+  return 0;
+}
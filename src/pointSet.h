@@ -0,0 +1,180 @@
+#ifndef POINT_SET_H
+#define POINT_SET_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Features are stored row-major in one buffer aligned to a cache line
+#define POINT_SET_ALIGNMENT 64
+
+// Minimal allocator handing out POINT_SET_ALIGNMENT-aligned blocks
+template<typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    size_t bytes = (n * sizeof(T) + POINT_SET_ALIGNMENT - 1) / POINT_SET_ALIGNMENT * POINT_SET_ALIGNMENT;
+    void* memory = aligned_alloc(POINT_SET_ALIGNMENT, bytes > 0 ? bytes : POINT_SET_ALIGNMENT);
+    if (memory == nullptr) {
+      throw bad_alloc();
+    }
+    return static_cast<T*>(memory);
+  }
+
+  void deallocate(T* memory, size_t) { free(memory); }
+
+  // Elements grown without a value stay unwritten, so the pages of a fresh
+  // buffer are first touched (and placed, see numa.h) by whoever fills them
+  template<typename U>
+  void construct(U* p) { ::new (static_cast<void*>(p)) U; }
+
+  template<typename U, typename... Args>
+  void construct(U* p, Args&&... args) { ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+
+  template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+  template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// Non-owning view of one point of a PointSet.
+// Stays valid until the set it came from is resized or destroyed.
+struct PointView {
+  const double* features;
+  size_t dimensions;
+  int label;
+
+  double operator[](size_t axis) const { return features[axis]; }
+  const double* begin() const { return features; }
+  const double* end() const { return features + dimensions; }
+
+  // Owned copy of the features
+  vector<double> toVector() const { return vector<double>(begin(), end()); }
+};
+
+// Labeled points with a fixed number of features, stored as one contiguous
+// row-major feature buffer plus a label array. Point i's features are
+// features(i)[0 .. dimensions() - 1].
+class PointSet {
+public:
+  PointSet() : numDimensions(0) {}
+  explicit PointSet(size_t dimensions) : numDimensions(dimensions) {}
+
+  size_t size() const { return labels.size(); }
+  bool empty() const { return labels.empty(); }
+  size_t dimensions() const { return numDimensions; }
+
+  void reserve(size_t numPoints) {
+    values.reserve(numPoints * numDimensions);
+    labels.reserve(numPoints);
+  }
+
+  // Grow or shrink to numPoints, new points are zeroed with label 0
+  void resize(size_t numPoints) {
+    values.resize(numPoints * numDimensions, 0.0);
+    labels.resize(numPoints, 0);
+  }
+
+  // Grow to numPoints leaving the new features unwritten, for callers that
+  // fill them right away from the threads that will read them
+  void resizeUninitialized(size_t numPoints) {
+    values.resize(numPoints * numDimensions);
+    labels.resize(numPoints, 0);
+  }
+
+  void clear() {
+    values.clear();
+    labels.clear();
+  }
+
+  // Release all memory
+  void release() {
+    PointSet(numDimensions).swap(*this);
+  }
+
+  // Drop spare capacity left over from push_back
+  void shrinkToFit() {
+    values.shrink_to_fit();
+    labels.shrink_to_fit();
+  }
+
+  void swap(PointSet& other) {
+    values.swap(other.values);
+    labels.swap(other.labels);
+    std::swap(numDimensions, other.numDimensions);
+  }
+
+  // Append a point, features must hold dimensions() values
+  void push_back(const double* features, int label) {
+    values.insert(values.end(), features, features + numDimensions);
+    labels.push_back(label);
+  }
+
+  void push_back(const PointView& point) {
+    push_back(point.features, point.label);
+  }
+
+  // Append all points of another set with the same dimensions
+  void append(const PointSet& other) {
+    values.insert(values.end(), other.values.begin(), other.values.end());
+    labels.insert(labels.end(), other.labels.begin(), other.labels.end());
+  }
+
+  const double* features(size_t i) const { return values.data() + i * numDimensions; }
+  double* features(size_t i) { return values.data() + i * numDimensions; }
+
+  int label(size_t i) const { return labels[i]; }
+  int& label(size_t i) { return labels[i]; }
+
+  PointView operator[](size_t i) const { return {features(i), numDimensions, labels[i]}; }
+
+  // Raw buffers, e.g. to send a whole set with MPI
+  const double* data() const { return values.data(); }
+  double* data() { return values.data(); }
+  const int* labelData() const { return labels.data(); }
+  int* labelData() { return labels.data(); }
+
+  // Copy of the set keeping only the first `dimensions` features of every point
+  PointSet project(size_t dimensions) const {
+    if (dimensions >= numDimensions) {
+      return *this;
+    }
+    PointSet projected(dimensions);
+    projected.values.resize(size() * dimensions);
+    projected.labels = labels;
+    for (size_t i = 0; i < size(); i++) {
+      memcpy(projected.features(i), features(i), dimensions * sizeof(double));
+    }
+    return projected;
+  }
+
+  // Copy of the set whose i-th point is point order[i] of this set
+  PointSet permuted(const vector<size_t>& order) const {
+    PointSet result(numDimensions);
+    result.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      memcpy(result.features(i), features(order[i]), numDimensions * sizeof(double));
+      result.labels[i] = labels[order[i]];
+    }
+    return result;
+  }
+
+  // Bytes held by the feature buffer and labels
+  size_t memoryBytes() const {
+    return values.capacity() * sizeof(double) + labels.capacity() * sizeof(int);
+  }
+
+private:
+  vector<double, AlignedAllocator<double>> values;
+  vector<int> labels;
+  size_t numDimensions;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef RANGE_QUERY_H
+#define RANGE_QUERY_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <omp.h>
+
+using namespace std;
+
+// Range queries shared by the static tree (unique_ptr children) and the
+// lock-free tree (atomic children). Points equal to the split value may sit on
+// either side (nth_element builds), so both sides are visited on ties.
+
+// Subtrees above this depth are searched as separate OpenMP tasks
+#define RANGE_PARALLEL_DEPTH 8
+
+template<typename Node>
+const Node* childNode(const unique_ptr<Node>& child) {
+  return child.get();
+}
+
+template<typename Node>
+const Node* childNode(const atomic<Node*>& child) {
+  return child.load();
+}
+
+// Static tree nodes point into the tree's PointSet, lock-free nodes own their features
+inline const double* featureData(const double* features) {
+  return features;
+}
+
+inline const double* featureData(const vector<double>& features) {
+  return features.data();
+}
+
+// All points within `radius` of `center` (Euclidean over the tree's split axes)
+struct BallRegion {
+  const vector<double>& center;
+  double radius;
+
+  // One coordinate per axis the tree splits on, see rangeSearch
+  bool fits(size_t dims) const { return center.size() == dims; }
+
+  bool contains(const double* features) const {
+    double distance = 0.0;
+    for (size_t i = 0; i < center.size(); i++) {
+      double diff = features[i] - center[i];
+      distance += diff * diff;
+    }
+    return distance <= radius * radius;
+  }
+
+  double low(size_t axis) const { return center[axis] - radius; }
+  double high(size_t axis) const { return center[axis] + radius; }
+};
+
+// All points inside the axis-aligned box [low, high] (bounds included)
+struct BoxRegion {
+  const vector<double>& lowCorner;
+  const vector<double>& highCorner;
+
+  bool fits(size_t dims) const { return lowCorner.size() == dims && highCorner.size() == dims; }
+
+  bool contains(const double* features) const {
+    for (size_t i = 0; i < lowCorner.size(); i++) {
+      if (features[i] < lowCorner[i] || features[i] > highCorner[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  double low(size_t axis) const { return lowCorner[axis]; }
+  double high(size_t axis) const { return highCorner[axis]; }
+};
+
+// Accumulators: each task works on its own copy (split) which is folded back (merge)
+
+// Count matches only, nothing is materialized
+struct RangeCounter {
+  size_t count = 0;
+
+  RangeCounter split() const { return RangeCounter(); }
+  template<typename Node> void add(const Node*) { count++; }
+  void merge(const RangeCounter& other) { count += other.count; }
+};
+
+// Stream matches to a callback, which may be called from several threads at once
+template<typename Callback>
+struct RangeStreamer {
+  Callback* callback;
+
+  RangeStreamer split() const { return *this; }
+  template<typename Node> void add(const Node* node) { (*callback)(*node); }
+  void merge(const RangeStreamer&) {}
+};
+
+// Collect pointers to the matching nodes, per subtree then concatenated
+template<typename Node>
+struct RangeCollector {
+  vector<const Node*> nodes;
+
+  RangeCollector split() const { return RangeCollector(); }
+  void add(const Node* node) { nodes.push_back(node); }
+  void merge(RangeCollector& other) {
+    nodes.insert(nodes.end(), other.nodes.begin(), other.nodes.end());
+  }
+};
+
+template<typename Node, typename Region, typename Accumulator>
+void rangeSearchImpl(const Node* node, const Region& region, size_t dims, int depth,
+                     Accumulator& result) {
+  if (node == nullptr) {
+    return;
+  }
+
+  const double* features = featureData(node->features);
+  if (region.contains(features)) {
+    result.add(node);
+  }
+
+  size_t axis = depth % dims;
+  double split = features[axis];
+  const Node* left = region.low(axis) <= split ? childNode(node->left) : nullptr;
+  const Node* right = region.high(axis) >= split ? childNode(node->right) : nullptr;
+
+  if (depth < RANGE_PARALLEL_DEPTH && left != nullptr && right != nullptr) {
+    Accumulator leftResult = result.split();
+    Accumulator rightResult = result.split();
+
+    #pragma omp task shared(leftResult, region)
+    rangeSearchImpl(left, region, dims, depth + 1, leftResult);
+
+    #pragma omp task shared(rightResult, region)
+    rangeSearchImpl(right, region, dims, depth + 1, rightResult);
+
+    #pragma omp taskwait
+    result.merge(leftResult);
+    result.merge(rightResult);
+  } else {
+    rangeSearchImpl(left, region, dims, depth + 1, result);
+    rangeSearchImpl(right, region, dims, depth + 1, result);
+  }
+}
+
+// Entry point: run the search from `root`, split on dims axes in turn, on a
+// team of threads. The region must have exactly one coordinate per split axis:
+// a shorter one would walk the wrong axes and prune matches, a longer one
+// could read past the rows.
+template<typename Node, typename Region, typename Accumulator>
+void rangeSearch(const Node* root, const Region& region, size_t dims, Accumulator& result) {
+  if (root == nullptr || dims == 0) {
+    return;
+  }
+  if (!region.fits(dims)) {
+    throw invalid_argument("Range query must have one coordinate per tree dimension (" + to_string(dims) + ")");
+  }
+
+  if (omp_in_parallel()) {
+    rangeSearchImpl(root, region, dims, 0, result);
+    return;
+  }
+
+  #pragma omp parallel
+  {
+    #pragma omp single
+    rangeSearchImpl(root, region, dims, 0, result);
+  }
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+#include "timing.h"
+
+using namespace std;
+
+// Answers of recent searches, for skewed traffic where the same targets come
+// back again and again:
+//
+//   ResultCache<vector<Answer>> cache(64 << 20);
+//   uint64_t version = tree.version();            // before searching
+//   CacheKey key = makeCacheKey(target, k, tag, quantum);
+//   vector<Answer> answer = cache.fetch(key, version, [&]() { return search(target, k); });
+//
+// The key is the target snapped to a grid of cells `quantum` wide (0 keeps
+// the exact bits), k and a tag for whatever else the answer depends on, such
+// as the metric. Targets in one cell share their answer, so quantum > 0
+// trades exactness for hits.
+//
+// Every entry remembers the version of the index it was computed on and is
+// dropped when looked up at another one, so an index that counts its
+// modifications (lockFree/kdTree.h) invalidates the cache by merely changing.
+// Indexes rebuilt in place call invalidate().
+//
+// Entries are spread over shards with a lock each and evicted with the CLOCK
+// algorithm once their shard's share of the byte budget is used up.
+
+#define RESULT_CACHE_SHARDS 16
+#define RESULT_CACHE_ENTRY_OVERHEAD 64   // Hash index node and bucket, per entry
+
+struct CacheKey {
+  vector<int64_t> cells;   // Quantized target
+  uint64_t k;
+  uint64_t tag;
+  uint64_t hash;
+
+  bool operator==(const CacheKey& other) const {
+    return hash == other.hash && k == other.k && tag == other.tag && cells == other.cells;
+  }
+};
+
+struct CacheKeyHash {
+  size_t operator()(const CacheKey& key) const { return key.hash; }
+};
+
+// FNV-1a over 64-bit words
+inline uint64_t hashWord(uint64_t hash, uint64_t word) {
+  for (int byte = 0; byte < 8; byte++) {
+    hash ^= (word >> (8 * byte)) & 0xff;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+inline uint64_t hashWords(const double* values, size_t n, uint64_t hash = 14695981039346656037ull) {
+  for (size_t i = 0; i < n; i++) {
+    uint64_t bits;
+    memcpy(&bits, &values[i], sizeof(bits));
+    hash = hashWord(hash, bits);
+  }
+  return hash;
+}
+
+inline CacheKey makeCacheKey(const double* target, size_t n, size_t k, uint64_t tag, double quantum) {
+  CacheKey key;
+  key.cells.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    if (quantum > 0.0) {
+      key.cells[i] = (int64_t)floor(target[i] / quantum);
+    } else {
+      double value = target[i] == 0.0 ? 0.0 : target[i];   // -0.0 and 0.0 find the same points
+      memcpy(&key.cells[i], &value, sizeof(value));
+    }
+  }
+  key.k = k;
+  key.tag = tag;
+  key.hash = hashWord(hashWord(14695981039346656037ull, k), tag);
+  for (int64_t cell : key.cells) {
+    key.hash = hashWord(key.hash, (uint64_t)cell);
+  }
+  return key;
+}
+
+inline CacheKey makeCacheKey(const vector<double>& target, size_t k, uint64_t tag, double quantum) {
+  return makeCacheKey(target.data(), target.size(), k, tag, quantum);
+}
+
+// Heap bytes of a cached answer, overload for other answer types
+template<typename T>
+size_t resultBytes(const vector<T>& value) {
+  return value.capacity() * sizeof(T);
+}
+
+struct CacheStats {
+  size_t lookups;
+  size_t hits;
+  size_t stale;        // Lookups that found an entry of another index version
+  size_t inserts;
+  size_t evictions;
+  size_t rejected;     // Answers larger than a whole shard, never cached
+  size_t invalidations;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+  size_t searches;     // Misses fetch() searched and timed
+  double hitSeconds;   // Spent answering hits in fetch()
+  double searchSeconds;
+
+  size_t misses() const { return lookups - hits; }
+  double hitRate() const { return lookups > 0 ? (double)hits / lookups : 0.0; }
+  double meanHitSeconds() const { return hits > 0 ? hitSeconds / hits : 0.0; }
+  double meanSearchSeconds() const { return searches > 0 ? searchSeconds / searches : 0.0; }
+
+  // What the hits would have cost as searches, minus what they did cost
+  double savedSeconds() const { return hits * meanSearchSeconds() - hitSeconds; }
+};
+
+template<typename Value>
+class ResultCache {
+public:
+  explicit ResultCache(size_t budgetBytes, size_t numShards = RESULT_CACHE_SHARDS)
+      : shards(max<size_t>(numShards, 1)), budget(budgetBytes), shardBudget(budgetBytes / shards.size()),
+        lookups(0), hits(0), stale(0), inserts(0), evictions(0), rejected(0), invalidations(0),
+        searches(0), hitNanos(0), searchNanos(0) {
+    for (unique_ptr<Shard>& shard : shards) {
+      shard.reset(new Shard());
+    }
+  }
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // The answer cached for key at this version of the index
+  bool lookup(const CacheKey& key, uint64_t version, Value& value) {
+    lookups.fetch_add(1, memory_order_relaxed);
+    Shard& shard = shardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+      return false;
+    }
+    Slot& slot = shard.slots[found->second];
+    if (slot.version != version) {
+      // Computed before the index changed, it will not be valid again
+      if (slot.version < version) {
+        stale.fetch_add(1, memory_order_relaxed);
+        release(shard, found->second);
+      }
+      return false;
+    }
+    slot.referenced = true;
+    value = slot.value;
+    hits.fetch_add(1, memory_order_relaxed);
+    return true;
+  }
+
+  // Cache an answer computed on this version of the index, evicting as needed
+  void insert(const CacheKey& key, uint64_t version, const Value& value, size_t valueBytes) {
+    size_t bytes = sizeof(Slot) + key.cells.capacity() * sizeof(int64_t) + valueBytes + RESULT_CACHE_ENTRY_OVERHEAD;
+    if (bytes > shardBudget) {
+      rejected.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+
+    Shard& shard = shardOf(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+      // A search racing an insert into the index may finish last with the older answer
+      if (shard.slots[found->second].version > version) {
+        return;
+      }
+      release(shard, found->second);
+    }
+    while (shard.bytes + bytes > shardBudget && evictOne(shard)) {}
+
+    size_t position;
+    if (!shard.freeSlots.empty()) {
+      position = shard.freeSlots.back();
+      shard.freeSlots.pop_back();
+    } else {
+      position = shard.slots.size();
+      shard.slots.emplace_back();
+    }
+    Slot& slot = shard.slots[position];
+    slot.key = key;
+    slot.value = value;
+    slot.version = version;
+    slot.bytes = bytes;
+    slot.referenced = false;
+    slot.used = true;
+    shard.index.emplace(key, position);
+    shard.bytes += bytes;
+    inserts.fetch_add(1, memory_order_relaxed);
+  }
+
+  // The cached answer, or compute() stored under version. Read the version
+  // before searching, so that a change during the search leaves the answer stale.
+  template<typename Compute>
+  Value fetch(const CacheKey& key, uint64_t version, Compute compute) {
+    Timer timer;
+    Value value;
+    if (lookup(key, version, value)) {
+      hitNanos.fetch_add((uint64_t)(timer.elapsed() * 1e9), memory_order_relaxed);
+      return value;
+    }
+    timer.reset();
+    value = compute();
+    searchNanos.fetch_add((uint64_t)(timer.elapsed() * 1e9), memory_order_relaxed);
+    searches.fetch_add(1, memory_order_relaxed);
+    insert(key, version, value, resultBytes(value));
+    return value;
+  }
+
+  // Drop every entry, for indexes without a version that were rebuilt
+  void invalidate() {
+    for (unique_ptr<Shard>& shard : shards) {
+      lock_guard<mutex> guard(shard->lock);
+      shard->slots.clear();
+      shard->freeSlots.clear();
+      shard->index.clear();
+      shard->hand = 0;
+      shard->bytes = 0;
+    }
+    invalidations.fetch_add(1, memory_order_relaxed);
+  }
+
+  CacheStats stats() const {
+    CacheStats result = {lookups.load(), hits.load(), stale.load(), inserts.load(), evictions.load(),
+                         rejected.load(), invalidations.load(), 0, 0, budget, searches.load(),
+                         hitNanos.load() / 1e9, searchNanos.load() / 1e9};
+    for (const unique_ptr<Shard>& shard : shards) {
+      lock_guard<mutex> guard(shard->lock);
+      result.entries += shard->index.size();
+      result.bytes += shard->bytes;
+    }
+    return result;
+  }
+
+  void resetStats() {
+    lookups = 0;
+    hits = 0;
+    stale = 0;
+    inserts = 0;
+    evictions = 0;
+    rejected = 0;
+    invalidations = 0;
+    searches = 0;
+    hitNanos = 0;
+    searchNanos = 0;
+  }
+
+private:
+  struct Slot {
+    CacheKey key;
+    Value value;
+    uint64_t version;
+    size_t bytes;
+    bool referenced;   // Hit since the clock hand last passed
+    bool used;
+  };
+
+  struct Shard {
+    mutex lock;
+    vector<Slot> slots;
+    vector<size_t> freeSlots;
+    unordered_map<CacheKey, size_t, CacheKeyHash> index;
+    size_t hand = 0;
+    size_t bytes = 0;
+  };
+
+  Shard& shardOf(const CacheKey& key) {
+    // The index buckets use the low bits, shards the high ones
+    return *shards[(key.hash >> 40) % shards.size()];
+  }
+
+  void release(Shard& shard, size_t position) {
+    Slot& slot = shard.slots[position];
+    shard.index.erase(slot.key);
+    shard.bytes -= slot.bytes;
+    slot = Slot();
+    slot.used = false;
+    shard.freeSlots.push_back(position);
+  }
+
+  // Advance the hand, sparing referenced entries once, and evict the first
+  // unreferenced one. False if the shard is empty.
+  bool evictOne(Shard& shard) {
+    if (shard.index.empty()) {
+      return false;
+    }
+    while (true) {
+      if (shard.hand >= shard.slots.size()) {
+        shard.hand = 0;
+      }
+      Slot& slot = shard.slots[shard.hand];
+      size_t position = shard.hand++;
+      if (!slot.used) {
+        continue;
+      }
+      if (slot.referenced) {
+        slot.referenced = false;
+        continue;
+      }
+      release(shard, position);
+      evictions.fetch_add(1, memory_order_relaxed);
+      return true;
+    }
+  }
+
+  vector<unique_ptr<Shard>> shards;
+  size_t budget;
+  size_t shardBudget;
+  atomic<size_t> lookups;
+  atomic<size_t> hits;
+  atomic<size_t> stale;
+  atomic<size_t> inserts;
+  atomic<size_t> evictions;
+  atomic<size_t> rejected;
+  atomic<size_t> invalidations;
+  atomic<size_t> searches;
+  atomic<uint64_t> hitNanos;
+  atomic<uint64_t> searchNanos;
+};
+
+inline void printCacheStats(const CacheStats& stats) {
+  printf("\nResult cache: %zu lookups, %zu hits (%.2f%%), %zu stale, %zu evictions, %zu rejected\n",
+         stats.lookups, stats.hits, 100.0 * stats.hitRate(), stats.stale, stats.evictions, stats.rejected);
+  printf("  %zu entries, %zu of %zu bytes\n", stats.entries, stats.bytes, stats.budget);
+  printf("  mean hit %.3fus, mean search %.3fus, saved %.6fs\n", stats.meanHitSeconds() * 1e6,
+         stats.meanSearchSeconds() * 1e6, stats.savedSeconds());
+}
+
+inline void writeCacheStatsJSON(ostream& out, const CacheStats& stats) {
+  out << "{\"lookups\": " << stats.lookups << ", \"hits\": " << stats.hits << ", \"hitRate\": " << stats.hitRate()
+      << ", \"stale\": " << stats.stale << ", \"inserts\": " << stats.inserts << ", \"evictions\": "
+      << stats.evictions << ", \"rejected\": " << stats.rejected << ", \"invalidations\": " << stats.invalidations
+      << ", \"entries\": " << stats.entries << ", \"bytes\": " << stats.bytes << ", \"budget\": " << stats.budget
+      << ", \"meanHitSeconds\": " << stats.meanHitSeconds() << ", \"meanSearchSeconds\": "
+      << stats.meanSearchSeconds() << ", \"savedSeconds\": " << stats.savedSeconds() << "}";
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef SPACE_FILLING_CURVE_H
+#define SPACE_FILLING_CURVE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "pointSet.h"
+
+using namespace std;
+
+// Space-filling curves map a point to a 64-bit key so that points with close
+// keys are close in space. Sorting by key puts neighbors next to each other
+// in memory (points before a build) or in time (queries of a batch).
+
+// Keys hold at most this many axes, further axes are ignored
+#define CURVE_MAX_AXES 64
+
+enum CurveType {
+  CURVE_NONE,
+  CURVE_MORTON,    // Z-order: interleaved coordinate bits, cheap
+  CURVE_HILBERT    // No jumps between consecutive cells, better locality
+};
+
+// Parse "none", "morton" or "hilbert"
+inline bool parseCurveType(const string& value, CurveType& type) {
+  if (value == "none") {
+    type = CURVE_NONE;
+  } else if (value == "morton" || value == "z") {
+    type = CURVE_MORTON;
+  } else if (value == "hilbert") {
+    type = CURVE_HILBERT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+class SpaceFillingCurve {
+public:
+  SpaceFillingCurve(CurveType type, size_t dimensions)
+      : type(type), axes(min<size_t>(dimensions, CURVE_MAX_AXES)),
+        bitsPerAxis(axes > 0 ? min<size_t>(32, max<size_t>(1, 64 / axes)) : 0),
+        low(axes, numeric_limits<double>::max()), high(axes, numeric_limits<double>::lowest()) {}
+
+  // Grow the bounding box the coordinates are quantized in
+  void fit(const double* point) {
+    for (size_t axis = 0; axis < axes; axis++) {
+      low[axis] = min(low[axis], point[axis]);
+      high[axis] = max(high[axis], point[axis]);
+    }
+  }
+
+  void fit(const PointSet& points) {
+    for (size_t i = 0; i < points.size(); i++) {
+      fit(points.features(i));
+    }
+  }
+
+  void fit(const vector<vector<double>>& points) {
+    for (const vector<double>& point : points) {
+      if (point.size() >= axes) {
+        fit(point.data());
+      }
+    }
+  }
+
+  // Position of a point along the curve, coordinates outside the box are clamped
+  uint64_t key(const double* point) const {
+    uint32_t cells[CURVE_MAX_AXES];
+    double maxCell = (double)((1ULL << bitsPerAxis) - 1);
+    for (size_t axis = 0; axis < axes; axis++) {
+      double extent = high[axis] - low[axis];
+      double scaled = extent > 0.0 ? (point[axis] - low[axis]) / extent * maxCell : 0.0;
+      cells[axis] = (uint32_t)min(max(scaled, 0.0), maxCell);
+    }
+
+    if (type == CURVE_HILBERT) {
+      hilbertTranspose(cells);
+    }
+    return interleave(cells);
+  }
+
+  // Indices of the points in curve order
+  vector<size_t> order(const PointSet& points) const {
+    vector<uint64_t> keys(points.size());
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < points.size(); i++) {
+      keys[i] = key(points.features(i));
+    }
+    return sortedByKey(keys);
+  }
+
+  vector<size_t> order(const vector<vector<double>>& points) const {
+    vector<uint64_t> keys(points.size(), 0);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < points.size(); i++) {
+      if (points[i].size() >= axes) {
+        keys[i] = key(points[i].data());
+      }
+    }
+    return sortedByKey(keys);
+  }
+
+private:
+  CurveType type;
+  size_t axes;
+  size_t bitsPerAxis;
+  vector<double> low;
+  vector<double> high;
+
+  // Most significant bit of every axis first, then the next bit of every axis...
+  uint64_t interleave(const uint32_t* cells) const {
+    uint64_t result = 0;
+    for (int bit = (int)bitsPerAxis - 1; bit >= 0; bit--) {
+      for (size_t axis = 0; axis < axes; axis++) {
+        result = (result << 1) | ((cells[axis] >> bit) & 1);
+      }
+    }
+    return result;
+  }
+
+  // Turn cell coordinates into the "transposed" Hilbert index, whose
+  // interleaved bits are the Hilbert key (J. Skilling, "Programming the
+  // Hilbert curve", 2004)
+  void hilbertTranspose(uint32_t* cells) const {
+    uint32_t highBit = 1u << (bitsPerAxis - 1);
+
+    // Inverse undo
+    for (uint32_t q = highBit; q > 1; q >>= 1) {
+      uint32_t p = q - 1;
+      for (size_t axis = 0; axis < axes; axis++) {
+        if (cells[axis] & q) {
+          cells[0] ^= p;
+        } else {
+          uint32_t t = (cells[0] ^ cells[axis]) & p;
+          cells[0] ^= t;
+          cells[axis] ^= t;
+        }
+      }
+    }
+
+    // Gray encode
+    for (size_t axis = 1; axis < axes; axis++) {
+      cells[axis] ^= cells[axis - 1];
+    }
+    uint32_t t = 0;
+    for (uint32_t q = highBit; q > 1; q >>= 1) {
+      if (cells[axes - 1] & q) {
+        t ^= q - 1;
+      }
+    }
+    for (size_t axis = 0; axis < axes; axis++) {
+      cells[axis] ^= t;
+    }
+  }
+
+  // Stable, so points in the same cell keep their input order
+  static vector<size_t> sortedByKey(const vector<uint64_t>& keys) {
+    vector<size_t> indices(keys.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+      indices[i] = i;
+    }
+    stable_sort(indices.begin(), indices.end(),
+                [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    return indices;
+  }
+};
+
+// Sort points along a curve through their first `dimensions` features
+inline void sortAlongCurve(PointSet& points, CurveType type, size_t dimensions) {
+  if (type == CURVE_NONE || points.size() < 2) {
+    return;
+  }
+  SpaceFillingCurve curve(type, min(dimensions, points.dimensions()));
+  curve.fit(points);
+  points = points.permuted(curve.order(points));
+}
+
+// Curve order of a batch of queries, so consecutive queries touch the same
+// part of the tree. Answer query order[i] i-th and scatter the answers back
+// with restoreOrder. Every query must hold at least `dimensions` features.
+inline vector<size_t> queryCurveOrder(const vector<vector<double>>& queries, CurveType type, size_t dimensions) {
+  if (type == CURVE_NONE) {
+    vector<size_t> identity(queries.size());
+    for (size_t i = 0; i < identity.size(); i++) {
+      identity[i] = i;
+    }
+    return identity;
+  }
+  SpaceFillingCurve curve(type, dimensions);
+  curve.fit(queries);
+  return curve.order(queries);
+}
+
+// items[i] = old items[order[i]]
+template<typename T>
+void applyOrder(vector<T>& items, const vector<size_t>& order) {
+  vector<T> ordered;
+  ordered.reserve(items.size());
+  for (size_t index : order) {
+    ordered.push_back(move(items[index]));
+  }
+  items.swap(ordered);
+}
+
+// Undo applyOrder: items[order[i]] = old items[i]
+template<typename T>
+void restoreOrder(vector<T>& items, const vector<size_t>& order) {
+  vector<T> restored(items.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    restored[order[i]] = move(items[i]);
+  }
+  items.swap(restored);
+}
+
+#endif
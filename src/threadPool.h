@@ -0,0 +1,309 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <condition_variable>
+
+using namespace std;
+
+// Persistent work-stealing thread pool, meant to be the only source of
+// threads in a process that builds, updates and searches trees at once.
+//
+// Every worker owns a deque: tasks it spawns go to the back and it pops from
+// the back (newest first, warm in cache), idle workers steal from the front of
+// the others. Tasks submitted from outside the pool go to a shared queue.
+// Waiting on a future with wait() runs pending tasks meanwhile, so tasks may
+// wait on their own subtasks without tying up a worker.
+
+typedef chrono::steady_clock::time_point Deadline;
+
+inline Deadline noDeadline() {
+  return Deadline::max();
+}
+
+// Deadline `budget` from now, e.g. deadlineIn(chrono::milliseconds(5))
+template<typename Duration>
+Deadline deadlineIn(Duration budget) {
+  return chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(budget);
+}
+
+// Set in the future of a task cancelled before it started
+struct TaskCancelled : runtime_error {
+  explicit TaskCancelled(const string& what = "task cancelled") : runtime_error(what) {}
+};
+
+// Set in the future of a task whose deadline passed before it started
+struct DeadlineExceeded : TaskCancelled {
+  DeadlineExceeded() : TaskCancelled("deadline exceeded") {}
+};
+
+// Copies share one flag. Tasks not started yet are dropped once it is set,
+// running tasks may poll cancelled() to stop early.
+class CancellationToken {
+public:
+  CancellationToken() : flag(make_shared<atomic<bool>>(false)) {}
+
+  void cancel() { *flag = true; }
+  bool cancelled() const { return *flag; }
+
+private:
+  shared_ptr<atomic<bool>> flag;
+};
+
+// Run f into promise, forwarding its exception
+template<typename R, typename F>
+void fulfil(promise<R>& result, F& f) {
+  try {
+    result.set_value(f());
+  } catch (...) {
+    result.set_exception(current_exception());
+  }
+}
+
+template<typename F>
+void fulfil(promise<void>& result, F& f) {
+  try {
+    f();
+    result.set_value();
+  } catch (...) {
+    result.set_exception(current_exception());
+  }
+}
+
+// Fail the promise if the task must not start, true if it was failed
+template<typename R>
+bool abandonTask(promise<R>& result, const CancellationToken& token, Deadline deadline) {
+  if (token.cancelled()) {
+    result.set_exception(make_exception_ptr(TaskCancelled()));
+    return true;
+  }
+  if (deadline != noDeadline() && chrono::steady_clock::now() > deadline) {
+    result.set_exception(make_exception_ptr(DeadlineExceeded()));
+    return true;
+  }
+  return false;
+}
+
+class ThreadPool {
+public:
+  // numThreads = 0 uses every core
+  explicit ThreadPool(size_t numThreads = 0) : pending(0), stopping(false) {
+    if (numThreads == 0) {
+      numThreads = max(1u, thread::hardware_concurrency());
+    }
+    // Queue numThreads is the shared queue of outside submissions
+    for (size_t q = 0; q <= numThreads; q++) {
+      queues.emplace_back(new TaskQueue());
+    }
+    for (size_t w = 0; w < numThreads; w++) {
+      workers.emplace_back([this, w]() { workerLoop(w); });
+    }
+  }
+
+  // Runs every task already submitted, then joins the workers
+  ~ThreadPool() {
+    {
+      lock_guard<mutex> guard(sleepLock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return workers.size(); }
+
+  // Fire and forget
+  void post(function<void()> task) {
+    size_t self = currentWorker();
+    TaskQueue& queue = *queues[self != NO_WORKER ? self : workers.size()];
+    {
+      lock_guard<mutex> guard(queue.lock);
+      pending++;
+      queue.tasks.push_back(move(task));
+    }
+    {
+      lock_guard<mutex> guard(sleepLock);
+    }
+    wake.notify_one();
+  }
+
+  // Run f() on the pool, its result or exception comes through the future
+  template<typename F>
+  auto submit(F f) -> future<decltype(f())> {
+    return submit(move(f), CancellationToken(), noDeadline());
+  }
+
+  // Same, the future gets TaskCancelled or DeadlineExceeded instead if the
+  // token is cancelled or the deadline passed before f() starts
+  template<typename F>
+  auto submit(F f, const CancellationToken& token, Deadline deadline) -> future<decltype(f())> {
+    typedef decltype(f()) R;
+    auto result = make_shared<promise<R>>();
+    auto task = make_shared<F>(move(f));
+    future<R> answer = result->get_future();
+    post([result, task, token, deadline]() {
+      if (!abandonTask(*result, token, deadline)) {
+        fulfil(*result, *task);
+      }
+    });
+    return answer;
+  }
+
+  // Run one pending task on the calling thread, false if there was none
+  bool runPendingTask() {
+    function<void()> task;
+    if (!popTask(currentWorker(), task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+  // Wait for a future, running pending tasks meanwhile. Safe inside a task.
+  template<typename T>
+  void wait(const future<T>& result) {
+    while (result.wait_for(chrono::seconds(0)) != future_status::ready) {
+      if (!runPendingTask()) {
+        result.wait_for(chrono::microseconds(50));
+      }
+    }
+  }
+
+  template<typename T>
+  T get(future<T>& result) {
+    wait(result);
+    return result.get();
+  }
+
+  // f(i) for every i in [begin, end), grain indices per task. The caller
+  // takes part and it returns once all are done, rethrowing the first exception.
+  template<typename F>
+  void parallelFor(size_t begin, size_t end, size_t grain, F f) {
+    grain = max<size_t>(grain, 1);
+    vector<future<void>> chunks;
+    for (size_t first = begin; first < end; first += grain) {
+      size_t last = min(end, first + grain);
+      chunks.push_back(submit([&f, first, last]() {
+        for (size_t i = first; i < last; i++) {
+          f(i);
+        }
+      }));
+    }
+    for (future<void>& chunk : chunks) {
+      wait(chunk);
+    }
+    for (future<void>& chunk : chunks) {
+      chunk.get();
+    }
+  }
+
+private:
+  static const size_t NO_WORKER = ~(size_t)0;
+
+  struct TaskQueue {
+    mutex lock;
+    deque<function<void()>> tasks;
+  };
+
+  // Index of the calling thread among this pool's workers, NO_WORKER outside
+  size_t currentWorker() const {
+    return currentPool() == this ? currentIndex() : NO_WORKER;
+  }
+
+  static const ThreadPool*& currentPool() {
+    thread_local const ThreadPool* pool = nullptr;
+    return pool;
+  }
+
+  static size_t& currentIndex() {
+    thread_local size_t index = NO_WORKER;
+    return index;
+  }
+
+  // Own queue from the back, then the shared queue, then steal from the front of the others
+  bool popTask(size_t self, function<void()>& task) {
+    if (pending.load() == 0) {
+      return false;
+    }
+    size_t numQueues = queues.size();
+    if (self != NO_WORKER && takeFrom(*queues[self], task, true)) {
+      return true;
+    }
+    if (takeFrom(*queues[numQueues - 1], task, false)) {
+      return true;
+    }
+    size_t start = self != NO_WORKER ? self + 1 : 0;
+    for (size_t i = 0; i < numQueues - 1; i++) {
+      size_t victim = (start + i) % (numQueues - 1);
+      if (victim != self && takeFrom(*queues[victim], task, false)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool takeFrom(TaskQueue& queue, function<void()>& task, bool back) {
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    if (back) {
+      task = move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    pending--;
+    return true;
+  }
+
+  void workerLoop(size_t index) {
+    currentPool() = this;
+    currentIndex() = index;
+    function<void()> task;
+    while (true) {
+      if (popTask(index, task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      unique_lock<mutex> guard(sleepLock);
+      wake.wait(guard, [this]() { return stopping || pending.load() > 0; });
+      if (stopping && pending.load() == 0) {
+        return;
+      }
+    }
+  }
+
+  vector<unique_ptr<TaskQueue>> queues;
+  vector<thread> workers;
+  atomic<size_t> pending;
+  mutex sleepLock;
+  condition_variable wake;
+  bool stopping;
+};
+
+// Process-wide pool, KNN_POOL_THREADS threads or one per core
+inline ThreadPool& sharedThreadPool() {
+  static ThreadPool pool(getenv("KNN_POOL_THREADS") != nullptr ? strtoul(getenv("KNN_POOL_THREADS"), nullptr, 10) : 0);
+  return pool;
+}
+
+#endif
@@ -2,6 +2,25 @@
 #define TIMING_H
 
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 class Timer {
 public:
@@ -17,4 +36,445 @@ private:
   std::chrono::time_point<clock_> beg_;
 };
 
-#endif
\ No newline at end of file
+// Phase profiler. A ScopedPhase times the enclosing scope, phases opened
+// inside it on the same thread nest under it, giving paths like
+// "build;level 0;level 1". Each thread keeps its own stack and totals,
+// merged when reporting.
+//
+// Off by default, a disabled ScopedPhase costs one branch. Enable with
+//   KNN_PROFILE=<file>  summary to <file>, folded stacks to <file>.folded
+//   KNN_PROFILE=-       summary to stdout at exit
+//   KNN_PERF=1          on Linux, also count cycles, instructions, last level
+//                       cache misses and branch misses per phase
+// or from code with enablePhaseProfiler().
+//
+// The folded files feed flamegraph.pl directly; <file>.llc.folded weighs
+// every phase by its cache misses, which is where the memory stalls are.
+
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_COUNTERS
+};
+
+// Hardware counters of the calling thread, opened on first use
+class PerfCounters {
+public:
+  PerfCounters() : opened(false) {
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      fds[c] = -1;
+    }
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      if (fds[c] >= 0) {
+        close(fds[c]);
+      }
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Returns false if no counter could be opened, error() says why
+  bool open() {
+    if (opened) {
+      return available();
+    }
+    opened = true;
+#ifdef __linux__
+    // LLC misses are the generic cache-miss event, last level on most CPUs
+    static const uint64_t configs[PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[c];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // This thread only, on any CPU
+      fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fds[c] < 0 && failure.empty()) {
+        failure = strerror(errno);
+      }
+    }
+#else
+    failure = "not supported on this platform";
+#endif
+    return available();
+  }
+
+  bool available() const {
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      if (fds[c] >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::string& error() const { return failure; }
+
+  // Counter values so far, scaled up when the kernel multiplexed them
+  void read(uint64_t values[PERF_COUNTERS]) const {
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      values[c] = 0;
+#ifdef __linux__
+      uint64_t data[3];
+      if (fds[c] >= 0 && ::read(fds[c], data, sizeof(data)) == sizeof(data)) {
+        values[c] = data[2] > 0 && data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+      }
+#endif
+    }
+  }
+
+private:
+  int fds[PERF_COUNTERS];
+  bool opened;
+  std::string failure;
+};
+
+struct PhaseTotals {
+  size_t calls;
+  size_t threads;
+  double seconds;
+  double selfSeconds;  // Without the phases nested in it
+  uint64_t counters[PERF_COUNTERS];
+  uint64_t selfCounters[PERF_COUNTERS];
+
+  PhaseTotals() : calls(0), threads(0), seconds(0.0), selfSeconds(0.0), counters(), selfCounters() {}
+
+  void merge(const PhaseTotals& other) {
+    calls += other.calls;
+    threads += other.threads;
+    seconds += other.seconds;
+    selfSeconds += other.selfSeconds;
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      counters[c] += other.counters[c];
+      selfCounters[c] += other.selfCounters[c];
+    }
+  }
+};
+
+// Paths sorted depth first: a phase comes right before the phases nested in it
+struct PhasePathLess {
+  bool operator()(const std::string& a, const std::string& b) const {
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+      return (x == ';' ? '\0' : x) < (y == ';' ? '\0' : y);
+    });
+  }
+};
+
+typedef std::map<std::string, PhaseTotals, PhasePathLess> PhaseMap;
+
+struct PhaseFrame {
+  size_t parentLength;
+  std::chrono::steady_clock::time_point start;
+  uint64_t startCounters[PERF_COUNTERS];
+  double childSeconds;
+  uint64_t childCounters[PERF_COUNTERS];
+};
+
+// Per-thread phases, owned by the profiler so they outlive their threads
+struct ThreadPhases {
+  std::string path;
+  std::vector<PhaseFrame> frames;
+  PhaseMap totals;
+  PerfCounters perf;
+};
+
+struct PhaseProfiler {
+  bool enabled;
+  bool useCounters;
+  std::string outputPath;
+  std::mutex lock;
+  std::vector<std::unique_ptr<ThreadPhases>> threads;
+
+  PhaseProfiler() : enabled(false), useCounters(false) {
+    const char* path = getenv("KNN_PROFILE");
+    const char* perf = getenv("KNN_PERF");
+    if (path != nullptr && path[0] != '\0') {
+      outputPath = path;
+      enabled = true;
+      useCounters = perf != nullptr && std::string(perf) == "1";
+    }
+  }
+
+  ~PhaseProfiler();
+};
+
+inline PhaseProfiler& phaseProfiler() {
+  static PhaseProfiler profiler;
+  return profiler;
+}
+
+// Call before any phase runs, typically first thing in main
+inline void enablePhaseProfiler(bool counters = false) {
+  phaseProfiler().enabled = true;
+  phaseProfiler().useCounters = counters;
+}
+
+inline bool phaseProfilerEnabled() {
+  return phaseProfiler().enabled;
+}
+
+// Where the report goes at exit, e.g. one file per MPI rank
+inline void setPhaseProfilePath(const std::string& path) {
+  phaseProfiler().outputPath = path;
+}
+
+inline std::string phaseProfilePath() {
+  return phaseProfiler().outputPath;
+}
+
+inline ThreadPhases& threadPhases() {
+  thread_local ThreadPhases* phases = nullptr;
+  if (phases == nullptr) {
+    PhaseProfiler& profiler = phaseProfiler();
+    std::lock_guard<std::mutex> guard(profiler.lock);
+    profiler.threads.push_back(std::unique_ptr<ThreadPhases>(new ThreadPhases()));
+    phases = profiler.threads.back().get();
+    if (profiler.useCounters && !phases->perf.open() && profiler.threads.size() == 1) {
+      std::cerr << "Hardware counters unavailable: " << phases->perf.error() << std::endl;
+    }
+  }
+  return *phases;
+}
+
+// Path of the innermost open phase on this thread, "" when disabled
+inline std::string phasePath() {
+  return phaseProfilerEnabled() ? threadPhases().path : std::string();
+}
+
+class ScopedPhase {
+public:
+  explicit ScopedPhase(const char* name) : phases(nullptr) {
+    if (name != nullptr && phaseProfilerEnabled()) {
+      begin(name);
+    }
+  }
+
+  ~ScopedPhase() { end(); }
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+  // Close the phase before the end of the scope, phases nested in it must be closed
+  void end() {
+    if (phases == nullptr) {
+      return;
+    }
+    PhaseFrame frame = phases->frames.back();
+    phases->frames.pop_back();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.start).count();
+    uint64_t counters[PERF_COUNTERS] = {0};
+    if (phases->perf.available()) {
+      phases->perf.read(counters);
+      for (int c = 0; c < PERF_COUNTERS; c++) {
+        counters[c] -= frame.startCounters[c];
+      }
+    }
+
+    PhaseTotals& totals = phases->totals[phases->path];
+    totals.calls++;
+    totals.threads = 1;
+    totals.seconds += seconds;
+    totals.selfSeconds += std::max(0.0, seconds - frame.childSeconds);
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      totals.counters[c] += counters[c];
+      totals.selfCounters[c] += counters[c] > frame.childCounters[c] ? counters[c] - frame.childCounters[c] : 0;
+    }
+
+    if (!phases->frames.empty()) {
+      PhaseFrame& parent = phases->frames.back();
+      parent.childSeconds += seconds;
+      for (int c = 0; c < PERF_COUNTERS; c++) {
+        parent.childCounters[c] += counters[c];
+      }
+    }
+    phases->path.resize(frame.parentLength);
+    phases = nullptr;
+  }
+
+private:
+  void begin(const char* name) {
+    phases = &threadPhases();
+    PhaseFrame frame;
+    frame.parentLength = phases->path.size();
+    frame.childSeconds = 0.0;
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+      frame.childCounters[c] = 0;
+    }
+    if (!phases->path.empty()) {
+      phases->path += ';';
+    }
+    phases->path += name;
+    if (phases->perf.available()) {
+      phases->perf.read(frame.startCounters);
+    }
+    frame.start = std::chrono::steady_clock::now();
+    phases->frames.push_back(frame);
+  }
+
+  ThreadPhases* phases;
+};
+
+// Nest this thread's phases under a path taken from another thread, e.g.
+// in OpenMP tasks and parallel regions: string parent = phasePath(); then
+// PhaseContext context(parent); inside the region.
+class PhaseContext {
+public:
+  explicit PhaseContext(const std::string& parent) : phases(nullptr) {
+    if (phaseProfilerEnabled()) {
+      phases = &threadPhases();
+      saved = phases->path;
+      phases->path = parent;
+    }
+  }
+
+  ~PhaseContext() {
+    if (phases != nullptr) {
+      phases->path = saved;
+    }
+  }
+
+  PhaseContext(const PhaseContext&) = delete;
+  PhaseContext& operator=(const PhaseContext&) = delete;
+
+private:
+  ThreadPhases* phases;
+  std::string saved;
+};
+
+// Recursive builds profile their top levels one by one and everything from
+// PHASE_LEVELS down as a single phase, nullptr below that
+#define PHASE_LEVELS 8
+
+inline const char* levelPhaseName(int level) {
+  static const char* names[PHASE_LEVELS + 1] = {"level 0", "level 1", "level 2", "level 3", "level 4",
+                                                "level 5", "level 6", "level 7", "levels 8+"};
+  return level >= 0 && level <= PHASE_LEVELS ? names[level] : nullptr;
+}
+
+inline PhaseMap mergeThreadPhases(const std::vector<std::unique_ptr<ThreadPhases>>& threads, bool& haveCounters) {
+  PhaseMap merged;
+  haveCounters = false;
+  for (const auto& phases : threads) {
+    haveCounters = haveCounters || phases->perf.available();
+    for (const auto& entry : phases->totals) {
+      merged[entry.first].merge(entry.second);
+    }
+  }
+  return merged;
+}
+
+// Every thread's totals merged by path, call while no phase is running
+inline PhaseMap phaseSnapshot(bool& haveCounters) {
+  PhaseProfiler& profiler = phaseProfiler();
+  std::lock_guard<std::mutex> guard(profiler.lock);
+  return mergeThreadPhases(profiler.threads, haveCounters);
+}
+
+// Indented tree of phases. Seconds are summed over threads. With counters,
+// low IPC together with many LLC misses per 1000 instructions marks a phase
+// stalled on memory.
+inline void writePhaseSummary(std::ostream& out, const PhaseMap& phases, bool haveCounters) {
+
+  double selfSeconds = 0.0;
+  for (const auto& entry : phases) {
+    selfSeconds += entry.second.selfSeconds;
+  }
+
+  out << "\nPhase profile (seconds summed over threads, self excludes nested phases)\n";
+  out << std::left << std::setw(36) << "  phase" << std::right << std::setw(8) << "threads" << std::setw(10)
+      << "calls" << std::setw(12) << "total" << std::setw(12) << "self" << std::setw(8) << "self%";
+  if (haveCounters) {
+    out << std::setw(8) << "IPC" << std::setw(10) << "LLC/ki" << std::setw(10) << "br/ki";
+  }
+  out << "\n";
+
+  for (const auto& entry : phases) {
+    const PhaseTotals& totals = entry.second;
+    size_t depth = std::count(entry.first.begin(), entry.first.end(), ';');
+    size_t nameStart = entry.first.rfind(';');
+    std::string name = std::string(2 + 2 * depth, ' ') +
+                       entry.first.substr(nameStart == std::string::npos ? 0 : nameStart + 1);
+
+    out << std::left << std::setw(36) << name << std::right << std::setw(8) << totals.threads << std::setw(10)
+        << totals.calls << std::fixed << std::setprecision(6) << std::setw(12) << totals.seconds << std::setw(12)
+        << totals.selfSeconds << std::setprecision(1) << std::setw(8)
+        << (selfSeconds > 0.0 ? 100.0 * totals.selfSeconds / selfSeconds : 0.0);
+    if (haveCounters) {
+      double cycles = totals.selfCounters[PERF_CYCLES];
+      double instructions = totals.selfCounters[PERF_INSTRUCTIONS];
+      out << std::setprecision(2) << std::setw(8) << (cycles > 0 ? instructions / cycles : 0.0)
+          << std::setw(10) << (instructions > 0 ? 1000.0 * totals.selfCounters[PERF_LLC_MISSES] / instructions : 0.0)
+          << std::setw(10) << (instructions > 0 ? 1000.0 * totals.selfCounters[PERF_BRANCH_MISSES] / instructions : 0.0);
+    }
+    out << "\n";
+    out.unsetf(std::ios::fixed);
+  }
+}
+
+// Folded stacks for flamegraph.pl: "path value" per phase, value is the self
+// time in microseconds, or a self counter when counter >= 0
+inline void writePhaseFolded(std::ostream& out, const PhaseMap& phases, int counter = -1) {
+  for (const auto& entry : phases) {
+    uint64_t value = counter >= 0 ? entry.second.selfCounters[counter]
+                                  : (uint64_t)(entry.second.selfSeconds * 1e6 + 0.5);
+    if (value > 0) {
+      out << entry.first << " " << value << "\n";
+    }
+  }
+}
+
+// Summary and folded stacks as described at the top, "-" prints the summary
+inline bool writePhaseReport(const std::string& path, const PhaseMap& phases, bool haveCounters) {
+  if (path == "-") {
+    writePhaseSummary(std::cout, phases, haveCounters);
+    return true;
+  }
+
+  std::ofstream summary(path);
+  std::ofstream folded(path + ".folded");
+  if (!summary.is_open() || !folded.is_open()) {
+    std::cerr << "Unable to open file " << path << std::endl;
+    return false;
+  }
+  writePhaseSummary(summary, phases, haveCounters);
+  writePhaseFolded(folded, phases);
+
+  if (haveCounters) {
+    std::ofstream cycles(path + ".cycles.folded");
+    std::ofstream misses(path + ".llc.folded");
+    writePhaseFolded(cycles, phases, PERF_CYCLES);
+    writePhaseFolded(misses, phases, PERF_LLC_MISSES);
+  }
+  return true;
+}
+
+inline bool writePhaseReport(const std::string& path) {
+  bool haveCounters;
+  PhaseMap phases = phaseSnapshot(haveCounters);
+  return writePhaseReport(path, phases, haveCounters);
+}
+
+inline PhaseProfiler::~PhaseProfiler() {
+  if (!enabled || outputPath == "" || threads.empty()) {
+    return;
+  }
+  bool haveCounters;
+  PhaseMap phases = mergeThreadPhases(threads, haveCounters);
+  writePhaseReport(outputPath, phases, haveCounters);
+}
+
+#endif
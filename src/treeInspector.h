@@ -0,0 +1,281 @@
+#ifndef TREE_INSPECTOR_H
+#define TREE_INSPECTOR_H
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
+#include "rangeQuery.h"
+#include "timing.h"
+
+using namespace std;
+
+// Shape and health of a KD-tree, for the static tree and the lock-free one
+// alike (see rangeQuery.h for how both are walked). One parallel pass over
+// the nodes gives the depth distribution, the imbalance of every level, how
+// full the nodes are, the memory they take and, optionally, a check of the
+// kd ordering. Safe next to lock-free inserts, which it may or may not see,
+// so it can run periodically on a live tree:
+//
+//   TreeReport report = tree.inspect();
+//   if (needsRebuild(report, 1.5)) { ... rebuild once inserts are quiet ... }
+
+// Subtrees above this depth are inspected as separate OpenMP tasks
+#define INSPECT_PARALLEL_DEPTH 8
+
+// Levels printed by printTreeReport, deeper ones are summed up
+#define INSPECT_PRINTED_LEVELS 48
+
+struct LevelStats {
+  size_t nodes;
+  size_t leaves;
+  double imbalanceSum;   // Over the nodes with children, see TreeReport
+  double imbalanceMax;
+};
+
+struct TreeReport {
+  size_t nodes;
+  size_t leaves;          // No child
+  size_t oneChild;        // Only one child: a chain in the making
+  size_t height;          // Levels, 0 for an empty tree
+  double meanDepth;       // Root at depth 0
+  double meanLeafDepth;
+  size_t memoryBytes;     // Nodes and the feature storage they own
+  bool invariantChecked;
+  size_t violations;      // Nodes on the wrong side of an ancestor's split
+  // Imbalance of a node with subtrees of L and R nodes:
+  // (|L - R| - (L + R) % 2) / (L + R), 0 when split as evenly as possible,
+  // 1 when one side is empty
+  vector<LevelStats> levels;
+  double balancedMeanDepth;   // Of a complete tree with as many nodes
+  double predictedVisits;     // Nodes on the path of a query that lands like the points, meanDepth + 1
+  double costRatio;           // predictedVisits against the complete tree's, 1 is optimal
+  double seconds;
+};
+
+struct InspectOptions {
+  bool checkInvariant = true;   // d comparisons per node, skip for the cheapest pass
+};
+
+// Feature storage a node owns: static tree rows live in the tree's PointSet
+inline size_t featureBytes(const double*) {
+  return 0;
+}
+
+inline size_t featureBytes(const vector<double>& features) {
+  return features.capacity() * sizeof(double);
+}
+
+// Mean depth of the nodes of a complete binary tree of n nodes
+inline double completeTreeMeanDepth(size_t n) {
+  if (n == 0) {
+    return 0.0;
+  }
+  double depthSum = 0.0;
+  size_t remaining = n;
+  for (size_t depth = 0, width = 1; remaining > 0; depth++, width *= 2) {
+    size_t level = min(width, remaining);
+    depthSum += (double)depth * level;
+    remaining -= level;
+  }
+  return depthSum / n;
+}
+
+// Totals of a subtree, folded into the parent's (split / merge as in rangeQuery.h)
+struct TreeInspection {
+  size_t nodes = 0;
+  size_t leaves = 0;
+  size_t oneChild = 0;
+  size_t height = 0;
+  double depthSum = 0.0;
+  double leafDepthSum = 0.0;
+  size_t memoryBytes = 0;
+  size_t violations = 0;
+  vector<LevelStats> levels;
+
+  TreeInspection split() const { return TreeInspection(); }
+
+  LevelStats& level(size_t depth) {
+    if (levels.size() <= depth) {
+      levels.resize(depth + 1, LevelStats{0, 0, 0.0, 0.0});
+    }
+    return levels[depth];
+  }
+
+  void merge(const TreeInspection& other) {
+    nodes += other.nodes;
+    leaves += other.leaves;
+    oneChild += other.oneChild;
+    height = max(height, other.height);
+    depthSum += other.depthSum;
+    leafDepthSum += other.leafDepthSum;
+    memoryBytes += other.memoryBytes;
+    violations += other.violations;
+    for (size_t depth = 0; depth < other.levels.size(); depth++) {
+      LevelStats& mine = level(depth);
+      const LevelStats& theirs = other.levels[depth];
+      mine.nodes += theirs.nodes;
+      mine.leaves += theirs.leaves;
+      mine.imbalanceSum += theirs.imbalanceSum;
+      mine.imbalanceMax = max(mine.imbalanceMax, theirs.imbalanceMax);
+    }
+  }
+};
+
+// Nodes of the subtree. low / high are the bounds the ancestors' splits put
+// on it, restored before returning.
+template<typename Node>
+size_t inspectSubtree(const Node* node, size_t depth, size_t dims, vector<double>& low, vector<double>& high,
+                      bool checkInvariant, TreeInspection& result) {
+  if (node == nullptr) {
+    return 0;
+  }
+
+  const double* features = featureData(node->features);
+  result.nodes++;
+  result.depthSum += depth;
+  result.height = max(result.height, depth + 1);
+  result.memoryBytes += sizeof(Node) + featureBytes(node->features);
+  LevelStats& level = result.level(depth);
+  level.nodes++;
+
+  if (checkInvariant) {
+    for (size_t axis = 0; axis < dims; axis++) {
+      if (features[axis] < low[axis] || features[axis] > high[axis]) {
+        result.violations++;
+        break;
+      }
+    }
+  }
+
+  const Node* left = childNode(node->left);
+  const Node* right = childNode(node->right);
+  if (left == nullptr && right == nullptr) {
+    result.leaves++;
+    result.leafDepthSum += depth;
+    level.leaves++;
+    return 1;
+  }
+  if (left == nullptr || right == nullptr) {
+    result.oneChild++;
+  }
+
+  // Points equal to the split may sit on either side
+  size_t axis = depth % dims;
+  double split = features[axis];
+  size_t leftNodes, rightNodes;
+  if (depth < INSPECT_PARALLEL_DEPTH && left != nullptr && right != nullptr) {
+    TreeInspection leftResult = result.split();
+    TreeInspection rightResult = result.split();
+    vector<double> leftHigh = high;
+    vector<double> rightLow = low;
+    leftHigh[axis] = min(high[axis], split);
+    rightLow[axis] = max(low[axis], split);
+
+    #pragma omp task shared(leftResult, leftNodes, low, leftHigh)
+    leftNodes = inspectSubtree(left, depth + 1, dims, low, leftHigh, checkInvariant, leftResult);
+
+    #pragma omp task shared(rightResult, rightNodes, rightLow, high)
+    rightNodes = inspectSubtree(right, depth + 1, dims, rightLow, high, checkInvariant, rightResult);
+
+    #pragma omp taskwait
+    result.merge(leftResult);
+    result.merge(rightResult);
+  } else {
+    double bound = high[axis];
+    high[axis] = min(bound, split);
+    leftNodes = inspectSubtree(left, depth + 1, dims, low, high, checkInvariant, result);
+    high[axis] = bound;
+
+    bound = low[axis];
+    low[axis] = max(bound, split);
+    rightNodes = inspectSubtree(right, depth + 1, dims, low, high, checkInvariant, result);
+    low[axis] = bound;
+  }
+
+  // The merge may have grown the levels, so look this one up again
+  size_t below = leftNodes + rightNodes;
+  size_t difference = leftNodes > rightNodes ? leftNodes - rightNodes : rightNodes - leftNodes;
+  double imbalance = (double)(difference - below % 2) / below;
+  LevelStats& after = result.level(depth);
+  after.imbalanceSum += imbalance;
+  after.imbalanceMax = max(after.imbalanceMax, imbalance);
+  return 1 + below;
+}
+
+// Inspect the tree under root, split on its first dims axes, on a team of threads
+template<typename Node>
+TreeReport inspectTree(const Node* root, size_t dims, const InspectOptions& options = InspectOptions()) {
+  Timer inspectTimer;
+  TreeInspection result;
+  if (root != nullptr && dims > 0) {
+    vector<double> low(dims, -numeric_limits<double>::infinity());
+    vector<double> high(dims, numeric_limits<double>::infinity());
+    if (omp_in_parallel()) {
+      inspectSubtree(root, 0, dims, low, high, options.checkInvariant, result);
+    } else {
+      #pragma omp parallel
+      {
+        #pragma omp single
+        inspectSubtree(root, 0, dims, low, high, options.checkInvariant, result);
+      }
+    }
+  }
+
+  TreeReport report;
+  report.nodes = result.nodes;
+  report.leaves = result.leaves;
+  report.oneChild = result.oneChild;
+  report.height = result.height;
+  report.meanDepth = result.nodes > 0 ? result.depthSum / result.nodes : 0.0;
+  report.meanLeafDepth = result.leaves > 0 ? result.leafDepthSum / result.leaves : 0.0;
+  report.memoryBytes = result.memoryBytes;
+  report.invariantChecked = options.checkInvariant;
+  report.violations = result.violations;
+  report.levels = result.levels;
+  report.balancedMeanDepth = completeTreeMeanDepth(result.nodes);
+  report.predictedVisits = result.nodes > 0 ? report.meanDepth + 1.0 : 0.0;
+  report.costRatio = result.nodes > 0 ? report.predictedVisits / (report.balancedMeanDepth + 1.0) : 1.0;
+  report.seconds = inspectTimer.elapsed();
+  return report;
+}
+
+// Whether searches have become costRatio times dearer than on a balanced
+// tree, or the tree is broken
+inline bool needsRebuild(const TreeReport& report, double maxCostRatio) {
+  return report.costRatio > maxCostRatio || report.violations > 0;
+}
+
+inline void printTreeReport(const TreeReport& report) {
+  printf("\nTree: %zu nodes, %zu leaves, %zu with one child, height %zu (%.6fs)\n", report.nodes, report.leaves,
+         report.oneChild, report.height, report.seconds);
+  printf("  mean depth %.2f (complete tree %.2f), mean leaf depth %.2f\n", report.meanDepth,
+         report.balancedMeanDepth, report.meanLeafDepth);
+  printf("  predicted visits per query %.2f, %.3fx a balanced tree\n", report.predictedVisits, report.costRatio);
+  printf("  memory %.2f MB (%.1f bytes per node)\n", report.memoryBytes / 1048576.0,
+         report.nodes > 0 ? (double)report.memoryBytes / report.nodes : 0.0);
+  if (report.invariantChecked) {
+    printf("  kd ordering: %s (%zu violations)\n", report.violations == 0 ? "ok" : "BROKEN", report.violations);
+  }
+
+  printf("  %5s %10s %10s %10s %10s\n", "depth", "nodes", "leaves", "imbalance", "worst");
+  size_t printed = min<size_t>(report.levels.size(), INSPECT_PRINTED_LEVELS);
+  for (size_t depth = 0; depth < printed; depth++) {
+    const LevelStats& level = report.levels[depth];
+    size_t inner = level.nodes - level.leaves;
+    printf("  %5zu %10zu %10zu %10.4f %10.4f\n", depth, level.nodes, level.leaves,
+           inner > 0 ? level.imbalanceSum / inner : 0.0, level.imbalanceMax);
+  }
+  if (printed < report.levels.size()) {
+    size_t nodes = 0, leaves = 0;
+    for (size_t depth = printed; depth < report.levels.size(); depth++) {
+      nodes += report.levels[depth].nodes;
+      leaves += report.levels[depth].leaves;
+    }
+    printf("  %2zu-%-2zu %10zu %10zu\n", printed, report.levels.size() - 1, nodes, leaves);
+  }
+}
+
+#endif
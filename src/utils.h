@@ -2,6 +2,8 @@
 #define __UTILS_H__
 
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 using namespace std;
 
@@ -15,4 +17,37 @@ bool isPositiveInteger(const string& s) {
   return true;
 }
 
+// Function to check if a string is a non-negative decimal number
+bool isNonNegativeNumber(const string& s) {
+  bool seenDigit = false;
+  bool seenDot = false;
+  for (char c : s) {
+    if (isdigit(c)) {
+      seenDigit = true;
+    } else if (c == '.' && !seenDot) {
+      seenDot = true;
+    } else {
+      return false;
+    }
+  }
+  return seenDigit;
+}
+
+// Function to parse a list of numbers separated by spaces or commas
+vector<double> parseDoubleList(string s) {
+  for (char& c : s) {
+    if (c == ',') {
+      c = ' ';
+    }
+  }
+
+  istringstream iss(s);
+  vector<double> values;
+  double value;
+  while (iss >> value) {
+    values.push_back(value);
+  }
+  return values;
+}
+
 #endif